@@ -27,6 +27,9 @@ fn main() {
             "src/q3/q_shared.c",
         ])
         .warnings(false)
+        // Fused multiply-adds round differently, which would make traces differ between machines
+        // and between the scalar and vectorized brush code
+        .flag_if_supported("-ffp-contract=off")
         .compile("q3");
 
     bindgen::Builder::default()
@@ -37,8 +40,13 @@ fn main() {
         .allowlist_function("Com_Init")
         .allowlist_function("COM_Parse")
         .allowlist_function("CM_LoadMap")
+        .allowlist_function("CM_WritePatchCache")
+        .allowlist_function("CM_AllocScratch")
+        .allowlist_function("CM_FreeScratch")
+        .allowlist_function("CM_SetScratchScalar")
         .allowlist_function("CM_EntityString")
         .allowlist_function("CM_BoxTrace")
+        .allowlist_function("CM_BoxTraceBatch")
         .allowlist_function("CM_TransformedBoxTrace")
         .allowlist_function("CM_PointContents")
         .allowlist_function("CM_InlineModel")
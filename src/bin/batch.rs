@@ -0,0 +1,209 @@
+//! Resimulates usercmd files without a window, for verification and other long jobs.
+//!
+//! With `--compare` it checks one way of executing the qvm against another, comparing the player
+//! state on every frame, and fails if they ever differ. Checking the JIT against the interpreter
+//! on a set of runs looks like:
+//!
+//! ```text
+//! cargo run --release --bin batch -- -r baseq3,defrag maps/q3dm17.bsp *.usercmds --compare jit
+//! ```
+
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    path::{Path, PathBuf},
+    process::ExitCode,
+    time::{Duration, Instant},
+};
+
+use bytemuck::bytes_of;
+use clap::Parser;
+use tasjr::{
+    fs::Fs,
+    game::{Game, rolling_checksums},
+    q3::{self, Map, playerState_t, usercmd_t},
+    run::RunFile,
+    vm::ExecMode,
+};
+
+#[derive(clap::Parser)]
+struct Args {
+    /// Comma-separated list of root directories
+    #[arg(short, long, value_delimiter = ',')]
+    roots: Vec<PathBuf>,
+
+    /// BSP to load
+    #[arg()]
+    bsp: PathBuf,
+
+    /// User inputs to simulate, each starting from the same state
+    #[arg(required = true)]
+    usercmds: Vec<PathBuf>,
+
+    /// How to execute the qvm
+    #[arg(long, value_enum, default_value_t = ExecMode::Interpreted)]
+    vm: ExecMode,
+
+    /// Simulate everything again in this mode and report the first frame where the player state
+    /// or what was written to memory differs. Any difference, from this or from when a file was
+    /// saved, makes the exit status a failure
+    #[arg(long, value_enum)]
+    compare: Option<ExecMode>,
+
+    /// Directory to write the player's origin and velocity on every frame of each file to, as CSV
+    #[arg(long)]
+    dump: Option<PathBuf>,
+
+    /// Directory to write folded call stacks to, for making flamegraphs
+    #[cfg(feature = "profile")]
+    #[arg(long)]
+    profile: Option<PathBuf>,
+}
+
+fn main() -> ExitCode {
+    let args = Args::parse();
+    let fs = Fs::new(&args.roots).unwrap();
+
+    let buf = fs.get(&args.bsp).unwrap();
+    Map::load(
+        args.bsp.to_str().unwrap(),
+        &buf,
+        q3::patch_cache_dir().as_deref(),
+    );
+
+    // Initialization is the same for every file, so it only has to be done once
+    let start = Game::start(&fs, args.vm);
+    let compare_start = args.compare.map(|mode| Game::start(&fs, mode));
+    let map_checksum = Map::get().checksum();
+
+    // Only profile the simulation itself, not initialization
+    #[cfg(feature = "profile")]
+    tasjr::profile::set_enabled(args.profile.is_some());
+
+    let mut total_frames = 0;
+    let mut total_time = Duration::ZERO;
+    let mut any_differ = false;
+    for path in &args.usercmds {
+        let file = RunFile::read(path).unwrap();
+        let usercmds = &file.usercmds;
+
+        let mut game = start.clone();
+        let (states, checksums, elapsed) = simulate(&mut game, usercmds);
+        report(path, args.vm, usercmds.len(), elapsed);
+        total_frames += usercmds.len();
+        total_time += elapsed;
+
+        let saved = file.checksums(start.qvm_checksum, map_checksum);
+        if let Some(frame) = first_difference(&checksums, saved) {
+            any_differ = true;
+            println!(
+                "{}: differs from when it was saved on frame {frame}",
+                path.display()
+            );
+        }
+
+        if let Some(dir) = &args.dump {
+            dump(
+                &dir.join(path.file_stem().unwrap()).with_extension("csv"),
+                &states,
+            );
+        }
+
+        if let Some(compare_start) = &compare_start {
+            let mut game = compare_start.clone();
+            let (compare_states, compare_checksums, elapsed) = simulate(&mut game, usercmds);
+            report(path, game.vm.mode, usercmds.len(), elapsed);
+
+            let mismatch = states
+                .iter()
+                .zip(&compare_states)
+                .position(|(a, b)| bytes_of(a) != bytes_of(b));
+            // Only worth mentioning if it shows up before the player state does
+            let checksum_mismatch = first_difference(&checksums, &compare_checksums)
+                .filter(|&frame| mismatch.is_none_or(|mismatch| frame < mismatch));
+            any_differ |= mismatch.is_some() || checksum_mismatch.is_some();
+            if let Some(frame) = checksum_mismatch {
+                println!(
+                    "{}: memory written differs on frame {frame}",
+                    path.display()
+                );
+            }
+            if let Some(frame) = mismatch {
+                let (a, b) = (&states[frame], &compare_states[frame]);
+                println!("{}: player state differs on frame {frame}", path.display());
+                println!(
+                    "  {:?}: origin {:?} velocity {:?}",
+                    args.vm, a.origin, a.velocity
+                );
+                println!(
+                    "  {:?}: origin {:?} velocity {:?}",
+                    game.vm.mode, b.origin, b.velocity
+                );
+            }
+        }
+    }
+
+    if args.usercmds.len() > 1 {
+        report(Path::new("total"), args.vm, total_frames, total_time);
+    }
+
+    #[cfg(feature = "profile")]
+    if let Some(dir) = &args.profile {
+        // Every game has been dropped by now, so everything they recorded has been flushed
+        tasjr::profile::save_folded(dir).unwrap();
+    }
+
+    if any_differ {
+        ExitCode::FAILURE
+    } else {
+        ExitCode::SUCCESS
+    }
+}
+
+/// Runs every usercmd, returning the player state before the first and after each one, the
+/// rolling checksum after each one, and how long the simulation took.
+fn simulate(game: &mut Game, usercmds: &[usercmd_t]) -> (Vec<playerState_t>, Vec<u64>, Duration) {
+    let mut states = Vec::with_capacity(usercmds.len() + 1);
+    let mut frame_hashes = Vec::with_capacity(usercmds.len());
+    states.push(*game.ps());
+    game.hash_frames = true;
+
+    let start = Instant::now();
+    for &usercmd in usercmds {
+        game.run_frame(usercmd);
+        states.push(*game.ps());
+        frame_hashes.push(game.frame_hash());
+    }
+    let elapsed = start.elapsed();
+    (states, rolling_checksums(frame_hashes), elapsed)
+}
+
+/// The first frame whose rolling checksum differs, of the frames both have one for, numbered like
+/// the player states from `simulate`.
+fn first_difference(a: &[u64], b: &[u64]) -> Option<usize> {
+    a.iter().zip(b).position(|(a, b)| a != b).map(|i| i + 1)
+}
+
+fn report(path: &Path, mode: ExecMode, frames: usize, elapsed: Duration) {
+    println!(
+        "{}: {frames} frames in {:.3}s ({:.0} fps, {mode:?})",
+        path.display(),
+        elapsed.as_secs_f64(),
+        frames as f64 / elapsed.as_secs_f64(),
+    );
+}
+
+fn dump(path: &Path, states: &[playerState_t]) {
+    let mut w = BufWriter::new(File::create(path).unwrap());
+    writeln!(
+        w,
+        "frame,origin_x,origin_y,origin_z,velocity_x,velocity_y,velocity_z"
+    )
+    .unwrap();
+    for (frame, ps) in states.iter().enumerate() {
+        let [x, y, z] = ps.origin;
+        let [vx, vy, vz] = ps.velocity;
+        writeln!(w, "{frame},{x},{y},{z},{vx},{vy},{vz}").unwrap();
+    }
+    w.flush().unwrap();
+}
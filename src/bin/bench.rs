@@ -0,0 +1,372 @@
+//! Times the hot paths of simulation, so changes to them can be measured.
+//!
+//! With `--fixtures` it runs on the test map and stand-in game the unit tests use, which anyone
+//! can reproduce:
+//!
+//! ```text
+//! cargo run --release --features fixtures --bin bench -- --fixtures
+//! ```
+//!
+//! The trace and snapshot numbers from those are representative, but the stand-in game's think is
+//! only a few instructions, so the VM and frame numbers mostly measure syscall overhead. Those need
+//! a real map, qvm and run, which aren't ours to check in. The reference setup for them is a
+//! Quake 3 `baseq3` directory plus the Defrag mod on top of it:
+//!
+//! ```text
+//! cargo run --release --bin bench -- -r baseq3,defrag maps/q3dm17.bsp run.usercmds
+//! ```
+//!
+//! Results are comparable between machines and commits as long as the inputs are the same. Every
+//! benchmark is sampled a number of times, with each sample repeating it enough to take at least
+//! `SAMPLE_TIME`, and the median and fastest samples are reported. The sample count can be raised
+//! with `--samples` when looking for small differences.
+//!
+//! This is a binary rather than `cargo bench` targets because the real inputs are paths given on
+//! the command line, and medians over a fixed number of samples are as precise as these numbers
+//! need to be.
+
+use std::{
+    hint::black_box,
+    path::PathBuf,
+    thread,
+    time::{Duration, Instant},
+};
+
+use bytemuck::Zeroable;
+use clap::{Parser, ValueEnum};
+use tasjr::{
+    Snapshot,
+    fs::Fs,
+    game::{Game, GameSnapshot},
+    q3::{self, Map, TraceScratch, playerState_t, trace_t, usercmd_t, vec3_t},
+    run::RunFile,
+    vm::ExecMode,
+};
+
+/// Repeat each benchmark for at least this long per sample.
+const SAMPLE_TIME: Duration = Duration::from_millis(20);
+
+/// Number of frames simulated per iteration when comparing execution modes.
+const SEGMENT: usize = 125;
+
+/// `MASK_PLAYERSOLID` from bg_public.h.
+const MASK_PLAYERSOLID: i32 = 0x1 | 0x10000 | 0x2000000;
+
+/// Frame counts to measure snapshots over, from a single frame to a whole segment.
+const SNAPSHOT_FRAMES: [usize; 3] = [1, 8, SEGMENT];
+
+/// Numbers of clients to simulate together in one game.
+const CLIENT_COUNTS: [usize; 3] = [1, 4, 16];
+
+#[derive(clap::Parser)]
+struct Args {
+    /// Comma-separated list of root directories
+    #[arg(short, long, value_delimiter = ',')]
+    roots: Vec<PathBuf>,
+
+    /// BSP to load
+    #[arg(required_unless_present = "fixtures")]
+    bsp: Option<PathBuf>,
+
+    /// User inputs to simulate
+    #[arg(required_unless_present = "fixtures")]
+    usercmds: Option<PathBuf>,
+
+    /// Use the test map and game instead, which needs the `fixtures` feature
+    #[arg(long, conflicts_with_all = ["roots", "bsp", "usercmds"])]
+    fixtures: bool,
+
+    /// How to execute the qvm, other than when comparing modes
+    #[arg(long, value_enum, default_value_t = ExecMode::Interpreted)]
+    vm: ExecMode,
+
+    /// Number of samples to take of each benchmark
+    #[arg(long, default_value_t = 20)]
+    samples: usize,
+
+    /// Only run benchmarks whose names contain this
+    #[arg(short, long)]
+    filter: Option<String>,
+}
+
+struct Bencher {
+    samples: usize,
+    filter: Option<String>,
+}
+
+impl Bencher {
+    /// Measures how long `f` takes. Each call is `per_call` units of work, for benchmarks where
+    /// a single call does a batch of things.
+    fn bench(&self, name: &str, per_call: usize, mut f: impl FnMut()) {
+        if self
+            .filter
+            .as_ref()
+            .is_some_and(|filter| !name.contains(filter))
+        {
+            return;
+        }
+
+        // Warm up, and find out how many calls fill a sample
+        let start = Instant::now();
+        f();
+        let once = start.elapsed();
+        let calls = (SAMPLE_TIME.as_nanos() / once.as_nanos().max(1)).max(1) as u32;
+
+        let mut samples: Vec<Duration> = (0..self.samples)
+            .map(|_| {
+                let start = Instant::now();
+                for _ in 0..calls {
+                    f();
+                }
+                start.elapsed() / calls / per_call as u32
+            })
+            .collect();
+        samples.sort();
+
+        println!(
+            "{name:<32} median {:>12?}  min {:>12?}",
+            samples[samples.len() / 2],
+            samples[0],
+        );
+    }
+}
+
+fn main() {
+    let args = Args::parse();
+    let (fs, map, usercmds) = if args.fixtures {
+        fixtures()
+    } else {
+        let fs = Fs::new(&args.roots).unwrap();
+        let bsp = args.bsp.unwrap();
+        let buf = fs.get(&bsp).unwrap();
+        let map = Map::load(
+            bsp.to_str().unwrap(),
+            &buf,
+            q3::patch_cache_dir().as_deref(),
+        );
+        let usercmds = RunFile::read(&args.usercmds.unwrap()).unwrap().usercmds;
+        (fs, map, usercmds)
+    };
+    assert!(
+        usercmds.len() >= 2 * SEGMENT,
+        "the run needs at least {} frames",
+        2 * SEGMENT
+    );
+
+    let bencher = Bencher {
+        samples: args.samples.max(1),
+        filter: args.filter,
+    };
+
+    let start = Game::start(&fs, args.vm);
+
+    // Everything but the whole-run benchmark starts from the middle of the run, where the game is
+    // in a typical state rather than just after spawning
+    let mid = usercmds.len() / 2 - SEGMENT;
+    let mut game = start.clone();
+    let mut states: Vec<playerState_t> = vec![];
+    for &usercmd in &usercmds {
+        game.run_frame(usercmd);
+        states.push(*game.ps());
+    }
+    let baseline = start.take_snapshot(None);
+    let mut game = start.clone();
+    for &usercmd in &usercmds[..mid] {
+        game.run_frame(usercmd);
+    }
+    let mid_snapshot = game.take_snapshot(Some(&baseline));
+
+    bench_vm(&bencher, &game, &mid_snapshot, &usercmds[mid..][..SEGMENT]);
+    bench_run(&bencher, &start, &usercmds);
+    bench_traces(&bencher, map, &states);
+    bench_snapshots(&bencher, &game, &mid_snapshot, &usercmds[mid..]);
+    bench_clients(&bencher, &fs, args.vm, &usercmds[..SEGMENT]);
+}
+
+/// The test map and game, and a run that sweeps back and forth across the map's patch and
+/// brushes, speeding up and slowing down along each axis out of step with the others.
+#[cfg(feature = "fixtures")]
+fn fixtures() -> (Fs, &'static Map, Vec<usercmd_t>) {
+    let fs = tasjr::game::test_game::fs();
+    let wave = |i: usize, period: usize, scale: i8| {
+        // Half a period pushing one way and half the other, so the speed keeps coming back to 0
+        let phase = (i + period / 4) % period;
+        if phase < period / 2 { scale } else { -scale }
+    };
+    let usercmds = (0..4 * SEGMENT)
+        .map(|i| usercmd_t {
+            serverTime: i as i32 * 8,
+            forwardmove: wave(i, 32, 2),
+            rightmove: wave(i, 24, 1),
+            upmove: wave(i, 40, 1),
+            ..usercmd_t::zeroed()
+        })
+        .collect();
+    (fs, q3::test_map::load(), usercmds)
+}
+
+#[cfg(not(feature = "fixtures"))]
+fn fixtures() -> (Fs, &'static Map, Vec<usercmd_t>) {
+    panic!("--fixtures needs bench to be built with the fixtures feature");
+}
+
+/// The same segment in every execution mode, per frame.
+fn bench_vm(bencher: &Bencher, game: &Game, start: &GameSnapshot, usercmds: &[usercmd_t]) {
+    for &mode in ExecMode::value_variants() {
+        let mut game = game.clone();
+        game.vm.mode = mode;
+        bencher.bench(&format!("vm/{mode:?}"), usercmds.len(), || {
+            game.restore_from_snapshot(start);
+            for &usercmd in usercmds {
+                game.run_frame(usercmd);
+            }
+        });
+    }
+}
+
+/// The whole run from the start, per frame.
+fn bench_run(bencher: &Bencher, start: &Game, usercmds: &[usercmd_t]) {
+    bencher.bench("run_frame", usercmds.len(), || {
+        let mut game = start.clone();
+        for &usercmd in usercmds {
+            game.run_frame(usercmd);
+        }
+    });
+}
+
+/// The traces pmove does most, from every recorded player state, per trace.
+fn bench_traces(bencher: &Bencher, map: &'static Map, states: &[playerState_t]) {
+    let hulls: [(&str, vec3_t, vec3_t); 3] = [
+        ("point", [0.0; 3], [0.0; 3]),
+        ("standing", [-15.0, -15.0, -24.0], [15.0, 15.0, 32.0]),
+        ("crouching", [-15.0, -15.0, -24.0], [15.0, 15.0, 16.0]),
+    ];
+
+    // One frame's worth of movement, and the ground check below the player
+    let moves: Vec<(vec3_t, vec3_t)> = states
+        .iter()
+        .flat_map(|ps| {
+            let [x, y, z] = ps.origin;
+            let [vx, vy, vz] = ps.velocity;
+            [
+                (ps.origin, [x + vx * 0.008, y + vy * 0.008, z + vz * 0.008]),
+                (ps.origin, [x, y, z - 0.25]),
+            ]
+        })
+        .collect();
+
+    let mut scratch = TraceScratch::new(map);
+    let num_threads = thread::available_parallelism().map_or(1, |n| n.get());
+    let mut scratches: Vec<_> = (0..num_threads).map(|_| TraceScratch::new(map)).collect();
+    let (starts, ends): (Vec<_>, Vec<_>) = moves.iter().copied().unzip();
+    let mut traces = vec![trace_t::zeroed(); moves.len()];
+    let model = map.inline_model(0);
+    for (name, mins, maxs) in hulls {
+        bencher.bench(&format!("trace/box/{name}"), moves.len(), || {
+            for (start, end) in &moves {
+                let mut trace = trace_t::zeroed();
+                map.box_trace(
+                    &mut scratch,
+                    &mut trace,
+                    start,
+                    end,
+                    &mins,
+                    &maxs,
+                    model,
+                    MASK_PLAYERSOLID,
+                    false,
+                );
+                black_box(&trace);
+            }
+        });
+
+        bencher.bench(&format!("trace/transformed/{name}"), moves.len(), || {
+            for (start, end) in &moves {
+                let mut trace = trace_t::zeroed();
+                map.transformed_box_trace(
+                    &mut scratch,
+                    &mut trace,
+                    start,
+                    end,
+                    &mins,
+                    &maxs,
+                    model,
+                    MASK_PLAYERSOLID,
+                    &[0.0; 3],
+                    &[0.0; 3],
+                    false,
+                );
+                black_box(&trace);
+            }
+        });
+
+        for (kind, scratches) in [
+            ("batch", std::slice::from_mut(&mut scratch)),
+            ("batch_threaded", &mut scratches[..]),
+        ] {
+            bencher.bench(&format!("trace/{kind}/{name}"), moves.len(), || {
+                map.box_trace_batch(
+                    scratches,
+                    &mut traces,
+                    &starts,
+                    &ends,
+                    &mins,
+                    &maxs,
+                    model,
+                    MASK_PLAYERSOLID,
+                    false,
+                );
+                black_box(&traces);
+            });
+        }
+    }
+}
+
+/// Taking and restoring a memory snapshot after simulating different numbers of frames since the
+/// previous one, so the number of dirty chunks is like it is in practice.
+fn bench_snapshots(bencher: &Bencher, game: &Game, start: &GameSnapshot, usercmds: &[usercmd_t]) {
+    for frames in SNAPSHOT_FRAMES {
+        let mut game = game.clone();
+        game.restore_from_snapshot(start);
+        let parent = game.vm.memory.take_snapshot(None);
+        for &usercmd in &usercmds[..frames] {
+            game.run_frame(usercmd);
+        }
+
+        let memory = &mut game.vm.memory;
+        bencher.bench(&format!("snapshot/take/{frames}"), 1, || {
+            black_box(memory.take_snapshot(Some(&parent)));
+        });
+
+        let snapshot = memory.take_snapshot(Some(&parent));
+        bencher.bench(&format!("snapshot/restore/{frames}"), 1, || {
+            memory.restore_from_snapshot(&snapshot);
+        });
+    }
+}
+
+/// A segment from the start with several clients in the same game all doing the same thing, per
+/// client per frame, to see how much running them together saves over running them one by one.
+fn bench_clients(bencher: &Bencher, fs: &Fs, vm_mode: ExecMode, usercmds: &[usercmd_t]) {
+    for num_clients in CLIENT_COUNTS {
+        let name = format!("clients/{num_clients}");
+        if bencher
+            .filter
+            .as_ref()
+            .is_some_and(|filter| !name.contains(filter))
+        {
+            continue;
+        }
+
+        let mut game = Game::start_with_clients(fs, vm_mode, num_clients);
+        let start = game.take_snapshot(None);
+        let mut frame_usercmds = vec![usercmd_t::zeroed(); num_clients];
+        bencher.bench(&name, usercmds.len() * num_clients, || {
+            game.restore_from_snapshot(&start);
+            for &usercmd in usercmds {
+                frame_usercmds.fill(usercmd);
+                game.run_frame_with_clients(&frame_usercmds);
+            }
+        });
+    }
+}
@@ -1,11 +1,13 @@
 use std::{
+    borrow::Cow,
     error::Error,
-    io::{Read, Seek, SeekFrom},
+    io::{Cursor, Read, Seek, SeekFrom},
     marker::PhantomData,
+    mem::size_of,
 };
 
 use binrw::{BinRead, Endian, binread, helpers::until_eof, io::TakeSeekExt};
-use bytemuck::{Pod, Zeroable};
+use bytemuck::{Pod, Zeroable, pod_collect_to_vec, try_cast_slice};
 
 type Result<T> = std::result::Result<T, Box<dyn Error>>;
 
@@ -33,7 +35,15 @@ pub struct Bsp {
     pub visibility: Lump<u8>,
 }
 
-#[derive(Debug)]
+impl Bsp {
+    /// The header of the BSP in `buf`. The lumps are read from the same buffer.
+    pub fn parse(buf: &[u8]) -> Result<Self> {
+        Ok(Self::read(&mut Cursor::new(buf))?)
+    }
+}
+
+#[derive(Debug, Clone, Copy, Pod, Zeroable)]
+#[repr(C)]
 #[binread]
 pub struct DrawVert {
     pub xyz: [f32; 3],
@@ -93,6 +103,22 @@ pub struct Lump<T> {
 }
 
 impl<T> Lump<T> {
+    /// The lump, cast in place if it's aligned in `buf` and copied if it isn't.
+    pub fn cast<'a>(&self, buf: &'a [u8]) -> Result<Cow<'a, [T]>>
+    where
+        T: Pod,
+    {
+        let (start, len) = (self.fileofs as usize, self.filelen as usize);
+        let bytes = buf.get(start..start + len).ok_or("lump out of bounds")?;
+        if len % size_of::<T>() != 0 {
+            Err("lump size isn't a multiple of its element size")?
+        }
+        Ok(match try_cast_slice(bytes) {
+            Ok(elements) => Cow::Borrowed(elements),
+            Err(_) => Cow::Owned(pod_collect_to_vec(bytes)),
+        })
+    }
+
     pub fn read<Arg, R: Read + Seek>(&self, mut reader: R) -> Result<Vec<T>>
     where
         T: for<'a> BinRead<Args<'a> = Arg>,
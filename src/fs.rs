@@ -1,41 +1,116 @@
+//! Files from the roots, and from the pk3s in them. Pk3s are memory mapped and their central
+//! directories are cached between launches in an index, so startup only has to look at the ones
+//! that changed, and stored entries can be read without copying them.
+
 use std::{
-    collections::HashMap,
+    borrow::Cow,
+    collections::{HashMap, HashSet},
+    env,
     error::Error,
     fs::{self, File},
-    io::{Cursor, Read},
+    io::{self, BufWriter, Cursor, Read, Write},
     path::{Path, PathBuf},
+    sync::OnceLock,
 };
 
 use zip::ZipArchive;
 
+mod index;
+mod pk3;
+
+use index::{Index, Stamp};
+use pk3::Mapping;
+
 pub struct Fs {
     roots: Vec<PathBuf>,
+    pk3s: Vec<Pk3>,
     containing_pk3_map: HashMap<String, Pk3Entry>,
 }
 
+struct Pk3 {
+    path: PathBuf,
+    entries: Vec<pk3::Entry>,
+
+    /// Mapped the first time anything is read from it, unless it was just scanned.
+    mapping: OnceLock<Mapping>,
+
+    /// Only needed to inflate compressed entries.
+    archive: OnceLock<ZipArchive<Cursor<Mapping>>>,
+}
+
+impl Pk3 {
+    fn mapping(&self) -> io::Result<&Mapping> {
+        if let Some(mapping) = self.mapping.get() {
+            return Ok(mapping);
+        }
+        let mapping = Mapping::new(&self.path)?;
+        Ok(self.mapping.get_or_init(|| mapping))
+    }
+
+    fn archive(&self) -> Result<&ZipArchive<Cursor<Mapping>>, Box<dyn Error>> {
+        if let Some(archive) = self.archive.get() {
+            return Ok(archive);
+        }
+        let archive = ZipArchive::new(self.mapping()?.cursor())?;
+        Ok(self.archive.get_or_init(|| archive))
+    }
+}
+
 struct Pk3Entry {
-    pk3_path: PathBuf,
-    entry_path: String,
+    pk3: usize,
+    entry: usize,
 }
 
 impl Fs {
     pub fn new<P: AsRef<Path>>(roots: &[P]) -> Result<Self, Box<dyn Error>> {
         let roots: Vec<_> = roots.iter().map(|root| root.as_ref().to_owned()).collect();
+        let mut pk3s: Vec<Pk3> = vec![];
         let mut containing_pk3_map = HashMap::new();
         let mut priority_map = HashMap::new();
+        let mut index = Index::load();
 
         for (priority, root) in roots.iter().enumerate() {
+            // The index is keyed on absolute paths so it works from any directory
+            let indexed_root = fs::canonicalize(root)?;
+            let mut seen = HashSet::new();
+
             let pk3_paths = fs::read_dir(root)?
                 .filter_map(|res| res.ok())
                 .map(|entry| entry.path())
                 .filter(|path| path.extension().is_some_and(|extension| extension == "pk3"));
 
             for pk3_path in pk3_paths {
-                let mut pk3 = ZipArchive::new(File::open(&pk3_path)?)?;
-
-                for i in 0..pk3.len() {
-                    let file = pk3.by_index(i)?;
-                    let key = file.name().to_lowercase();
+                let indexed_path = indexed_root.join(pk3_path.file_name().unwrap());
+                let stamp = fs::metadata(&pk3_path)
+                    .ok()
+                    .and_then(|metadata| Stamp::new(&metadata));
+
+                let (entries, mapping) =
+                    match stamp.and_then(|stamp| index.get(&indexed_path, stamp)) {
+                        Some(entries) => (entries.to_vec(), OnceLock::new()),
+                        None => {
+                            let mapping = Mapping::new(&pk3_path)?;
+                            let entries = pk3::entries(mapping.as_ref())
+                                .map_err(|err| format!("failed to read {pk3_path:?}: {err}"))?;
+                            if let Some(stamp) = stamp {
+                                index.insert(indexed_path.clone(), stamp, entries.clone());
+                            }
+                            (entries, OnceLock::from(mapping))
+                        }
+                    };
+                seen.insert(indexed_path);
+
+                let i = pk3s.len();
+                pk3s.push(Pk3 {
+                    path: pk3_path,
+                    entries,
+                    mapping,
+                    archive: OnceLock::new(),
+                });
+
+                let pk3 = &pk3s[i];
+                for (j, file) in pk3.entries.iter().enumerate() {
+                    let key = file.name.to_lowercase();
 
                     if priority_map
                         .get(&key)
@@ -46,34 +121,34 @@ impl Fs {
 
                     let should_insert = containing_pk3_map
                         .get(&key)
-                        .is_none_or(|entry: &Pk3Entry| pk3_path > entry.pk3_path);
+                        .is_none_or(|entry: &Pk3Entry| pk3.path > pk3s[entry.pk3].path);
 
                     if should_insert {
-                        containing_pk3_map.insert(
-                            key.clone(),
-                            Pk3Entry {
-                                pk3_path: pk3_path.to_path_buf(),
-                                entry_path: file.name().to_string(),
-                            },
-                        );
+                        containing_pk3_map.insert(key.clone(), Pk3Entry { pk3: i, entry: j });
                         priority_map.insert(key, priority);
                     }
                 }
             }
+
+            index.retain_seen(&indexed_root, &seen);
         }
 
+        index.save();
+
         Ok(Self {
             roots,
+            pk3s,
             containing_pk3_map,
         })
     }
 
-    pub fn open<P: AsRef<Path>>(&self, path: P) -> Result<Cursor<Vec<u8>>, Box<dyn Error>> {
+    /// The contents of `path`, borrowed straight from the pk3 it's in if it isn't compressed.
+    pub fn get<P: AsRef<Path>>(&self, path: P) -> Result<Cow<'_, [u8]>, Box<dyn Error>> {
         let path = path.as_ref();
 
         for root in &self.roots {
             if let Ok(data) = fs::read(root.join(path)) {
-                return Ok(Cursor::new(data));
+                return Ok(Cow::Owned(data));
             }
         }
 
@@ -81,16 +156,62 @@ impl Fs {
             .containing_pk3_map
             .get(&path.to_str().unwrap().to_lowercase())
         {
-            let mut data = vec![];
-            let mut pk3 = ZipArchive::new(File::open(&entry.pk3_path)?)?;
-            pk3.by_name(&entry.entry_path)?.read_to_end(&mut data)?;
-            return Ok(Cursor::new(data));
+            let pk3 = &self.pk3s[entry.pk3];
+            let file = &pk3.entries[entry.entry];
+            if file.method == pk3::STORED {
+                return Ok(Cow::Borrowed(file.data(pk3.mapping()?.as_ref())?));
+            }
+
+            // Clones of an archive share its central directory, so this doesn't parse it again
+            let mut data = Vec::with_capacity(file.size as usize);
+            pk3.archive()?
+                .clone()
+                .by_name(&file.name)?
+                .read_to_end(&mut data)?;
+            return Ok(Cow::Owned(data));
         }
 
         Err(format!("failed to load {path:?}"))?
     }
 
+    pub fn open<P: AsRef<Path>>(&self, path: P) -> Result<Cursor<Cow<'_, [u8]>>, Box<dyn Error>> {
+        Ok(Cursor::new(self.get(path)?))
+    }
+
     pub fn read<P: AsRef<Path>>(&self, path: P) -> Result<Vec<u8>, Box<dyn Error>> {
-        Ok(self.open(path)?.into_inner())
+        Ok(self.get(path)?.into_owned())
+    }
+}
+
+/// The directory for files that only make things faster, so losing them doesn't matter.
+pub fn cache_dir() -> Option<PathBuf> {
+    let cache_dir = if let Some(dir) = env::var_os("XDG_CACHE_HOME") {
+        PathBuf::from(dir)
+    } else if let Some(home) = env::var_os("HOME") {
+        PathBuf::from(home).join(".cache")
+    } else {
+        PathBuf::from(env::var_os("LOCALAPPDATA")?)
+    };
+    Some(cache_dir.join("tasjr"))
+}
+
+/// Replaces a file in the cache directory with what `write` writes. It's written elsewhere first
+/// so another instance never reads half of it.
+pub fn write_cache(
+    path: &Path,
+    write: impl FnOnce(&mut BufWriter<File>) -> io::Result<()>,
+) -> io::Result<()> {
+    let temp_path = path.with_extension("tmp");
+    let result = fs::create_dir_all(path.parent().unwrap())
+        .and_then(|_| File::create(&temp_path))
+        .and_then(|file| {
+            let mut w = BufWriter::new(file);
+            write(&mut w)?;
+            w.flush()
+        })
+        .and_then(|_| fs::rename(&temp_path, path));
+    if result.is_err() {
+        let _ = fs::remove_file(&temp_path);
     }
+    result
 }
@@ -0,0 +1,174 @@
+//! A cache of every pk3's central directory, so starting up doesn't have to open every pk3 in
+//! every root. Pk3s are looked up by path and only used if their size and modification time are
+//! the same as when they were cached.
+//!
+//! It's a single file in the user's cache directory, little endian:
+//!
+//! - The magic `TASJRIDX` and the format version.
+//! - The number of pk3s, and then for each one its path, modification time in nanoseconds since
+//!   the epoch and size, then the number of entries and the entries themselves.
+//!
+//! Failing to read or write it only means pk3s get scanned again.
+
+use std::{
+    collections::{HashMap, HashSet},
+    fs::{File, Metadata},
+    io::{self, BufReader, Read, Write},
+    path::{Path, PathBuf},
+    time::UNIX_EPOCH,
+};
+
+use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
+
+use super::pk3::Entry;
+
+const MAGIC: &[u8; 8] = b"TASJRIDX";
+const VERSION: u32 = 1;
+
+/// Longer than any real path, so a corrupt length can't cause a huge allocation.
+const MAX_STRING_LEN: usize = 1 << 16;
+
+/// What a pk3 was like when it was cached.
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub struct Stamp {
+    mtime: u64,
+    size: u64,
+}
+
+impl Stamp {
+    pub fn new(metadata: &Metadata) -> Option<Self> {
+        let mtime = metadata.modified().ok()?.duration_since(UNIX_EPOCH).ok()?;
+        Some(Self {
+            mtime: mtime.as_nanos() as u64,
+            size: metadata.len(),
+        })
+    }
+}
+
+#[derive(Default)]
+pub struct Index {
+    pk3s: HashMap<PathBuf, (Stamp, Vec<Entry>)>,
+    changed: bool,
+}
+
+impl Index {
+    /// The cached index, or an empty one if there isn't a usable one.
+    pub fn load() -> Self {
+        path()
+            .and_then(|path| File::open(path).ok())
+            .and_then(|file| read(&mut BufReader::new(file)).ok())
+            .map(|pk3s| Self {
+                pk3s,
+                changed: false,
+            })
+            .unwrap_or_default()
+    }
+
+    pub fn get(&self, path: &Path, stamp: Stamp) -> Option<&[Entry]> {
+        self.pk3s
+            .get(path)
+            .filter(|(cached_stamp, _)| *cached_stamp == stamp)
+            .map(|(_, entries)| entries.as_slice())
+    }
+
+    pub fn insert(&mut self, path: PathBuf, stamp: Stamp, entries: Vec<Entry>) {
+        self.pk3s.insert(path, (stamp, entries));
+        self.changed = true;
+    }
+
+    /// Forgets pk3s in `root` that aren't in `seen` anymore.
+    pub fn retain_seen(&mut self, root: &Path, seen: &HashSet<PathBuf>) {
+        let len = self.pk3s.len();
+        self.pk3s
+            .retain(|path, _| !path.starts_with(root) || seen.contains(path));
+        self.changed |= self.pk3s.len() != len;
+    }
+
+    /// Writes the index back out if anything about it changed.
+    pub fn save(&self) {
+        if !self.changed {
+            return;
+        }
+        let Some(path) = path() else {
+            return;
+        };
+        let _ = super::write_cache(&path, |w| write(w, &self.pk3s));
+    }
+}
+
+fn path() -> Option<PathBuf> {
+    Some(super::cache_dir()?.join("pk3-index"))
+}
+
+fn read(r: &mut impl Read) -> io::Result<HashMap<PathBuf, (Stamp, Vec<Entry>)>> {
+    let mut magic = [0; 8];
+    r.read_exact(&mut magic)?;
+    if &magic != MAGIC || r.read_u32::<LittleEndian>()? != VERSION {
+        return Err(io::ErrorKind::InvalidData.into());
+    }
+
+    let num_pk3s = r.read_u32::<LittleEndian>()?;
+    let mut pk3s = HashMap::new();
+    for _ in 0..num_pk3s {
+        let path = PathBuf::from(read_string(r)?);
+        let stamp = Stamp {
+            mtime: r.read_u64::<LittleEndian>()?,
+            size: r.read_u64::<LittleEndian>()?,
+        };
+        let num_entries = r.read_u32::<LittleEndian>()?;
+        let entries = (0..num_entries)
+            .map(|_| {
+                Ok(Entry {
+                    name: read_string(r)?,
+                    method: r.read_u16::<LittleEndian>()?,
+                    compressed_size: r.read_u32::<LittleEndian>()?,
+                    size: r.read_u32::<LittleEndian>()?,
+                    header_offset: r.read_u32::<LittleEndian>()?,
+                })
+            })
+            .collect::<io::Result<_>>()?;
+        pk3s.insert(path, (stamp, entries));
+    }
+    Ok(pk3s)
+}
+
+fn write(w: &mut impl Write, pk3s: &HashMap<PathBuf, (Stamp, Vec<Entry>)>) -> io::Result<()> {
+    // Paths that aren't UTF-8 just never get cached
+    let pk3s: Vec<_> = pk3s
+        .iter()
+        .filter_map(|(path, pk3)| Some((path.to_str()?, pk3)))
+        .collect();
+
+    w.write_all(MAGIC)?;
+    w.write_u32::<LittleEndian>(VERSION)?;
+    w.write_u32::<LittleEndian>(pk3s.len() as u32)?;
+    for (path, (stamp, entries)) in pk3s {
+        write_string(w, path)?;
+        w.write_u64::<LittleEndian>(stamp.mtime)?;
+        w.write_u64::<LittleEndian>(stamp.size)?;
+        w.write_u32::<LittleEndian>(entries.len() as u32)?;
+        for entry in entries {
+            write_string(w, &entry.name)?;
+            w.write_u16::<LittleEndian>(entry.method)?;
+            w.write_u32::<LittleEndian>(entry.compressed_size)?;
+            w.write_u32::<LittleEndian>(entry.size)?;
+            w.write_u32::<LittleEndian>(entry.header_offset)?;
+        }
+    }
+    Ok(())
+}
+
+fn read_string(r: &mut impl Read) -> io::Result<String> {
+    let len = r.read_u32::<LittleEndian>()? as usize;
+    if len > MAX_STRING_LEN {
+        return Err(io::ErrorKind::InvalidData.into());
+    }
+    let mut buf = vec![0; len];
+    r.read_exact(&mut buf)?;
+    String::from_utf8(buf).map_err(|_| io::ErrorKind::InvalidData.into())
+}
+
+fn write_string(w: &mut impl Write, s: &str) -> io::Result<()> {
+    w.write_u32::<LittleEndian>(s.len() as u32)?;
+    w.write_all(s.as_bytes())
+}
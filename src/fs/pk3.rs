@@ -0,0 +1,203 @@
+//! Reading pk3s in place. The central directory is parsed directly from a mapping of the whole
+//! archive, and stored entries are sliced straight out of it, so only compressed entries cost an
+//! allocation. Pk3s are never ZIP64, so that isn't supported.
+
+use std::{
+    error::Error,
+    fs::File,
+    io::{self, Cursor},
+    ops::Deref,
+    path::Path,
+    sync::Arc,
+};
+
+use byteorder::{ByteOrder, LittleEndian};
+
+const END_OF_CENTRAL_DIRECTORY: u32 = 0x06054b50;
+const CENTRAL_DIRECTORY_HEADER: u32 = 0x02014b50;
+const LOCAL_FILE_HEADER: u32 = 0x04034b50;
+
+/// Compression method of entries that are stored as is.
+pub const STORED: u16 = 0;
+
+/// An entry in the central directory.
+#[derive(Clone)]
+pub struct Entry {
+    pub name: String,
+    pub method: u16,
+    pub compressed_size: u32,
+    pub size: u32,
+    pub header_offset: u32,
+}
+
+impl Entry {
+    /// The entry's data as it is in `archive`, compressed or not.
+    pub fn data<'a>(&self, archive: &'a [u8]) -> Result<&'a [u8], Box<dyn Error>> {
+        let header = archive
+            .get(self.header_offset as usize..)
+            .filter(|header| header.len() >= 30)
+            .ok_or("local file header out of bounds")?;
+        if LittleEndian::read_u32(header) != LOCAL_FILE_HEADER {
+            Err("bad local file header")?
+        }
+
+        // The local header's name and extra field can differ from the central directory's
+        let start = 30
+            + LittleEndian::read_u16(&header[26..]) as usize
+            + LittleEndian::read_u16(&header[28..]) as usize;
+        Ok(header
+            .get(start..start + self.compressed_size as usize)
+            .ok_or("entry data out of bounds")?)
+    }
+}
+
+/// Every entry in `archive`, in the order of the central directory.
+pub fn entries(archive: &[u8]) -> Result<Vec<Entry>, Box<dyn Error>> {
+    // The end of central directory record is at least 22 bytes and followed by a comment of up to
+    // 64K
+    let search_start = archive.len().saturating_sub(22 + 0xffff);
+    let end = (search_start..archive.len().saturating_sub(21))
+        .rev()
+        .find(|&i| LittleEndian::read_u32(&archive[i..]) == END_OF_CENTRAL_DIRECTORY)
+        .ok_or("no end of central directory")?;
+    let end = &archive[end..];
+    let num_entries = LittleEndian::read_u16(&end[10..]) as usize;
+    let offset = LittleEndian::read_u32(&end[16..]) as usize;
+
+    let mut entries = Vec::with_capacity(num_entries);
+    let mut header = archive
+        .get(offset..)
+        .ok_or("central directory out of bounds")?;
+    for _ in 0..num_entries {
+        if header.len() < 46 || LittleEndian::read_u32(header) != CENTRAL_DIRECTORY_HEADER {
+            Err("bad central directory header")?
+        }
+        let name_len = LittleEndian::read_u16(&header[28..]) as usize;
+        let extra_len = LittleEndian::read_u16(&header[30..]) as usize;
+        let comment_len = LittleEndian::read_u16(&header[32..]) as usize;
+        let name = header
+            .get(46..46 + name_len)
+            .ok_or("central directory out of bounds")?;
+
+        entries.push(Entry {
+            name: String::from_utf8_lossy(name).into_owned(),
+            method: LittleEndian::read_u16(&header[10..]),
+            compressed_size: LittleEndian::read_u32(&header[20..]),
+            size: LittleEndian::read_u32(&header[24..]),
+            header_offset: LittleEndian::read_u32(&header[42..]),
+        });
+        header = header
+            .get(46 + name_len + extra_len + comment_len..)
+            .ok_or("central directory out of bounds")?;
+    }
+    Ok(entries)
+}
+
+/// A whole archive, memory mapped where possible. Cloning it shares the mapping, so it can back a
+/// `ZipArchive` as well.
+#[derive(Clone)]
+pub struct Mapping(Arc<Bytes>);
+
+impl Mapping {
+    pub fn new(path: &Path) -> io::Result<Self> {
+        Ok(Self(Arc::new(Bytes::new(File::open(path)?)?)))
+    }
+
+    pub fn cursor(&self) -> Cursor<Self> {
+        Cursor::new(self.clone())
+    }
+}
+
+impl AsRef<[u8]> for Mapping {
+    fn as_ref(&self) -> &[u8] {
+        &self.0
+    }
+}
+
+#[cfg(not(unix))]
+struct Bytes(Vec<u8>);
+
+#[cfg(not(unix))]
+impl Bytes {
+    fn new(mut file: File) -> io::Result<Self> {
+        use std::io::Read;
+
+        let mut data = vec![];
+        file.read_to_end(&mut data)?;
+        Ok(Self(data))
+    }
+}
+
+#[cfg(not(unix))]
+impl Deref for Bytes {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.0
+    }
+}
+
+/// A read-only mapping of a file. Pk3s are expected to stay as they are while they're open, like
+/// they do in the engine.
+#[cfg(unix)]
+struct Bytes {
+    ptr: *const u8,
+    len: usize,
+}
+
+// The mapping is never written to
+#[cfg(unix)]
+unsafe impl Send for Bytes {}
+#[cfg(unix)]
+unsafe impl Sync for Bytes {}
+
+#[cfg(unix)]
+impl Bytes {
+    fn new(file: File) -> io::Result<Self> {
+        use std::{os::fd::AsRawFd, ptr::null_mut};
+
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Ok(Self {
+                ptr: std::ptr::NonNull::dangling().as_ptr(),
+                len,
+            });
+        }
+
+        let ptr = unsafe {
+            libc::mmap(
+                null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self {
+            ptr: ptr.cast_const().cast(),
+            len,
+        })
+    }
+}
+
+#[cfg(unix)]
+impl Drop for Bytes {
+    fn drop(&mut self) {
+        if self.len > 0 {
+            unsafe { libc::munmap(self.ptr.cast_mut().cast(), self.len) };
+        }
+    }
+}
+
+#[cfg(unix)]
+impl Deref for Bytes {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
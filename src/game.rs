@@ -1,56 +1,114 @@
+#[cfg(feature = "profile")]
+use std::time::Instant;
 use std::{
-    collections::{HashMap, HashSet},
+    collections::HashMap,
+    hash::{DefaultHasher, Hash, Hasher},
+    io::{self, Read, Write},
     marker::PhantomData,
+    mem,
     path::Path,
+    sync::Arc,
 };
 
 use bytemuck::{Zeroable, cast, cast_slice_mut};
+use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
 use glam::Vec3;
 
+#[cfg(feature = "profile")]
+use crate::profile;
 use crate::{
     Snapshot,
     fs::Fs,
     q3::{
-        ENTITYNUM_NONE, ENTITYNUM_WORLD, MAX_CLIENTS, Map, gameExport_t::*, gameImport_t::*,
-        playerState_t, qtime_t, sharedEntity_t, sharedTraps_t::*, trace_t, usercmd_t, vmCvar_t,
+        ENTITYNUM_NONE, ENTITYNUM_WORLD, MAX_CLIENTS, Map, TraceScratch, checksum, gameExport_t::*,
+        gameImport_t::*, playerState_t, qtime_t, sharedEntity_t, sharedTraps_t::*, trace_t,
+        usercmd_t, vmCvar_t,
     },
-    vm::{ExitReason, Vm},
+    vm::{ExecMode, ExitReason, MemorySnapshot, Vm},
 };
 
+#[cfg(any(test, feature = "fixtures"))]
+pub mod test_game;
+mod world;
+
+use world::World;
+
+/// Longest cvar name that can be looked up without allocating, which is longer than any the
+/// engine allows.
+const MAX_CVAR_NAME_LEN: usize = 256;
+
+/// Only changes occasionally, so clones share it until one of them does. Names are case
+/// insensitive, and are lowercased once when a cvar is first set so looking one up never has to
+/// allocate.
 #[derive(Clone, Default, Debug)]
 pub struct Cvars {
-    cvars: HashMap<String, String>,
-    registered: Vec<String>,
+    /// Indices into `values` by lowercased name.
+    indices: Arc<HashMap<Box<[u8]>, usize>>,
+    values: Arc<Vec<String>>,
+
+    /// The cvar of each handle given to the game.
+    registered: Arc<Vec<usize>>,
 }
 
 impl Cvars {
-    pub fn get_str(&self, name: &str) -> &str {
-        self.cvars
-            .get(&name.to_ascii_lowercase())
-            .map(String::as_str)
+    fn index(&self, name: &[u8]) -> Option<usize> {
+        let mut buf = [0; MAX_CVAR_NAME_LEN];
+        if let Some(lowercase) = buf.get_mut(..name.len()) {
+            lowercase.copy_from_slice(name);
+            lowercase.make_ascii_lowercase();
+            self.indices.get(&*lowercase).copied()
+        } else {
+            self.indices.get(&*name.to_ascii_lowercase()).copied()
+        }
+    }
+
+    fn index_or_insert(&mut self, name: &[u8]) -> usize {
+        self.index(name).unwrap_or_else(|| {
+            let index = self.values.len();
+            Arc::make_mut(&mut self.values).push(String::new());
+            Arc::make_mut(&mut self.indices).insert(name.to_ascii_lowercase().into(), index);
+            index
+        })
+    }
+
+    pub fn get_str(&self, name: impl AsRef<[u8]>) -> &str {
+        self.index(name.as_ref())
+            .map(|index| self.values[index].as_str())
             .unwrap_or("")
     }
 
-    pub fn get_i32(&self, name: &str) -> i32 {
-        self.get_str(&name.to_ascii_lowercase())
-            .parse()
-            .unwrap_or_default()
+    pub fn get_i32(&self, name: impl AsRef<[u8]>) -> i32 {
+        self.get_str(name).parse().unwrap_or_default()
     }
 
-    pub fn get_f32(&self, name: &str) -> f32 {
-        self.get_str(&name.to_ascii_lowercase())
-            .parse()
-            .unwrap_or_default()
+    pub fn get_f32(&self, name: impl AsRef<[u8]>) -> f32 {
+        self.get_str(name).parse().unwrap_or_default()
     }
 
-    pub fn set(&mut self, name: &str, value: String) {
-        self.cvars.insert(name.to_ascii_lowercase(), value);
+    /// The value of the cvar the game was given `handle` for.
+    pub fn get_handle_str(&self, handle: usize) -> &str {
+        &self.values[self.registered[handle]]
+    }
+
+    pub fn set(&mut self, name: impl AsRef<[u8]>, value: &str) {
+        let index = self.index_or_insert(name.as_ref());
+        // The game sets the same cvars to the same values over and over, which shouldn't unshare
+        // anything
+        if self.values[index] != value {
+            let old = &mut Arc::make_mut(&mut self.values)[index];
+            old.clear();
+            old.push_str(value);
+        }
     }
 
-    pub fn register(&mut self, name: String, value: String) -> usize {
+    pub fn register(&mut self, name: impl AsRef<[u8]>, value: &str) -> usize {
+        let index = self.index(name.as_ref()).unwrap_or_else(|| {
+            let index = self.index_or_insert(name.as_ref());
+            Arc::make_mut(&mut self.values)[index] = value.to_string();
+            index
+        });
         let handle = self.registered.len();
-        self.registered.push(name.to_ascii_lowercase());
-        self.cvars.entry(name.to_ascii_lowercase()).or_insert(value);
+        Arc::make_mut(&mut self.registered).push(index);
         handle
     }
 }
@@ -82,6 +140,36 @@ impl<T> GameData<T> {
     }
 }
 
+/// Folds `frame_hashes` into a hash of each frame together with every frame before it, so the
+/// first of these that differs between two runs is the first frame where they went differently.
+pub fn rolling_checksums(frame_hashes: impl IntoIterator<Item = u64>) -> Vec<u64> {
+    frame_hashes
+        .into_iter()
+        .scan(0u64, |rolling, hash| {
+            *rolling = (rolling.rotate_left(5) ^ hash).wrapping_mul(0x100000001b3);
+            Some(*rolling)
+        })
+        .collect()
+}
+
+/// The arguments of a `G_TRACE`. Floats are compared by their bits so only exactly the same trace
+/// hits the cache.
+#[derive(Clone, Copy, PartialEq, Eq, Hash)]
+struct TraceKey {
+    start: [u32; 3],
+    mins: [u32; 3],
+    maxs: [u32; 3],
+    end: [u32; 3],
+    pass_entity_num: i32,
+    content_mask: i32,
+}
+
+#[derive(Clone, Copy, Default, Debug)]
+pub struct TraceCacheStats {
+    pub hits: u64,
+    pub misses: u64,
+}
+
 #[derive(Clone)]
 pub struct Game {
     pub cvars: Cvars,
@@ -90,55 +178,155 @@ pub struct Game {
     pub clients: Option<GameData<playerState_t>>,
     pub init_time: i32,
     pub time: i32,
-    usercmd: usercmd_t,
-    linked_entities: HashSet<u32>,
+
+    /// What each client is doing this frame. Clients don't see or touch each other, so several
+    /// players can be simulated in the same game.
+    usercmds: Vec<usercmd_t>,
+
+    /// The client the qvm is being called for, which other clients' entities are hidden from.
+    current_client: Option<u32>,
+
+    world: World,
+
+    /// Reused for the results of `World::entities_in_box`.
+    entity_list: Vec<u32>,
+
+    /// Results of the traces done so far this frame, since the same ones are often repeated.
+    /// Anything that links or unlinks entities clears it.
+    trace_cache: HashMap<TraceKey, trace_t>,
+    pub trace_cache_stats: TraceCacheStats,
+
+    next_entity_token: usize,
+    trace_scratch: TraceScratch,
+
+    /// See `q3::checksum`.
+    pub qvm_checksum: u64,
+
+    /// Whether `run_frame` should hash what each frame did, for `frame_hash`. Costs a pass over
+    /// the memory written that frame, which is small next to running it.
+    pub hash_frames: bool,
+    frame_hash: u64,
 }
 
 impl Game {
     pub fn new<P: AsRef<Path>>(fs: &Fs, vm_path: P) -> Self {
         let cvars = Cvars::default();
 
+        #[cfg(feature = "profile")]
+        profile::load_symbols(fs, vm_path.as_ref());
+
         let mut vm = Vm::default();
         let f = fs.open(vm_path).unwrap();
+        let qvm_checksum = checksum(f.get_ref());
         vm.load(f).unwrap();
 
+        let mut trace_scratch = TraceScratch::new(Map::get());
+        let (mut mins, mut maxs) = ([0.0; 3], [0.0; 3]);
+        let world_model = Map::get().inline_model(0);
+        Map::get().model_bounds(&mut trace_scratch, world_model, &mut mins, &mut maxs);
+
         Self {
             cvars,
             vm,
             g_entities: None,
             clients: None,
-            usercmd: usercmd_t::zeroed(),
+            usercmds: vec![],
+            current_client: None,
             init_time: 0,
             time: 0,
-            linked_entities: HashSet::new(),
+            world: World::new(mins.into(), maxs.into()),
+            entity_list: vec![],
+            trace_cache: HashMap::new(),
+            trace_cache_stats: TraceCacheStats::default(),
+            next_entity_token: 0,
+            trace_scratch,
+            qvm_checksum,
+            hash_frames: false,
+            frame_hash: 0,
         }
     }
 
-    pub fn init(&mut self) {
+    /// Loads the game from `fs`, set up like a local defrag server, and initializes it.
+    pub fn start(fs: &Fs, vm_mode: ExecMode) -> Self {
+        Self::start_with_clients(fs, vm_mode, 1)
+    }
+
+    /// Like `start`, but with `num_clients` players, who all spawn in the same place and then go
+    /// their own way. Only collisions between them are filtered out, so they can still affect each
+    /// other through anything they share, like items or the random seed.
+    pub fn start_with_clients(fs: &Fs, vm_mode: ExecMode, num_clients: usize) -> Self {
+        assert!((1..=MAX_CLIENTS as usize).contains(&num_clients));
+        let mut game = Self::new(fs, "vm/qagame.qvm");
+        game.vm.mode = vm_mode;
+        game.cvars.set("dedicated", "1");
+        game.cvars.set("df_promode", "1");
+        if num_clients > 1 {
+            game.cvars.set("sv_maxclients", &num_clients.to_string());
+            // Defrag's own way of keeping players apart, which also covers splash damage and the
+            // like that the syscalls don't get to see
+            game.cvars.set("df_mp_interferenceOff", "3");
+        }
+        game.init(num_clients);
+        game
+    }
+
+    pub fn init(&mut self, num_clients: usize) {
         self.g_init(0, 0, false);
         for _ in 0..3 {
             self.g_run_frame(self.time);
             self.time += 100;
         }
         self.init_time = self.time;
-        self.g_client_connect(0, true, false).unwrap();
-        self.g_client_begin(0);
+        self.usercmds = vec![usercmd_t::zeroed(); num_clients];
+        for client_num in 0..num_clients as i32 {
+            self.g_client_connect(client_num, true, false).unwrap();
+            self.g_client_begin(client_num);
+        }
     }
 
+    pub fn num_clients(&self) -> usize {
+        self.usercmds.len()
+    }
+
+    /// Runs a frame with the one client doing `usercmd`.
     pub fn run_frame(&mut self, usercmd: usercmd_t) {
-        self.usercmd = usercmd;
-        self.usercmd.serverTime = self.time;
+        self.run_frame_with_clients(&[usercmd]);
+    }
 
-        // We use absolute angles, but the game expects them to be relative to delta_angles
-        let ps = self
-            .vm
-            .memory
-            .cast_mut::<playerState_t>(self.clients.unwrap().address);
-        (0..3).for_each(|i| self.usercmd.angles[i] -= ps.delta_angles[i]);
+    /// Runs a frame with each client doing its own usercmd.
+    pub fn run_frame_with_clients(&mut self, usercmds: &[usercmd_t]) {
+        assert_eq!(usercmds.len(), self.num_clients());
+        self.trace_cache.clear();
+
+        if self.hash_frames {
+            self.vm.memory.track_writes();
+        }
+        for (client_num, &usercmd) in usercmds.iter().enumerate() {
+            let mut usercmd = usercmd;
+            usercmd.serverTime = self.time;
 
-        self.g_client_think(0);
+            // We use absolute angles, but the game expects them to be relative to delta_angles
+            let ps = self.client_ps(client_num);
+            (0..3).for_each(|i| usercmd.angles[i] -= ps.delta_angles[i]);
+
+            self.usercmds[client_num] = usercmd;
+            self.g_client_think(client_num as i32);
+        }
         self.g_run_frame(self.time);
         self.time += 8;
+        if self.hash_frames {
+            let ps_hash = (0..self.num_clients()).fold(0u64, |hash, client_num| {
+                hash.rotate_left(5) ^ checksum(bytemuck::bytes_of(self.client_ps(client_num)))
+            });
+            self.frame_hash = ps_hash ^ self.vm.memory.hash_writes();
+        }
+    }
+
+    /// A hash of the players' states after the last frame and of all the memory that frame wrote,
+    /// if `hash_frames` was set for it. Two simulations that agree on these for every frame almost
+    /// certainly went the same way.
+    pub fn frame_hash(&self) -> u64 {
+        self.frame_hash
     }
 
     pub fn relative_time(&self) -> i32 {
@@ -150,8 +338,37 @@ impl Game {
         (self.relative_time() / 8) as usize
     }
 
+    /// The first client's state, which is the only one unless the game was started with more.
     pub fn ps(&self) -> &playerState_t {
-        self.vm.memory.cast(self.clients.unwrap().address)
+        self.client_ps(0)
+    }
+
+    pub fn client_ps(&self, client_num: usize) -> &playerState_t {
+        assert!(client_num < self.num_clients());
+        self.vm
+            .memory
+            .cast(self.clients.unwrap().address(client_num as u32))
+    }
+
+    /// The client an entity is or belongs to, if any.
+    fn client_of(&self, ent: u32) -> Option<u32> {
+        let num_clients = self.num_clients() as u32;
+        if ent < num_clients {
+            return Some(ent);
+        }
+        let owner_num = self.entity(ent).r.ownerNum;
+        (0..num_clients as i32)
+            .contains(&owner_num)
+            .then_some(owner_num as u32)
+    }
+
+    /// Whether `ent` belongs to a client other than `client`, so `client` should act as if it
+    /// isn't there.
+    fn is_hidden_from(&self, client: Option<u32>, ent: u32) -> bool {
+        client.is_some()
+            && self
+                .client_of(ent)
+                .is_some_and(|owner| Some(owner) != client)
     }
 
     pub fn entity(&self, index: u32) -> &sharedEntity_t {
@@ -159,10 +376,22 @@ impl Game {
     }
 
     fn call_vm(&mut self, args: [u32; 10]) -> u32 {
+        #[cfg(feature = "profile")]
+        profile::Recorder::update(&mut self.vm.recorder);
+
         self.vm.prepare_call(&args);
         loop {
             match self.vm.run() {
                 ExitReason::Return => return self.vm.op_stack.pop().unwrap(),
+                #[cfg(feature = "profile")]
+                ExitReason::Syscall(syscall) if self.vm.recorder.is_some() => {
+                    let start = Instant::now();
+                    self.handle_syscall(syscall);
+                    let elapsed = start.elapsed();
+                    if let Some(recorder) = &mut self.vm.recorder {
+                        recorder.syscall(syscall, elapsed);
+                    }
+                }
                 ExitReason::Syscall(syscall) => self.handle_syscall(syscall),
             }
         }
@@ -209,6 +438,8 @@ impl Game {
     }
 
     pub fn g_client_begin(&mut self, client_num: i32) {
+        // Spawning looks for players in the way, and other clients shouldn't count
+        self.current_client = Some(client_num as u32);
         self.call_vm([
             GAME_CLIENT_BEGIN as _,
             client_num as u32,
@@ -221,9 +452,11 @@ impl Game {
             0,
             0,
         ]);
+        self.current_client = None;
     }
 
     pub fn g_client_think(&mut self, client_num: i32) {
+        self.current_client = Some(client_num as u32);
         self.call_vm([
             GAME_CLIENT_THINK as _,
             client_num as u32,
@@ -236,6 +469,7 @@ impl Game {
             0,
             0,
         ]);
+        self.current_client = None;
     }
 
     pub fn g_run_frame(&mut self, level_time: i32) {
@@ -269,27 +503,22 @@ impl Game {
             }
             G_CVAR_REGISTER => {
                 let vm_cvar = self.vm.read_arg::<u32>(0);
-                let name = self
-                    .vm
-                    .memory
-                    .cstr(self.vm.read_arg(1))
-                    .to_string_lossy()
-                    .to_string();
-                let default = self
-                    .vm
-                    .memory
-                    .cstr(self.vm.read_arg(2))
-                    .to_string_lossy()
-                    .to_string();
+                // Only borrowed unless the default isn't UTF-8
+                let name = self.vm.memory.cstr(self.vm.read_arg(1)).to_bytes();
+                let default = self.vm.memory.cstr(self.vm.read_arg(2)).to_string_lossy();
                 let flags = self.vm.read_arg::<u32>(3);
-                eprintln!("G_CVAR_REGISTER {name} {default:?} {flags}");
-                let handle = self.cvars.register(name.to_owned(), default.to_owned());
+                eprintln!(
+                    "G_CVAR_REGISTER {} {default:?} {flags}",
+                    name.escape_ascii()
+                );
+                let handle = self.cvars.register(name, &default);
                 if vm_cvar != 0 {
+                    let value = self.cvars.get_handle_str(handle);
                     let vm_cvar = self.vm.memory.cast_mut::<vmCvar_t>(vm_cvar);
                     vm_cvar.handle = handle as i32;
-                    vm_cvar.value = self.cvars.get_f32(&name);
-                    vm_cvar.integer = self.cvars.get_i32(&name);
-                    let bytes = self.cvars.get_str(&name).as_bytes();
+                    vm_cvar.value = value.parse().unwrap_or_default();
+                    vm_cvar.integer = value.parse().unwrap_or_default();
+                    let bytes = value.as_bytes();
                     let size = bytes.len().min(vm_cvar.string.len());
                     cast_slice_mut(&mut vm_cvar.string[..size]).copy_from_slice(&bytes[..size]);
                 }
@@ -297,18 +526,19 @@ impl Game {
             }
             G_CVAR_UPDATE => {
                 let vm_cvar = self.vm.memory.cast_mut::<vmCvar_t>(self.vm.read_arg(0));
-                let _name = &self.cvars.registered[vm_cvar.handle as usize];
+                let _value = self.cvars.get_handle_str(vm_cvar.handle as usize);
                 self.vm.set_result(0);
             }
             G_CVAR_SET => {
-                let name = self.vm.memory.cstr(self.vm.read_arg(0)).to_string_lossy();
+                // Only borrowed unless the value isn't UTF-8
+                let name = self.vm.memory.cstr(self.vm.read_arg(0)).to_bytes();
                 let value = self.vm.memory.cstr(self.vm.read_arg(1)).to_string_lossy();
-                self.cvars.set(&name, value.to_string());
+                self.cvars.set(name, &value);
                 self.vm.set_result(0);
             }
             G_CVAR_VARIABLE_INTEGER_VALUE => {
-                let name = self.vm.memory.cstr(self.vm.read_arg(0)).to_string_lossy();
-                self.vm.set_result(self.cvars.get_i32(&name) as u32);
+                let name = self.vm.memory.cstr(self.vm.read_arg(0)).to_bytes();
+                self.vm.set_result(self.cvars.get_i32(name) as u32);
             }
             G_CVAR_VARIABLE_STRING_BUFFER => {
                 let name = self.vm.memory.cstr(self.vm.read_arg(0)).to_string_lossy();
@@ -370,10 +600,15 @@ impl Game {
             }
             G_SET_BRUSH_MODEL => {
                 let ent_addr = self.vm.read_arg(0);
-                let name = self.vm.memory.cstr(self.vm.read_arg(1)).to_string_lossy();
-                let model = Map::instance().inline_model(name[1..].parse().unwrap());
+                let name = self.vm.memory.cstr(self.vm.read_arg(1)).to_str().unwrap();
+                let model = Map::get().inline_model(name[1..].parse().unwrap());
                 let ent = self.vm.memory.cast_mut::<sharedEntity_t>(ent_addr);
-                Map::instance().model_bounds(model, &mut ent.r.mins, &mut ent.r.maxs);
+                Map::get().model_bounds(
+                    &mut self.trace_scratch,
+                    model,
+                    &mut ent.r.mins,
+                    &mut ent.r.maxs,
+                );
                 ent.s.modelindex = model;
                 ent.r.bmodel = 1;
                 ent.r.contents = -1;
@@ -382,123 +617,39 @@ impl Game {
             }
             G_TRACE => {
                 let results = self.vm.read_arg::<u32>(0);
-                let start = self.vm.memory.read::<[f32; 3]>(self.vm.read_arg(1));
-                let mins = self.vm.memory.read::<[f32; 3]>(self.vm.read_arg(2));
-                let maxs = self.vm.memory.read::<[f32; 3]>(self.vm.read_arg(3));
-                let end = self.vm.memory.read::<[f32; 3]>(self.vm.read_arg(4));
-                let pass_entity_num = self.vm.read_arg::<i32>(5);
-                let content_mask = self.vm.read_arg::<i32>(6);
-
-                let mut clip_trace = trace_t::zeroed();
-
-                Map::instance().box_trace(
-                    &mut clip_trace,
-                    &start,
-                    &end,
-                    &mins,
-                    &maxs,
-                    0,
-                    content_mask,
-                    false,
-                );
+                let key = TraceKey {
+                    start: self.vm.memory.read(self.vm.read_arg(1)),
+                    mins: self.vm.memory.read(self.vm.read_arg(2)),
+                    maxs: self.vm.memory.read(self.vm.read_arg(3)),
+                    end: self.vm.memory.read(self.vm.read_arg(4)),
+                    pass_entity_num: self.vm.read_arg(5),
+                    content_mask: self.vm.read_arg(6),
+                };
 
-                clip_trace.entityNum = if clip_trace.fraction == 1.0 {
-                    ENTITYNUM_NONE
+                let trace = if let Some(&trace) = self.trace_cache.get(&key) {
+                    self.trace_cache_stats.hits += 1;
+                    trace
                 } else {
-                    ENTITYNUM_WORLD
-                } as i32;
-
-                if clip_trace.fraction == 0.0 {
-                    *self.vm.memory.cast_mut::<trace_t>(results) = clip_trace;
-                    self.vm.set_result(0);
-                    return;
-                }
-
-                let box_mins = Vec3::min(Vec3::from(start), Vec3::from(end)) + Vec3::from(mins)
-                    - Vec3::splat(1.0);
-                let box_maxs = Vec3::max(Vec3::from(start), Vec3::from(end))
-                    + Vec3::from(maxs)
-                    + Vec3::splat(1.0);
-
-                let mut pass_owner_num = -1;
-                if pass_entity_num >= 0 && pass_entity_num != ENTITYNUM_NONE as _ {
-                    let owner_num = self.entity(pass_entity_num as _).r.ownerNum;
-                    if owner_num != ENTITYNUM_NONE as _ {
-                        pass_owner_num = owner_num;
-                    }
-                }
-
-                for n in self.entities_in_box(box_mins, box_maxs) {
-                    if clip_trace.allsolid != 0 {
-                        *self.vm.memory.cast_mut::<trace_t>(results) = clip_trace;
-                        self.vm.set_result(0);
-                        return;
-                    }
-
-                    let ent = self.entity(n);
-
-                    if pass_entity_num != ENTITYNUM_NONE as _
-                        && (n == pass_entity_num as _
-                            || ent.r.ownerNum == pass_entity_num
-                            || ent.r.ownerNum == pass_owner_num)
-                    {
-                        continue;
-                    }
-
-                    if content_mask & ent.r.contents == 0 {
-                        continue;
-                    }
-
-                    let clip_handle = if ent.r.bmodel != 0 {
-                        Map::instance().inline_model(ent.s.modelindex)
-                    } else {
-                        Map::instance().temp_box_model(&ent.r.mins, &ent.r.maxs, false)
-                    };
-
-                    let origin = ent.r.currentOrigin;
-                    let angles = if ent.r.bmodel == 0 {
-                        [0.0; 3]
-                    } else {
-                        ent.r.currentAngles
-                    };
-
-                    let mut trace = trace_t::zeroed();
-                    Map::instance().transformed_box_trace(
-                        &mut trace,
-                        &start,
-                        &end,
-                        &mins,
-                        &maxs,
-                        clip_handle,
-                        content_mask,
-                        &origin,
-                        &angles,
-                        false,
+                    self.trace_cache_stats.misses += 1;
+                    let trace = self.trace(
+                        cast(key.start),
+                        cast(key.mins),
+                        cast(key.maxs),
+                        cast(key.end),
+                        key.pass_entity_num,
+                        key.content_mask,
                     );
+                    self.trace_cache.insert(key, trace);
+                    trace
+                };
 
-                    if trace.allsolid != 0 {
-                        clip_trace.allsolid = 1;
-                        trace.entityNum = ent.s.number;
-                    } else if trace.startsolid != 0 {
-                        clip_trace.startsolid = 1;
-                        trace.entityNum = ent.s.number;
-                    }
-
-                    if trace.fraction < clip_trace.fraction {
-                        let old_start = clip_trace.startsolid;
-                        trace.entityNum = ent.s.number;
-                        clip_trace = trace;
-                        clip_trace.startsolid |= old_start;
-                    }
-                }
-
-                *self.vm.memory.cast_mut::<trace_t>(results) = clip_trace;
+                *self.vm.memory.cast_mut::<trace_t>(results) = trace;
                 self.vm.set_result(0);
             }
             G_POINT_CONTENTS => {
                 let p = self.vm.memory.read::<[f32; 3]>(self.vm.read_arg(0));
-                self.vm
-                    .set_result(Map::instance().point_contents(&p, 0) as u32);
+                let contents = Map::get().point_contents(&mut self.trace_scratch, &p, 0);
+                self.vm.set_result(contents as u32);
             }
             G_ADJUST_AREA_PORTAL_STATE => {
                 self.vm.set_result(0);
@@ -508,7 +659,9 @@ impl Game {
                 self.vm.set_result(0);
             }
             G_UNLINKENTITY => {
-                self.linked_entities.remove(&self.vm.read_arg(0));
+                let ent = self.g_entities.unwrap().index_of(self.vm.read_arg(0));
+                self.world.unlink(ent);
+                self.trace_cache.clear();
                 self.vm.set_result(0);
             }
             G_ENTITIES_IN_BOX => {
@@ -517,16 +670,14 @@ impl Game {
                 let entity_list = self.vm.read_arg::<u32>(2);
                 let max_count = self.vm.read_arg::<u32>(3);
 
-                let entities = self
-                    .entities_in_box(mins.into(), maxs.into())
-                    .into_iter()
-                    .take(max_count as usize);
+                self.entities_in_box(mins, maxs);
+                let count = self.entity_list.len().min(max_count as usize);
 
-                self.vm.set_result(entities.len() as u32);
+                self.vm.set_result(count as u32);
 
-                entities.enumerate().for_each(|(i, ent)| {
+                for (i, &ent) in self.entity_list[..count].iter().enumerate() {
                     self.vm.memory.write(entity_list + 4 * i as u32, ent);
-                });
+                }
             }
             G_ENTITY_CONTACT => {
                 let mins = self.vm.memory.read::<[f32; 3]>(self.vm.read_arg(0));
@@ -534,14 +685,20 @@ impl Game {
                 let ent = self.vm.memory.cast::<sharedEntity_t>(self.vm.read_arg(2));
 
                 let clip_handle = if ent.r.bmodel != 0 {
-                    Map::instance().inline_model(ent.s.modelindex)
+                    Map::get().inline_model(ent.s.modelindex)
                 } else {
-                    Map::instance().temp_box_model(&ent.r.mins, &ent.r.maxs, false)
+                    Map::get().temp_box_model(
+                        &mut self.trace_scratch,
+                        &ent.r.mins,
+                        &ent.r.maxs,
+                        false,
+                    )
                 };
 
                 let mut trace = trace_t::zeroed();
 
-                Map::instance().transformed_box_trace(
+                Map::get().transformed_box_trace(
+                    &mut self.trace_scratch,
                     &mut trace,
                     &[0.0; 3],
                     &[0.0; 3],
@@ -557,11 +714,15 @@ impl Game {
                 self.vm.set_result(trace.startsolid as _);
             }
             G_GET_USERCMD => {
-                self.vm.memory.write(self.vm.read_arg(1), self.usercmd);
+                let client_num = self.vm.read_arg::<u32>(0) as usize;
+                self.vm
+                    .memory
+                    .write(self.vm.read_arg(1), self.usercmds[client_num]);
                 self.vm.set_result(0);
             }
             G_GET_ENTITY_TOKEN => {
-                if let Some(token) = Map::instance().entity_tokens.next() {
+                if let Some(token) = Map::get().entity_tokens().get(self.next_entity_token) {
+                    self.next_entity_token += 1;
                     let token = token.as_bytes();
                     let buffer = self.vm.read_arg::<u32>(0) as usize;
                     let size = self.vm.read_arg::<u32>(1) as usize;
@@ -630,10 +791,147 @@ impl Game {
         };
     }
 
-    fn link_entity(&mut self, ent: u32) {
-        self.linked_entities.insert(ent);
+    fn trace(
+        &mut self,
+        start: [f32; 3],
+        mins: [f32; 3],
+        maxs: [f32; 3],
+        end: [f32; 3],
+        pass_entity_num: i32,
+        content_mask: i32,
+    ) -> trace_t {
+        let mut clip_trace = trace_t::zeroed();
+
+        Map::get().box_trace(
+            &mut self.trace_scratch,
+            &mut clip_trace,
+            &start,
+            &end,
+            &mins,
+            &maxs,
+            0,
+            content_mask,
+            false,
+        );
+
+        clip_trace.entityNum = if clip_trace.fraction == 1.0 {
+            ENTITYNUM_NONE
+        } else {
+            ENTITYNUM_WORLD
+        } as i32;
+
+        if clip_trace.fraction == 0.0 {
+            return clip_trace;
+        }
+
+        let box_mins =
+            Vec3::min(Vec3::from(start), Vec3::from(end)) + Vec3::from(mins) - Vec3::splat(1.0);
+        let box_maxs =
+            Vec3::max(Vec3::from(start), Vec3::from(end)) + Vec3::from(maxs) + Vec3::splat(1.0);
+
+        let mut pass_owner_num = -1;
+        if pass_entity_num >= 0 && pass_entity_num != ENTITYNUM_NONE as _ {
+            let owner_num = self.entity(pass_entity_num as _).r.ownerNum;
+            if owner_num != ENTITYNUM_NONE as _ {
+                pass_owner_num = owner_num;
+            }
+        }
+
+        // Whoever's tracing only collides with their own client's entities
+        let tracer = (self.num_clients() > 1
+            && (0..ENTITYNUM_WORLD as i32).contains(&pass_entity_num))
+        .then(|| self.client_of(pass_entity_num as _))
+        .flatten();
+
+        let mut entity_list = mem::take(&mut self.entity_list);
+        self.world
+            .entities_in_box(box_mins, box_maxs, &mut entity_list);
+
+        for &n in &entity_list {
+            if clip_trace.allsolid != 0 {
+                break;
+            }
+            if self.is_hidden_from(tracer, n) {
+                continue;
+            }
+
+            let ent = *self.entity(n);
+
+            if pass_entity_num != ENTITYNUM_NONE as _
+                && (n == pass_entity_num as _
+                    || ent.r.ownerNum == pass_entity_num
+                    || ent.r.ownerNum == pass_owner_num)
+            {
+                continue;
+            }
+
+            if content_mask & ent.r.contents == 0 {
+                continue;
+            }
+
+            let clip_handle = if ent.r.bmodel != 0 {
+                Map::get().inline_model(ent.s.modelindex)
+            } else {
+                Map::get().temp_box_model(&mut self.trace_scratch, &ent.r.mins, &ent.r.maxs, false)
+            };
+
+            let origin = ent.r.currentOrigin;
+            let angles = if ent.r.bmodel == 0 {
+                [0.0; 3]
+            } else {
+                ent.r.currentAngles
+            };
+
+            let mut trace = trace_t::zeroed();
+            Map::get().transformed_box_trace(
+                &mut self.trace_scratch,
+                &mut trace,
+                &start,
+                &end,
+                &mins,
+                &maxs,
+                clip_handle,
+                content_mask,
+                &origin,
+                &angles,
+                false,
+            );
+
+            if trace.allsolid != 0 {
+                clip_trace.allsolid = 1;
+                trace.entityNum = ent.s.number;
+            } else if trace.startsolid != 0 {
+                clip_trace.startsolid = 1;
+                trace.entityNum = ent.s.number;
+            }
+
+            if trace.fraction < clip_trace.fraction {
+                let old_start = clip_trace.startsolid;
+                trace.entityNum = ent.s.number;
+                clip_trace = trace;
+                clip_trace.startsolid |= old_start;
+            }
+        }
+        self.entity_list = entity_list;
+
+        clip_trace
+    }
+
+    /// Fills `entity_list` with the entities touching the box that the current client can see.
+    fn entities_in_box(&mut self, mins: [f32; 3], maxs: [f32; 3]) {
+        self.world
+            .entities_in_box(mins.into(), maxs.into(), &mut self.entity_list);
+        if self.num_clients() > 1 {
+            let mut entity_list = mem::take(&mut self.entity_list);
+            entity_list.retain(|&ent| !self.is_hidden_from(self.current_client, ent));
+            self.entity_list = entity_list;
+        }
+    }
+
+    fn link_entity(&mut self, ent_addr: u32) {
+        self.trace_cache.clear();
 
-        let ent = self.vm.memory.cast_mut::<sharedEntity_t>(ent);
+        let ent = self.vm.memory.cast_mut::<sharedEntity_t>(ent_addr);
 
         let origin = Vec3::from(ent.r.currentOrigin);
         let angles = Vec3::from(ent.r.currentAngles);
@@ -647,21 +945,12 @@ impl Game {
             (origin + mins, origin + maxs)
         };
 
-        ent.r.absmin = (absmin - Vec3::ONE).into();
-        ent.r.absmax = (absmax + Vec3::ONE).into();
-    }
+        let (absmin, absmax) = (absmin - Vec3::ONE, absmax + Vec3::ONE);
+        ent.r.absmin = absmin.into();
+        ent.r.absmax = absmax.into();
 
-    fn entities_in_box(&self, mins: Vec3, maxs: Vec3) -> Vec<u32> {
-        let g_entities = self.g_entities.unwrap();
-        self.linked_entities
-            .iter()
-            .cloned()
-            .filter(|&ent| {
-                let ent = self.vm.memory.cast::<sharedEntity_t>(ent);
-                maxs.cmpge(ent.r.absmin.into()).all() && mins.cmple(ent.r.absmax.into()).all()
-            })
-            .map(|ent| g_entities.index_of(ent))
-            .collect()
+        let ent = self.g_entities.unwrap().index_of(ent_addr);
+        self.world.link(ent, absmin, absmax);
     }
 }
 
@@ -670,19 +959,91 @@ pub struct GameSnapshot {
     g_entities: Option<GameData<sharedEntity_t>>,
     clients: Option<GameData<playerState_t>>,
     time: i32,
-    linked_entities: HashSet<u32>,
+    world: <World as Snapshot>::Snapshot,
+    hash: u64,
+}
+
+impl GameSnapshot {
+    /// Snapshots with the same hash are assumed to capture exactly the same state, so simulating
+    /// forward from either one gives the same results.
+    pub fn hash(&self) -> u64 {
+        self.hash
+    }
+
+    /// Roughly how many bytes this snapshot holds on its own, not counting what it shares with
+    /// earlier snapshots.
+    pub fn size(&self) -> usize {
+        self.vm.size() + self.world.size()
+    }
+
+    /// See `MemorySnapshot::depth`.
+    pub fn depth(&self) -> usize {
+        self.vm.depth()
+    }
+
+    pub fn is_packed(&self) -> bool {
+        self.vm.is_packed()
+    }
+
+    /// See `MemorySnapshot::rebased`.
+    pub fn rebased(&self, parent: Option<&Self>, pack: bool) -> Self {
+        Self {
+            vm: self.vm.rebased(parent.map(|parent| &parent.vm), pack),
+            g_entities: self.g_entities,
+            clients: self.clients,
+            time: self.time,
+            world: self.world.clone(),
+            hash: self.hash,
+        }
+    }
+
+    fn compute_hash(vm: &<Vm as Snapshot>::Snapshot, time: i32, world: &World) -> u64 {
+        // The locations of g_entities and clients never change after initialization, so they're
+        // left out
+        let mut hasher = DefaultHasher::new();
+        vm.hash().hash(&mut hasher);
+        time.hash(&mut hasher);
+        world.hash(&mut hasher);
+        hasher.finish()
+    }
+
+    /// Writes what differs from `previous`, a snapshot of the same game, so that `read` can rebuild
+    /// this snapshot on top of it.
+    pub fn write(&self, previous: &Self, w: &mut impl Write) -> io::Result<()> {
+        self.vm.write(&previous.vm, w)?;
+        w.write_i32::<LittleEndian>(self.time)?;
+        self.world.write(w)
+    }
+
+    /// Reads a snapshot written by `write` relative to `previous`.
+    pub fn read(previous: &Self, r: &mut impl Read) -> io::Result<Self> {
+        let vm = MemorySnapshot::read(&previous.vm, r)?;
+        let time = r.read_i32::<LittleEndian>()?;
+        let world = previous.world.read(r)?;
+        Ok(Self {
+            hash: Self::compute_hash(&vm, time, &world),
+            vm,
+            g_entities: previous.g_entities,
+            clients: previous.clients,
+            time,
+            world,
+        })
+    }
 }
 
 impl Snapshot for Game {
     type Snapshot = GameSnapshot;
 
     fn take_snapshot(&self, baseline: Option<&Self::Snapshot>) -> Self::Snapshot {
+        let vm = self.vm.take_snapshot(baseline.map(|b| &b.vm));
+        let world = self.world.take_snapshot(baseline.map(|b| &b.world));
         Self::Snapshot {
-            vm: self.vm.take_snapshot(baseline.map(|b| &b.vm)),
+            hash: GameSnapshot::compute_hash(&vm, self.time, &world),
+            vm,
             g_entities: self.g_entities,
             clients: self.clients,
             time: self.time,
-            linked_entities: self.linked_entities.clone(),
+            world,
         }
     }
 
@@ -691,6 +1052,211 @@ impl Snapshot for Game {
         self.g_entities = snapshot.g_entities;
         self.clients = snapshot.clients;
         self.time = snapshot.time;
-        self.linked_entities = snapshot.linked_entities.clone();
+        self.world.restore_from_snapshot(&snapshot.world);
+        self.trace_cache.clear();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{
+        alloc::{GlobalAlloc, Layout, System},
+        cell::Cell,
+    };
+
+    use bytemuck::bytes_of;
+    use clap::ValueEnum;
+
+    use super::*;
+    use crate::q3::test_map;
+
+    /// The system allocator, counting how many times each thread asks it for memory, since tests
+    /// run alongside each other.
+    struct CountingAllocator;
+
+    thread_local! {
+        static ALLOCATIONS: Cell<usize> = const { Cell::new(0) };
+    }
+
+    fn allocations() -> usize {
+        ALLOCATIONS.with(Cell::get)
+    }
+
+    fn count_allocation() {
+        // Threads can still allocate after their thread locals are gone
+        let _ = ALLOCATIONS.try_with(|allocations| allocations.set(allocations.get() + 1));
+    }
+
+    unsafe impl GlobalAlloc for CountingAllocator {
+        unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+            count_allocation();
+            unsafe { System.alloc(layout) }
+        }
+
+        unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+            count_allocation();
+            unsafe { System.alloc_zeroed(layout) }
+        }
+
+        unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+            count_allocation();
+            unsafe { System.realloc(ptr, layout, new_size) }
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            unsafe { System.dealloc(ptr, layout) }
+        }
+    }
+
+    #[global_allocator]
+    static GLOBAL: CountingAllocator = CountingAllocator;
+
+    const CONTENTS_BODY: i32 = 0x2000000;
+    const MASK_PLAYERSOLID: i32 = test_map::CONTENTS_SOLID | CONTENTS_BODY;
+    const BODY_MINS: [f32; 3] = [-15.0, -15.0, -24.0];
+    const BODY_MAXS: [f32; 3] = [15.0, 15.0, 32.0];
+
+    fn usercmds(seed: i32, num_frames: usize) -> Vec<usercmd_t> {
+        (0..num_frames as i32)
+            .map(|i| usercmd_t {
+                forwardmove: ((seed * 37 + i * 11) % 255 - 127) as i8,
+                rightmove: ((seed * 13 - i * 7) % 127) as i8,
+                upmove: (seed - i % 3) as i8,
+                ..usercmd_t::zeroed()
+            })
+            .collect()
+    }
+
+    /// Every client in a game with several ends up the same as the only client in a game of its
+    /// own given the same usercmds, in every execution mode.
+    #[test]
+    fn clients_match_single_client() {
+        const NUM_CLIENTS: usize = 5;
+        const NUM_FRAMES: usize = 40;
+
+        for &mode in ExecMode::value_variants() {
+            let mut game = test_game::start(mode, NUM_CLIENTS);
+            let all: Vec<_> = (0..NUM_CLIENTS as i32)
+                .map(|seed| usercmds(seed, NUM_FRAMES))
+                .collect();
+            for frame in 0..NUM_FRAMES {
+                let usercmds: Vec<_> = all.iter().map(|usercmds| usercmds[frame]).collect();
+                game.run_frame_with_clients(&usercmds);
+            }
+
+            for (client_num, usercmds) in all.iter().enumerate() {
+                let mut single = test_game::start(mode, 1);
+                usercmds
+                    .iter()
+                    .for_each(|&usercmd| single.run_frame(usercmd));
+                assert_eq!(
+                    bytes_of(game.client_ps(client_num)),
+                    bytes_of(single.ps()),
+                    "client {client_num} in {mode:?}"
+                );
+                assert_ne!(single.ps().origin, [0.0; 3]);
+            }
+        }
+    }
+
+    /// Once a game has simulated some frames, so everything it reuses between frames has grown as
+    /// big as it needs to be, simulating them again doesn't allocate, in any execution mode and
+    /// with any number of clients.
+    #[test]
+    fn warmed_up_frames_dont_allocate() {
+        const NUM_FRAMES: usize = 40;
+
+        for &mode in ExecMode::value_variants() {
+            for num_clients in [1, 3] {
+                let mut game = test_game::start(mode, num_clients);
+                game.hash_frames = true;
+                let start = game.take_snapshot(None);
+                let all: Vec<_> = (0..num_clients as i32)
+                    .map(|seed| usercmds(seed, NUM_FRAMES))
+                    .collect();
+                let frames: Vec<Vec<_>> = (0..NUM_FRAMES)
+                    .map(|frame| all.iter().map(|usercmds| usercmds[frame]).collect())
+                    .collect();
+                let run_frames = |game: &mut Game| {
+                    game.restore_from_snapshot(&start);
+                    for usercmds in &frames {
+                        if num_clients == 1 {
+                            game.run_frame(usercmds[0]);
+                        } else {
+                            game.run_frame_with_clients(usercmds);
+                        }
+                    }
+                };
+
+                run_frames(&mut game);
+                let before = allocations();
+                run_frames(&mut game);
+                let allocated = allocations() - before;
+
+                assert_eq!(allocated, 0, "{num_clients} clients in {mode:?}");
+                assert_ne!(game.trace_cache_stats.misses, 0);
+                assert_eq!(game.cvars.get_i32("g_speed"), 320);
+            }
+        }
+    }
+
+    /// Links a player-sized body for `ent` at `origin`, owned by `owner_num`.
+    fn link_body(game: &mut Game, ent: u32, origin: [f32; 3], owner_num: u32) {
+        let address = game.g_entities.unwrap().address(ent);
+        let body = game.vm.memory.cast_mut::<sharedEntity_t>(address);
+        body.s.number = ent as i32;
+        body.r.contents = CONTENTS_BODY;
+        body.r.mins = BODY_MINS;
+        body.r.maxs = BODY_MAXS;
+        body.r.currentOrigin = origin;
+        body.r.ownerNum = owner_num as i32;
+        game.link_entity(address);
+    }
+
+    /// Clients sharing a game neither trace into nor find each other, or anything the other
+    /// owns, even when they overlap, but everyone still collides with what nobody owns.
+    #[test]
+    fn clients_are_hidden_from_each_other() {
+        const ORIGIN: [f32; 3] = [0.0, 200.0, 100.0];
+
+        let mut game = test_game::start(ExecMode::Interpreted, 2);
+        link_body(&mut game, 0, ORIGIN, ENTITYNUM_NONE);
+        link_body(&mut game, 1, ORIGIN, ENTITYNUM_NONE);
+        // Something client 1 fired, right where client 0 is heading
+        link_body(&mut game, 2, [100.0, 200.0, 100.0], 1);
+        // And something of nobody's further along
+        link_body(&mut game, 3, [200.0, 200.0, 100.0], ENTITYNUM_NONE);
+
+        let trace = |game: &mut Game, pass_entity_num: i32| {
+            game.trace(
+                ORIGIN,
+                BODY_MINS,
+                BODY_MAXS,
+                [300.0, 200.0, 100.0],
+                pass_entity_num,
+                MASK_PLAYERSOLID,
+            )
+        };
+
+        // Nobody in particular runs into the overlapping bodies straight away
+        assert_eq!(trace(&mut game, ENTITYNUM_NONE as i32).startsolid, 1);
+
+        let trace_0 = trace(&mut game, 0);
+        assert_eq!(trace_0.startsolid, 0);
+        assert_eq!(trace_0.entityNum, 3);
+        let trace_1 = trace(&mut game, 1);
+        assert_eq!(trace_1.startsolid, 0);
+        assert_eq!(trace_1.entityNum, 3);
+
+        let found = |game: &mut Game, client| {
+            game.current_client = client;
+            game.entities_in_box([-100.0, 100.0, 0.0], [300.0, 300.0, 200.0]);
+            let mut found = game.entity_list.clone();
+            found.sort();
+            found
+        };
+        assert_eq!(found(&mut game, None), [0, 1, 2, 3]);
+        assert_eq!(found(&mut game, Some(0)), [0, 3]);
+        assert_eq!(found(&mut game, Some(1)), [1, 2, 3]);
     }
 }
@@ -0,0 +1,208 @@
+//! A tiny stand-in for the game module for tests and `bench --fixtures`, since the real qvm isn't
+//! ours to check in. Each client's think adds its moves to its velocity and its velocity to its
+//! origin, so where a client ends up depends on every usercmd it was given. It then traces at its
+//! origin and sets and reads a cvar, like pmove and the real game do every frame, though it ignores
+//! what it gets back.
+
+use std::{
+    env, fs,
+    mem::{offset_of, size_of},
+    path::PathBuf,
+    sync::OnceLock,
+};
+
+use super::Game;
+use crate::{
+    fs::Fs,
+    q3::{
+        MAX_CLIENTS, gameExport_t::*, gameImport_t::*, opcode_t::Type as opcode_t, opcode_t::*,
+        playerState_t, sharedEntity_t, test_map, usercmd_t,
+    },
+    vm::{ExecMode, test_qvm},
+};
+
+const MEMORY_SIZE: u32 = 0x40000;
+
+/// The data segment: a cvar's name and a value for it, then a zero vector after them in the bss.
+const DATA: &[u8] = b"g_speed\0320\0";
+const CVAR_NAME: u32 = 0;
+const CVAR_VALUE: u32 = 8;
+const ZERO: u32 = 16;
+
+const G_ENTITIES: u32 = 0x100;
+const CLIENTS: u32 = G_ENTITIES + MAX_CLIENTS * size_of::<sharedEntity_t>() as u32;
+
+/// `MASK_PLAYERSOLID` from bg_public.h.
+const MASK_PLAYERSOLID: u32 = 0x1 | 0x10000 | 0x2000000;
+
+/// vmMain's frame: the return address and the caller's stack, then the arguments to syscalls,
+/// then the client's usercmd, the address of its player state and where its trace goes.
+const FRAME_SIZE: u32 = 160;
+const USERCMD: u32 = 48;
+const PS: u32 = USERCMD + size_of::<usercmd_t>() as u32;
+const TRACE: u32 = PS + 4;
+
+/// Where vmMain's own `n`th argument is, relative to its frame.
+const fn local_arg(n: u32) -> u32 {
+    FRAME_SIZE + 8 + n * 4
+}
+
+#[derive(Default)]
+struct Assembler {
+    code: Vec<(opcode_t, u32)>,
+}
+
+impl Assembler {
+    fn op(&mut self, opcode: opcode_t, arg: u32) -> &mut Self {
+        self.code.push((opcode, arg));
+        self
+    }
+
+    /// Pops what was pushed last into the `n`th argument of the next syscall.
+    fn arg(&mut self, n: u32) -> &mut Self {
+        self.op(OP_ARG, 8 + n * 4)
+    }
+
+    /// Calls `syscall` with the arguments set so far, ignoring its result.
+    fn call(&mut self, syscall: u32) {
+        self.op(OP_CONST, -(syscall as i32 + 1) as u32)
+            .op(OP_CALL, 0)
+            .op(OP_POP, 0);
+    }
+
+    fn syscall(&mut self, syscall: u32, args: &[u32]) {
+        for (i, &arg) in args.iter().enumerate() {
+            self.op(OP_CONST, arg).arg(i as u32);
+        }
+        self.call(syscall);
+    }
+
+    /// Pushes the client number vmMain was called with.
+    fn client_num(&mut self) -> &mut Self {
+        self.op(OP_LOCAL, local_arg(1)).op(OP_LOAD4, 0)
+    }
+
+    /// Skips to whatever is assembled after the returned index, once it's patched, unless
+    /// vmMain was called with `command`.
+    fn unless_command(&mut self, command: u32) -> usize {
+        self.op(OP_LOCAL, local_arg(0))
+            .op(OP_LOAD4, 0)
+            .op(OP_CONST, command)
+            .op(OP_NE, 0);
+        self.code.len() - 1
+    }
+
+    fn patch(&mut self, branch: usize) {
+        self.code[branch].1 = self.code.len() as u32;
+    }
+
+    /// Pushes the address of `offset` bytes into the client's player state.
+    fn ps_field(&mut self, offset: usize) -> &mut Self {
+        self.op(OP_LOCAL, PS)
+            .op(OP_LOAD4, 0)
+            .op(OP_CONST, offset as u32)
+            .op(OP_ADD, 0)
+    }
+
+    /// Adds the float pushed by `value` to the float at `offset` in the player state.
+    fn add_to_ps(&mut self, offset: usize, value: impl FnOnce(&mut Self)) {
+        self.ps_field(offset).ps_field(offset).op(OP_LOAD4, 0);
+        value(self);
+        self.op(OP_ADDF, 0).op(OP_STORE4, 0);
+    }
+
+    fn return_zero(&mut self) {
+        self.op(OP_CONST, 0).op(OP_LEAVE, FRAME_SIZE);
+    }
+}
+
+fn build() -> Vec<u8> {
+    let mut asm = Assembler::default();
+    asm.op(OP_ENTER, FRAME_SIZE);
+
+    let not_init = asm.unless_command(GAME_INIT as _);
+    asm.syscall(
+        G_LOCATE_GAME_DATA as _,
+        &[
+            G_ENTITIES,
+            MAX_CLIENTS,
+            size_of::<sharedEntity_t>() as u32,
+            CLIENTS,
+            size_of::<playerState_t>() as u32,
+        ],
+    );
+    asm.return_zero();
+    asm.patch(not_init);
+
+    let not_think = asm.unless_command(GAME_CLIENT_THINK as _);
+    asm.client_num().arg(0).op(OP_LOCAL, USERCMD).arg(1);
+    asm.call(G_GET_USERCMD as _);
+    asm.op(OP_LOCAL, PS)
+        .op(OP_CONST, CLIENTS)
+        .client_num()
+        .op(OP_CONST, size_of::<playerState_t>() as u32)
+        .op(OP_MULI, 0)
+        .op(OP_ADD, 0)
+        .op(OP_STORE4, 0);
+    asm.ps_field(offset_of!(playerState_t, commandTime))
+        .op(OP_LOCAL, USERCMD + offset_of!(usercmd_t, serverTime) as u32)
+        .op(OP_LOAD4, 0)
+        .op(OP_STORE4, 0);
+    let moves = [
+        offset_of!(usercmd_t, forwardmove),
+        offset_of!(usercmd_t, rightmove),
+        offset_of!(usercmd_t, upmove),
+    ];
+    for (i, offset) in moves.into_iter().enumerate() {
+        let velocity = offset_of!(playerState_t, velocity) + i * 4;
+        asm.add_to_ps(velocity, |asm| {
+            asm.op(OP_LOCAL, USERCMD + offset as u32)
+                .op(OP_LOAD1, 0)
+                .op(OP_SEX8, 0)
+                .op(OP_CVIF, 0);
+        });
+        asm.add_to_ps(offset_of!(playerState_t, origin) + i * 4, |asm| {
+            asm.ps_field(velocity).op(OP_LOAD4, 0);
+        });
+    }
+    let origin = offset_of!(playerState_t, origin);
+    asm.op(OP_LOCAL, TRACE).arg(0);
+    asm.ps_field(origin).arg(1);
+    asm.op(OP_CONST, ZERO).arg(2);
+    asm.op(OP_CONST, ZERO).arg(3);
+    asm.ps_field(origin).arg(4);
+    asm.client_num().arg(5);
+    asm.op(OP_CONST, MASK_PLAYERSOLID).arg(6);
+    asm.call(G_TRACE as _);
+    asm.syscall(G_CVAR_SET as _, &[CVAR_NAME, CVAR_VALUE]);
+    asm.syscall(G_CVAR_VARIABLE_INTEGER_VALUE as _, &[CVAR_NAME]);
+    asm.return_zero();
+    asm.patch(not_think);
+
+    // Connecting, beginning and running frames do nothing, and connecting is never refused
+    asm.return_zero();
+
+    test_qvm::qvm(&asm.code, DATA, MEMORY_SIZE)
+}
+
+/// A directory with the qvm in it, written once per test process.
+fn root() -> &'static PathBuf {
+    static ROOT: OnceLock<PathBuf> = OnceLock::new();
+    ROOT.get_or_init(|| {
+        let root = env::temp_dir().join(format!("tasjr-test-game-{}", std::process::id()));
+        fs::create_dir_all(root.join("vm")).unwrap();
+        fs::write(root.join("vm/qagame.qvm"), build()).unwrap();
+        root
+    })
+}
+
+/// The files the test game is started from, once the test map is loaded.
+pub fn fs() -> Fs {
+    test_map::load();
+    Fs::new(&[root()]).unwrap()
+}
+
+/// Starts the test game on the test map with `num_clients` players.
+pub fn start(vm_mode: ExecMode, num_clients: usize) -> Game {
+    Game::start_with_clients(&fs(), vm_mode, num_clients)
+}
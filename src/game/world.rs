@@ -0,0 +1,300 @@
+//! Linked entities sorted into a fixed tree of boxes, like the area nodes in the Q3 server, so
+//! finding the entities in a box only has to look at the ones nearby.
+
+use std::{
+    hash::{Hash, Hasher},
+    io::{self, Read, Write},
+    sync::Arc,
+};
+
+use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
+use glam::Vec3;
+
+use crate::Snapshot;
+
+/// Splitting the world four times gives 16 leaves, which is what the Q3 server uses.
+const AREA_DEPTH: usize = 4;
+
+/// Stands in for a node or entity number in an empty slot.
+const NONE: u32 = u32::MAX;
+
+struct AreaNode {
+    /// The axis this node's box is split along, or `None` for leaves.
+    axis: Option<usize>,
+    dist: f32,
+
+    /// Entities entirely above `dist` go in the first child and those entirely below it in the
+    /// second. The rest stay in this node.
+    children: [u32; 2],
+}
+
+/// Where an entity is linked. Entities in the same node form a doubly linked list.
+#[derive(Clone, Copy)]
+struct Link {
+    node: u32,
+    prev: u32,
+    next: u32,
+    absmin: Vec3,
+    absmax: Vec3,
+}
+
+impl Link {
+    const UNLINKED: Self = Self {
+        node: NONE,
+        prev: NONE,
+        next: NONE,
+        absmin: Vec3::ZERO,
+        absmax: Vec3::ZERO,
+    };
+}
+
+/// Everything is indexed by entity number and kept in flat arrays, so snapshots can be taken and
+/// restored with a copy rather than rebuilding the tree.
+#[derive(Clone)]
+pub struct World {
+    /// The tree only depends on the map, so it's shared with every clone.
+    nodes: Arc<[AreaNode]>,
+
+    /// The most recently linked entity in each node.
+    heads: Vec<u32>,
+
+    links: Vec<Link>,
+    num_linked: usize,
+}
+
+impl World {
+    pub fn new(mins: Vec3, maxs: Vec3) -> Self {
+        fn create_node(nodes: &mut Vec<AreaNode>, depth: usize, mins: Vec3, maxs: Vec3) -> u32 {
+            let num = nodes.len();
+            nodes.push(AreaNode {
+                axis: None,
+                dist: 0.0,
+                children: [NONE; 2],
+            });
+            if depth == AREA_DEPTH {
+                return num as u32;
+            }
+
+            let size = maxs - mins;
+            let axis = if size[0] > size[1] { 0 } else { 1 };
+            let dist = 0.5 * (maxs[axis] + mins[axis]);
+
+            let mut mins1 = mins.to_array();
+            mins1[axis] = dist;
+            let mut maxs2 = maxs.to_array();
+            maxs2[axis] = dist;
+
+            let children = [
+                create_node(nodes, depth + 1, mins1.into(), maxs),
+                create_node(nodes, depth + 1, mins, maxs2.into()),
+            ];
+            nodes[num] = AreaNode {
+                axis: Some(axis),
+                dist,
+                children,
+            };
+            num as u32
+        }
+
+        let mut nodes = vec![];
+        create_node(&mut nodes, 0, mins, maxs);
+
+        Self {
+            heads: vec![NONE; nodes.len()],
+            nodes: nodes.into(),
+            links: vec![],
+            num_linked: 0,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.num_linked
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.num_linked == 0
+    }
+
+    /// Bytes used by the parts that aren't shared between clones.
+    pub fn size(&self) -> usize {
+        self.heads.len() * size_of::<u32>() + self.links.len() * size_of::<Link>()
+    }
+
+    /// Links an entity, or moves it if it's already linked.
+    pub fn link(&mut self, ent: u32, absmin: Vec3, absmax: Vec3) {
+        self.unlink(ent);
+
+        let mut node = 0;
+        while let Some(axis) = self.nodes[node].axis {
+            let AreaNode { dist, children, .. } = self.nodes[node];
+            if absmin[axis] > dist {
+                node = children[0] as usize;
+            } else if absmax[axis] < dist {
+                node = children[1] as usize;
+            } else {
+                break;
+            }
+        }
+
+        if ent as usize >= self.links.len() {
+            self.links.resize(ent as usize + 1, Link::UNLINKED);
+        }
+
+        let next = self.heads[node];
+        if next != NONE {
+            self.links[next as usize].prev = ent;
+        }
+        self.heads[node] = ent;
+        self.links[ent as usize] = Link {
+            node: node as u32,
+            prev: NONE,
+            next,
+            absmin,
+            absmax,
+        };
+        self.num_linked += 1;
+    }
+
+    pub fn unlink(&mut self, ent: u32) {
+        let Some(&link) = self.links.get(ent as usize) else {
+            return;
+        };
+        if link.node == NONE {
+            return;
+        }
+
+        if link.prev == NONE {
+            self.heads[link.node as usize] = link.next;
+        } else {
+            self.links[link.prev as usize].next = link.next;
+        }
+        if link.next != NONE {
+            self.links[link.next as usize].prev = link.prev;
+        }
+        self.links[ent as usize] = Link::UNLINKED;
+        self.num_linked -= 1;
+    }
+
+    pub fn write(&self, w: &mut impl Write) -> io::Result<()> {
+        w.write_u32::<LittleEndian>(self.num_linked as u32)?;
+        for &head in &self.heads {
+            w.write_u32::<LittleEndian>(head)?;
+        }
+        w.write_u32::<LittleEndian>(self.links.len() as u32)?;
+        for link in &self.links {
+            for x in [link.node, link.prev, link.next] {
+                w.write_u32::<LittleEndian>(x)?;
+            }
+            for x in link
+                .absmin
+                .to_array()
+                .into_iter()
+                .chain(link.absmax.to_array())
+            {
+                w.write_f32::<LittleEndian>(x)?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Reads a world written by `write` for the same map as this one.
+    pub fn read(&self, r: &mut impl Read) -> io::Result<Self> {
+        let num_linked = r.read_u32::<LittleEndian>()? as usize;
+        let mut heads = vec![0; self.nodes.len()];
+        r.read_u32_into::<LittleEndian>(&mut heads)?;
+
+        let num_links = r.read_u32::<LittleEndian>()? as usize;
+        let mut links = Vec::with_capacity(num_links);
+        for _ in 0..num_links {
+            let mut ids = [0; 3];
+            r.read_u32_into::<LittleEndian>(&mut ids)?;
+            let (mut absmin, mut absmax) = ([0.0; 3], [0.0; 3]);
+            r.read_f32_into::<LittleEndian>(&mut absmin)?;
+            r.read_f32_into::<LittleEndian>(&mut absmax)?;
+            links.push(Link {
+                node: ids[0],
+                prev: ids[1],
+                next: ids[2],
+                absmin: absmin.into(),
+                absmax: absmax.into(),
+            });
+        }
+
+        let valid = |id: u32, len: usize| id == NONE || (id as usize) < len;
+        let in_range = heads.iter().all(|&head| valid(head, links.len()))
+            && links.iter().all(|link| {
+                valid(link.node, self.nodes.len())
+                    && valid(link.prev, links.len())
+                    && valid(link.next, links.len())
+            });
+        if !in_range {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "bad world links",
+            ));
+        }
+
+        Ok(Self {
+            nodes: Arc::clone(&self.nodes),
+            heads,
+            links,
+            num_linked,
+        })
+    }
+
+    /// Replaces the contents of `list` with the entities whose bounds touch the box.
+    pub fn entities_in_box(&self, mins: Vec3, maxs: Vec3, list: &mut Vec<u32>) {
+        list.clear();
+        self.entities_in_box_r(0, mins, maxs, list);
+    }
+
+    fn entities_in_box_r(&self, node: usize, mins: Vec3, maxs: Vec3, list: &mut Vec<u32>) {
+        let mut ent = self.heads[node];
+        while ent != NONE {
+            let link = &self.links[ent as usize];
+            if maxs.cmpge(link.absmin).all() && mins.cmple(link.absmax).all() {
+                list.push(ent);
+            }
+            ent = link.next;
+        }
+
+        let node = &self.nodes[node];
+        if let Some(axis) = node.axis {
+            if maxs[axis] > node.dist {
+                self.entities_in_box_r(node.children[0] as usize, mins, maxs, list);
+            }
+            if mins[axis] < node.dist {
+                self.entities_in_box_r(node.children[1] as usize, mins, maxs, list);
+            }
+        }
+    }
+}
+
+impl Hash for World {
+    fn hash<H: Hasher>(&self, state: &mut H) {
+        // The order entities are linked in matters since it's the order they're found in
+        self.num_linked.hash(state);
+        self.heads.hash(state);
+        for link in &self.links {
+            link.node.hash(state);
+            link.next.hash(state);
+            link.absmin.to_array().map(f32::to_bits).hash(state);
+            link.absmax.to_array().map(f32::to_bits).hash(state);
+        }
+    }
+}
+
+impl Snapshot for World {
+    type Snapshot = Self;
+
+    fn take_snapshot(&self, _baseline: Option<&Self::Snapshot>) -> Self::Snapshot {
+        self.clone()
+    }
+
+    fn restore_from_snapshot(&mut self, snapshot: &Self::Snapshot) {
+        // Reuses the existing allocations
+        self.heads.clone_from(&snapshot.heads);
+        self.links.clone_from(&snapshot.links);
+        self.num_linked = snapshot.num_linked;
+    }
+}
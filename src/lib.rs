@@ -1,9 +1,13 @@
 pub mod bsp;
 pub mod fs;
 pub mod game;
+#[cfg(feature = "profile")]
+pub mod profile;
 pub mod q3;
 pub mod renderer;
 pub mod run;
+pub mod search;
+pub mod triple_buffer;
 pub mod ui;
 pub mod vm;
 
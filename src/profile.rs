@@ -0,0 +1,438 @@
+//! A profiler for finding out where simulation time goes: how often each syscall is made and how
+//! long it takes, how many instructions each QVM function executes, and how long seeking and the
+//! snapshot workers take per frame.
+//!
+//! It's only built with the `profile` feature, and even then nothing is recorded until it's
+//! enabled. Instructions are only counted by the interpreter, since the other execution modes don't
+//! go through `Vm::step`.
+
+use std::{
+    collections::HashMap,
+    fs::File,
+    io::{self, BufWriter, Write},
+    path::Path,
+    sync::{
+        LazyLock, Mutex, MutexGuard, OnceLock,
+        atomic::{AtomicBool, Ordering},
+    },
+    time::{Duration, Instant},
+};
+
+use crate::{
+    fs::Fs,
+    q3::{gameImport_t::*, sharedTraps_t::*},
+};
+
+/// How often recorders add what they've recorded to the global profile.
+const FLUSH_INTERVAL: Duration = Duration::from_millis(250);
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static PROFILE: LazyLock<Mutex<Profile>> = LazyLock::new(|| Mutex::new(Profile::new()));
+
+/// Function names by address, from the map file written by q3asm alongside the qvm.
+static SYMBOLS: OnceLock<HashMap<u32, String>> = OnceLock::new();
+
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+pub fn set_enabled(enabled: bool) {
+    ENABLED.store(enabled, Ordering::Relaxed);
+}
+
+/// Everything recorded so far, as of the last time each recorder flushed.
+pub fn get() -> MutexGuard<'static, Profile> {
+    PROFILE.lock().unwrap()
+}
+
+/// Writes the profile to `instructions.folded` and `syscalls.folded` in `dir`. See
+/// `Profile::write_folded`.
+pub fn save_folded(dir: &Path) -> io::Result<()> {
+    let mut instructions = BufWriter::new(File::create(dir.join("instructions.folded"))?);
+    let mut syscalls = BufWriter::new(File::create(dir.join("syscalls.folded"))?);
+    get().write_folded(&mut instructions, &mut syscalls)?;
+    instructions.flush()?;
+    syscalls.flush()
+}
+
+/// Loads function names from the map file next to `vm_path`, if there is one. Only the first call
+/// does anything since every game runs the same qvm.
+pub fn load_symbols(fs: &Fs, vm_path: &Path) {
+    SYMBOLS.get_or_init(|| {
+        let Ok(buf) = fs.read(vm_path.with_extension("map")) else {
+            return HashMap::new();
+        };
+
+        // Each line is a segment number, a hex address and a name. Segment 0 is code.
+        String::from_utf8_lossy(&buf)
+            .lines()
+            .filter_map(|line| {
+                let mut fields = line.split_whitespace();
+                if fields.next()? != "0" {
+                    return None;
+                }
+                let address = u32::from_str_radix(fields.next()?, 16).ok()?;
+                Some((address, fields.next()?.to_string()))
+            })
+            .collect()
+    });
+}
+
+fn function_name(address: u32) -> String {
+    SYMBOLS
+        .get()
+        .and_then(|symbols| symbols.get(&address))
+        .cloned()
+        .unwrap_or_else(|| format!("{address:#x}"))
+}
+
+pub fn syscall_name(syscall: u32) -> &'static str {
+    macro_rules! names {
+        ($($name:ident),* $(,)?) => {
+            match syscall {
+                $(_ if syscall == $name as u32 => stringify!($name),)*
+                _ => "unknown syscall",
+            }
+        };
+    }
+
+    names!(
+        G_PRINT,
+        G_ERROR,
+        G_MILLISECONDS,
+        G_CVAR_REGISTER,
+        G_CVAR_UPDATE,
+        G_CVAR_SET,
+        G_CVAR_VARIABLE_INTEGER_VALUE,
+        G_CVAR_VARIABLE_STRING_BUFFER,
+        G_FS_FOPEN_FILE,
+        G_FS_READ,
+        G_FS_WRITE,
+        G_FS_FCLOSE_FILE,
+        G_LOCATE_GAME_DATA,
+        G_SEND_SERVER_COMMAND,
+        G_SET_CONFIGSTRING,
+        G_GET_CONFIGSTRING,
+        G_GET_USERINFO,
+        G_SET_BRUSH_MODEL,
+        G_TRACE,
+        G_POINT_CONTENTS,
+        G_ADJUST_AREA_PORTAL_STATE,
+        G_LINKENTITY,
+        G_UNLINKENTITY,
+        G_ENTITIES_IN_BOX,
+        G_ENTITY_CONTACT,
+        G_GET_USERCMD,
+        G_GET_ENTITY_TOKEN,
+        G_REAL_TIME,
+        G_SNAPVECTOR,
+        G_CEIL,
+        TRAP_MEMSET,
+        TRAP_MEMCPY,
+        TRAP_SIN,
+        TRAP_COS,
+        TRAP_ATAN2,
+        TRAP_SQRT,
+        TRAP_STRNCPY,
+    )
+}
+
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Timing {
+    pub count: u64,
+    pub time: Duration,
+}
+
+impl Timing {
+    fn add(&mut self, other: Timing) {
+        self.count += other.count;
+        self.time += other.time;
+    }
+}
+
+/// Time spent simulating, and how many frames it was spent on.
+#[derive(Clone, Copy, Default, Debug)]
+pub struct FrameTiming {
+    pub count: u64,
+    pub frames: u64,
+    pub time: Duration,
+}
+
+impl FrameTiming {
+    pub fn per_frame(&self) -> Duration {
+        self.time
+            .checked_div(self.frames as u32)
+            .unwrap_or_default()
+    }
+}
+
+fn add_syscall(syscalls: &mut Vec<(u32, Timing)>, syscall: u32, timing: Timing) {
+    match syscalls.iter_mut().find(|(s, _)| *s == syscall) {
+        Some((_, total)) => total.add(timing),
+        None => syscalls.push((syscall, timing)),
+    }
+}
+
+/// One function as called along one particular path from `vmMain`.
+#[derive(Clone)]
+struct Node {
+    function: u32,
+    parent: u32,
+    children: Vec<u32>,
+
+    /// Instructions executed in this function itself, not counting the functions it called.
+    instructions: u64,
+
+    /// Syscalls made directly from this function, by number.
+    syscalls: Vec<(u32, Timing)>,
+}
+
+impl Node {
+    fn new(function: u32, parent: u32) -> Self {
+        Self {
+            function,
+            parent,
+            children: vec![],
+            instructions: 0,
+            syscalls: vec![],
+        }
+    }
+
+    fn is_empty(&self) -> bool {
+        self.instructions == 0 && self.syscalls.is_empty()
+    }
+}
+
+/// Every call stack seen so far, merged into a tree. The root stands in for the engine.
+#[derive(Clone)]
+struct CallTree {
+    nodes: Vec<Node>,
+}
+
+impl CallTree {
+    fn new() -> Self {
+        Self {
+            nodes: vec![Node::new(0, 0)],
+        }
+    }
+
+    fn child(&mut self, parent: u32, function: u32) -> u32 {
+        let existing = self.nodes[parent as usize]
+            .children
+            .iter()
+            .copied()
+            .find(|&child| self.nodes[child as usize].function == function);
+        existing.unwrap_or_else(|| {
+            let child = self.nodes.len() as u32;
+            self.nodes.push(Node::new(function, parent));
+            self.nodes[parent as usize].children.push(child);
+            child
+        })
+    }
+
+    /// Adds the counts in `other` to this tree, then clears them from `other`.
+    fn take_from(&mut self, other: &mut CallTree) {
+        fn merge(dst: &mut CallTree, dst_node: u32, src: &mut CallTree, src_node: u32) {
+            let node = &mut src.nodes[src_node as usize];
+            let instructions = std::mem::take(&mut node.instructions);
+            let syscalls = std::mem::take(&mut node.syscalls);
+
+            let node = &mut dst.nodes[dst_node as usize];
+            node.instructions += instructions;
+            for (syscall, timing) in syscalls {
+                add_syscall(&mut node.syscalls, syscall, timing);
+            }
+
+            for i in 0..src.nodes[src_node as usize].children.len() {
+                let src_child = src.nodes[src_node as usize].children[i];
+                let dst_child = dst.child(dst_node, src.nodes[src_child as usize].function);
+                merge(dst, dst_child, src, src_child);
+            }
+        }
+
+        merge(self, 0, other, 0);
+    }
+
+    /// The names of the functions from the root to `node`, separated by semicolons.
+    fn stack(&self, node: u32) -> String {
+        let mut names = vec![];
+        let mut node = node;
+        while node != 0 {
+            names.push(function_name(self.nodes[node as usize].function));
+            node = self.nodes[node as usize].parent;
+        }
+        names.push("engine".to_string());
+        names.reverse();
+        names.join(";")
+    }
+}
+
+/// Records what one `Vm` does. Recorders are flushed to the global profile every so often, so
+/// threads don't have to share anything while simulating.
+pub struct Recorder {
+    tree: CallTree,
+    current: u32,
+    last_flush: Instant,
+}
+
+impl Default for Recorder {
+    fn default() -> Self {
+        Self {
+            tree: CallTree::new(),
+            current: 0,
+            last_flush: Instant::now(),
+        }
+    }
+}
+
+// Clones start out with nothing recorded, so nothing gets counted twice
+impl Clone for Recorder {
+    fn clone(&self) -> Self {
+        Self::default()
+    }
+}
+
+impl Recorder {
+    /// Creates or drops `recorder` to match whether profiling is enabled, and flushes it if it's
+    /// been a while. Should be called between calls into the vm, when the call stack is empty.
+    pub fn update(recorder: &mut Option<Box<Recorder>>) {
+        if !enabled() {
+            *recorder = None;
+            return;
+        }
+
+        let recorder = recorder.get_or_insert_default();
+        if recorder.last_flush.elapsed() >= FLUSH_INTERVAL {
+            recorder.flush();
+        }
+    }
+
+    #[inline(always)]
+    pub fn instruction(&mut self) {
+        self.tree.nodes[self.current as usize].instructions += 1;
+    }
+
+    pub fn enter(&mut self, function: u32) {
+        self.current = self.tree.child(self.current, function);
+    }
+
+    pub fn leave(&mut self) {
+        self.current = self.tree.nodes[self.current as usize].parent;
+    }
+
+    pub fn syscall(&mut self, syscall: u32, time: Duration) {
+        let node = &mut self.tree.nodes[self.current as usize];
+        add_syscall(&mut node.syscalls, syscall, Timing { count: 1, time });
+    }
+
+    fn flush(&mut self) {
+        get().tree.take_from(&mut self.tree);
+        self.last_flush = Instant::now();
+    }
+}
+
+impl Drop for Recorder {
+    fn drop(&mut self) {
+        self.flush();
+    }
+}
+
+pub struct Profile {
+    tree: CallTree,
+
+    /// Time spent in `Run::seek`, including restoring snapshots.
+    pub seek: FrameTiming,
+
+    /// Time the snapshot workers spent simulating.
+    pub worker: FrameTiming,
+
+    /// Time spent taking snapshots, by both seeking and workers.
+    pub snapshots: Timing,
+}
+
+impl Profile {
+    fn new() -> Self {
+        Self {
+            tree: CallTree::new(),
+            seek: FrameTiming::default(),
+            worker: FrameTiming::default(),
+            snapshots: Timing::default(),
+        }
+    }
+
+    pub fn reset(&mut self) {
+        *self = Self::new();
+    }
+
+    pub fn record_seek(&mut self, frames: usize, time: Duration) {
+        self.seek.count += 1;
+        self.seek.frames += frames as u64;
+        self.seek.time += time;
+    }
+
+    pub fn record_worker(&mut self, frames: usize, time: Duration) {
+        self.worker.count += 1;
+        self.worker.frames += frames as u64;
+        self.worker.time += time;
+    }
+
+    pub fn record_snapshot(&mut self, time: Duration) {
+        self.snapshots.add(Timing { count: 1, time });
+    }
+
+    /// Totals for each syscall, most time consuming first.
+    pub fn syscalls(&self) -> Vec<(&'static str, Timing)> {
+        let mut totals: HashMap<u32, Timing> = HashMap::new();
+        for node in &self.tree.nodes {
+            for &(syscall, timing) in &node.syscalls {
+                totals.entry(syscall).or_default().add(timing);
+            }
+        }
+
+        let mut totals: Vec<_> = totals
+            .into_iter()
+            .map(|(syscall, timing)| (syscall_name(syscall), timing))
+            .collect();
+        totals.sort_by(|a, b| b.1.time.cmp(&a.1.time));
+        totals
+    }
+
+    /// Instructions executed by each function itself, most first.
+    pub fn functions(&self) -> Vec<(String, u64)> {
+        let mut totals: HashMap<u32, u64> = HashMap::new();
+        for node in self.tree.nodes.iter().skip(1) {
+            *totals.entry(node.function).or_default() += node.instructions;
+        }
+
+        let mut totals: Vec<_> = totals
+            .into_iter()
+            .map(|(function, instructions)| (function_name(function), instructions))
+            .collect();
+        totals.sort_by(|a, b| b.1.cmp(&a.1));
+        totals
+    }
+
+    /// Writes instruction counts per call stack to `instructions`, and time spent in syscalls in
+    /// microseconds per call stack to `syscalls`, in the folded format read by flamegraph tools.
+    pub fn write_folded(
+        &self,
+        mut instructions: impl Write,
+        mut syscalls: impl Write,
+    ) -> io::Result<()> {
+        for (i, node) in self.tree.nodes.iter().enumerate() {
+            if node.is_empty() {
+                continue;
+            }
+
+            let stack = self.tree.stack(i as u32);
+            if node.instructions > 0 {
+                writeln!(instructions, "{stack} {}", node.instructions)?;
+            }
+            for &(syscall, timing) in &node.syscalls {
+                let name = syscall_name(syscall);
+                writeln!(syscalls, "{stack};{name} {}", timing.time.as_micros())?;
+            }
+        }
+        Ok(())
+    }
+}
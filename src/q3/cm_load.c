@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 // cmodel.c -- model loading
 
 #include "cm_local.h"
+#include "cm_patch.h"
 
 // to allow boxes to be treated as brush models, we allocate
 // some extra indexes along with those needed by the map
@@ -32,21 +33,30 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define	LL(x) x=LittleLong(x)
 
+// see CM_WritePatchCache, the version changes whenever the patches would be
+// generated differently
+#define	PATCH_CACHE_IDENT	(('C'<<24)+('P'<<16)+('M'<<8)+'C')
+#define	PATCH_CACHE_VERSION	1
+
+typedef struct {
+	int		ident;
+	int		version;
+	int		patchCollideSize;		// the sizes of the structs, in case they change
+	int		patchPlaneSize;
+	int		facetSize;
+	int		numSurfaces;
+} patchCacheHeader_t;
+
 
 clipMap_t	cm;
-int			c_pointcontents;
-int			c_traces, c_brush_traces, c_patch_traces;
+_Thread_local int	c_pointcontents;
+_Thread_local int	c_traces, c_brush_traces, c_patch_traces;
 
 
 static byte *cmod_base;
 
-static cmodel_t box_model;
-static cplane_t *box_planes;
-static cbrush_t *box_brush;
 
 
-
-static void	CM_InitBoxHull (void);
 void	CM_FloodAreaConnections (void);
 
 
@@ -183,6 +193,85 @@ static void CMod_LoadNodes( const lump_t *l ) {
 
 }
 
+/*
+=================
+CMod_PackNodes
+
+Lays out the nodes reachable from the root depth-first, so a node's first
+child usually shares its cache line, with each node's plane copied into it so
+going down a level doesn't have to look anywhere else
+=================
+*/
+static void CMod_PackNodes( void ) {
+#if CM_PACKED_NODES
+	int				*newIndex, *order, *stack;
+	int				i, j, num, child, depth, count, sp;
+	cPackedNode_t	*out;
+	const cNode_t	*node;
+
+	newIndex = malloc( cm.numNodes * sizeof( *newIndex ) );
+	order = malloc( cm.numNodes * sizeof( *order ) );
+	// pairs of node numbers and depths
+	stack = malloc( 2 * ( cm.numNodes + 1 ) * sizeof( *stack ) );
+	if ( !newIndex || !order || !stack ) {
+		Com_Error( ERR_FATAL, "%s: out of memory", __func__ );
+	}
+	for ( i = 0; i < cm.numNodes; i++ ) {
+		newIndex[i] = -1;
+	}
+
+	count = 0;
+	sp = 0;
+	stack[sp++] = 0;
+	stack[sp++] = 1;
+	while ( sp ) {
+		depth = stack[--sp];
+		num = stack[--sp];
+		if ( newIndex[num] != -1 ) {
+			// reachable twice, so traces keep recursing over the nodes as they are
+			goto done;
+		}
+		newIndex[num] = count;
+		order[count++] = num;
+		if ( depth > cm.nodeDepth ) {
+			cm.nodeDepth = depth;
+		}
+
+		// the first child goes on last so it comes right after its parent
+		for ( j = 1; j >= 0; j-- ) {
+			child = cm.nodes[num].children[j];
+			if ( child >= cm.numNodes ) {
+				Com_Error( ERR_DROP, "%s: bad child %i", __func__, child );
+			}
+			if ( child >= 0 ) {
+				stack[sp++] = child;
+				stack[sp++] = depth + 1;
+			}
+		}
+	}
+
+	cm.packedNodes = Hunk_Alloc( count * sizeof( *cm.packedNodes ), h_high );
+	for ( i = 0, out = cm.packedNodes; i < count; i++, out++ ) {
+		node = &cm.nodes[order[i]];
+		VectorCopy( node->plane->normal, out->normal );
+		out->dist = node->plane->dist;
+		out->type = node->plane->type;
+		for ( j = 0; j < 2; j++ ) {
+			child = node->children[j];
+			out->children[j] = child < 0 ? child : newIndex[child];
+		}
+	}
+
+done:
+	if ( !cm.packedNodes ) {
+		cm.nodeDepth = 0;
+	}
+	free( newIndex );
+	free( order );
+	free( stack );
+#endif
+}
+
 /*
 =================
 CM_BoundBrush
@@ -239,6 +328,44 @@ static void CMod_LoadBrushes( const lump_t *l ) {
 }
 
 
+/*
+=================
+CMod_BuildBrushPlanes
+
+Copies the planes of every brush's sides next to each other, so the trace
+code can evaluate several of them at once
+=================
+*/
+static void CMod_BuildBrushPlanes( void ) {
+#if CM_SIMD
+	cbrush_t	*brush;
+	float		*planes;
+	int			i, j, stride, total;
+
+	total = 0;
+	for ( i = 0; i < cm.numBrushes; i++ ) {
+		total += 4 * CM_BRUSH_PLANES_STRIDE( cm.brushes[i].numsides );
+	}
+
+	planes = Hunk_Alloc( total * sizeof( *planes ), h_high );
+
+	for ( i = 0, brush = cm.brushes; i < cm.numBrushes; i++, brush++ ) {
+		stride = CM_BRUSH_PLANES_STRIDE( brush->numsides );
+		for ( j = 0; j < brush->numsides; j++ ) {
+			const cplane_t *plane = brush->sides[j].plane;
+
+			planes[j] = plane->normal[0];
+			planes[stride + j] = plane->normal[1];
+			planes[2 * stride + j] = plane->normal[2];
+			planes[3 * stride + j] = plane->dist;
+		}
+		brush->planes = planes;
+		planes += 4 * stride;
+	}
+#endif
+}
+
+
 /*
 =================
 CMod_LoadLeafs
@@ -478,13 +605,29 @@ static void CMod_LoadVisibility( const lump_t *l ) {
 //==================================================================
 
 
+/*
+=================
+CMod_InitPatchHeader
+=================
+*/
+static void CMod_InitPatchHeader( patchCacheHeader_t *header ) {
+	header->ident = PATCH_CACHE_IDENT;
+	header->version = PATCH_CACHE_VERSION;
+	header->patchCollideSize = sizeof( patchCollide_t );
+	header->patchPlaneSize = sizeof( patchPlane_t );
+	header->facetSize = sizeof( facet_t );
+	header->numSurfaces = cm.numSurfaces;
+}
+
 /*
 =================
 CMod_LoadPatches
+
+Patches are read from the cache if it's usable, and generated otherwise
 =================
 */
 #define	MAX_PATCH_VERTS		1024
-static void CMod_LoadPatches( const lump_t *surfs, const lump_t *verts ) {
+static void CMod_LoadPatches( const lump_t *surfs, const lump_t *verts, const byte *cache, int cacheLength ) {
 	drawVert_t	*dv, *dv_p;
 	dsurface_t	*in;
 	int			count;
@@ -494,6 +637,8 @@ static void CMod_LoadPatches( const lump_t *surfs, const lump_t *verts ) {
 	vec3_t		points[MAX_PATCH_VERTS];
 	int			width, height;
 	int			shaderNum;
+	patchCacheHeader_t	header;
+	const byte	*cacheEnd;
 
 	in = (void *)(cmod_base + surfs->fileofs);
 	if (surfs->filelen % sizeof(*in))
@@ -506,6 +651,15 @@ static void CMod_LoadPatches( const lump_t *surfs, const lump_t *verts ) {
 	if (verts->filelen % sizeof(*dv))
 		Com_Error( ERR_DROP, "%s: funny lump size", __func__ );
 
+	CMod_InitPatchHeader( &header );
+	cacheEnd = NULL;
+	if ( !cache || cacheLength < (int)sizeof( header ) || memcmp( cache, &header, sizeof( header ) ) ) {
+		cache = NULL;
+	} else {
+		cacheEnd = cache + cacheLength;
+		cache += sizeof( header );
+	}
+
 	// scan through all the surfaces, but only load patches,
 	// not planar faces
 	for ( i = 0 ; i < count ; i++, in++ ) {
@@ -516,6 +670,19 @@ static void CMod_LoadPatches( const lump_t *surfs, const lump_t *verts ) {
 
 		cm.surfaces[ i ] = patch = Hunk_Alloc( sizeof( *patch ), h_high );
 
+		shaderNum = LittleLong( in->shaderNum );
+		patch->contents = cm.shaders[shaderNum].contentFlags;
+		patch->surfaceFlags = cm.shaders[shaderNum].surfaceFlags;
+
+		if ( cache ) {
+			patch->pc = CM_ReadPatchCollide( &cache, cacheEnd );
+			if ( patch->pc ) {
+				continue;
+			}
+			// it's no good from here on
+			cache = NULL;
+		}
+
 		// load the full drawverts onto the stack
 		width = LittleLong( in->patchWidth );
 		height = LittleLong( in->patchHeight );
@@ -531,10 +698,6 @@ static void CMod_LoadPatches( const lump_t *surfs, const lump_t *verts ) {
 			points[j][2] = LittleFloat( dv_p->xyz[2] );
 		}
 
-		shaderNum = LittleLong( in->shaderNum );
-		patch->contents = cm.shaders[shaderNum].contentFlags;
-		patch->surfaceFlags = cm.shaders[shaderNum].surfaceFlags;
-
 		// create the internal facet structure
 		patch->pc = CM_GeneratePatchCollide( width, height, points );
 	}
@@ -543,14 +706,53 @@ static void CMod_LoadPatches( const lump_t *surfs, const lump_t *verts ) {
 //==================================================================
 
 
+/*
+==================
+CM_WritePatchCache
+
+Returns the size of the cache of the loaded map's patches, and writes it to
+buf if it's at least that big. Passing it to CM_LoadMap along with the same
+map skips generating the patches, which is most of the time it takes to load
+a map with a lot of curves.
+==================
+*/
+int CM_WritePatchCache( void *buf, int size ) {
+	patchCacheHeader_t	header;
+	byte		*out;
+	int			i, total;
+
+	CMod_InitPatchHeader( &header );
+	total = sizeof( header );
+	for ( i = 0 ; i < cm.numSurfaces ; i++ ) {
+		if ( cm.surfaces[i] ) {
+			total += CM_WritePatchCollide( cm.surfaces[i]->pc, NULL );
+		}
+	}
+	if ( !buf || size < total ) {
+		return total;
+	}
+
+	out = buf;
+	Com_Memcpy( out, &header, sizeof( header ) );
+	out += sizeof( header );
+	for ( i = 0 ; i < cm.numSurfaces ; i++ ) {
+		if ( cm.surfaces[i] ) {
+			out += CM_WritePatchCollide( cm.surfaces[i]->pc, out );
+		}
+	}
+	return total;
+}
+
+
 /*
 ==================
 CM_LoadMap
 
-Loads in the map and all submodels
+Loads in the map and all submodels, with the patches from patchCache if it's
+from CM_WritePatchCache for the same map. It's ignored if it's NULL or unusable.
 ==================
 */
-void CM_LoadMap( const char *name, void *buf, int length ) {
+void CM_LoadMap( const char *name, void *buf, int length, const void *patchCache, int patchCacheLength ) {
 	int				i;
 	dheader_t		header;
 
@@ -591,15 +793,18 @@ void CM_LoadMap( const char *name, void *buf, int length ) {
 	CMod_LoadPlanes (&header.lumps[LUMP_PLANES]);
 	CMod_LoadBrushSides (&header.lumps[LUMP_BRUSHSIDES]);
 	CMod_LoadBrushes (&header.lumps[LUMP_BRUSHES]);
+	CMod_BuildBrushPlanes();
 	CMod_LoadSubmodels (&header.lumps[LUMP_MODELS]);
 	CMod_LoadNodes (&header.lumps[LUMP_NODES]);
+	CMod_PackNodes();
 	CMod_LoadEntityString (&header.lumps[LUMP_ENTITIES]);
 	CMod_LoadVisibility( &header.lumps[LUMP_VISIBILITY] );
-	CMod_LoadPatches( &header.lumps[LUMP_SURFACES], &header.lumps[LUMP_DRAWVERTS] );
+	CMod_LoadPatches( &header.lumps[LUMP_SURFACES], &header.lumps[LUMP_DRAWVERTS], patchCache, patchCacheLength );
 
 	CMod_CheckLeafBrushes();
 
-	CM_InitBoxHull();
+	// the leaf of every scratch's box model, see CM_InitBoxHull
+	cm.leafbrushes[cm.numLeafBrushes] = cm.numBrushes;
 
 	CM_FloodAreaConnections();
 
@@ -623,7 +828,7 @@ void CM_ClearMap( void ) {
 CM_ClipHandleToModel
 ==================
 */
-cmodel_t *CM_ClipHandleToModel( clipHandle_t handle ) {
+cmodel_t *CM_ClipHandleToModel( cmScratch_t *scratch, clipHandle_t handle ) {
 	if ( handle < 0 ) {
 		Com_Error( ERR_DROP, "CM_ClipHandleToModel: bad handle %i", handle );
 	}
@@ -631,7 +836,7 @@ cmodel_t *CM_ClipHandleToModel( clipHandle_t handle ) {
 		return &cm.cmodels[handle];
 	}
 	if ( handle == BOX_MODEL_HANDLE ) {
-		return &box_model;
+		return &scratch->boxModel;
 	}
 	if ( handle < MAX_SUBMODELS ) {
 		Com_Error( ERR_DROP, "CM_ClipHandleToModel: bad handle %i < %i < %i", 
@@ -697,42 +902,40 @@ Set up the planes and nodes so that the six floats of a bounding box
 can just be stored out and get a proper clipping hull structure.
 ===================
 */
-static void CM_InitBoxHull( void )
+static void CM_InitBoxHull( cmScratch_t *scratch )
 {
 	int			i;
 	int			side;
 	cplane_t	*p;
 	cbrushside_t	*s;
+	cbrush_t	*box_brush;
 
-	box_planes = &cm.planes[cm.numPlanes];
-
-	box_brush = &cm.brushes[cm.numBrushes];
+	box_brush = &scratch->boxBrush;
 	box_brush->numsides = 6;
-	box_brush->sides = cm.brushsides + cm.numBrushSides;
+	box_brush->sides = scratch->boxSides;
 	box_brush->contents = CONTENTS_BODY;
 
-	box_model.leaf.numLeafBrushes = 1;
+	scratch->boxModel.leaf.numLeafBrushes = 1;
 //	box_model.leaf.firstLeafBrush = cm.numBrushes;
-	box_model.leaf.firstLeafBrush = cm.numLeafBrushes;
-	cm.leafbrushes[cm.numLeafBrushes] = cm.numBrushes;
+	scratch->boxModel.leaf.firstLeafBrush = cm.numLeafBrushes;
 
 	for ( i = 0; i < 6; i++ )
 	{
 		side = i & 1;
 
 		// brush sides
-		s = &cm.brushsides[cm.numBrushSides + i];
-		s->plane = cm.planes + ( cm.numPlanes + i * 2 + side );
+		s = &scratch->boxSides[i];
+		s->plane = &scratch->boxPlanes[i * 2 + side];
 		s->surfaceFlags = 0;
 
 		// planes
-		p = &box_planes[i * 2];
+		p = &scratch->boxPlanes[i * 2];
 		p->type = i >> 1;
 		p->signbits = 0;
 		VectorClear( p->normal );
 		p->normal[i >> 1] = 1;
 
-		p = &box_planes[i * 2 + 1];
+		p = &scratch->boxPlanes[i * 2 + 1];
 		p->type = 3 + ( i >> 1 );
 		p->signbits = 0;
 		VectorClear( p->normal );
@@ -743,6 +946,55 @@ static void CM_InitBoxHull( void )
 }
 
 
+/*
+===================
+CM_AllocScratch
+
+The checkcounts are sized for the map that is loaded now, so a scratch
+must not outlive it.
+===================
+*/
+cmScratch_t *CM_AllocScratch( void ) {
+	cmScratch_t	*scratch;
+
+	scratch = calloc( 1, sizeof( *scratch ) );
+	if ( scratch ) {
+		scratch->brushCheckcounts = calloc( cm.numBrushes + 1, sizeof( *scratch->brushCheckcounts ) );
+		scratch->patchCheckcounts = calloc( cm.numSurfaces + 1, sizeof( *scratch->patchCheckcounts ) );
+		scratch->traceStack = calloc( cm.nodeDepth + 1, sizeof( *scratch->traceStack ) );
+	}
+	if ( !scratch || !scratch->brushCheckcounts || !scratch->patchCheckcounts || !scratch->traceStack ) {
+		Com_Error( ERR_FATAL, "CM_AllocScratch: out of memory" );
+	}
+	CM_InitBoxHull( scratch );
+
+	return scratch;
+}
+
+
+/*
+===================
+CM_FreeScratch
+===================
+*/
+void CM_FreeScratch( cmScratch_t *scratch ) {
+	free( scratch->brushCheckcounts );
+	free( scratch->patchCheckcounts );
+	free( scratch->traceStack );
+	free( scratch );
+}
+
+
+/*
+===================
+CM_SetScratchScalar
+===================
+*/
+void CM_SetScratchScalar( cmScratch_t *scratch, qboolean scalar ) {
+	scratch->scalar = scalar;
+}
+
+
 /*
 ===================
 CM_TempBoxModel
@@ -752,15 +1004,17 @@ BSP trees instead of being compared directly.
 Capsules are handled differently though.
 ===================
 */
-clipHandle_t CM_TempBoxModel( const vec3_t mins, const vec3_t maxs, int capsule ) {
+clipHandle_t CM_TempBoxModel( cmScratch_t *scratch, const vec3_t mins, const vec3_t maxs, int capsule ) {
+	cplane_t	*box_planes;
 
-	VectorCopy( mins, box_model.mins );
-	VectorCopy( maxs, box_model.maxs );
+	VectorCopy( mins, scratch->boxModel.mins );
+	VectorCopy( maxs, scratch->boxModel.maxs );
 
 	if ( capsule ) {
 		return CAPSULE_MODEL_HANDLE;
 	}
 
+	box_planes = scratch->boxPlanes;
 	box_planes[0].dist = maxs[0];
 	box_planes[1].dist = -maxs[0];
 	box_planes[2].dist = mins[0];
@@ -774,8 +1028,8 @@ clipHandle_t CM_TempBoxModel( const vec3_t mins, const vec3_t maxs, int capsule
 	box_planes[10].dist = mins[2];
 	box_planes[11].dist = -mins[2];
 
-	VectorCopy( mins, box_brush->bounds[0] );
-	VectorCopy( maxs, box_brush->bounds[1] );
+	VectorCopy( mins, scratch->boxBrush.bounds[0] );
+	VectorCopy( maxs, scratch->boxBrush.bounds[1] );
 
 	return BOX_MODEL_HANDLE;
 }
@@ -786,10 +1040,10 @@ clipHandle_t CM_TempBoxModel( const vec3_t mins, const vec3_t maxs, int capsule
 CM_ModelBounds
 ===================
 */
-void CM_ModelBounds( clipHandle_t model, vec3_t mins, vec3_t maxs ) {
+void CM_ModelBounds( cmScratch_t *scratch, clipHandle_t model, vec3_t mins, vec3_t maxs ) {
 	cmodel_t *cmod;
 
-	cmod = CM_ClipHandleToModel( model );
+	cmod = CM_ClipHandleToModel( scratch, model );
 	VectorCopy( cmod->mins, mins );
 	VectorCopy( cmod->maxs, maxs );
 }
@@ -23,11 +23,17 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "q_shared.h"
 #include "qcommon.h"
 #include "cm_polylib.h"
+#include "cm_simd.h"
 
 #define	MAX_SUBMODELS			256
 #define	BOX_MODEL_HANDLE		255
 #define CAPSULE_MODEL_HANDLE	254
 
+// pack the nodes for faster traces, see CMod_PackNodes
+#ifndef CM_PACKED_NODES
+#define CM_PACKED_NODES			1
+#endif
+
 
 // forced double-precison functions
 #define DotProductDP(x,y)		((double)(x)[0]*(y)[0]+(double)(x)[1]*(y)[1]+(double)(x)[2]*(y)[2])
@@ -78,6 +84,22 @@ typedef struct {
 	int			children[2];		// negative numbers are leafs
 } cNode_t;
 
+// a node with its plane inlined, two to a cache line
+typedef struct {
+	vec3_t		normal;
+	float		dist;
+	int			children[2];		// indexes into cm.packedNodes, negative numbers are leafs
+	int			type;				// the plane's type
+	int			pad;
+} cPackedNode_t;
+
+// the far side of a node that a trace still has to go through
+typedef struct {
+	int			num;
+	float		p1f, p2f;
+	vec3_t		p1, p2;
+} cTraceStackEntry_t;
+
 typedef struct {
 	int			cluster;
 	int			area;
@@ -106,12 +128,19 @@ typedef struct {
 	vec3_t		bounds[2];
 	int			numsides;
 	cbrushside_t	*sides;
-	int			checkcount;		// to avoid repeated testings
+
+	// the normals and distances of the sides' planes, as four arrays of
+	// CM_BRUSH_PLANES_STRIDE( numsides ) floats, or NULL if there are none
+	// because CM_SIMD is 0 or this is the box brush
+	float		*planes;
 } cbrush_t;
 
+// enough for batches of four starting at the first side or at the first
+// non-axial one, without any reading past the end
+#define CM_BRUSH_PLANES_STRIDE( numsides )	( ( ( numsides ) + 3 ) / 4 * 4 + 4 )
+
 
 typedef struct {
-	int			checkcount;				// to avoid repeated testings
 	int			surfaceFlags;
 	int			contents;
 	struct patchCollide_s	*pc;
@@ -138,6 +167,11 @@ typedef struct {
 	int			numNodes;
 	cNode_t		*nodes;
 
+	// the nodes in depth-first order from the root, or NULL if
+	// CM_PACKED_NODES is 0 or they don't form a tree
+	cPackedNode_t	*packedNodes;
+	int			nodeDepth;			// most nodes on the way from the root to a leaf
+
 	int			numLeafs;
 	cLeaf_t		*leafs;
 
@@ -169,7 +203,6 @@ typedef struct {
 	cPatch_t	**surfaces;			// non-patches will be NULL
 
 	int			floodvalid;
-	int			checkcount;					// incremented on each trace
 
 	unsigned int checksum;
 } clipMap_t;
@@ -180,8 +213,33 @@ typedef struct {
 #define	SURFACE_CLIP_EPSILON	(0.125)
 
 extern	clipMap_t	cm;
-extern	int			c_pointcontents;
-extern	int			c_traces, c_brush_traces, c_patch_traces;
+extern	_Thread_local int	c_pointcontents;
+extern	_Thread_local int	c_traces, c_brush_traces, c_patch_traces;
+
+// Everything a query writes to while it runs, so that the map itself stays
+// untouched after loading and any number of threads can query it at once,
+// each with its own scratch.
+struct cmScratch_s {
+	int			checkcount;			// incremented on each trace
+	int			*brushCheckcounts;	// [cm.numBrushes + 1] to avoid repeated testings
+	int			*patchCheckcounts;	// [cm.numSurfaces]
+	cTraceStackEntry_t	*traceStack;	// [cm.nodeDepth] for CM_TraceThroughPackedTree
+	qboolean	scalar;				// don't use the CM_SIMD brush code, see CM_SetScratchScalar
+
+	// the hull built by CM_TempBoxModel
+	cmodel_t	boxModel;
+	cbrush_t	boxBrush;
+	cbrushside_t boxSides[6];
+	cplane_t	boxPlanes[12];
+};
+
+// the box brush is numbered one past the map's own brushes
+static ID_INLINE cbrush_t *CM_Brush( cmScratch_t *scratch, int brushnum ) {
+	if ( brushnum == cm.numBrushes ) {
+		return &scratch->boxBrush;
+	}
+	return &cm.brushes[brushnum];
+}
 
 // cm_test.c
 
@@ -207,6 +265,7 @@ typedef struct {
 	qboolean	isPoint;	// optimized case
 	trace_t		trace;		// returned from trace call
 	sphere_t	sphere;		// sphere for oriendted capsule collision
+	cmScratch_t	*scratch;
 } traceWork_t;
 
 typedef struct leafList_s {
@@ -216,24 +275,27 @@ typedef struct leafList_s {
 	int		*list;
 	vec3_t	bounds[2];
 	int		lastLeaf;		// for overflows where each leaf can't be stored individually
+	cmScratch_t	*scratch;
 	void	(*storeLeafs)( struct leafList_s *ll, int nodenum );
 } leafList_t;
 
 
-int CM_BoxBrushes( const vec3_t mins, const vec3_t maxs, cbrush_t **list, int listsize );
+int CM_BoxBrushes( cmScratch_t *scratch, const vec3_t mins, const vec3_t maxs, cbrush_t **list, int listsize );
 
 void CM_StoreLeafs( leafList_t *ll, int nodenum );
 void CM_StoreBrushes( leafList_t *ll, int nodenum );
 
 void CM_BoxLeafnums_r( leafList_t *ll, int nodenum );
 
-cmodel_t	*CM_ClipHandleToModel( clipHandle_t handle );
+cmodel_t	*CM_ClipHandleToModel( cmScratch_t *scratch, clipHandle_t handle );
 qboolean CM_BoundsIntersect( const vec3_t mins, const vec3_t maxs, const vec3_t mins2, const vec3_t maxs2 );
 qboolean CM_BoundsIntersectPoint( const vec3_t mins, const vec3_t maxs, const vec3_t point );
 
 // cm_patch.c
 
 struct patchCollide_s	*CM_GeneratePatchCollide( int width, int height, vec3_t *points );
+int CM_WritePatchCollide( const struct patchCollide_s *pc, byte *out );
+struct patchCollide_s	*CM_ReadPatchCollide( const byte **data, const byte *end );
 void CM_TraceThroughPatchCollide( traceWork_t *tw, const struct patchCollide_s *pc );
 qboolean CM_PositionTestInPatchCollide( traceWork_t *tw, const struct patchCollide_s *pc );
 void CM_ClearLevelPatches( void );
@@ -1209,6 +1209,102 @@ struct patchCollide_s *CM_GeneratePatchCollide( int width, int height, vec3_t *p
 /*
 ================================================================================
 
+CACHING
+
+A patchCollide_t is stored as the struct itself followed by its planes and
+facets, in the machine's own layout, so reading one back is just copying it.
+
+================================================================================
+*/
+
+/*
+===================
+CM_WritePatchCollide
+
+Returns the number of bytes the patch takes, and writes them to out unless
+it's NULL. The pointers and padding are written as zeros, so the same patch
+is always written the same way.
+===================
+*/
+int CM_WritePatchCollide( const struct patchCollide_s *pc, byte *out ) {
+	patchCollide_t	header;
+	int		planesSize, facetsSize;
+
+	planesSize = pc->numPlanes * sizeof( *pc->planes );
+	facetsSize = pc->numFacets * sizeof( *pc->facets );
+	if ( out ) {
+		Com_Memset( &header, 0, sizeof( header ) );
+		VectorCopy( pc->bounds[0], header.bounds[0] );
+		VectorCopy( pc->bounds[1], header.bounds[1] );
+		header.numPlanes = pc->numPlanes;
+		header.numFacets = pc->numFacets;
+		Com_Memcpy( out, &header, sizeof( header ) );
+		Com_Memcpy( out + sizeof( *pc ), pc->planes, planesSize );
+		Com_Memcpy( out + sizeof( *pc ) + planesSize, pc->facets, facetsSize );
+	}
+	return sizeof( *pc ) + planesSize + facetsSize;
+}
+
+/*
+===================
+CM_ReadPatchCollide
+
+Reads a patch written by CM_WritePatchCollide from the start of data and
+advances past it, or returns NULL if it isn't one. Every plane number is
+checked since traces index with them unchecked.
+===================
+*/
+struct patchCollide_s *CM_ReadPatchCollide( const byte **data, const byte *end ) {
+	patchCollide_t	header, *pf;
+	const byte		*planesData, *facetsData;
+	const facet_t	*facet;
+	facet_t			facetCopy;
+	int				i, j;
+
+	if ( end - *data < (int)sizeof( header ) ) {
+		return NULL;
+	}
+	Com_Memcpy( &header, *data, sizeof( header ) );
+	if ( header.numPlanes < 0 || header.numPlanes > MAX_PATCH_PLANES
+		|| header.numFacets < 0 || header.numFacets > MAX_FACETS ) {
+		return NULL;
+	}
+	if ( end - *data < CM_WritePatchCollide( &header, NULL ) ) {
+		return NULL;
+	}
+
+	planesData = *data + sizeof( header );
+	facetsData = planesData + header.numPlanes * sizeof( *header.planes );
+
+	for ( i = 0 ; i < header.numFacets ; i++ ) {
+		// the data isn't necessarily aligned
+		Com_Memcpy( &facetCopy, facetsData + i * sizeof( facetCopy ), sizeof( facetCopy ) );
+		facet = &facetCopy;
+		if ( facet->surfacePlane < 0 || facet->surfacePlane >= header.numPlanes
+			|| facet->numBorders < 0 || facet->numBorders > (int)ARRAY_LEN( facet->borderPlanes ) ) {
+			return NULL;
+		}
+		for ( j = 0 ; j < facet->numBorders ; j++ ) {
+			if ( facet->borderPlanes[j] < 0 || facet->borderPlanes[j] >= header.numPlanes ) {
+				return NULL;
+			}
+		}
+	}
+
+	pf = Hunk_Alloc( sizeof( *pf ), h_high );
+	*pf = header;
+	pf->planes = Hunk_Alloc( pf->numPlanes * sizeof( *pf->planes ), h_high );
+	Com_Memcpy( pf->planes, planesData, pf->numPlanes * sizeof( *pf->planes ) );
+	pf->facets = Hunk_Alloc( pf->numFacets * sizeof( *pf->facets ), h_high );
+	Com_Memcpy( pf->facets, facetsData, pf->numFacets * sizeof( *pf->facets ) );
+
+	*data = facetsData + pf->numFacets * sizeof( *pf->facets );
+	return pf;
+}
+
+/*
+================================================================================
+
 TRACE TESTING
 
 ================================================================================
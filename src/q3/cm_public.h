@@ -22,26 +22,43 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "qfiles.h"
 
+// per-thread state for collision queries, see CM_AllocScratch
+typedef struct cmScratch_s cmScratch_t;
 
-void		CM_LoadMap( const char *name, void *buf, int length );
+void		CM_LoadMap( const char *name, void *buf, int length, const void *patchCache, int patchCacheLength );
+int			CM_WritePatchCache( void *buf, int size );
 void		CM_ClearMap( void );
 clipHandle_t CM_InlineModel( int index );		// 0 = world, 1 + are bmodels
-clipHandle_t CM_TempBoxModel( const vec3_t mins, const vec3_t maxs, int capsule );
 
-void		CM_ModelBounds( clipHandle_t model, vec3_t mins, vec3_t maxs );
+// the map is read-only once loaded, but each thread that queries it needs a
+// scratch of its own, allocated after the map is loaded
+cmScratch_t	*CM_AllocScratch( void );
+void		CM_FreeScratch( cmScratch_t *scratch );
+// makes queries through the scratch use the scalar brush code, which gives the
+// same results, for checking that it does
+void		CM_SetScratchScalar( cmScratch_t *scratch, qboolean scalar );
+
+// the returned handle refers to a box in the scratch
+clipHandle_t CM_TempBoxModel( cmScratch_t *scratch, const vec3_t mins, const vec3_t maxs, int capsule );
+
+void		CM_ModelBounds( cmScratch_t *scratch, clipHandle_t model, vec3_t mins, vec3_t maxs );
 
 int			CM_NumClusters (void);
 int			CM_NumInlineModels( void );
 char		*CM_EntityString (void);
 
 // returns an ORed contents mask
-int			CM_PointContents( const vec3_t p, clipHandle_t model );
-int			CM_TransformedPointContents( const vec3_t p, clipHandle_t model, const vec3_t origin, const vec3_t angles );
+int			CM_PointContents( cmScratch_t *scratch, const vec3_t p, clipHandle_t model );
+int			CM_TransformedPointContents( cmScratch_t *scratch, const vec3_t p, clipHandle_t model, const vec3_t origin, const vec3_t angles );
 
-void		CM_BoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
+void		CM_BoxTrace( cmScratch_t *scratch, trace_t *results, const vec3_t start, const vec3_t end,
+						const vec3_t mins, const vec3_t maxs,
+						clipHandle_t model, int brushmask, qboolean capsule );
+// traces from each start to the matching end with one hull
+void		CM_BoxTraceBatch( cmScratch_t *scratch, trace_t *results, int numTraces, const vec3_t *starts, const vec3_t *ends,
 						const vec3_t mins, const vec3_t maxs,
 						clipHandle_t model, int brushmask, qboolean capsule );
-void		CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
+void		CM_TransformedBoxTrace( cmScratch_t *scratch, trace_t *results, const vec3_t start, const vec3_t end,
 						const vec3_t mins, const vec3_t maxs,
 						clipHandle_t model, int brushmask,
 						const vec3_t origin, const vec3_t angles, qboolean capsule );
@@ -52,7 +69,7 @@ int			CM_PointLeafnum( const vec3_t p );
 
 // only returns non-solid leafs
 // overflow if return listsize and if *lastLeaf != list[listsize-1]
-int			CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list,
+int			CM_BoxLeafnums( cmScratch_t *scratch, const vec3_t mins, const vec3_t maxs, int *list,
 		 					int listsize, int *lastLeaf );
 
 int			CM_LeafCluster (int leafnum);
@@ -0,0 +1,159 @@
+/*
+===========================================================================
+Four-wide float and double vectors for evaluating brush planes in batches.
+
+Every operation is a single IEEE operation per lane, so a computation written
+with these rounds exactly like the same scalar expressions evaluated in the
+same order. That only holds as long as the compiler isn't allowed to fuse
+multiplies and adds, which build.rs makes sure of.
+
+CM_SIMD is 0 where there's no implementation, and the scalar code is used.
+The NEON one is only built with CM_SIMD_NEON defined, until it's been checked
+against the scalar code on an ARM machine.
+===========================================================================
+*/
+
+#if defined( __AVX__ )
+#define CM_SIMD 1
+#include <immintrin.h>
+
+typedef __m128	v4f_t;
+typedef __m128	v4fmask_t;
+typedef __m256d	v4d_t;
+typedef __m256d	v4dmask_t;
+
+static ID_INLINE v4f_t V4f_Load( const float *p ) { return _mm_loadu_ps( p ); }
+static ID_INLINE v4f_t V4f_Set( float x ) { return _mm_set1_ps( x ); }
+static ID_INLINE v4f_t V4f_Add( v4f_t a, v4f_t b ) { return _mm_add_ps( a, b ); }
+static ID_INLINE v4f_t V4f_Sub( v4f_t a, v4f_t b ) { return _mm_sub_ps( a, b ); }
+static ID_INLINE v4f_t V4f_Mul( v4f_t a, v4f_t b ) { return _mm_mul_ps( a, b ); }
+static ID_INLINE v4fmask_t V4f_Less( v4f_t a, v4f_t b ) { return _mm_cmplt_ps( a, b ); }
+static ID_INLINE v4f_t V4f_Select( v4fmask_t m, v4f_t a, v4f_t b ) { return _mm_blendv_ps( b, a, m ); }
+
+static ID_INLINE v4d_t V4d_FromFloat( v4f_t a ) { return _mm256_cvtps_pd( a ); }
+static ID_INLINE v4d_t V4d_Set( double x ) { return _mm256_set1_pd( x ); }
+static ID_INLINE v4d_t V4d_Add( v4d_t a, v4d_t b ) { return _mm256_add_pd( a, b ); }
+static ID_INLINE v4d_t V4d_Sub( v4d_t a, v4d_t b ) { return _mm256_sub_pd( a, b ); }
+static ID_INLINE v4d_t V4d_Mul( v4d_t a, v4d_t b ) { return _mm256_mul_pd( a, b ); }
+static ID_INLINE v4d_t V4d_Div( v4d_t a, v4d_t b ) { return _mm256_div_pd( a, b ); }
+static ID_INLINE v4dmask_t V4d_Less( v4d_t a, v4d_t b ) { return _mm256_cmp_pd( a, b, _CMP_LT_OQ ); }
+static ID_INLINE v4dmask_t V4d_LessEqual( v4d_t a, v4d_t b ) { return _mm256_cmp_pd( a, b, _CMP_LE_OQ ); }
+static ID_INLINE v4dmask_t V4d_Greater( v4d_t a, v4d_t b ) { return _mm256_cmp_pd( a, b, _CMP_GT_OQ ); }
+static ID_INLINE v4dmask_t V4d_GreaterEqual( v4d_t a, v4d_t b ) { return _mm256_cmp_pd( a, b, _CMP_GE_OQ ); }
+static ID_INLINE v4d_t V4d_Select( v4dmask_t m, v4d_t a, v4d_t b ) { return _mm256_blendv_pd( b, a, m ); }
+static ID_INLINE int V4d_Bits( v4dmask_t m ) { return _mm256_movemask_pd( m ); }
+static ID_INLINE void V4d_Store( double *p, v4d_t a ) { _mm256_storeu_pd( p, a ); }
+
+#elif defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define CM_SIMD 1
+#include <emmintrin.h>
+
+typedef __m128	v4f_t;
+typedef __m128	v4fmask_t;
+typedef struct { __m128d lo, hi; } v4d_t;
+typedef v4d_t	v4dmask_t;
+
+static ID_INLINE v4f_t V4f_Load( const float *p ) { return _mm_loadu_ps( p ); }
+static ID_INLINE v4f_t V4f_Set( float x ) { return _mm_set1_ps( x ); }
+static ID_INLINE v4f_t V4f_Add( v4f_t a, v4f_t b ) { return _mm_add_ps( a, b ); }
+static ID_INLINE v4f_t V4f_Sub( v4f_t a, v4f_t b ) { return _mm_sub_ps( a, b ); }
+static ID_INLINE v4f_t V4f_Mul( v4f_t a, v4f_t b ) { return _mm_mul_ps( a, b ); }
+static ID_INLINE v4fmask_t V4f_Less( v4f_t a, v4f_t b ) { return _mm_cmplt_ps( a, b ); }
+static ID_INLINE v4f_t V4f_Select( v4fmask_t m, v4f_t a, v4f_t b ) {
+	return _mm_or_ps( _mm_and_ps( m, a ), _mm_andnot_ps( m, b ) );
+}
+
+#define V4D_OP( name, op ) \
+	static ID_INLINE v4d_t name( v4d_t a, v4d_t b ) { \
+		v4d_t r = { op( a.lo, b.lo ), op( a.hi, b.hi ) }; \
+		return r; \
+	}
+
+V4D_OP( V4d_Add, _mm_add_pd )
+V4D_OP( V4d_Sub, _mm_sub_pd )
+V4D_OP( V4d_Mul, _mm_mul_pd )
+V4D_OP( V4d_Div, _mm_div_pd )
+V4D_OP( V4d_Less, _mm_cmplt_pd )
+V4D_OP( V4d_LessEqual, _mm_cmple_pd )
+V4D_OP( V4d_Greater, _mm_cmpgt_pd )
+V4D_OP( V4d_GreaterEqual, _mm_cmpge_pd )
+
+static ID_INLINE v4d_t V4d_FromFloat( v4f_t a ) {
+	v4d_t r = { _mm_cvtps_pd( a ), _mm_cvtps_pd( _mm_movehl_ps( a, a ) ) };
+	return r;
+}
+static ID_INLINE v4d_t V4d_Set( double x ) {
+	v4d_t r = { _mm_set1_pd( x ), _mm_set1_pd( x ) };
+	return r;
+}
+static ID_INLINE v4d_t V4d_Select( v4dmask_t m, v4d_t a, v4d_t b ) {
+	v4d_t r = {
+		_mm_or_pd( _mm_and_pd( m.lo, a.lo ), _mm_andnot_pd( m.lo, b.lo ) ),
+		_mm_or_pd( _mm_and_pd( m.hi, a.hi ), _mm_andnot_pd( m.hi, b.hi ) )
+	};
+	return r;
+}
+static ID_INLINE int V4d_Bits( v4dmask_t m ) {
+	return _mm_movemask_pd( m.lo ) | ( _mm_movemask_pd( m.hi ) << 2 );
+}
+static ID_INLINE void V4d_Store( double *p, v4d_t a ) {
+	_mm_storeu_pd( p, a.lo );
+	_mm_storeu_pd( p + 2, a.hi );
+}
+
+#elif defined( CM_SIMD_NEON ) && defined( __aarch64__ ) && defined( __ARM_NEON )
+#define CM_SIMD 1
+#include <arm_neon.h>
+
+typedef float32x4_t	v4f_t;
+typedef uint32x4_t	v4fmask_t;
+typedef struct { float64x2_t lo, hi; } v4d_t;
+typedef struct { uint64x2_t lo, hi; } v4dmask_t;
+
+static ID_INLINE v4f_t V4f_Load( const float *p ) { return vld1q_f32( p ); }
+static ID_INLINE v4f_t V4f_Set( float x ) { return vdupq_n_f32( x ); }
+static ID_INLINE v4f_t V4f_Add( v4f_t a, v4f_t b ) { return vaddq_f32( a, b ); }
+static ID_INLINE v4f_t V4f_Sub( v4f_t a, v4f_t b ) { return vsubq_f32( a, b ); }
+static ID_INLINE v4f_t V4f_Mul( v4f_t a, v4f_t b ) { return vmulq_f32( a, b ); }
+static ID_INLINE v4fmask_t V4f_Less( v4f_t a, v4f_t b ) { return vcltq_f32( a, b ); }
+static ID_INLINE v4f_t V4f_Select( v4fmask_t m, v4f_t a, v4f_t b ) { return vbslq_f32( m, a, b ); }
+
+#define V4D_OP( name, type, op ) \
+	static ID_INLINE type name( v4d_t a, v4d_t b ) { \
+		type r = { op( a.lo, b.lo ), op( a.hi, b.hi ) }; \
+		return r; \
+	}
+
+V4D_OP( V4d_Add, v4d_t, vaddq_f64 )
+V4D_OP( V4d_Sub, v4d_t, vsubq_f64 )
+V4D_OP( V4d_Mul, v4d_t, vmulq_f64 )
+V4D_OP( V4d_Div, v4d_t, vdivq_f64 )
+V4D_OP( V4d_Less, v4dmask_t, vcltq_f64 )
+V4D_OP( V4d_LessEqual, v4dmask_t, vcleq_f64 )
+V4D_OP( V4d_Greater, v4dmask_t, vcgtq_f64 )
+V4D_OP( V4d_GreaterEqual, v4dmask_t, vcgeq_f64 )
+
+static ID_INLINE v4d_t V4d_FromFloat( v4f_t a ) {
+	v4d_t r = { vcvt_f64_f32( vget_low_f32( a ) ), vcvt_high_f64_f32( a ) };
+	return r;
+}
+static ID_INLINE v4d_t V4d_Set( double x ) {
+	v4d_t r = { vdupq_n_f64( x ), vdupq_n_f64( x ) };
+	return r;
+}
+static ID_INLINE v4d_t V4d_Select( v4dmask_t m, v4d_t a, v4d_t b ) {
+	v4d_t r = { vbslq_f64( m.lo, a.lo, b.lo ), vbslq_f64( m.hi, a.hi, b.hi ) };
+	return r;
+}
+static ID_INLINE int V4d_Bits( v4dmask_t m ) {
+	return ( vgetq_lane_u64( m.lo, 0 ) & 1 ) | ( vgetq_lane_u64( m.lo, 1 ) & 2 )
+		| ( vgetq_lane_u64( m.hi, 0 ) & 4 ) | ( vgetq_lane_u64( m.hi, 1 ) & 8 );
+}
+static ID_INLINE void V4d_Store( double *p, v4d_t a ) {
+	vst1q_f64( p, a.lo );
+	vst1q_f64( p + 2, a.hi );
+}
+
+#else
+#define CM_SIMD 0
+#endif
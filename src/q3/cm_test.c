@@ -101,10 +101,10 @@ void CM_StoreBrushes( leafList_t *ll, int nodenum ) {
 	for ( k = 0 ; k < leaf->numLeafBrushes ; k++ ) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
 		b = &cm.brushes[brushnum];
-		if ( b->checkcount == cm.checkcount ) {
+		if ( ll->scratch->brushCheckcounts[brushnum] == ll->scratch->checkcount ) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		ll->scratch->brushCheckcounts[brushnum] = ll->scratch->checkcount;
 		for ( i = 0 ; i < 3 ; i++ ) {
 			if ( b->bounds[0][i] >= ll->bounds[1][i] || b->bounds[1][i] <= ll->bounds[0][i] ) {
 				break;
@@ -169,10 +169,10 @@ void CM_BoxLeafnums_r( leafList_t *ll, int nodenum ) {
 CM_BoxLeafnums
 ==================
 */
-int	CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list, int listsize, int *lastLeaf) {
+int	CM_BoxLeafnums( cmScratch_t *scratch, const vec3_t mins, const vec3_t maxs, int *list, int listsize, int *lastLeaf) {
 	leafList_t	ll;
 
-	cm.checkcount++;
+	scratch->checkcount++;
 
 	VectorCopy( mins, ll.bounds[0] );
 	VectorCopy( maxs, ll.bounds[1] );
@@ -182,6 +182,7 @@ int	CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list, int listsiz
 	ll.storeLeafs = CM_StoreLeafs;
 	ll.lastLeaf = 0;
 	ll.overflowed = qfalse;
+	ll.scratch = scratch;
 
 	CM_BoxLeafnums_r( &ll, 0 );
 
@@ -194,10 +195,10 @@ int	CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list, int listsiz
 CM_BoxBrushes
 ==================
 */
-int CM_BoxBrushes( const vec3_t mins, const vec3_t maxs, cbrush_t **list, int listsize ) {
+int CM_BoxBrushes( cmScratch_t *scratch, const vec3_t mins, const vec3_t maxs, cbrush_t **list, int listsize ) {
 	leafList_t	ll;
 
-	cm.checkcount++;
+	scratch->checkcount++;
 
 	VectorCopy( mins, ll.bounds[0] );
 	VectorCopy( maxs, ll.bounds[1] );
@@ -207,6 +208,7 @@ int CM_BoxBrushes( const vec3_t mins, const vec3_t maxs, cbrush_t **list, int li
 	ll.storeLeafs = CM_StoreBrushes;
 	ll.lastLeaf = 0;
 	ll.overflowed = qfalse;
+	ll.scratch = scratch;
 	
 	CM_BoxLeafnums_r( &ll, 0 );
 
@@ -223,7 +225,7 @@ CM_PointContents
 
 ==================
 */
-int CM_PointContents( const vec3_t p, clipHandle_t model ) {
+int CM_PointContents( cmScratch_t *scratch, const vec3_t p, clipHandle_t model ) {
 	int			leafnum;
 	int			i, k;
 	int			brushnum;
@@ -238,7 +240,7 @@ int CM_PointContents( const vec3_t p, clipHandle_t model ) {
 	}
 
 	if ( model ) {
-		clipm = CM_ClipHandleToModel( model );
+		clipm = CM_ClipHandleToModel( scratch, model );
 		leaf = &clipm->leaf;
 	} else {
 		leafnum = CM_PointLeafnum_r (p, 0);
@@ -248,7 +250,7 @@ int CM_PointContents( const vec3_t p, clipHandle_t model ) {
 	contents = 0;
 	for (k=0 ; k<leaf->numLeafBrushes ; k++) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
-		b = &cm.brushes[brushnum];
+		b = CM_Brush( scratch, brushnum );
 
 		if ( !CM_BoundsIntersectPoint( b->bounds[0], b->bounds[1], p ) ) {
 			continue;
@@ -280,7 +282,7 @@ Handles offsetting and rotation of the end points for moving and
 rotating entities
 ==================
 */
-int	CM_TransformedPointContents( const vec3_t p, clipHandle_t model, const vec3_t origin, const vec3_t angles) {
+int	CM_TransformedPointContents( cmScratch_t *scratch, const vec3_t p, clipHandle_t model, const vec3_t origin, const vec3_t angles) {
 	vec3_t		p_l;
 	vec3_t		temp;
 	vec3_t		forward, right, up;
@@ -300,7 +302,7 @@ int	CM_TransformedPointContents( const vec3_t p, clipHandle_t model, const vec3_
 		p_l[2] = DotProduct (temp, up);
 	}
 
-	return CM_PointContents( p_l, model );
+	return CM_PointContents( scratch, p_l, model );
 }
 
 
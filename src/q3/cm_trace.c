@@ -146,6 +146,62 @@ POSITION TESTING
 ===============================================================================
 */
 
+#if CM_SIMD
+/*
+================
+CM_TestBoxInBrushPlanes
+
+The non-axial part of the box case of CM_TestBoxInBrush, four planes at a
+time. Returns qfalse if the box is completely in front of one of them.
+================
+*/
+static qboolean CM_TestBoxInBrushPlanes( const traceWork_t *tw, const cbrush_t *brush ) {
+	const int	stride = CM_BRUSH_PLANES_STRIDE( brush->numsides );
+	const float	*planes = brush->planes;
+	v4f_t		size[2][3];
+	v4d_t		start[3];
+	int			i, j, valid;
+
+	for ( j = 0; j < 3; j++ ) {
+		size[0][j] = V4f_Set( tw->size[0][j] );
+		size[1][j] = V4f_Set( tw->size[1][j] );
+		start[j] = V4d_Set( tw->start[j] );
+	}
+
+	for ( i = 6; i < brush->numsides; i += 4 ) {
+		v4f_t	normal[3], offset[3], dist;
+		v4d_t	normalDP[3], d1;
+
+		for ( j = 0; j < 3; j++ ) {
+			normal[j] = V4f_Load( planes + j * stride + i );
+			normalDP[j] = V4d_FromFloat( normal[j] );
+			// the same as tw->offsets[ plane->signbits ][j]
+			offset[j] = V4f_Select( V4f_Less( normal[j], V4f_Set( 0 ) ), size[1][j], size[0][j] );
+		}
+
+		// dist = plane->dist - DotProduct( offset, plane->normal )
+		dist = V4f_Sub( V4f_Load( planes + 3 * stride + i ),
+			V4f_Add( V4f_Add( V4f_Mul( offset[0], normal[0] ), V4f_Mul( offset[1], normal[1] ) ),
+				V4f_Mul( offset[2], normal[2] ) ) );
+
+		// d1 = DotProductDP( tw->start, plane->normal ) - dist
+		d1 = V4d_Sub( V4d_Add( V4d_Add( V4d_Mul( start[0], normalDP[0] ), V4d_Mul( start[1], normalDP[1] ) ),
+				V4d_Mul( start[2], normalDP[2] ) ),
+			V4d_FromFloat( dist ) );
+
+		valid = brush->numsides - i >= 4 ? 15 : ( 1 << ( brush->numsides - i ) ) - 1;
+		if ( V4d_Bits( V4d_Greater( d1, V4d_Set( 0 ) ) ) & valid ) {
+			return qfalse;
+		}
+	}
+
+	return qtrue;
+}
+#else
+#define CM_TestBoxInBrushPlanes( tw, brush ) qtrue
+#endif
+
+
 /*
 ================
 CM_TestBoxInBrush
@@ -200,6 +256,10 @@ static void CM_TestBoxInBrush( traceWork_t *tw, const cbrush_t *brush ) {
 				return;
 			}
 		}
+	} else if ( CM_SIMD && brush->planes && !tw->scratch->scalar ) {
+		if ( !CM_TestBoxInBrushPlanes( tw, brush ) ) {
+			return;
+		}
 	} else {
 		// the first six planes are the axial planes, so we only
 		// need to test the remainder
@@ -234,17 +294,18 @@ CM_TestInLeaf
 static void CM_TestInLeaf( traceWork_t *tw, const cLeaf_t *leaf ) {
 	int			k;
 	int			brushnum;
+	int			surfacenum;
 	cbrush_t	*b;
 	cPatch_t	*patch;
 
 	// test box position against all brushes in the leaf
 	for (k=0 ; k<leaf->numLeafBrushes ; k++) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
-		b = &cm.brushes[brushnum];
-		if (b->checkcount == cm.checkcount) {
+		b = CM_Brush( tw->scratch, brushnum );
+		if ( tw->scratch->brushCheckcounts[brushnum] == tw->scratch->checkcount ) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		tw->scratch->brushCheckcounts[brushnum] = tw->scratch->checkcount;
 
 		if ( !(b->contents & tw->contents)) {
 			continue;
@@ -258,14 +319,15 @@ static void CM_TestInLeaf( traceWork_t *tw, const cLeaf_t *leaf ) {
 
 	// test against all patches
 	for ( k = 0 ; k < leaf->numLeafSurfaces ; k++ ) {
-		patch = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
+		surfacenum = cm.leafsurfaces[ leaf->firstLeafSurface + k ];
+		patch = cm.surfaces[ surfacenum ];
 		if ( !patch ) {
 			continue;
 		}
-		if ( patch->checkcount == cm.checkcount ) {
+		if ( tw->scratch->patchCheckcounts[surfacenum] == tw->scratch->checkcount ) {
 			continue;	// already checked this brush in another leaf
 		}
-		patch->checkcount = cm.checkcount;
+		tw->scratch->patchCheckcounts[surfacenum] = tw->scratch->checkcount;
 
 		if ( !(patch->contents & tw->contents)) {
 			continue;
@@ -296,7 +358,7 @@ static void CM_TestCapsuleInCapsule( traceWork_t *tw, clipHandle_t model ) {
 	vec3_t offset, symetricSize[2];
 	float radius, halfwidth, halfheight, offs, r;
 
-	CM_ModelBounds(model, mins, maxs);
+	CM_ModelBounds(tw->scratch, model, mins, maxs);
 
 	VectorAdd(tw->start, tw->sphere.offset, top);
 	VectorSubtract(tw->start, tw->sphere.offset, bottom);
@@ -365,7 +427,7 @@ static void CM_TestBoundingBoxInCapsule( traceWork_t *tw, clipHandle_t model ) {
 	int i;
 
 	// mins maxs of the capsule
-	CM_ModelBounds(model, mins, maxs);
+	CM_ModelBounds(tw->scratch, model, mins, maxs);
 
 	// offset for capsule center
 	for ( i = 0 ; i < 3 ; i++ ) {
@@ -383,9 +445,9 @@ static void CM_TestBoundingBoxInCapsule( traceWork_t *tw, clipHandle_t model ) {
 	VectorSet( tw->sphere.offset, 0, 0, size[1][2] - tw->sphere.radius );
 
 	// replace the capsule with the bounding box
-	h = CM_TempBoxModel(tw->size[0], tw->size[1], qfalse);
+	h = CM_TempBoxModel(tw->scratch, tw->size[0], tw->size[1], qfalse);
 	// calculate collision
-	cmod = CM_ClipHandleToModel( h );
+	cmod = CM_ClipHandleToModel( tw->scratch, h );
 	CM_TestInLeaf( tw, &cmod->leaf );
 }
 
@@ -416,13 +478,14 @@ static void CM_PositionTest( traceWork_t *tw ) {
 	ll.storeLeafs = CM_StoreLeafs;
 	ll.lastLeaf = 0;
 	ll.overflowed = qfalse;
+	ll.scratch = tw->scratch;
 
-	cm.checkcount++;
+	tw->scratch->checkcount++;
 
 	CM_BoxLeafnums_r( &ll, 0 );
 
 
-	cm.checkcount++;
+	tw->scratch->checkcount++;
 
 	// test the contents of the leafs
 	for (i=0 ; i < ll.count ; i++) {
@@ -463,6 +526,118 @@ static void CM_TraceThroughPatch( traceWork_t *tw, const cPatch_t *patch ) {
 }
 
 
+#if CM_SIMD
+/*
+================
+CM_TraceThroughBrushPlanes
+
+The box case of the plane loop in CM_TraceThroughBrush, with the distances
+and fractions computed four planes at a time. The fractions are then taken
+in plane order so ties resolve the same way. Returns qfalse if the trace is
+completely in front of a plane and misses the brush.
+================
+*/
+static qboolean CM_TraceThroughBrushPlanes( const traceWork_t *tw, const cbrush_t *brush,
+		float *enterFrac, float *leaveFrac, cplane_t **clipplane, cbrushside_t **leadside,
+		qboolean *getout, qboolean *startout ) {
+	const int	stride = CM_BRUSH_PLANES_STRIDE( brush->numsides );
+	const float	*planes = brush->planes;
+	const v4d_t	zero = V4d_Set( 0 );
+	const v4d_t	epsilon = V4d_Set( SURFACE_CLIP_EPSILON );
+	v4d_t		size[2][3], start[3], end[3];
+	double		enterFracs[4], leaveFracs[4];
+	float		f;
+	int			i, j, k, valid, out, endOut, crosses, enters;
+
+	for ( j = 0; j < 3; j++ ) {
+		size[0][j] = V4d_Set( tw->size[0][j] );
+		size[1][j] = V4d_Set( tw->size[1][j] );
+		start[j] = V4d_Set( tw->start[j] );
+		end[j] = V4d_Set( tw->end[j] );
+	}
+
+	for ( i = 0; i < brush->numsides; i += 4 ) {
+		v4d_t	normal[3], offset[3], dist, d1, d2;
+
+		for ( j = 0; j < 3; j++ ) {
+			normal[j] = V4d_FromFloat( V4f_Load( planes + j * stride + i ) );
+			// the same as tw->offsets[ plane->signbits ][j]
+			offset[j] = V4d_Select( V4d_Less( normal[j], zero ), size[1][j], size[0][j] );
+		}
+
+		// dist = plane->dist - DotProductDP( offset, plane->normal )
+		dist = V4d_Sub( V4d_FromFloat( V4f_Load( planes + 3 * stride + i ) ),
+			V4d_Add( V4d_Add( V4d_Mul( offset[0], normal[0] ), V4d_Mul( offset[1], normal[1] ) ),
+				V4d_Mul( offset[2], normal[2] ) ) );
+
+		// d1 = DotProductDP( tw->start, plane->normal ) - dist, and d2 for tw->end
+		d1 = V4d_Sub( V4d_Add( V4d_Add( V4d_Mul( start[0], normal[0] ), V4d_Mul( start[1], normal[1] ) ),
+				V4d_Mul( start[2], normal[2] ) ), dist );
+		d2 = V4d_Sub( V4d_Add( V4d_Add( V4d_Mul( end[0], normal[0] ), V4d_Mul( end[1], normal[1] ) ),
+				V4d_Mul( end[2], normal[2] ) ), dist );
+
+		valid = brush->numsides - i >= 4 ? 15 : ( 1 << ( brush->numsides - i ) ) - 1;
+		out = V4d_Bits( V4d_Greater( d1, zero ) ) & valid;
+		endOut = V4d_Bits( V4d_Greater( d2, zero ) ) & valid;
+
+		if ( endOut ) {
+			*getout = qtrue;	// endpoint is not in solid
+		}
+		if ( out ) {
+			*startout = qtrue;
+		}
+
+		// if completely in front of face, no intersection with the entire brush
+		if ( out & ( V4d_Bits( V4d_GreaterEqual( d2, epsilon ) ) | V4d_Bits( V4d_GreaterEqual( d2, d1 ) ) ) ) {
+			return qfalse;
+		}
+
+		// if it doesn't cross the plane, the plane isn't relevant, written like
+		// the scalar test so that NaNs cross the same way
+		crosses = ~( V4d_Bits( V4d_LessEqual( d1, zero ) ) & V4d_Bits( V4d_LessEqual( d2, zero ) ) ) & valid;
+		if ( !crosses ) {
+			continue;
+		}
+
+		enters = V4d_Bits( V4d_Greater( d1, d2 ) );
+		V4d_Store( enterFracs, V4d_Div( V4d_Sub( d1, epsilon ), V4d_Sub( d1, d2 ) ) );
+		V4d_Store( leaveFracs, V4d_Div( V4d_Add( d1, epsilon ), V4d_Sub( d1, d2 ) ) );
+
+		for ( k = 0; k < 4; k++ ) {
+			if ( !( crosses & ( 1 << k ) ) ) {
+				continue;
+			}
+
+			// crosses face
+			if ( enters & ( 1 << k ) ) {	// enter
+				f = enterFracs[k];
+				if ( f < 0 ) {
+					f = 0;
+				}
+				if ( f > *enterFrac ) {
+					*enterFrac = f;
+					*leadside = brush->sides + i + k;
+					*clipplane = ( *leadside )->plane;
+				}
+			} else {	// leave
+				f = leaveFracs[k];
+				if ( f > 1 ) {
+					f = 1;
+				}
+				if ( f < *leaveFrac ) {
+					*leaveFrac = f;
+				}
+			}
+		}
+	}
+
+	return qtrue;
+}
+#else
+#define CM_TraceThroughBrushPlanes( tw, brush, enterFrac, leaveFrac, clipplane, leadside, getout, startout ) qtrue
+#endif
+
+
 /*
 ================
 CM_TraceThroughBrush
@@ -563,6 +738,11 @@ static void CM_TraceThroughBrush( traceWork_t *tw, const cbrush_t *brush ) {
 				}
 			}
 		}
+	} else if ( CM_SIMD && brush->planes && !tw->scratch->scalar ) {
+		if ( !CM_TraceThroughBrushPlanes( tw, brush, &enterFrac, &leaveFrac,
+				&clipplane, &leadside, &getout, &startout ) ) {
+			return;
+		}
 	} else {
 		//
 		// compare the trace against all planes of the brush
@@ -659,6 +839,7 @@ CM_TraceThroughLeaf
 static void CM_TraceThroughLeaf( traceWork_t *tw, const cLeaf_t *leaf ) {
 	int			k;
 	int			brushnum;
+	int			surfacenum;
 	cbrush_t	*b;
 	cPatch_t	*patch;
 
@@ -666,11 +847,11 @@ static void CM_TraceThroughLeaf( traceWork_t *tw, const cLeaf_t *leaf ) {
 	for ( k = 0 ; k < leaf->numLeafBrushes ; k++ ) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
 
-		b = &cm.brushes[brushnum];
-		if ( b->checkcount == cm.checkcount ) {
+		b = CM_Brush( tw->scratch, brushnum );
+		if ( tw->scratch->brushCheckcounts[brushnum] == tw->scratch->checkcount ) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		tw->scratch->brushCheckcounts[brushnum] = tw->scratch->checkcount;
 
 		if ( !(b->contents & tw->contents) ) {
 			continue;
@@ -689,14 +870,15 @@ static void CM_TraceThroughLeaf( traceWork_t *tw, const cLeaf_t *leaf ) {
 
 	// trace line against all patches in the leaf
 	for ( k = 0 ; k < leaf->numLeafSurfaces ; k++ ) {
-		patch = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
+		surfacenum = cm.leafsurfaces[ leaf->firstLeafSurface + k ];
+		patch = cm.surfaces[ surfacenum ];
 		if ( !patch ) {
 			continue;
 		}
-		if ( patch->checkcount == cm.checkcount ) {
+		if ( tw->scratch->patchCheckcounts[surfacenum] == tw->scratch->checkcount ) {
 			continue;	// already checked this patch in another leaf
 		}
-		patch->checkcount = cm.checkcount;
+		tw->scratch->patchCheckcounts[surfacenum] = tw->scratch->checkcount;
 
 		if ( !(patch->contents & tw->contents) ) {
 			continue;
@@ -920,7 +1102,7 @@ static void CM_TraceCapsuleThroughCapsule( traceWork_t *tw, clipHandle_t model )
 	vec3_t offset, symetricSize[2];
 	float radius, halfwidth, halfheight, offs, h;
 
-	CM_ModelBounds(model, mins, maxs);
+	CM_ModelBounds(tw->scratch, model, mins, maxs);
 	// test trace bounds vs. capsule bounds
 	if ( tw->bounds[0][0] > maxs[0] + RADIUS_EPSILON
 		|| tw->bounds[0][1] > maxs[1] + RADIUS_EPSILON
@@ -983,7 +1165,7 @@ static void CM_TraceBoundingBoxThroughCapsule( traceWork_t *tw, clipHandle_t mod
 	int i;
 
 	// mins maxs of the capsule
-	CM_ModelBounds(model, mins, maxs);
+	CM_ModelBounds(tw->scratch, model, mins, maxs);
 
 	// offset for capsule center
 	for ( i = 0 ; i < 3 ; i++ ) {
@@ -1001,9 +1183,9 @@ static void CM_TraceBoundingBoxThroughCapsule( traceWork_t *tw, clipHandle_t mod
 	VectorSet( tw->sphere.offset, 0, 0, size[1][2] - tw->sphere.radius );
 
 	// replace the capsule with the bounding box
-	h = CM_TempBoxModel(tw->size[0], tw->size[1], qfalse);
+	h = CM_TempBoxModel(tw->scratch, tw->size[0], tw->size[1], qfalse);
 	// calculate collision
-	cmod = CM_ClipHandleToModel( h );
+	cmod = CM_ClipHandleToModel( tw->scratch, h );
 	CM_TraceThroughLeaf( tw, &cmod->leaf );
 }
 
@@ -1121,37 +1303,158 @@ static void CM_TraceThroughTree( traceWork_t *tw, int num, float p1f, float p2f,
 }
 
 
-//======================================================================
-
-
 /*
 ==================
-CM_Trace
+CM_TraceThroughPackedTree
+
+The same as CM_TraceThroughTree from the root, over cm.packedNodes. Instead
+of recursing into both sides of a node, the far side is put on a stack to be
+gone through once everything on the near side has been.
 ==================
 */
-static void CM_Trace( trace_t *results, const vec3_t start, const vec3_t end, const vec3_t mins, const vec3_t maxs,
-						clipHandle_t model, const vec3_t origin, int brushmask, qboolean capsule, const sphere_t *sphere ) {
-	int			i;
-	traceWork_t	tw;
-	vec3_t		offset;
-	cmodel_t	*cmod;
+static void CM_TraceThroughPackedTree( traceWork_t *tw ) {
+	cTraceStackEntry_t	*stack, *entry;
+	const cPackedNode_t	*node;
+	double		t1, t2, offset;
+	float		frac, frac2;
+	float		idist;
+	vec3_t		p1, p2, mid;
+	int			num, side, sp;
+	float		p1f, p2f, midf;
+
+	stack = tw->scratch->traceStack;
+	sp = 0;
+
+	num = 0;
+	p1f = 0;
+	p2f = 1;
+	VectorCopy( tw->start, p1 );
+	VectorCopy( tw->end, p2 );
+
+	for ( ;; ) {
+		// if already hit something nearer, or in a leaf node, this side is done
+		if ( tw->trace.fraction <= p1f || num < 0 ) {
+			if ( tw->trace.fraction > p1f ) {
+				CM_TraceThroughLeaf( tw, &cm.leafs[-1-num] );
+			}
+			if ( !sp ) {
+				return;
+			}
+			entry = &stack[--sp];
+			num = entry->num;
+			p1f = entry->p1f;
+			p2f = entry->p2f;
+			VectorCopy( entry->p1, p1 );
+			VectorCopy( entry->p2, p2 );
+			continue;
+		}
+
+		//
+		// find the point distances to the separating plane
+		// and the offset for the size of the box
+		//
+		node = cm.packedNodes + num;
 
-	cmod = CM_ClipHandleToModel( model );
+		// adjust the plane distance appropriately for mins/maxs
+		if ( node->type < 3 ) {
+			t1 = p1[node->type] - node->dist;
+			t2 = p2[node->type] - node->dist;
+			offset = tw->extents[node->type];
+		} else {
+			t1 = DotProductDP( node->normal, p1 ) - node->dist;
+			t2 = DotProductDP( node->normal, p2 ) - node->dist;
+			if ( tw->isPoint ) {
+				offset = 0;
+			} else {
+				// this is silly
+				offset = 2048;
+			}
+		}
 
-	cm.checkcount++;		// for multi-check avoidance
+		// see which sides we need to consider
+		if ( t1 >= offset + 1 && t2 >= offset + 1 ) {
+			num = node->children[0];
+			continue;
+		}
+		if ( t1 < -offset - 1 && t2 < -offset - 1 ) {
+			num = node->children[1];
+			continue;
+		}
 
-	c_traces++;				// for statistics, may be zeroed
+		// put the crosspoint SURFACE_CLIP_EPSILON pixels on the near side
+		if ( t1 < t2 ) {
+			idist = 1.0/(t1-t2);
+			side = 1;
+			frac2 = (t1 + offset + SURFACE_CLIP_EPSILON)*idist;
+			frac = (t1 - offset + SURFACE_CLIP_EPSILON)*idist;
+		} else if (t1 > t2) {
+			idist = 1.0/(t1-t2);
+			side = 0;
+			frac2 = (t1 - offset - SURFACE_CLIP_EPSILON)*idist;
+			frac = (t1 + offset + SURFACE_CLIP_EPSILON)*idist;
+		} else {
+			side = 0;
+			frac = 1;
+			frac2 = 0;
+		}
 
-	// fill in a default trace
-	Com_Memset( &tw, 0, sizeof(tw) );
-	tw.trace.fraction = 1;	// assume it goes the entire distance until shown otherwise
-	VectorCopy(origin, tw.modelOrigin);
+		// move up to the node
+		if ( frac < 0 ) {
+			frac = 0;
+		} else if ( frac > 1 ) {
+			frac = 1;
+		}
 
-	if (!cm.numNodes) {
-		*results = tw.trace;
+		midf = p1f + (p2f - p1f)*frac;
 
-		return;	// map not loaded, shouldn't happen
+		mid[0] = p1[0] + frac*(p2[0] - p1[0]);
+		mid[1] = p1[1] + frac*(p2[1] - p1[1]);
+		mid[2] = p1[2] + frac*(p2[2] - p1[2]);
+
+		// go past the node, once the near side is done
+		if ( frac2 < 0 ) {
+			frac2 = 0;
+		} else if ( frac2 > 1 ) {
+			frac2 = 1;
+		}
+
+		entry = &stack[sp++];
+		entry->num = node->children[side^1];
+		entry->p1f = p1f + (p2f - p1f)*frac2;
+		entry->p2f = p2f;
+		entry->p1[0] = p1[0] + frac2*(p2[0] - p1[0]);
+		entry->p1[1] = p1[1] + frac2*(p2[1] - p1[1]);
+		entry->p1[2] = p1[2] + frac2*(p2[2] - p1[2]);
+		VectorCopy( p2, entry->p2 );
+
+		num = node->children[side];
+		p2f = midf;
+		VectorCopy( mid, p2 );
 	}
+}
+
+
+//======================================================================
+
+
+/*
+==================
+CM_SetTraceHull
+
+Fills in everything about a trace that only depends on the shape being
+swept, so traces sharing one only need their end points filled in.
+offset is what centers the hull on the traced points.
+==================
+*/
+static void CM_SetTraceHull( traceWork_t *tw, vec3_t offset, cmScratch_t *scratch, const vec3_t mins, const vec3_t maxs,
+						const vec3_t origin, int brushmask, qboolean capsule, const sphere_t *sphere ) {
+	int			i;
+
+	// fill in a default trace
+	Com_Memset( tw, 0, sizeof(*tw) );
+	tw->scratch = scratch;
+	tw->trace.fraction = 1;	// assume it goes the entire distance until shown otherwise
+	VectorCopy(origin, tw->modelOrigin);
 
 	// allow NULL to be passed in for 0,0,0
 	if ( !mins ) {
@@ -1162,64 +1465,97 @@ static void CM_Trace( trace_t *results, const vec3_t start, const vec3_t end, co
 	}
 
 	// set basic parms
-	tw.contents = brushmask;
+	tw->contents = brushmask;
 
 	// adjust so that mins and maxs are always symmetric, which
 	// avoids some complications with plane expanding of rotated
 	// bmodels
 	for ( i = 0 ; i < 3 ; i++ ) {
 		offset[i] = ( mins[i] + maxs[i] ) * 0.5;
-		tw.size[0][i] = mins[i] - offset[i];
-		tw.size[1][i] = maxs[i] - offset[i];
-		tw.start[i] = start[i] + offset[i];
-		tw.end[i] = end[i] + offset[i];
+		tw->size[0][i] = mins[i] - offset[i];
+		tw->size[1][i] = maxs[i] - offset[i];
 	}
 
 	// if a sphere is already specified
 	if ( sphere ) {
-		tw.sphere = *sphere;
+		tw->sphere = *sphere;
 	}
 	else {
-		tw.sphere.use = capsule;
-		tw.sphere.radius = ( tw.size[1][0] > tw.size[1][2] ) ? tw.size[1][2]: tw.size[1][0];
-		tw.sphere.halfheight = tw.size[1][2];
-		VectorSet( tw.sphere.offset, 0, 0, tw.size[1][2] - tw.sphere.radius );
+		tw->sphere.use = capsule;
+		tw->sphere.radius = ( tw->size[1][0] > tw->size[1][2] ) ? tw->size[1][2]: tw->size[1][0];
+		tw->sphere.halfheight = tw->size[1][2];
+		VectorSet( tw->sphere.offset, 0, 0, tw->size[1][2] - tw->sphere.radius );
 	}
 
-	tw.maxOffset = tw.size[1][0] + tw.size[1][1] + tw.size[1][2];
+	tw->maxOffset = tw->size[1][0] + tw->size[1][1] + tw->size[1][2];
+
+	// tw->offsets[signbits] = vector to appropriate corner from origin
+	tw->offsets[0][0] = tw->size[0][0];
+	tw->offsets[0][1] = tw->size[0][1];
+	tw->offsets[0][2] = tw->size[0][2];
+
+	tw->offsets[1][0] = tw->size[1][0];
+	tw->offsets[1][1] = tw->size[0][1];
+	tw->offsets[1][2] = tw->size[0][2];
+
+	tw->offsets[2][0] = tw->size[0][0];
+	tw->offsets[2][1] = tw->size[1][1];
+	tw->offsets[2][2] = tw->size[0][2];
+
+	tw->offsets[3][0] = tw->size[1][0];
+	tw->offsets[3][1] = tw->size[1][1];
+	tw->offsets[3][2] = tw->size[0][2];
+
+	tw->offsets[4][0] = tw->size[0][0];
+	tw->offsets[4][1] = tw->size[0][1];
+	tw->offsets[4][2] = tw->size[1][2];
+
+	tw->offsets[5][0] = tw->size[1][0];
+	tw->offsets[5][1] = tw->size[0][1];
+	tw->offsets[5][2] = tw->size[1][2];
+
+	tw->offsets[6][0] = tw->size[0][0];
+	tw->offsets[6][1] = tw->size[1][1];
+	tw->offsets[6][2] = tw->size[1][2];
+
+	tw->offsets[7][0] = tw->size[1][0];
+	tw->offsets[7][1] = tw->size[1][1];
+	tw->offsets[7][2] = tw->size[1][2];
+}
 
-	// tw.offsets[signbits] = vector to appropriate corner from origin
-	tw.offsets[0][0] = tw.size[0][0];
-	tw.offsets[0][1] = tw.size[0][1];
-	tw.offsets[0][2] = tw.size[0][2];
 
-	tw.offsets[1][0] = tw.size[1][0];
-	tw.offsets[1][1] = tw.size[0][1];
-	tw.offsets[1][2] = tw.size[0][2];
+/*
+==================
+CM_TraceWithHull
 
-	tw.offsets[2][0] = tw.size[0][0];
-	tw.offsets[2][1] = tw.size[1][1];
-	tw.offsets[2][2] = tw.size[0][2];
+Traces from start to end with a hull from CM_SetTraceHull, which is left as
+it was so it can be used again.
+==================
+*/
+static void CM_TraceWithHull( const traceWork_t *hull, const vec3_t offset, trace_t *results,
+						const vec3_t start, const vec3_t end, clipHandle_t model ) {
+	int			i;
+	traceWork_t	tw;
+	cmodel_t	*cmod;
+
+	cmod = CM_ClipHandleToModel( hull->scratch, model );
 
-	tw.offsets[3][0] = tw.size[1][0];
-	tw.offsets[3][1] = tw.size[1][1];
-	tw.offsets[3][2] = tw.size[0][2];
+	hull->scratch->checkcount++;	// for multi-check avoidance
+
+	c_traces++;				// for statistics, may be zeroed
 
-	tw.offsets[4][0] = tw.size[0][0];
-	tw.offsets[4][1] = tw.size[0][1];
-	tw.offsets[4][2] = tw.size[1][2];
+	tw = *hull;
 
-	tw.offsets[5][0] = tw.size[1][0];
-	tw.offsets[5][1] = tw.size[0][1];
-	tw.offsets[5][2] = tw.size[1][2];
+	if (!cm.numNodes) {
+		*results = tw.trace;
 
-	tw.offsets[6][0] = tw.size[0][0];
-	tw.offsets[6][1] = tw.size[1][1];
-	tw.offsets[6][2] = tw.size[1][2];
+		return;	// map not loaded, shouldn't happen
+	}
 
-	tw.offsets[7][0] = tw.size[1][0];
-	tw.offsets[7][1] = tw.size[1][1];
-	tw.offsets[7][2] = tw.size[1][2];
+	for ( i = 0 ; i < 3 ; i++ ) {
+		tw.start[i] = start[i] + offset[i];
+		tw.end[i] = end[i] + offset[i];
+	}
 
 	//
 	// calculate bounds
@@ -1319,6 +1655,8 @@ static void CM_Trace( trace_t *results, const vec3_t start, const vec3_t end, co
 			else {
 				CM_TraceThroughLeaf( &tw, &cmod->leaf );
 			}
+		} else if ( cm.packedNodes ) {
+			CM_TraceThroughPackedTree( &tw );
 		} else {
 			CM_TraceThroughTree( &tw, 0, 0, 1, tw.start, tw.end );
 		}
@@ -1343,15 +1681,52 @@ static void CM_Trace( trace_t *results, const vec3_t start, const vec3_t end, co
 }
 
 
+/*
+==================
+CM_Trace
+==================
+*/
+static void CM_Trace( cmScratch_t *scratch, trace_t *results, const vec3_t start, const vec3_t end, const vec3_t mins, const vec3_t maxs,
+						clipHandle_t model, const vec3_t origin, int brushmask, qboolean capsule, const sphere_t *sphere ) {
+	traceWork_t	hull;
+	vec3_t		offset;
+
+	CM_SetTraceHull( &hull, offset, scratch, mins, maxs, origin, brushmask, capsule, sphere );
+	CM_TraceWithHull( &hull, offset, results, start, end, model );
+}
+
+
 /*
 ==================
 CM_BoxTrace
 ==================
 */
-void CM_BoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
+void CM_BoxTrace( cmScratch_t *scratch, trace_t *results, const vec3_t start, const vec3_t end,
+						const vec3_t mins, const vec3_t maxs,
+						clipHandle_t model, int brushmask, qboolean capsule ) {
+	CM_Trace( scratch, results, start, end, mins, maxs, model, vec3_origin, brushmask, capsule, NULL );
+}
+
+
+/*
+==================
+CM_BoxTraceBatch
+
+Like CM_BoxTrace for each of numTraces pairs of points, with the hull set up
+only once for all of them.
+==================
+*/
+void CM_BoxTraceBatch( cmScratch_t *scratch, trace_t *results, int numTraces, const vec3_t *starts, const vec3_t *ends,
 						const vec3_t mins, const vec3_t maxs,
 						clipHandle_t model, int brushmask, qboolean capsule ) {
-	CM_Trace( results, start, end, mins, maxs, model, vec3_origin, brushmask, capsule, NULL );
+	traceWork_t	hull;
+	vec3_t		offset;
+	int			i;
+
+	CM_SetTraceHull( &hull, offset, scratch, mins, maxs, vec3_origin, brushmask, capsule, NULL );
+	for ( i = 0 ; i < numTraces ; i++ ) {
+		CM_TraceWithHull( &hull, offset, &results[i], starts[i], ends[i], model );
+	}
 }
 
 
@@ -1363,7 +1738,7 @@ Handles offsetting and rotation of the end points for moving and
 rotating entities
 ==================
 */
-void CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
+void CM_TransformedBoxTrace( cmScratch_t *scratch, trace_t *results, const vec3_t start, const vec3_t end,
 						const vec3_t mins, const vec3_t maxs,
 						clipHandle_t model, int brushmask,
 						const vec3_t origin, const vec3_t angles, qboolean capsule ) {
@@ -1437,7 +1812,7 @@ void CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t
 	}
 
 	// sweep the box through the model
-	CM_Trace( &trace, start_l, end_l, symetricSize[0], symetricSize[1], model, origin, brushmask, capsule, &sphere );
+	CM_Trace( scratch, &trace, start_l, end_l, symetricSize[0], symetricSize[1], model, origin, brushmask, capsule, &sphere );
 
 	// if the bmodel was rotated and there was a collision
 	if ( rotated && trace.fraction != 1.0 ) {
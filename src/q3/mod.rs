@@ -4,11 +4,20 @@
 
 use std::{
     ffi::{CStr, CString},
-    sync::{LazyLock, Mutex, MutexGuard},
+    io::Write,
+    path::{Path, PathBuf},
+    ptr::{NonNull, null_mut},
+    sync::OnceLock,
+    thread,
 };
 
+use crate::fs;
+
 include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
 
+#[cfg(any(test, feature = "fixtures"))]
+pub mod test_map;
+
 pub fn angle_to_short(x: f32) -> u16 {
     (x * u16::MAX as f32 / 360.0) as i32 as u16
 }
@@ -17,35 +26,90 @@ pub fn short_to_angle(x: u16) -> f32 {
     x as f32 * 360.0 / u16::MAX as f32
 }
 
+/// A 64-bit FNV-1a hash of a file's contents, for telling whether two files are the same. Unlike
+/// `DefaultHasher` it's stable between builds, so it can be saved.
+pub fn checksum(data: &[u8]) -> u64 {
+    data.iter().fold(0xcbf29ce484222325, |hash, &byte| {
+        (hash ^ byte as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+/// Batches smaller than this per thread aren't worth splitting between threads.
+const MIN_TRACES_PER_THREAD: usize = 256;
+
+/// `BOX_MODEL_HANDLE` and `CAPSULE_MODEL_HANDLE` from cm_local.h, which `CM_TempBoxModel` hands out
+/// for the box it last set up in a scratch.
+const TEMP_BOX_MODEL_HANDLES: [clipHandle_t; 2] = [255, 254];
+
+/// Where the collision patches generated for maps are kept, each in a file named after the map's
+/// checksum, since generating them is most of what loading a map with a lot of curves costs.
+pub fn patch_cache_dir() -> Option<PathBuf> {
+    Some(fs::cache_dir()?.join("patches"))
+}
+
+/// Loads the map in `buf` into the collision code, with the patches from `patch_cache` if it's
+/// usable, and returns the patch cache of what was loaded. Nothing else can be using the collision
+/// code while it's loading.
+unsafe fn load_collision(name: &str, buf: &[u8], patch_cache: &[u8]) -> Vec<u8> {
+    unsafe {
+        Com_Init();
+        CM_LoadMap(
+            CString::new(name).unwrap().as_ptr(),
+            // It only ever reads from the buffer
+            buf.as_ptr().cast_mut().cast(),
+            buf.len().try_into().unwrap(),
+            patch_cache.as_ptr().cast(),
+            patch_cache.len().try_into().unwrap(),
+        );
+        write_patch_cache()
+    }
+}
+
+/// The patches of the loaded map, as `CM_LoadMap` can read them back.
+unsafe fn write_patch_cache() -> Vec<u8> {
+    unsafe {
+        let mut patch_cache = vec![0u8; CM_WritePatchCache(null_mut(), 0) as usize];
+        CM_WritePatchCache(
+            patch_cache.as_mut_ptr().cast(),
+            patch_cache.len().try_into().unwrap(),
+        );
+        patch_cache
+    }
+}
+
 /// A safe wrapper around functions related to the currently loaded map.
+///
+/// The map never changes once loaded, so it can be queried from any number of threads at once.
+/// Anything a query needs to write to lives in a [`TraceScratch`] instead.
 pub struct Map {
-    pub entity_tokens: std::vec::IntoIter<String>,
-    loaded: bool,
+    entity_tokens: Vec<String>,
+    checksum: u64,
 }
 
+static MAP: OnceLock<Map> = OnceLock::new();
+
 impl Map {
-    pub fn instance<'a>() -> MutexGuard<'a, Self> {
-        static MAP: LazyLock<Mutex<Map>> = LazyLock::new(|| {
-            unsafe { Com_Init() };
-            Mutex::new(Map {
-                loaded: false,
-                entity_tokens: vec![].into_iter(),
-            })
-        });
+    /// Loads the map, keeping its patches in `patch_cache_dir` if there is one, which is normally
+    /// the one from `patch_cache_dir()`.
+    pub fn load(name: &str, buf: &[u8], patch_cache_dir: Option<&Path>) -> &'static Self {
+        let mut loaded = false;
+        let map = MAP.get_or_init(|| unsafe {
+            loaded = true;
+            let checksum = checksum(buf);
+            let patch_cache_path = patch_cache_dir.map(|dir| dir.join(format!("{checksum:016x}")));
+            let patch_cache = patch_cache_path
+                .as_ref()
+                .and_then(|path| std::fs::read(path).ok())
+                .unwrap_or_default();
 
-        MAP.lock().unwrap()
-    }
+            let new_patch_cache = load_collision(name, buf, &patch_cache);
 
-    pub fn load(&mut self, name: &str, buf: &mut [u8]) {
-        if self.loaded {
-            todo!();
-        }
-        unsafe {
-            CM_LoadMap(
-                CString::new(name).unwrap().as_ptr(),
-                buf.as_mut_ptr().cast(),
-                buf.len().try_into().unwrap(),
-            );
+            // Written again whenever the one there wasn't used, so it's never generated twice
+            if let Some(path) = patch_cache_path
+                && new_patch_cache != patch_cache
+            {
+                let _ = fs::write_cache(&path, |w| w.write_all(&new_patch_cache));
+            }
 
             let mut p = CM_EntityString().cast_const();
             assert!(!p.is_null());
@@ -58,14 +122,34 @@ impl Map {
                 }
                 entity_tokens.push(CStr::from_ptr(s).to_str().unwrap().to_string());
             }
-            self.entity_tokens = entity_tokens.into_iter();
-            self.loaded = true;
+            Map {
+                entity_tokens,
+                checksum,
+            }
+        });
+        if !loaded {
+            todo!();
         }
+        map
+    }
+
+    pub fn get() -> &'static Self {
+        MAP.get().expect("no map loaded")
+    }
+
+    pub fn entity_tokens(&self) -> &[String] {
+        &self.entity_tokens
+    }
+
+    /// See `checksum`.
+    pub fn checksum(&self) -> u64 {
+        self.checksum
     }
 
     #[allow(clippy::too_many_arguments)]
     pub fn box_trace(
         &self,
+        scratch: &mut TraceScratch,
         trace: &mut trace_t,
         start: &vec3_t,
         end: &vec3_t,
@@ -75,9 +159,9 @@ impl Map {
         brushmask: i32,
         capsule: bool,
     ) {
-        assert!(self.loaded);
         unsafe {
             CM_BoxTrace(
+                scratch.0.as_ptr(),
                 trace,
                 start.as_ptr(),
                 end.as_ptr(),
@@ -90,9 +174,79 @@ impl Map {
         }
     }
 
+    /// Traces from each of `starts` to the matching one of `ends` with the same hull, which is
+    /// only set up once. The traces are split between a thread per scratch, of which there has to be
+    /// at least one, so `model` can't be a temp box model unless there's only one, since that
+    /// refers to a box in a single scratch. Both are checked.
+    #[allow(clippy::too_many_arguments)]
+    pub fn box_trace_batch(
+        &self,
+        scratches: &mut [TraceScratch],
+        traces: &mut [trace_t],
+        starts: &[vec3_t],
+        ends: &[vec3_t],
+        mins: &vec3_t,
+        maxs: &vec3_t,
+        model: clipHandle_t,
+        brushmask: i32,
+        capsule: bool,
+    ) {
+        assert!(traces.len() == starts.len() && traces.len() == ends.len());
+        assert!(
+            !scratches.is_empty(),
+            "box_trace_batch needs at least one scratch"
+        );
+        assert!(
+            scratches.len() == 1 || !TEMP_BOX_MODEL_HANDLES.contains(&model),
+            "box_trace_batch can only trace a temp box model with the one scratch it's in"
+        );
+        let trace = |scratch: &mut TraceScratch,
+                     traces: &mut [trace_t],
+                     starts: &[vec3_t],
+                     ends: &[vec3_t]| unsafe {
+            CM_BoxTraceBatch(
+                scratch.0.as_ptr(),
+                traces.as_mut_ptr(),
+                traces.len() as i32,
+                starts.as_ptr(),
+                ends.as_ptr(),
+                mins.as_ptr(),
+                maxs.as_ptr(),
+                model,
+                brushmask,
+                capsule as qboolean,
+            );
+        };
+
+        let chunk_size = traces
+            .len()
+            .div_ceil(scratches.len())
+            .max(MIN_TRACES_PER_THREAD);
+        if traces.len() <= chunk_size {
+            trace(&mut scratches[0], traces, starts, ends);
+            return;
+        }
+
+        thread::scope(|scope| {
+            let mut chunks = scratches
+                .iter_mut()
+                .zip(traces.chunks_mut(chunk_size))
+                .zip(starts.chunks(chunk_size).zip(ends.chunks(chunk_size)));
+
+            // The first chunk is done on this thread while the others run
+            let first = chunks.next().unwrap();
+            for ((scratch, traces), (starts, ends)) in chunks {
+                scope.spawn(move || trace(scratch, traces, starts, ends));
+            }
+            let ((scratch, traces), (starts, ends)) = first;
+            trace(scratch, traces, starts, ends);
+        });
+    }
+
     #[allow(clippy::too_many_arguments)]
     pub fn transformed_box_trace(
         &self,
+        scratch: &mut TraceScratch,
         trace: &mut trace_t,
         start: &vec3_t,
         end: &vec3_t,
@@ -104,9 +258,9 @@ impl Map {
         angles: &vec3_t,
         capsule: bool,
     ) {
-        assert!(self.loaded);
         unsafe {
             CM_TransformedBoxTrace(
+                scratch.0.as_ptr(),
                 trace,
                 start.as_ptr(),
                 end.as_ptr(),
@@ -121,23 +275,273 @@ impl Map {
         }
     }
 
-    pub fn point_contents(&self, p: &vec3_t, model: clipHandle_t) -> i32 {
-        assert!(self.loaded);
-        unsafe { CM_PointContents(p.as_ptr(), model) }
+    pub fn point_contents(
+        &self,
+        scratch: &mut TraceScratch,
+        p: &vec3_t,
+        model: clipHandle_t,
+    ) -> i32 {
+        unsafe { CM_PointContents(scratch.0.as_ptr(), p.as_ptr(), model) }
     }
 
     pub fn inline_model(&self, index: i32) -> clipHandle_t {
-        assert!(self.loaded);
         unsafe { CM_InlineModel(index) }
     }
 
-    pub fn model_bounds(&self, model: clipHandle_t, mins: &mut vec3_t, maxs: &mut vec3_t) {
-        assert!(self.loaded);
-        unsafe { CM_ModelBounds(model, mins.as_mut_ptr(), maxs.as_mut_ptr()) }
+    pub fn model_bounds(
+        &self,
+        scratch: &mut TraceScratch,
+        model: clipHandle_t,
+        mins: &mut vec3_t,
+        maxs: &mut vec3_t,
+    ) {
+        unsafe {
+            CM_ModelBounds(
+                scratch.0.as_ptr(),
+                model,
+                mins.as_mut_ptr(),
+                maxs.as_mut_ptr(),
+            )
+        }
+    }
+
+    /// The returned handle refers to a box in `scratch`, and is only valid until the next call.
+    pub fn temp_box_model(
+        &self,
+        scratch: &mut TraceScratch,
+        mins: &vec3_t,
+        maxs: &vec3_t,
+        capsule: bool,
+    ) -> clipHandle_t {
+        unsafe {
+            CM_TempBoxModel(
+                scratch.0.as_ptr(),
+                mins.as_ptr(),
+                maxs.as_ptr(),
+                capsule as i32,
+            )
+        }
+    }
+}
+
+/// What a query writes to while it runs, like the counters that stop brushes from being tested
+/// twice and the hull used for boxes. Everything that queries the map at the same time needs its
+/// own.
+pub struct TraceScratch(NonNull<cmScratch_t>);
+
+// Only ever used through a mutable reference
+unsafe impl Send for TraceScratch {}
+unsafe impl Sync for TraceScratch {}
+
+impl TraceScratch {
+    pub fn new(_map: &'static Map) -> Self {
+        Self(NonNull::new(unsafe { CM_AllocScratch() }).unwrap())
+    }
+
+    /// Makes queries through this scratch test brushes one plane at a time, which is what the
+    /// SIMD path has to agree with.
+    pub fn set_scalar(&mut self, scalar: bool) {
+        unsafe { CM_SetScratchScalar(self.0.as_ptr(), scalar as qboolean) }
+    }
+}
+
+impl Clone for TraceScratch {
+    fn clone(&self) -> Self {
+        Self::new(Map::get())
+    }
+}
+
+impl Drop for TraceScratch {
+    fn drop(&mut self) {
+        unsafe { CM_FreeScratch(self.0.as_ptr()) }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use bytemuck::{Zeroable, bytes_of};
+
+    use super::{
+        test_map::{self, BRUSH_MAXS, BRUSH_MINS, CONTENTS_SOLID, PATCH_HEIGHT},
+        *,
+    };
+
+    fn point_trace(map: &'static Map, start: vec3_t, end: vec3_t) -> trace_t {
+        let mut scratch = TraceScratch::new(map);
+        let mut trace = trace_t::zeroed();
+        map.box_trace(
+            &mut scratch,
+            &mut trace,
+            &start,
+            &end,
+            &[0.0; 3],
+            &[0.0; 3],
+            0,
+            CONTENTS_SOLID,
+            false,
+        );
+        trace
+    }
+
+    /// Position tests don't take the point special case that sweeps do, so a point on a patch is
+    /// inside it, like it always was.
+    #[test]
+    fn point_position_test_hits_patch() {
+        let map = test_map::load();
+
+        let on = point_trace(map, [10.0, 20.0, PATCH_HEIGHT], [10.0, 20.0, PATCH_HEIGHT]);
+        assert!(on.startsolid != 0 && on.allsolid != 0);
+        assert_eq!(on.fraction, 0.0);
+        assert_eq!(on.contents, CONTENTS_SOLID);
+
+        let above = [10.0, 20.0, PATCH_HEIGHT + 8.0];
+        let off = point_trace(map, above, above);
+        assert!(off.startsolid == 0 && off.allsolid == 0);
+        assert_eq!(off.fraction, 1.0);
+    }
+
+    /// Loading the patches from the cache gives exactly the patches generating them does, and
+    /// leaves the cache as it was.
+    #[test]
+    fn patch_cache_matches_generated_patches() {
+        test_map::load();
+        let generated = test_map::generated_patch_cache();
+        assert!(generated.len() > 64);
+        assert!(unsafe { write_patch_cache() } == generated);
+
+        let files: Vec<_> = std::fs::read_dir(test_map::patch_cache_dir())
+            .unwrap()
+            .map(|entry| std::fs::read(entry.unwrap().path()).unwrap())
+            .collect();
+        assert_eq!(files.len(), 1);
+        assert!(files[0] == generated);
+    }
+
+    /// A batch gives the same results as tracing one at a time, position tests included.
+    #[test]
+    fn batch_matches_single_traces() {
+        let map = test_map::load();
+        let points: Vec<vec3_t> = (0..64)
+            .map(|i| {
+                [
+                    i as f32 * 3.0 - 96.0,
+                    i as f32 * -2.0 + 40.0,
+                    (i % 5) as f32 - 2.0,
+                ]
+            })
+            .collect();
+        // Sweeps down onto each point, then position tests at each of them
+        let starts: Vec<vec3_t> = points
+            .iter()
+            .map(|&[x, y, _]| [x, y, 16.0])
+            .chain(points.iter().copied())
+            .collect();
+        let ends = [&points[..], &points[..]].concat();
+
+        let mut scratches = [TraceScratch::new(map)];
+        let mut traces = vec![trace_t::zeroed(); starts.len()];
+        map.box_trace_batch(
+            &mut scratches,
+            &mut traces,
+            &starts,
+            &ends,
+            &[0.0; 3],
+            &[0.0; 3],
+            0,
+            CONTENTS_SOLID,
+            false,
+        );
+        for ((&start, &end), batched) in starts.iter().zip(&ends).zip(&traces) {
+            assert_eq!(bytes_of(&point_trace(map, start, end)), bytes_of(batched));
+        }
     }
 
-    pub fn temp_box_model(&self, mins: &vec3_t, maxs: &vec3_t, capsule: bool) -> clipHandle_t {
-        assert!(self.loaded);
-        unsafe { CM_TempBoxModel(mins.as_ptr(), maxs.as_ptr(), capsule as i32) }
+    /// A temp box model only exists in the scratch it was set up in, so the other threads of a
+    /// batch would trace against whatever box was last set up in theirs.
+    #[test]
+    #[should_panic(expected = "temp box model")]
+    fn batch_rejects_temp_box_model_with_several_scratches() {
+        let map = test_map::load();
+        let mut scratches = [TraceScratch::new(map), TraceScratch::new(map)];
+        let model = map.temp_box_model(&mut scratches[0], &[-8.0; 3], &[8.0; 3], false);
+        let mut traces = [trace_t::zeroed()];
+        map.box_trace_batch(
+            &mut scratches,
+            &mut traces,
+            &[[0.0, 0.0, 16.0]],
+            &[[0.0; 3]],
+            &[0.0; 3],
+            &[0.0; 3],
+            model,
+            CONTENTS_SOLID,
+            false,
+        );
+    }
+
+    /// The SIMD brush code gives exactly what the scalar code does, for random boxes and points
+    /// swept through and started in brushes with every remainder of planes, NaNs included.
+    #[test]
+    fn simd_matches_scalar() {
+        let map = test_map::load();
+        let mut scalar = TraceScratch::new(map);
+        scalar.set_scalar(true);
+        let mut simd = TraceScratch::new(map);
+
+        // xorshift, so failures can be reproduced
+        let mut state = 0x2545_f491_4f6c_dd1du64;
+        let mut random = move || {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            (state >> 40) as f32 / (1 << 24) as f32
+        };
+        let point = |random: &mut dyn FnMut() -> f32| -> vec3_t {
+            [0, 1, 2].map(|i| {
+                let margin = 40.0;
+                BRUSH_MINS[i] - margin + (BRUSH_MAXS[i] - BRUSH_MINS[i] + 2.0 * margin) * random()
+            })
+        };
+
+        for i in 0..20000 {
+            let (mins, maxs) = match i % 3 {
+                0 => ([0.0; 3], [0.0; 3]),
+                1 => ([-15.0, -15.0, -24.0], [15.0, 15.0, 32.0]),
+                _ => {
+                    let half = [0, 1, 2].map(|_| random() * 20.0);
+                    (half.map(|x| -x), half)
+                }
+            };
+            let start = point(&mut random);
+            let mut end = if i % 4 == 0 {
+                start
+            } else {
+                point(&mut random)
+            };
+            if i % 97 == 0 {
+                end[i % 3] = f32::NAN;
+            }
+            let capsule = i % 11 == 0;
+
+            let [a, b] = [&mut scalar, &mut simd].map(|scratch| {
+                let mut trace = trace_t::zeroed();
+                map.box_trace(
+                    scratch,
+                    &mut trace,
+                    &start,
+                    &end,
+                    &mins,
+                    &maxs,
+                    0,
+                    CONTENTS_SOLID,
+                    capsule,
+                );
+                trace
+            });
+            assert_eq!(
+                bytes_of(&a),
+                bytes_of(&b),
+                "trace {i} from {start:?} to {end:?} with {mins:?} {maxs:?}"
+            );
+        }
     }
 }
@@ -0,0 +1,231 @@
+//! A small map built in memory for tests and `bench --fixtures`, since real ones aren't ours to
+//! check in. Only one map can ever be loaded, so every test that needs one shares this one.
+//!
+//! Its patches are generated once and put in a cache of the test's own, which the map is then
+//! loaded from, so loading from the cache gets tested along with everything else and the real
+//! cache is never touched.
+
+use std::{env, fs, path::PathBuf, process, sync::OnceLock};
+
+use byteorder::{LittleEndian, WriteBytesExt};
+
+use super::{Map, checksum, load_collision, vec3_t};
+
+/// `CONTENTS_SOLID` from surfaceflags.h.
+pub const CONTENTS_SOLID: i32 = 1;
+
+/// A flat 3x3 patch at this height, covering `PATCH_MINS` to `PATCH_MAXS` horizontally.
+pub const PATCH_HEIGHT: f32 = 0.0;
+pub const PATCH_MINS: [f32; 2] = [-64.0, -64.0];
+pub const PATCH_MAXS: [f32; 2] = [64.0, 64.0];
+
+/// Boxes in a row along x above the patch, each with its corners cut off by a different number of
+/// extra planes, so the brush code sees every count of planes left over after batches of four.
+pub const NUM_BRUSHES: usize = 12;
+pub const BRUSH_MINS: vec3_t = [-300.0, -20.0, 32.0];
+pub const BRUSH_MAXS: vec3_t = [300.0, 20.0, 112.0];
+const BRUSH_WIDTH: f32 = 40.0;
+
+const LUMP_ENTITIES: usize = 0;
+const LUMP_SHADERS: usize = 1;
+const LUMP_PLANES: usize = 2;
+const LUMP_NODES: usize = 3;
+const LUMP_LEAFS: usize = 4;
+const LUMP_LEAFSURFACES: usize = 5;
+const LUMP_LEAFBRUSHES: usize = 6;
+const LUMP_MODELS: usize = 7;
+const LUMP_BRUSHES: usize = 8;
+const LUMP_BRUSHSIDES: usize = 9;
+const LUMP_DRAWVERTS: usize = 10;
+const LUMP_SURFACES: usize = 13;
+const HEADER_LUMPS: usize = 17;
+
+/// `MST_PATCH` from qfiles.h.
+const MST_PATCH: i32 = 2;
+
+const NAME: &str = "maps/test.bsp";
+
+static GENERATED_PATCH_CACHE: OnceLock<Vec<u8>> = OnceLock::new();
+
+pub fn load() -> &'static Map {
+    static MAP: OnceLock<&'static Map> = OnceLock::new();
+    MAP.get_or_init(|| {
+        let buf = build();
+        let dir = patch_cache_dir();
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        // Nothing else can be using the collision code before the map is loaded
+        let generated = unsafe { load_collision(NAME, &buf, &[]) };
+        fs::write(dir.join(format!("{:016x}", checksum(&buf))), &generated).unwrap();
+        GENERATED_PATCH_CACHE.set(generated).unwrap();
+        Map::load(NAME, &buf, Some(&dir))
+    })
+}
+
+/// The patch cache the map is loaded from.
+pub fn patch_cache_dir() -> PathBuf {
+    env::temp_dir().join(format!("tasjr-test-patches-{}", process::id()))
+}
+
+/// The patch cache from generating the map's patches without one.
+pub fn generated_patch_cache() -> &'static [u8] {
+    load();
+    GENERATED_PATCH_CACHE.get().unwrap()
+}
+
+fn write_i32s(w: &mut Vec<u8>, values: &[i32]) {
+    values
+        .iter()
+        .for_each(|&value| w.write_i32::<LittleEndian>(value).unwrap());
+}
+
+fn write_f32s(w: &mut Vec<u8>, values: &[f32]) {
+    values
+        .iter()
+        .for_each(|&value| w.write_f32::<LittleEndian>(value).unwrap());
+}
+
+/// The planes of each brush, the six axial ones first in the order `CM_BoundBrush` expects.
+fn brush_planes() -> Vec<Vec<([f32; 3], f32)>> {
+    let directions: Vec<vec3_t> = [
+        [1.0, 1.0, 0.0],
+        [-1.0, 1.0, 0.0],
+        [1.0, -1.0, 0.0],
+        [-1.0, -1.0, 0.0],
+        [1.0, 0.0, 1.0],
+        [-1.0, 0.0, 1.0],
+        [0.0, 1.0, -1.0],
+        [0.0, -1.0, -1.0],
+        [1.0, 1.0, 1.0],
+        [-1.0, -1.0, 1.0],
+        [1.0, -1.0, -1.0],
+        [-0.3, 1.0, 0.7],
+    ]
+    .map(|[x, y, z]| {
+        let length = f32::sqrt(x * x + y * y + z * z);
+        [x / length, y / length, z / length]
+    })
+    .into();
+
+    (0..NUM_BRUSHES)
+        .map(|i| {
+            let x = BRUSH_MINS[0] + (BRUSH_MAXS[0] - BRUSH_MINS[0]) * i as f32 / NUM_BRUSHES as f32;
+            let mins = [x + 5.0, BRUSH_MINS[1], BRUSH_MINS[2]];
+            let maxs = [x + 5.0 + BRUSH_WIDTH, BRUSH_MAXS[1], BRUSH_MAXS[2]];
+            let mut planes = vec![];
+            for axis in 0..3 {
+                let mut normal = [0.0; 3];
+                normal[axis] = -1.0;
+                planes.push((normal, -mins[axis]));
+                normal[axis] = 1.0;
+                planes.push((normal, maxs[axis]));
+            }
+
+            // Each cuts through the box most of the way from its center to the corner it faces
+            let center: vec3_t = [0, 1, 2].map(|j| (mins[j] + maxs[j]) / 2.0);
+            for &normal in &directions[..i] {
+                let [along_center, to_corner] = [0, 1].map(|k| {
+                    (0..3)
+                        .map(|j| {
+                            let half = (maxs[j] - mins[j]) / 2.0;
+                            normal[j]
+                                * if k == 0 {
+                                    center[j]
+                                } else {
+                                    normal[j].signum() * half
+                                }
+                        })
+                        .sum::<f32>()
+                });
+                planes.push((normal, along_center + 0.7 * to_corner));
+            }
+            planes
+        })
+        .collect()
+}
+
+fn build() -> Vec<u8> {
+    let mut lumps: [Vec<u8>; HEADER_LUMPS] = Default::default();
+
+    lumps[LUMP_ENTITIES].extend(b"{\n\"classname\" \"worldspawn\"\n}\n\0");
+
+    let mut name = [0u8; 64];
+    name[..19].copy_from_slice(b"textures/test/solid");
+    lumps[LUMP_SHADERS].extend(name);
+    write_i32s(&mut lumps[LUMP_SHADERS], &[0, CONTENTS_SOLID]);
+
+    // A single node splitting the world in two, with everything in both halves
+    write_f32s(&mut lumps[LUMP_PLANES], &[1.0, 0.0, 0.0, 0.0]);
+    write_i32s(&mut lumps[LUMP_NODES], &[0, -1, -2, 0, 0, 0, 0, 0, 0]);
+    for _ in 0..2 {
+        write_i32s(
+            &mut lumps[LUMP_LEAFS],
+            &[0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, NUM_BRUSHES as i32],
+        );
+    }
+    write_i32s(&mut lumps[LUMP_LEAFSURFACES], &[0]);
+    write_i32s(
+        &mut lumps[LUMP_LEAFBRUSHES],
+        &(0..NUM_BRUSHES as i32).collect::<Vec<_>>(),
+    );
+
+    let mut num_planes = 1;
+    let mut num_sides = 0;
+    for planes in brush_planes() {
+        write_i32s(
+            &mut lumps[LUMP_BRUSHES],
+            &[num_sides, planes.len() as i32, 0],
+        );
+        for (normal, dist) in planes {
+            write_f32s(&mut lumps[LUMP_PLANES], &normal);
+            write_f32s(&mut lumps[LUMP_PLANES], &[dist]);
+            write_i32s(&mut lumps[LUMP_BRUSHSIDES], &[num_planes, 0]);
+            num_planes += 1;
+            num_sides += 1;
+        }
+    }
+
+    let mins = [BRUSH_MINS[0], PATCH_MINS[1], PATCH_HEIGHT - 1.0];
+    let maxs = [BRUSH_MAXS[0], PATCH_MAXS[1], BRUSH_MAXS[2]];
+    write_f32s(&mut lumps[LUMP_MODELS], &mins);
+    write_f32s(&mut lumps[LUMP_MODELS], &maxs);
+    write_i32s(&mut lumps[LUMP_MODELS], &[0, 1, 0, NUM_BRUSHES as i32]);
+
+    for row in 0..3 {
+        for column in 0..3 {
+            let lerp = |i: usize, t: usize| {
+                PATCH_MINS[i] + (PATCH_MAXS[i] - PATCH_MINS[i]) * t as f32 / 2.0
+            };
+            let xyz: vec3_t = [lerp(0, column), lerp(1, row), PATCH_HEIGHT];
+            let w = &mut lumps[LUMP_DRAWVERTS];
+            write_f32s(w, &xyz);
+            write_f32s(w, &[0.0; 4]);
+            write_f32s(w, &[0.0, 0.0, 1.0]);
+            w.extend([255; 4]);
+        }
+    }
+
+    let surface = &mut lumps[LUMP_SURFACES];
+    // shaderNum, fogNum, surfaceType, firstVert, numVerts, firstIndex, numIndexes, lightmapNum,
+    // lightmapX, lightmapY, lightmapWidth, lightmapHeight
+    write_i32s(surface, &[0, -1, MST_PATCH, 0, 9, 0, 0, -1, 0, 0, 0, 0]);
+    // lightmapOrigin and lightmapVecs
+    write_f32s(surface, &[0.0; 12]);
+    // patchWidth, patchHeight
+    write_i32s(surface, &[3, 3]);
+
+    let mut buf = vec![];
+    buf.extend(b"IBSP");
+    write_i32s(&mut buf, &[46]);
+    // Each lump starts on a multiple of 4, since the structs in it are read in place
+    let mut offset = 8 + 8 * HEADER_LUMPS;
+    for lump in &lumps {
+        write_i32s(&mut buf, &[offset as i32, lump.len() as i32]);
+        offset += lump.len().next_multiple_of(4);
+    }
+    for lump in &lumps {
+        buf.extend(lump);
+        buf.resize(buf.len().next_multiple_of(4), 0);
+    }
+    buf
+}
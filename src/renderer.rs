@@ -1,28 +1,42 @@
 use std::{
+    error::Error,
+    io::Cursor,
     ops::{Index, IndexMut},
-    path::Path,
     sync::Arc,
+    thread,
 };
 
-use binrw::BinRead;
 use bytemuck::cast_slice;
 use eframe::{egui, glow};
 use three_d::*;
 
 use crate::{
-    bsp::{Bsp, LIGHTMAP_SIZE, Lightmap, MapSurfaceType},
-    fs::Fs,
-    run::Run,
+    bsp::{Bsp, DrawVert, LIGHTMAP_SIZE, Lightmap, MapSurfaceType, Surface},
+    run::{EntityBox, Trajectory, View},
+    triple_buffer::Reader,
 };
 
 pub struct Renderer {
     context: Context,
     map_model: Option<Gm<Mesh, PhysicalMaterial>>,
     bounding_box_model: Gm<InstancedMesh, PhysicalMaterial>,
+
+    /// A thin cylinder between the player's origin on each frame and the next.
+    path_model: Gm<InstancedMesh, PhysicalMaterial>,
+
+    /// The latest state of the game published by the run.
+    view: Reader<View>,
+
+    /// What `bounding_box_model` was last built from, so it's only uploaded again when something
+    /// moved.
+    boxes: Vec<EntityBox>,
+
+    /// Likewise for `path_model`.
+    trajectories: Vec<Arc<Trajectory>>,
 }
 
 impl Renderer {
-    pub fn new(gl: Arc<glow::Context>) -> Self {
+    pub fn new(gl: Arc<glow::Context>, view: Reader<View>) -> Self {
         let context = Context::from_gl_context(gl).unwrap();
 
         let mut material = PhysicalMaterial::new_transparent(
@@ -38,105 +52,30 @@ impl Renderer {
             material,
         );
 
+        let path_model = Gm::new(
+            InstancedMesh::new(&context, &Instances::default(), &CpuMesh::cylinder(6)),
+            PhysicalMaterial::new_opaque(
+                &context,
+                &CpuMaterial {
+                    albedo: Srgba::new_opaque(255, 208, 64),
+                    ..Default::default()
+                },
+            ),
+        );
+
         Self {
             context,
             map_model: None,
             bounding_box_model,
+            path_model,
+            view,
+            boxes: vec![],
+            trajectories: vec![],
         }
     }
 
-    pub fn load_bsp(&mut self, fs: &Fs, path: impl AsRef<Path>) {
-        let mut f = fs.open(path).unwrap();
-        let bsp = Bsp::read(&mut f).unwrap();
-        let draw_verts = bsp.draw_verts.read(&mut f).unwrap();
-        let draw_indexes = bsp.draw_indexes.read(&mut f).unwrap();
-
-        let mut lightmaps = bsp.lightmaps.read(&mut f).unwrap();
-
-        let white_lightmap = lightmaps.len();
-        lightmaps.push(Lightmap {
-            pixels: [[[255; _]; _]; _],
-        });
-
-        let mut positions = vec![];
-        let mut indices = vec![];
-        let mut uvs = vec![];
-        let mut colors = vec![];
-
-        for surface in bsp.surfaces.read(&mut f).unwrap() {
-            let lightmap_num = if surface.lightmap_num < 0 {
-                white_lightmap
-            } else {
-                surface.lightmap_num as usize
-            };
-
-            let lightmap_base_uv = vec2(0.0, lightmap_num as f32);
-
-            match surface.surface_type {
-                MapSurfaceType::Planar | MapSurfaceType::TriangleSoup => {
-                    let first_out_vert = positions.len() as u32;
-
-                    for i in 0..surface.num_verts {
-                        let vert = &draw_verts[(surface.first_vert + i) as usize];
-                        positions.push(Vec3::from(vert.xyz));
-                        uvs.push(lightmap_base_uv + Vec2::from(vert.lightmap));
-                        colors.push(if surface.lightmap_num < 0 {
-                            Srgba::from(vert.color)
-                        } else {
-                            Srgba::WHITE
-                        });
-                    }
-
-                    for i in 0..surface.num_indexes {
-                        indices.push(
-                            draw_indexes[(surface.first_index + i) as usize] + first_out_vert,
-                        );
-                    }
-                }
-                MapSurfaceType::Patch => {
-                    let (first_vert, width, height) = (
-                        surface.first_vert as usize,
-                        surface.patch_width as usize,
-                        surface.patch_height as usize,
-                    );
-
-                    let mut points = Grid::new(width, height);
-
-                    for i in 0..width {
-                        for j in 0..height {
-                            let vert = &draw_verts[first_vert + i + j * width];
-                            points[(i, j)] = Vertex {
-                                position: Vec3::from(vert.xyz),
-                                uv: lightmap_base_uv + Vec2::from(vert.lightmap),
-                            }
-                        }
-                    }
-
-                    points = tessellate_bezier(points, 16, Vertex::lerp);
-
-                    let first_vert = positions.len() as u32;
-                    let (patch_vertices, patch_indices) = points.triangulate();
-                    for vertex in patch_vertices {
-                        positions.push(vertex.position);
-                        uvs.push(vertex.uv);
-                        colors.push(Srgba::WHITE);
-                    }
-                    indices.extend(patch_indices.iter().map(|i| first_vert + i));
-                }
-                _ => {}
-            }
-        }
-
-        uvs.iter_mut().for_each(|uv| uv.y /= lightmaps.len() as f32);
-
-        let mut mesh = CpuMesh {
-            positions: Positions::F32(positions),
-            indices: Indices::U32(indices),
-            uvs: Some(uvs),
-            colors: Some(colors),
-            ..Default::default()
-        };
-        mesh.compute_normals();
+    pub fn load_map(&mut self, map: MapMesh) {
+        let MapMesh { mesh, lightmaps } = map;
 
         let (width, height) = (LIGHTMAP_SIZE, lightmaps.len() * LIGHTMAP_SIZE);
         let lightmap = Texture2D::new_empty::<[u8; 3]>(
@@ -159,34 +98,85 @@ impl Renderer {
         self.map_model = Some(Gm::new(Mesh::new(&self.context, &mesh), material));
     }
 
-    pub fn update(&mut self, run: &Run) {
-        let g_entities = run.game.g_entities.unwrap();
-
-        let mut instances = Instances {
-            transformations: vec![Mat4::identity(); g_entities.count as usize],
-            ..Default::default()
-        };
-
-        for i in 0..g_entities.count {
-            let ent = run.game.entity(i);
-
-            let origin: Vec3 = ent.r.currentOrigin.into();
-            let mins: Vec3 = origin + Vec3::from(ent.r.mins);
-            let maxs: Vec3 = origin + Vec3::from(ent.r.maxs);
+    /// Picks up the latest view, if there's a new one.
+    fn update(&mut self) {
+        if !self.view.update() {
+            return;
+        }
+        self.update_boxes();
+        self.update_path();
+    }
 
-            if mins != maxs {
+    fn update_boxes(&mut self) {
+        if self.view.get().boxes == self.boxes {
+            return;
+        }
+        self.boxes.clone_from(&self.view.get().boxes);
+
+        let transformations = self
+            .boxes
+            .iter()
+            .map(|entity| {
+                let (mins, maxs) = (Vec3::from(entity.mins), Vec3::from(entity.maxs));
+                if mins == maxs {
+                    return Mat4::identity();
+                }
                 let center = (mins + maxs) * 0.5;
                 let size = (maxs - mins) * 0.5;
+                Mat4::from_translation(center) * Mat4::from_diagonal(size.extend(1.0))
+            })
+            .collect();
+        self.bounding_box_model.set_instances(&Instances {
+            transformations,
+            ..Default::default()
+        });
+    }
 
-                instances.transformations[i as usize] =
-                    Mat4::from_translation(center) * Mat4::from_diagonal(size.extend(1.0));
-            }
+    fn update_path(&mut self) {
+        let trajectories = &self.view.get().trajectories;
+        if trajectories.len() == self.trajectories.len()
+            && trajectories
+                .iter()
+                .zip(&self.trajectories)
+                .all(|(a, b)| Arc::ptr_eq(a, b))
+        {
+            return;
         }
+        self.trajectories.clone_from(trajectories);
+
+        let points = self
+            .trajectories
+            .iter()
+            .flat_map(|trajectory| &trajectory.origins)
+            .map(|&origin| Vec3::from(origin));
+        let transformations = points
+            .clone()
+            .zip(points.skip(1))
+            .filter(|(a, b)| a != b)
+            .map(|(a, b)| {
+                let offset = b - a;
+                Mat4::from_translation(a)
+                    * Mat4::from(Quat::from_arc(Vec3::unit_x(), offset.normalize(), None))
+                    * Mat4::from_nonuniform_scale(offset.magnitude(), 1.0, 1.0)
+            })
+            .collect();
+        self.path_model.set_instances(&Instances {
+            transformations,
+            ..Default::default()
+        });
+    }
 
-        self.bounding_box_model.set_instances(&instances);
+    /// Renders what the player sees.
+    pub fn render_first_person(&mut self, info: egui::PaintCallbackInfo) {
+        self.update();
+        let view = self.view.get();
+        let (origin, angles) = (view.eye_origin.into(), view.view_angles.into());
+        self.render(info, origin, angles);
     }
 
-    pub fn render(&self, info: egui::PaintCallbackInfo, origin: Vec3, angles: Vec3) {
+    pub fn render(&mut self, info: egui::PaintCallbackInfo, origin: Vec3, angles: Vec3) {
+        self.update();
+
         let screen = RenderTarget::screen(
             &self.context,
             info.screen_size_px[0],
@@ -239,13 +229,170 @@ impl Renderer {
                 .render_partially(
                     scissor_box,
                     &camera,
-                    map_model.into_iter().chain(&self.bounding_box_model),
+                    map_model
+                        .into_iter()
+                        .chain(&self.bounding_box_model)
+                        .chain(&self.path_model),
                     &[&alight, &dlight1, &dlight2],
                 );
         }
     }
 }
 
+/// Everything the renderer needs from a BSP, which is built without a GL context so it can be done
+/// on another thread while the rest of the map loads.
+pub struct MapMesh {
+    mesh: CpuMesh,
+    lightmaps: Vec<Lightmap>,
+}
+
+impl MapMesh {
+    /// Builds the mesh from the BSP in `buf`. Surfaces are split between threads, since tessellating
+    /// patches is most of the work.
+    pub fn new(buf: &[u8]) -> Result<Self, Box<dyn Error>> {
+        let bsp = Bsp::parse(buf)?;
+        let draw_verts = bsp.draw_verts.cast(buf)?;
+        let draw_indexes = bsp.draw_indexes.cast(buf)?;
+        let surfaces = bsp.surfaces.read(Cursor::new(buf))?;
+
+        let mut lightmaps = bsp.lightmaps.cast(buf)?.into_owned();
+        let white_lightmap = lightmaps.len();
+        lightmaps.push(Lightmap {
+            pixels: [[[255; _]; _]; _],
+        });
+
+        let num_threads = thread::available_parallelism().map_or(1, |n| n.get());
+        let chunk_size = surfaces.len().div_ceil(num_threads).max(1);
+        let (draw_verts, draw_indexes) = (&*draw_verts, &*draw_indexes);
+        let mut geometry = thread::scope(|scope| {
+            let workers: Vec<_> = surfaces
+                .chunks(chunk_size)
+                .map(|surfaces| {
+                    scope.spawn(move || {
+                        let mut geometry = Geometry::default();
+                        for surface in surfaces {
+                            geometry.add_surface(surface, draw_verts, draw_indexes, white_lightmap);
+                        }
+                        geometry
+                    })
+                })
+                .collect();
+
+            // Joined in order so the mesh is the same no matter how many threads there are
+            let mut geometry = Geometry::default();
+            for worker in workers {
+                geometry.append(worker.join().unwrap());
+            }
+            geometry
+        });
+
+        geometry
+            .uvs
+            .iter_mut()
+            .for_each(|uv| uv.y /= lightmaps.len() as f32);
+
+        let mut mesh = CpuMesh {
+            positions: Positions::F32(geometry.positions),
+            indices: Indices::U32(geometry.indices),
+            uvs: Some(geometry.uvs),
+            colors: Some(geometry.colors),
+            ..Default::default()
+        };
+        mesh.compute_normals();
+
+        Ok(Self { mesh, lightmaps })
+    }
+}
+
+#[derive(Default)]
+struct Geometry {
+    positions: Vec<Vec3>,
+    indices: Vec<u32>,
+    uvs: Vec<Vec2>,
+    colors: Vec<Srgba>,
+}
+
+impl Geometry {
+    fn add_surface(
+        &mut self,
+        surface: &Surface,
+        draw_verts: &[DrawVert],
+        draw_indexes: &[u32],
+        white_lightmap: usize,
+    ) {
+        let lightmap_num = if surface.lightmap_num < 0 {
+            white_lightmap
+        } else {
+            surface.lightmap_num as usize
+        };
+
+        let lightmap_base_uv = vec2(0.0, lightmap_num as f32);
+
+        match surface.surface_type {
+            MapSurfaceType::Planar | MapSurfaceType::TriangleSoup => {
+                let first_out_vert = self.positions.len() as u32;
+
+                for i in 0..surface.num_verts {
+                    let vert = &draw_verts[(surface.first_vert + i) as usize];
+                    self.positions.push(Vec3::from(vert.xyz));
+                    self.uvs.push(lightmap_base_uv + Vec2::from(vert.lightmap));
+                    self.colors.push(if surface.lightmap_num < 0 {
+                        Srgba::from(vert.color)
+                    } else {
+                        Srgba::WHITE
+                    });
+                }
+
+                for i in 0..surface.num_indexes {
+                    self.indices
+                        .push(draw_indexes[(surface.first_index + i) as usize] + first_out_vert);
+                }
+            }
+            MapSurfaceType::Patch => {
+                let (first_vert, width, height) = (
+                    surface.first_vert as usize,
+                    surface.patch_width as usize,
+                    surface.patch_height as usize,
+                );
+
+                let mut points = Grid::new(width, height);
+
+                for i in 0..width {
+                    for j in 0..height {
+                        let vert = &draw_verts[first_vert + i + j * width];
+                        points[(i, j)] = Vertex {
+                            position: Vec3::from(vert.xyz),
+                            uv: lightmap_base_uv + Vec2::from(vert.lightmap),
+                        }
+                    }
+                }
+
+                points = tessellate_bezier(points, 16, Vertex::lerp);
+
+                let first_vert = self.positions.len() as u32;
+                let (patch_vertices, patch_indices) = points.triangulate();
+                for vertex in patch_vertices {
+                    self.positions.push(vertex.position);
+                    self.uvs.push(vertex.uv);
+                    self.colors.push(Srgba::WHITE);
+                }
+                self.indices
+                    .extend(patch_indices.iter().map(|i| first_vert + i));
+            }
+            _ => {}
+        }
+    }
+
+    fn append(&mut self, other: Self) {
+        let first_vert = self.positions.len() as u32;
+        self.positions.extend(other.positions);
+        self.indices
+            .extend(other.indices.iter().map(|i| first_vert + i));
+        self.uvs.extend(other.uvs);
+        self.colors.extend(other.colors);
+    }
+}
+
 #[derive(Clone)]
 struct Vertex {
     position: Vec3,
@@ -1,29 +1,106 @@
 use std::{
-    sync::{Arc, Mutex},
-    thread,
+    error::Error,
+    ops::{Deref, DerefMut},
+    path::Path,
+    sync::{
+        Arc, Mutex, MutexGuard, TryLockError,
+        atomic::{AtomicU64, AtomicUsize, Ordering},
+    },
+    time::{Duration, Instant},
 };
 
 use bytemuck::Zeroable;
 
-use crate::{Snapshot as _, fs::Fs, game::Game, q3::usercmd_t};
+#[cfg(feature = "profile")]
+use crate::profile;
+use crate::{
+    Snapshot as _,
+    fs::Fs,
+    game::{Game, TraceCacheStats, rolling_checksums},
+    q3::{Map, usercmd_t},
+    triple_buffer::{Reader, Writer, triple_buffer},
+    vm::ExecMode,
+};
+
+mod dense;
+mod file;
+mod pool;
+mod repack;
+mod seeker;
+mod trajectory;
+mod view;
+
+use dense::{DENSE_INTERVAL, DenseSnapshots};
+pub use file::RunFile;
+pub use repack::SnapshotMemoryStats;
+use seeker::{Request, Seeker};
+pub use trajectory::Trajectory;
+pub use view::{EntityBox, View};
 
 pub const SNAPSHOT_INTERVAL: usize = 125;
 
+/// Seeks that need more frames than this simulated after restoring a snapshot are left to the
+/// seeker. It's enough to get from one dense snapshot to the next, so scrubbing where they are
+/// doesn't wait a frame for the seeker.
+const MAX_FOREGROUND_SEEK_FRAMES: usize = DENSE_INTERVAL;
+
 type Snapshot = <Game as crate::Snapshot>::Snapshot;
 
-/// Data that is shared between threads and should all be locked at once.
+/// Cached state of the whole game every `SNAPSHOT_INTERVAL` frames to speed up seeking. The
+/// frames between one checkpoint and the next make up a segment.
+#[derive(Default)]
+struct Checkpoint {
+    /// Stored relative to the previous checkpoint's snapshot. An up to date checkpoint without one
+    /// had it dropped by `repack` to save memory, and is simulated to from an earlier one.
+    snapshot: Option<Arc<Snapshot>>,
+
+    /// The player's movement through the segment leading up to this checkpoint, from the same
+    /// simulation as `snapshot` unless it was loaded from a file, in which case there isn't one
+    /// until a worker simulates the segment again.
+    trajectory: Option<Arc<Trajectory>>,
+
+    /// Was `snapshot` simulated from the previous checkpoint's snapshot with the current usercmds?
+    /// If not, it's tentative: it's kept because simulating again often ends up in the same state,
+    /// in which case it and every checkpoint after it are still good.
+    up_to_date: bool,
+
+    /// Incremented whenever a usercmd leading up to this checkpoint changes.
+    version: u64,
+
+    /// Is a worker currently simulating the segment leading up to this checkpoint?
+    in_progress: bool,
+}
+
+/// Data that is shared between threads and should all be locked at once. Nothing slow is ever
+/// done while it's locked: anything that needs simulating takes its own reference to whatever it
+/// needs first.
 struct Shared {
-    /// User inputs for each frame of simulation.
-    usercmds: Vec<usercmd_t>,
+    /// User inputs for each frame of simulation. Edits copy the whole buffer if someone else is
+    /// still holding on to an old version.
+    usercmds: Arc<Vec<usercmd_t>>,
+
+    /// Incremented whenever `usercmds` changes.
+    usercmds_version: u64,
 
-    /// Cached state of the whole game every `SNAPSHOT_INTERVAL` frames to speed up seeking.
-    snapshots: Vec<Option<Snapshot>>,
+    checkpoints: Vec<Checkpoint>,
 
-    /// The number of up-to-date snapshots.
+    /// The number of checkpoints at the start of `checkpoints` that are up to date, which are the
+    /// only ones whose snapshots are valid.
     num_valid_snapshots: usize,
 
-    /// The number of usercmds the snapshot thread is aware of.
-    num_processed_usercmds: usize,
+    /// Should the snapshot pool work on this run?
+    workers_enabled: bool,
+
+    /// Incremented whenever what `trajectories` returns might have changed.
+    trajectories_version: u64,
+
+    /// The frame last seeked to, whose segment workers get to before later ones.
+    playhead: usize,
+
+    /// See `repack`.
+    pack_cold_snapshots: bool,
+    checkpoint_memory_cap: usize,
+    repacking: bool,
 }
 
 impl Shared {
@@ -31,196 +108,628 @@ impl Shared {
         frame < self.num_valid_snapshots * SNAPSHOT_INTERVAL
     }
 
+    /// The latest checkpoint at or before `checkpoint_num` with a snapshot, as long as every one
+    /// after it up to `checkpoint_num` is up to date, so that simulating from it gets to them.
+    fn snapshot_before(&self, checkpoint_num: usize) -> Option<(usize, &Arc<Snapshot>)> {
+        for i in (0..=checkpoint_num).rev() {
+            let checkpoint = &self.checkpoints[i];
+            if let Some(snapshot) = &checkpoint.snapshot {
+                return Some((i, snapshot));
+            }
+            if !checkpoint.up_to_date {
+                return None;
+            }
+        }
+        None
+    }
+
     fn invalidate(&mut self, frame: usize) {
-        self.num_valid_snapshots = self.num_valid_snapshots.min(frame / SNAPSHOT_INTERVAL + 1);
-        self.num_processed_usercmds = self.num_processed_usercmds.min(frame);
+        self.usercmds_version += 1;
+        let checkpoint_num = frame / SNAPSHOT_INTERVAL + 1;
+        if let Some(checkpoint) = self.checkpoints.get_mut(checkpoint_num) {
+            checkpoint.up_to_date = false;
+            checkpoint.version += 1;
+        }
+        self.num_valid_snapshots = self.num_valid_snapshots.min(checkpoint_num);
+        self.trajectories_version += 1;
+    }
+
+    /// Saves a freshly simulated snapshot. If it hashes the same as the tentative one already there
+    /// then the old one is kept, so every checkpoint after it that was simulated from it is
+    /// promoted without simulating anything. The same goes for an up to date checkpoint whose
+    /// snapshot was dropped, which stays dropped. The trajectory is always replaced, since the
+    /// frames in between can differ even when they end up in the same state.
+    fn store(
+        &mut self,
+        checkpoint_num: usize,
+        snapshot: Arc<Snapshot>,
+        trajectory: Option<Arc<Trajectory>>,
+    ) {
+        let checkpoint = &mut self.checkpoints[checkpoint_num];
+        checkpoint.trajectory = trajectory;
+        self.trajectories_version += 1;
+        let unchanged = match &checkpoint.snapshot {
+            Some(old) => old.hash() == snapshot.hash(),
+            None => checkpoint.up_to_date,
+        };
+        if !unchanged {
+            checkpoint.snapshot = Some(snapshot);
+            if let Some(next) = self.checkpoints.get_mut(checkpoint_num + 1) {
+                next.up_to_date = false;
+            }
+        }
+        self.checkpoints[checkpoint_num].up_to_date = true;
+
+        while self
+            .checkpoints
+            .get(self.num_valid_snapshots)
+            .is_some_and(|checkpoint| checkpoint.up_to_date)
+        {
+            self.num_valid_snapshots += 1;
+        }
+    }
+
+    /// The trajectories of every segment from the start, as far as they're valid.
+    fn trajectories(&self) -> Vec<Arc<Trajectory>> {
+        self.checkpoints[1..self.num_valid_snapshots.max(1)]
+            .iter()
+            .map_while(|checkpoint| checkpoint.trajectory.clone())
+            .collect()
     }
 }
 
-pub struct Run {
-    pub game: Game,
-    shared: Arc<Mutex<Shared>>,
+/// Who is waiting on a lock, for `LockWaitStats`.
+#[derive(Clone, Copy)]
+enum Waiter {
+    Run,
+    Worker,
+}
+
+/// How long threads have spent waiting to lock a run's shared data.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct LockWaitStats {
+    pub acquisitions: u64,
+    /// How many acquisitions found the lock already taken.
+    pub contended: u64,
+    pub total_wait: Duration,
+    pub max_wait: Duration,
+}
+
+#[derive(Default)]
+struct LockWaitCounters {
+    acquisitions: AtomicU64,
+    contended: AtomicU64,
+    total_wait_ns: AtomicU64,
+    max_wait_ns: AtomicU64,
+}
+
+impl LockWaitCounters {
+    fn get(&self) -> LockWaitStats {
+        LockWaitStats {
+            acquisitions: self.acquisitions.load(Ordering::Relaxed),
+            contended: self.contended.load(Ordering::Relaxed),
+            total_wait: Duration::from_nanos(self.total_wait_ns.load(Ordering::Relaxed)),
+            max_wait: Duration::from_nanos(self.max_wait_ns.load(Ordering::Relaxed)),
+        }
+    }
+}
+
+/// The parts of a `Run` that the snapshot pool works with.
+struct SharedRun {
+    state: Mutex<Shared>,
+
+    /// A copy of `Shared::num_valid_snapshots` that's published every time the lock is released,
+    /// so that checking whether a frame can be seeked to never has to wait.
+    num_valid_snapshots: AtomicUsize,
 
-    /// A snapshot taken after initialization but before any user input occurs that all other
-    /// snapshots are based on.
-    baseline: Arc<Snapshot>,
+    /// Likewise for `Shared::trajectories_version`.
+    trajectories_version: AtomicU64,
 
-    /// Generates snapshots in the background when usercmds change.
-    snapshot_worker: thread::JoinHandle<()>,
-    snapshot_worker_enabled: bool,
+    /// Indexed by `Waiter`.
+    lock_waits: [LockWaitCounters; 2],
+
+    /// Added to by workers after each job.
+    worker_trace_cache_hits: AtomicU64,
+    worker_trace_cache_misses: AtomicU64,
+
+    /// A copy of the game just for workers to clone so they don't need to lock the real one.
+    game: Game,
+}
+
+impl SharedRun {
+    fn lock(&self, waiter: Waiter) -> SharedGuard<'_> {
+        let counters = &self.lock_waits[waiter as usize];
+        counters.acquisitions.fetch_add(1, Ordering::Relaxed);
+
+        let guard = match self.state.try_lock() {
+            Ok(guard) => guard,
+            Err(TryLockError::WouldBlock) => {
+                let start = Instant::now();
+                let guard = self.state.lock().unwrap();
+                let wait = start.elapsed().as_nanos() as u64;
+                counters.contended.fetch_add(1, Ordering::Relaxed);
+                counters.total_wait_ns.fetch_add(wait, Ordering::Relaxed);
+                counters.max_wait_ns.fetch_max(wait, Ordering::Relaxed);
+                guard
+            }
+            Err(TryLockError::Poisoned(err)) => panic!("{err}"),
+        };
+
+        SharedGuard { guard, run: self }
+    }
+
+    fn has_valid_snapshot(&self, frame: usize) -> bool {
+        frame < self.num_valid_snapshots.load(Ordering::Acquire) * SNAPSHOT_INTERVAL
+    }
+
+    /// Stores the state of `game`, which has just reached a checkpoint, if it's the next one to
+    /// make valid and the usercmds haven't changed since `usercmds_version`. This is how
+    /// checkpoints get stored while workers are disabled.
+    fn store_reached_checkpoint(
+        &self,
+        waiter: Waiter,
+        game: &mut Game,
+        usercmds_version: u64,
+        trajectory: Option<Trajectory>,
+    ) {
+        let snapshot_num = game.frame() / SNAPSHOT_INTERVAL;
+        let previous_snapshot = {
+            let shared = self.lock(waiter);
+            if shared.usercmds_version != usercmds_version {
+                return;
+            }
+            assert!(shared.num_valid_snapshots >= snapshot_num);
+            if shared.num_valid_snapshots != snapshot_num {
+                return;
+            }
+            let (_, snapshot) = shared.snapshot_before(snapshot_num - 1).unwrap();
+            Arc::clone(snapshot)
+        };
+
+        #[cfg(feature = "profile")]
+        let snapshot_start = Instant::now();
+        let snapshot = Arc::new(game.take_snapshot(Some(&previous_snapshot)));
+        #[cfg(feature = "profile")]
+        if profile::enabled() {
+            profile::get().record_snapshot(snapshot_start.elapsed());
+        }
+
+        let mut shared = self.lock(waiter);
+        if shared.usercmds_version == usercmds_version {
+            shared.store(snapshot_num, snapshot, trajectory.map(Arc::new));
+        }
+    }
+}
+
+/// Publishes `num_valid_snapshots` when unlocked.
+struct SharedGuard<'a> {
+    guard: MutexGuard<'a, Shared>,
+    run: &'a SharedRun,
+}
+
+impl Deref for SharedGuard<'_> {
+    type Target = Shared;
+
+    fn deref(&self) -> &Shared {
+        &self.guard
+    }
+}
+
+impl DerefMut for SharedGuard<'_> {
+    fn deref_mut(&mut self) -> &mut Shared {
+        &mut self.guard
+    }
+}
+
+impl Drop for SharedGuard<'_> {
+    fn drop(&mut self) {
+        self.run
+            .num_valid_snapshots
+            .store(self.guard.num_valid_snapshots, Ordering::Release);
+        self.run
+            .trajectories_version
+            .store(self.guard.trajectories_version, Ordering::Release);
+    }
+}
+
+/// A run of a single player, edited a usercmd at a time. Its game only ever has the one client;
+/// `Game::run_frame_with_clients` is for searches, which don't need a run's history.
+///
+/// TODO: A stream of usercmds per client, so several players can be run together. That means a
+/// client count for `new`, a client for `set_usercmds`, `usercmd_mut`, `open` and `save`,
+/// checkpoints that check every client, and run files with a stream per client that still open
+/// the single-stream ones.
+pub struct Run {
+    pub game: Game,
+    shared: Arc<SharedRun>,
+    dense: DenseSnapshots,
+    seeker: Seeker,
 
     /// Is the current state of `game` based on old usercmds?
     stale: bool,
+
+    /// Where the state of `game` is published after every seek, if anything is drawing it.
+    view: Option<Writer<View>>,
+
+    /// The `Shared::trajectories_version` of the last published view.
+    view_trajectories_version: u64,
+
+    /// The checksums of the run file last opened, which still go with the usercmds as long as
+    /// they're at `opened_usercmds_version`. They cover frames that haven't been simulated again.
+    opened_checksums: Vec<u64>,
+    opened_usercmds_version: u64,
 }
 
 impl Run {
-    pub fn new(fs: &Fs) -> Self {
-        let mut game = Game::new(fs, "vm/qagame.qvm");
-        game.cvars.set("dedicated", "1".to_string());
-        game.cvars.set("df_promode", "1".to_string());
-        game.init();
+    pub fn new(fs: &Fs, vm_mode: ExecMode) -> Self {
+        let mut game = Game::start(fs, vm_mode);
+        game.hash_frames = true;
         game.vm.memory.clear_dirty();
+        // A snapshot taken after initialization but before any user input occurs that all other
+        // snapshots are ultimately based on
         let baseline = Arc::new(game.take_snapshot(None));
 
-        let shared = Arc::new(Mutex::new(Shared {
-            usercmds: vec![],
-            snapshots: vec![Some(game.take_snapshot(Some(&baseline)))],
-            num_valid_snapshots: 1,
-            num_processed_usercmds: 0,
-        }));
-
-        let snapshot_thread = {
-            // Make a copy of the game just for generating snapshots so we don't need to lock it
-            let mut game = game.clone();
-
-            let shared = Arc::clone(&shared);
-            let baseline = Arc::clone(&baseline);
-
-            thread::spawn(move || {
-                loop {
-                    // Wait for invalid snapshots to work on
-                    loop {
-                        {
-                            let shared = shared.lock().unwrap();
-                            if shared.num_valid_snapshots < shared.snapshots.len() {
-                                break;
-                            }
-                        }
-                        thread::park();
-                    }
-
-                    // Start from the last valid snapshot
-                    let next_snapshot_num;
-                    let num_processed_usercmds;
-                    let usercmds;
-                    {
-                        let mut shared = shared.lock().unwrap();
-
-                        shared.num_processed_usercmds =
-                            (shared.num_processed_usercmds + 1).next_multiple_of(SNAPSHOT_INTERVAL);
-                        num_processed_usercmds = shared.num_processed_usercmds;
-
-                        next_snapshot_num = num_processed_usercmds / SNAPSHOT_INTERVAL;
-
-                        usercmds = shared.usercmds[(next_snapshot_num - 1) * SNAPSHOT_INTERVAL..]
-                            [..SNAPSHOT_INTERVAL]
-                            .to_owned();
-
-                        // TODO: Could this hold the lock for too long? If so maybe we could box
-                        // the snaphots and temporarily .take() the one we neeed and decrement
-                        // num_valid_snapshots while restoring. Boxing would make moving cheap,
-                        // which might also speed up adding the new valid snapshot below.
-                        game.restore_from_snapshot(
-                            shared.snapshots[next_snapshot_num - 1].as_ref().unwrap(),
-                        );
-                    }
-
-                    // Simulate to the next snapshot
-                    for usercmd in usercmds {
-                        game.run_frame(usercmd);
-                    }
-                    let snapshot = game.take_snapshot(Some(&baseline));
-
-                    // Save it unless it's already been invalidated again
-                    {
-                        let mut shared = shared.lock().unwrap();
-                        if shared.num_processed_usercmds == num_processed_usercmds {
-                            shared.snapshots[next_snapshot_num] = Some(snapshot);
-                            shared.num_valid_snapshots = next_snapshot_num + 1;
-                        }
-                    }
-                }
-            })
-        };
+        let shared = Arc::new(SharedRun {
+            state: Mutex::new(Shared {
+                usercmds: Arc::new(vec![]),
+                usercmds_version: 0,
+                checkpoints: vec![Checkpoint {
+                    snapshot: Some(Arc::new(game.take_snapshot(Some(&baseline)))),
+                    up_to_date: true,
+                    ..Default::default()
+                }],
+                num_valid_snapshots: 1,
+                workers_enabled: true,
+                trajectories_version: 0,
+                playhead: 0,
+                pack_cold_snapshots: true,
+                checkpoint_memory_cap: usize::MAX,
+                repacking: false,
+            }),
+            num_valid_snapshots: AtomicUsize::new(1),
+            trajectories_version: AtomicU64::new(0),
+            lock_waits: Default::default(),
+            worker_trace_cache_hits: AtomicU64::new(0),
+            worker_trace_cache_misses: AtomicU64::new(0),
+            game: game.clone(),
+        });
+        pool::register(&shared);
 
         Self {
             game,
+            seeker: Seeker::new(&shared),
             shared,
-            baseline,
-            snapshot_worker: snapshot_thread,
-            snapshot_worker_enabled: true,
+            dense: DenseSnapshots::new(dense::DEFAULT_BUDGET),
             stale: false,
+            view: None,
+            view_trajectories_version: 0,
+            opened_checksums: vec![],
+            opened_usercmds_version: 0,
         }
     }
 
+    /// Starts publishing what there is to draw of the game after every seek, so it can be drawn
+    /// without waiting on simulation.
+    pub fn publish_views(&mut self) -> Reader<View> {
+        let (writer, reader) = triple_buffer();
+        self.view = Some(writer);
+        self.publish_view();
+        reader
+    }
+
+    fn publish_view(&mut self) {
+        let Some(view) = &mut self.view else {
+            return;
+        };
+        let (trajectories, version) = {
+            let shared = self.shared.lock(Waiter::Run);
+            (shared.trajectories(), shared.trajectories_version)
+        };
+        self.view_trajectories_version = version;
+
+        let next = view.get_mut();
+        next.capture(&self.game);
+        next.trajectories = trajectories;
+        view.publish();
+    }
+
     pub fn set_usercmds(&mut self, start_frame: usize, usercmds: &[usercmd_t]) {
         if start_frame < self.game.frame() {
             self.stale = true;
         }
+        self.dense.invalidate(start_frame);
+
+        {
+            let mut shared = self.shared.lock(Waiter::Run);
+
+            let new_len = shared.usercmds.len().max(start_frame + usercmds.len());
+            let buffer = Arc::make_mut(&mut shared.usercmds);
+            buffer.resize(new_len, usercmd_t::zeroed());
+            buffer[start_frame..][..usercmds.len()].copy_from_slice(usercmds);
 
-        let mut shared = self.shared.lock().unwrap();
+            let new_num_checkpoints = new_len / SNAPSHOT_INTERVAL + 1;
+            shared
+                .checkpoints
+                .resize_with(new_num_checkpoints, Default::default);
 
-        let new_len = shared.usercmds.len().max(start_frame + usercmds.len());
-        shared.usercmds.resize(new_len, usercmd_t::zeroed());
-        shared.usercmds[start_frame..][..usercmds.len()].copy_from_slice(usercmds);
+            // Every segment touched needs simulating again, not just the first
+            let end_frame = start_frame + usercmds.len();
+            for segment in start_frame / SNAPSHOT_INTERVAL..end_frame.div_ceil(SNAPSHOT_INTERVAL) {
+                shared.invalidate(segment * SNAPSHOT_INTERVAL);
+            }
+        }
+        pool::notify();
+    }
 
-        let new_num_snapshots = new_len / SNAPSHOT_INTERVAL + 1;
-        shared.snapshots.resize_with(new_num_snapshots, || None);
+    /// Replaces the usercmds with the ones in `file`, and uses its snapshots if they were made
+    /// with the same qvm and map so that there's nothing to simulate.
+    pub fn open(&mut self, file: &RunFile) -> Result<(), Box<dyn Error>> {
+        {
+            // Nothing past the end of the file is kept
+            let mut shared = self.shared.lock(Waiter::Run);
+            let len = file.usercmds.len();
+            if shared.usercmds.len() > len {
+                Arc::make_mut(&mut shared.usercmds).truncate(len);
+                shared.checkpoints.truncate(len / SNAPSHOT_INTERVAL + 1);
+                shared.invalidate(len);
+            }
+        }
+        self.set_usercmds(0, &file.usercmds);
+
+        let (first, usercmds_version) = {
+            let shared = self.shared.lock(Waiter::Run);
+            let first = Arc::clone(shared.checkpoints[0].snapshot.as_ref().unwrap());
+            (first, shared.usercmds_version)
+        };
+        let snapshots = file.snapshots(self.game.qvm_checksum, Map::get().checksum(), &first)?;
+
+        self.opened_checksums = file
+            .checksums(self.game.qvm_checksum, Map::get().checksum())
+            .to_vec();
+        self.opened_usercmds_version = usercmds_version;
+
+        let mut shared = self.shared.lock(Waiter::Run);
+        if shared.usercmds_version == usercmds_version {
+            let num_snapshots = snapshots.len().min(shared.checkpoints.len() - 1);
+            for (i, snapshot) in snapshots.into_iter().take(num_snapshots).enumerate() {
+                shared.store(i + 1, snapshot, None);
+            }
+        }
+        Ok(())
+    }
 
-        shared.invalidate(start_frame);
-        if self.snapshot_worker_enabled {
-            self.snapshot_worker.thread().unpark();
+    /// Saves the usercmds, along with the snapshots and checksums as far as they're valid. Snapshots
+    /// stop at the first one that was dropped. Checksums go on past what has been simulated with
+    /// the ones from the file that was opened, if the usercmds haven't changed since.
+    pub fn save(&self, path: &Path) -> Result<(), Box<dyn Error>> {
+        let (usercmds, usercmds_version, snapshots, trajectories) = {
+            let shared = self.shared.lock(Waiter::Run);
+            let snapshots: Vec<_> = shared.checkpoints[..shared.num_valid_snapshots]
+                .iter()
+                .map_while(|checkpoint| checkpoint.snapshot.clone())
+                .collect();
+            (
+                Arc::clone(&shared.usercmds),
+                shared.usercmds_version,
+                snapshots,
+                shared.trajectories(),
+            )
+        };
+        let frame_hashes = trajectories
+            .iter()
+            .flat_map(|trajectory| trajectory.frame_hashes.iter().copied());
+        let mut checksums = rolling_checksums(frame_hashes.take(usercmds.len()));
+        if usercmds_version == self.opened_usercmds_version {
+            extend_checksums(&mut checksums, &self.opened_checksums);
         }
+
+        RunFile::write(
+            path,
+            &usercmds,
+            self.game.qvm_checksum,
+            Map::get().checksum(),
+            &checksums,
+            &snapshots,
+        )?;
+        Ok(())
     }
 
     pub fn with_usercmd_mut<R>(&mut self, frame: usize, f: impl FnOnce(&mut usercmd_t) -> R) -> R {
         if frame < self.game.frame() {
             self.stale = true;
         }
+        self.dense.invalidate(frame);
 
-        let mut shared = self.shared.lock().unwrap();
+        let result = {
+            let mut shared = self.shared.lock(Waiter::Run);
 
-        let usercmd = &mut shared.usercmds[frame];
-        let result = f(usercmd);
+            let usercmd = &mut Arc::make_mut(&mut shared.usercmds)[frame];
+            let result = f(usercmd);
 
-        shared.invalidate(frame);
-        if self.snapshot_worker_enabled {
-            self.snapshot_worker.thread().unpark();
-        }
+            shared.invalidate(frame);
+            result
+        };
+        pool::notify();
 
         result
     }
 
     pub fn with_usercmd<R>(&mut self, frame: usize, f: impl FnOnce(&usercmd_t) -> R) -> R {
-        let shared = self.shared.lock().unwrap();
+        let shared = self.shared.lock(Waiter::Run);
         let usercmd = &shared.usercmds[frame];
         f(usercmd)
     }
 
+    /// Brings the game to `frame`. Anything more than a few frames of simulation away happens on
+    /// the seeker thread instead, and until it's done the game stays where it was.
     pub fn seek(&mut self, frame: usize) {
         if !self.stale && self.game.frame() == frame + 1 {
             // If we're just going to run the previous frame again but nothing has changed, we'll
-            // just end up exactly where we are now.
+            // just end up exactly where we are now. Workers might have added to what there is to
+            // draw though.
+            self.seeker.cancel();
+            if self.view.is_some()
+                && self.shared.trajectories_version.load(Ordering::Acquire)
+                    != self.view_trajectories_version
+            {
+                self.publish_view();
+            }
             return;
         }
 
-        let mut shared = self.shared.lock().unwrap();
+        // Only hold the lock long enough to grab everything needed, so workers are never kept
+        // waiting while simulating.
+        let (usercmds, usercmds_version, checkpoint, latest_checkpoint, workers_enabled) = {
+            let mut shared = self.shared.lock(Waiter::Run);
+            shared.playhead = frame;
+            let snapshot_before = |checkpoint_num| {
+                let (i, snapshot) = shared.snapshot_before(checkpoint_num).unwrap();
+                (i * SNAPSHOT_INTERVAL, Arc::clone(snapshot))
+            };
+            let checkpoint = shared
+                .has_valid_snapshot(frame)
+                .then(|| snapshot_before(frame / SNAPSHOT_INTERVAL));
+            let latest_checkpoint = snapshot_before(shared.num_valid_snapshots - 1);
+            (
+                Arc::clone(&shared.usercmds),
+                shared.usercmds_version,
+                checkpoint,
+                latest_checkpoint,
+                shared.workers_enabled,
+            )
+        };
 
-        if !self.can_step_to(frame) {
-            if !shared.has_valid_snapshot(frame) {
+        if let Some(finished) = self.seeker.take_finished()
+            && finished.usercmds_version == usercmds_version
+        {
+            for (dense_frame, snapshot) in finished.dense {
+                self.dense.insert(dense_frame, snapshot);
+            }
+
+            // The playhead has usually moved on a little while playing, in which case what's left
+            // is simulated from there
+            let closer =
+                self.stale || self.game.frame() > frame + 1 || self.game.frame() <= finished.frame;
+            if finished.frame <= frame && closer {
+                self.game.restore_from_snapshot(&finished.snapshot);
+                self.stale = false;
+                if finished.frame == frame {
+                    self.publish_view();
+                    return;
+                }
+            }
+        }
+
+        // Start from whichever state is closest before the target
+        let mut closest = checkpoint;
+        if let Some((dense_frame, snapshot)) = self.dense.latest(frame + 1)
+            && frame + 1 - dense_frame <= SNAPSHOT_INTERVAL
+            && closest
+                .as_ref()
+                .is_none_or(|&(closest_frame, _)| dense_frame > closest_frame)
+        {
+            closest = Some((dense_frame, snapshot));
+        }
+        // Stepping on from the current state can only happen here, since the seeker can only
+        // start from a snapshot, so it's not worth waiting on unless it's quick
+        let quick_step = self.can_step_to(frame)
+            && (!workers_enabled || frame + 1 - self.game.frame() <= MAX_FOREGROUND_SEEK_FRAMES);
+        let (start_frame, snapshot) = match closest {
+            Some((closest_frame, _)) if quick_step && self.game.frame() >= closest_frame => {
+                (self.game.frame(), None)
+            }
+            Some((closest_frame, snapshot)) => (closest_frame, Some(snapshot)),
+            None if self.can_step_to(frame) => (self.game.frame(), None),
+            None if !workers_enabled => {
                 self.stale = true;
                 return;
             }
-            let snapshot = shared.snapshots[frame / SNAPSHOT_INTERVAL]
-                .as_ref()
-                .unwrap();
-            self.game.restore_from_snapshot(snapshot);
+            None => (latest_checkpoint.0, Some(latest_checkpoint.1)),
+        };
+
+        // While recording every frame has to be simulated here, since it's what stores checkpoints
+        if workers_enabled
+            && let Some(snapshot) = &snapshot
+            && frame + 1 - start_frame > MAX_FOREGROUND_SEEK_FRAMES
+        {
+            self.seeker.request(Request {
+                frame,
+                usercmds,
+                usercmds_version,
+                start: (start_frame, Arc::clone(snapshot)),
+            });
+            return;
+        }
+        self.seeker.cancel();
+
+        #[cfg(feature = "profile")]
+        let start = Instant::now();
+
+        if let Some(snapshot) = snapshot {
+            self.game.restore_from_snapshot(&snapshot);
             self.stale = false;
         }
 
+        #[cfg(feature = "profile")]
+        let first_frame = self.game.frame();
+
+        // The checkpoint at the start of the segment being simulated, if it's valid
+        let mut segment_checkpoint: Option<(usize, Arc<Snapshot>)> = None;
+
+        // Only recorded when this is what stores checkpoints, and only from the start of a segment
+        let mut trajectory = (!workers_enabled && self.game.frame() % SNAPSHOT_INTERVAL == 0)
+            .then(|| Trajectory::with_capacity(SNAPSHOT_INTERVAL));
+
         while self.game.frame() <= frame {
-            self.game.run_frame(shared.usercmds[self.game.frame()]);
-
-            if !self.snapshot_worker_enabled && self.game.frame() % SNAPSHOT_INTERVAL == 0 {
-                let snapshot_num = self.game.frame() / SNAPSHOT_INTERVAL;
-                assert!(shared.num_valid_snapshots >= snapshot_num);
-                if shared.num_valid_snapshots == snapshot_num {
-                    shared.snapshots[snapshot_num] =
-                        Some(self.game.take_snapshot(Some(&self.baseline)));
-                    shared.num_valid_snapshots = snapshot_num + 1;
+            self.game.run_frame(usercmds[self.game.frame()]);
+            if let Some(trajectory) = &mut trajectory {
+                trajectory.record(&self.game);
+            }
+
+            let current = self.game.frame();
+            if current % DENSE_INTERVAL == 0
+                && current % SNAPSHOT_INTERVAL != 0
+                && !self.dense.contains(current)
+            {
+                let segment = current / SNAPSHOT_INTERVAL;
+                if segment_checkpoint
+                    .as_ref()
+                    .is_none_or(|&(s, _)| s != segment)
+                {
+                    let shared = self.shared.lock(Waiter::Run);
+                    segment_checkpoint = shared
+                        .has_valid_snapshot(current)
+                        .then(|| shared.checkpoints[segment].snapshot.clone())
+                        .flatten()
+                        .map(|snapshot| (segment, snapshot));
                 }
+
+                // Taking it relative to the checkpoint keeps it small, and means it doesn't keep
+                // any other dense snapshots alive after they're evicted
+                if let Some((_, checkpoint)) = &segment_checkpoint {
+                    let snapshot = Arc::new(self.game.take_snapshot(Some(checkpoint)));
+                    self.dense.insert(current, snapshot);
+                }
+            }
+
+            if !workers_enabled && self.game.frame() % SNAPSHOT_INTERVAL == 0 {
+                let segment_trajectory =
+                    trajectory.replace(Trajectory::with_capacity(SNAPSHOT_INTERVAL));
+                self.shared.store_reached_checkpoint(
+                    Waiter::Run,
+                    &mut self.game,
+                    usercmds_version,
+                    segment_trajectory,
+                );
             }
         }
+
+        #[cfg(feature = "profile")]
+        if profile::enabled() {
+            profile::get().record_seek(self.game.frame() - first_frame, start.elapsed());
+        }
+
+        self.publish_view();
     }
 
     fn can_step_to(&self, frame: usize) -> bool {
@@ -230,23 +739,190 @@ impl Run {
         !self.stale && forward_seekable_range.contains(&frame)
     }
 
+    /// Is the seeker still working on getting to the frame last seeked to?
+    pub fn is_seeking(&self) -> bool {
+        self.seeker.is_busy()
+    }
+
     pub fn can_seek_to(&self, frame: usize) -> bool {
-        let shared = self.shared.lock().unwrap();
-        self.can_step_to(frame) || shared.has_valid_snapshot(frame)
+        self.can_step_to(frame)
+            || self.shared.has_valid_snapshot(frame)
+            || self
+                .dense
+                .latest_frame(frame + 1)
+                .is_some_and(|dense_frame| frame + 1 - dense_frame <= SNAPSHOT_INTERVAL)
+    }
+
+    /// Frames with extra snapshots that make seeking near them faster.
+    pub fn dense_snapshot_frames(&self) -> impl Iterator<Item = usize> + '_ {
+        self.dense.frames()
+    }
+
+    /// Limits how much memory the extra snapshots taken while seeking can use.
+    pub fn set_dense_snapshot_budget(&mut self, bytes: usize) {
+        self.dense.set_budget(bytes);
+    }
+
+    /// How much memory snapshots are taking up.
+    pub fn snapshot_memory_stats(&self) -> SnapshotMemoryStats {
+        let mut stats = self.shared.lock(Waiter::Run).snapshot_memory_stats();
+        stats.dense = self.dense.len();
+        stats.dense_bytes = self.dense.size();
+        stats
+    }
+
+    /// The size of each checkpoint's snapshot, if it has one.
+    pub fn checkpoint_snapshot_sizes(&self) -> Vec<Option<usize>> {
+        let shared = self.shared.lock(Waiter::Run);
+        shared
+            .checkpoints
+            .iter()
+            .map(|checkpoint| checkpoint.snapshot.as_ref().map(|snapshot| snapshot.size()))
+            .collect()
+    }
+
+    /// Whether workers should pack the snapshots far from the playhead when they have nothing
+    /// else to do.
+    pub fn set_pack_cold_snapshots(&mut self, pack: bool) {
+        self.shared.lock(Waiter::Run).pack_cold_snapshots = pack;
+        pool::notify();
+    }
+
+    /// Limits how much memory the snapshots at checkpoints can use, past which workers drop the
+    /// ones far from the playhead. It's only a target: every group of checkpoints keeps at least
+    /// its first snapshot.
+    pub fn set_checkpoint_memory_cap(&mut self, bytes: usize) {
+        self.shared.lock(Waiter::Run).checkpoint_memory_cap = bytes;
+        pool::notify();
+    }
+
+    /// The trajectory of each segment from the start of the run, as far as it's been simulated with
+    /// the current usercmds. The frames of segment `i` start at `i * SNAPSHOT_INTERVAL`.
+    pub fn trajectories(&self) -> Vec<Arc<Trajectory>> {
+        self.shared.lock(Waiter::Run).trajectories()
     }
 
     pub fn num_frames_with_valid_snapshot(&self) -> usize {
-        self.shared.lock().unwrap().num_valid_snapshots * SNAPSHOT_INTERVAL
+        self.shared.num_valid_snapshots.load(Ordering::Acquire) * SNAPSHOT_INTERVAL
     }
 
     pub fn enable_snapshot_worker(&mut self) {
-        if !self.snapshot_worker_enabled {
-            self.snapshot_worker_enabled = true;
-            self.snapshot_worker.thread().unpark();
-        }
+        self.shared.lock(Waiter::Run).workers_enabled = true;
+        pool::notify();
     }
 
     pub fn disable_snapshot_worker(&mut self) {
-        self.snapshot_worker_enabled = false;
+        self.shared.lock(Waiter::Run).workers_enabled = false;
+    }
+
+    /// How long this run and the snapshot workers have each spent waiting on the other.
+    pub fn lock_wait_stats(&self) -> (LockWaitStats, LockWaitStats) {
+        (
+            self.shared.lock_waits[Waiter::Run as usize].get(),
+            self.shared.lock_waits[Waiter::Worker as usize].get(),
+        )
+    }
+
+    /// How the trace caches of this run's game and of the snapshot workers have done, combined.
+    pub fn trace_cache_stats(&self) -> TraceCacheStats {
+        let own = self.game.trace_cache_stats;
+        TraceCacheStats {
+            hits: own.hits + self.shared.worker_trace_cache_hits.load(Ordering::Relaxed),
+            misses: own.misses
+                + self
+                    .shared
+                    .worker_trace_cache_misses
+                    .load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// Carries on `checksums` with the ones a run was opened with, as long as they agree on the last
+/// frame both have, since each one follows on from the checksum before it.
+fn extend_checksums(checksums: &mut Vec<u64>, opened: &[u64]) {
+    let agree = match checksums.len().checked_sub(1) {
+        Some(last) => opened.get(last) == checksums.last(),
+        None => true,
+    };
+    if agree && opened.len() > checksums.len() {
+        checksums.extend_from_slice(&opened[checksums.len()..]);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use bytemuck::cast_slice;
+
+    use super::*;
+    use crate::game::test_game;
+
+    /// Opening a run and saving it without simulating anything, or only some of it, keeps every
+    /// checksum it had.
+    #[test]
+    fn checksums_survive_open_and_save() {
+        let usercmds: Vec<_> = (0..300)
+            .map(|i| usercmd_t {
+                serverTime: i * 8,
+                forwardmove: (i % 3) as i8,
+                ..usercmd_t::zeroed()
+            })
+            .collect();
+        let checksums = rolling_checksums((0..usercmds.len() as u64).map(|i| i * 0x9e37_79b9));
+        let path = std::env::temp_dir().join(format!("tasjr-checksums-{}.run", std::process::id()));
+        let save = |checksums: &[u64]| {
+            RunFile::write(&path, &usercmds, 1, 2, checksums, &[]).unwrap();
+            RunFile::read(&path).unwrap().checksums(1, 2).to_vec()
+        };
+
+        let opened = save(&checksums);
+        assert_eq!(opened, checksums);
+        for num_simulated in [0, 1, 125, 300] {
+            let mut resaved = checksums[..num_simulated].to_vec();
+            extend_checksums(&mut resaved, &opened);
+            assert_eq!(save(&resaved), checksums);
+        }
+
+        // Simulating differently makes the rest meaningless
+        let mut diverged = checksums[..125].to_vec();
+        diverged[124] ^= 1;
+        extend_checksums(&mut diverged, &opened);
+        assert_eq!(diverged.len(), 125);
+
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    /// Opening a run replaces all of the usercmds, even when there were more of them before.
+    #[test]
+    fn open_replaces_usercmds() {
+        let usercmds = |len: i32, forwardmove: i8| -> Vec<_> {
+            (0..len)
+                .map(|i| usercmd_t {
+                    serverTime: i * 8,
+                    forwardmove,
+                    ..usercmd_t::zeroed()
+                })
+                .collect()
+        };
+        let path = std::env::temp_dir().join(format!("tasjr-open-{}.run", std::process::id()));
+        let open = |run: &mut Run, usercmds: &[usercmd_t]| {
+            RunFile::write(&path, usercmds, 0, 0, &[], &[]).unwrap();
+            run.open(&RunFile::read(&path).unwrap()).unwrap();
+        };
+
+        let mut run = Run::new(&test_game::fs(), ExecMode::Interpreted);
+        open(&mut run, &usercmds(3 * SNAPSHOT_INTERVAL as i32 + 10, 127));
+        run.seek(2 * SNAPSHOT_INTERVAL + 5);
+        let short = usercmds(SNAPSHOT_INTERVAL as i32 + 3, -127);
+        open(&mut run, &short);
+        run.seek(short.len() - 1);
+        run.save(&path).unwrap();
+        let saved = RunFile::read(&path).unwrap().usercmds;
+        assert_eq!(cast_slice::<_, u8>(&saved), cast_slice::<_, u8>(&short));
+        assert_eq!(
+            run.shared.lock(Waiter::Run).checkpoints.len(),
+            short.len() / SNAPSHOT_INTERVAL + 1
+        );
+
+        std::fs::remove_file(&path).unwrap();
     }
 }
@@ -0,0 +1,108 @@
+//! Extra snapshots between checkpoints, taken while seeking, so scrubbing back and forth over the
+//! same few seconds only ever simulates a few frames. Only the thread that seeks uses them, and the
+//! least recently used ones are dropped to stay under a memory budget, which leaves them densest
+//! wherever seeking has happened lately.
+
+use std::{collections::BTreeMap, sync::Arc};
+
+use super::Snapshot;
+
+/// Frames between dense snapshots. It divides `SNAPSHOT_INTERVAL` so they're evenly spaced
+/// between checkpoints, and checkpoint frames are skipped since they already have snapshots.
+pub(super) const DENSE_INTERVAL: usize = 25;
+
+pub(super) const DEFAULT_BUDGET: usize = 256 << 20;
+
+struct Entry {
+    snapshot: Arc<Snapshot>,
+    size: usize,
+    last_used: u64,
+}
+
+pub(super) struct DenseSnapshots {
+    /// By the frame the game is on when restored from the snapshot.
+    entries: BTreeMap<usize, Entry>,
+    size: usize,
+    budget: usize,
+
+    /// Incremented every time a snapshot is used, for finding the least recently used one.
+    clock: u64,
+}
+
+impl DenseSnapshots {
+    pub fn new(budget: usize) -> Self {
+        Self {
+            entries: BTreeMap::new(),
+            size: 0,
+            budget,
+            clock: 0,
+        }
+    }
+
+    pub fn set_budget(&mut self, budget: usize) {
+        self.budget = budget;
+        self.evict();
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Bytes held by the snapshots, as counted against the budget.
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    pub fn contains(&self, frame: usize) -> bool {
+        self.entries.contains_key(&frame)
+    }
+
+    /// The frame of the latest snapshot at or before `frame`.
+    pub fn latest_frame(&self, frame: usize) -> Option<usize> {
+        self.entries.range(..=frame).next_back().map(|(&f, _)| f)
+    }
+
+    /// The latest snapshot at or before `frame`, which counts as using it.
+    pub fn latest(&mut self, frame: usize) -> Option<(usize, Arc<Snapshot>)> {
+        let (&frame, entry) = self.entries.range_mut(..=frame).next_back()?;
+        self.clock += 1;
+        entry.last_used = self.clock;
+        Some((frame, Arc::clone(&entry.snapshot)))
+    }
+
+    pub fn insert(&mut self, frame: usize, snapshot: Arc<Snapshot>) {
+        self.clock += 1;
+        let entry = Entry {
+            size: snapshot.size(),
+            snapshot,
+            last_used: self.clock,
+        };
+        self.size += entry.size;
+        if let Some(old) = self.entries.insert(frame, entry) {
+            self.size -= old.size;
+        }
+        self.evict();
+    }
+
+    /// Drops every snapshot that depends on the usercmd at `frame`.
+    pub fn invalidate(&mut self, frame: usize) {
+        for (_, entry) in self.entries.split_off(&(frame + 1)) {
+            self.size -= entry.size;
+        }
+    }
+
+    pub fn frames(&self) -> impl Iterator<Item = usize> + '_ {
+        self.entries.keys().copied()
+    }
+
+    fn evict(&mut self) {
+        while self.size > self.budget {
+            let (&frame, _) = self
+                .entries
+                .iter()
+                .min_by_key(|(_, entry)| entry.last_used)
+                .unwrap();
+            self.size -= self.entries.remove(&frame).unwrap().size;
+        }
+    }
+}
@@ -0,0 +1,450 @@
+//! The file format for runs. Usercmds are stored as the fields that changed since the previous
+//! one, since most of them stay the same from frame to frame, and can be followed by the snapshot
+//! at each checkpoint so a run can be seeked through as soon as it's opened.
+//!
+//! Everything is little endian:
+//!
+//! - The magic `TASJRRUN` and the format version.
+//! - Checksums of the qvm and the BSP the snapshots were simulated with. Snapshots made with
+//!   anything else are ignored.
+//! - The number of frames and then the usercmds, each a mask of fields followed by those fields.
+//! - The number of checksums and then the rolling checksum after each frame from the first, from
+//!   `game::rolling_checksums`, for as many frames as had been simulated when it was saved. Version
+//!   1 files don't have these.
+//! - The number of snapshots and then the snapshot at every checkpoint after the first, each
+//!   written relative to the one before it by `GameSnapshot::write`. The first is left out since
+//!   it's the same every time the game starts.
+//!
+//! Files without the magic are read as a raw array of `usercmd_t`, which is what runs used to be.
+
+use std::{
+    error::Error,
+    fs::File,
+    io::{self, BufWriter, Cursor, Read, Write},
+    path::Path,
+    sync::Arc,
+};
+
+use bytemuck::{Zeroable, pod_collect_to_vec};
+use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
+
+use super::Snapshot;
+use crate::q3::usercmd_t;
+
+const MAGIC: &[u8; 8] = b"TASJRRUN";
+const VERSION: u32 = 2;
+
+// Bits in the mask before each usercmd for which fields follow it. The server time is stored as
+// the difference from the previous usercmd's, and only when that's changed.
+const SERVER_TIME: u8 = 1 << 0;
+const ANGLES: [u8; 3] = [1 << 1, 1 << 2, 1 << 3];
+const BUTTONS: u8 = 1 << 4;
+const WEAPON: u8 = 1 << 5;
+const MOVES: u8 = 1 << 6;
+
+/// On its own, this means the previous usercmd repeats the number of times that follows.
+const REPEAT: u8 = 1 << 7;
+
+pub struct RunFile {
+    pub usercmds: Vec<usercmd_t>,
+    qvm_checksum: u64,
+    map_checksum: u64,
+    checksums: Vec<u64>,
+    num_snapshots: usize,
+
+    /// Snapshots can only be decoded once there's a first checkpoint to decode them relative to.
+    snapshots: Vec<u8>,
+}
+
+impl RunFile {
+    pub fn read(path: &Path) -> Result<Self, Box<dyn Error>> {
+        let buf = std::fs::read(path)?;
+        if !buf.starts_with(MAGIC) {
+            return Ok(Self {
+                usercmds: pod_collect_to_vec(&buf),
+                qvm_checksum: 0,
+                map_checksum: 0,
+                checksums: vec![],
+                num_snapshots: 0,
+                snapshots: vec![],
+            });
+        }
+
+        let mut r = Cursor::new(&buf[MAGIC.len()..]);
+        let version = r.read_u32::<LittleEndian>()?;
+        if !(1..=VERSION).contains(&version) {
+            return Err(format!("unsupported run file version {version}").into());
+        }
+        let qvm_checksum = r.read_u64::<LittleEndian>()?;
+        let map_checksum = r.read_u64::<LittleEndian>()?;
+        let num_frames = r.read_u32::<LittleEndian>()? as usize;
+        let usercmds = read_usercmds(&mut r, num_frames)?;
+        let checksums = if version >= 2 {
+            let num_checksums = r.read_u32::<LittleEndian>()? as usize;
+            if num_checksums > num_frames {
+                return Err("more checksums than frames".into());
+            }
+            (0..num_checksums)
+                .map(|_| r.read_u64::<LittleEndian>())
+                .collect::<io::Result<_>>()?
+        } else {
+            vec![]
+        };
+        let num_snapshots = r.read_u32::<LittleEndian>()? as usize;
+
+        let offset = r.position() as usize;
+        Ok(Self {
+            usercmds,
+            qvm_checksum,
+            map_checksum,
+            checksums,
+            num_snapshots,
+            snapshots: r.into_inner()[offset..].to_vec(),
+        })
+    }
+
+    /// Writes `usercmds` and the rolling `checksums` of however many of them were simulated, along
+    /// with `snapshots` at every checkpoint starting with the first.
+    pub fn write(
+        path: &Path,
+        usercmds: &[usercmd_t],
+        qvm_checksum: u64,
+        map_checksum: u64,
+        checksums: &[u64],
+        snapshots: &[Arc<Snapshot>],
+    ) -> io::Result<()> {
+        let mut w = BufWriter::new(File::create(path)?);
+        w.write_all(MAGIC)?;
+        w.write_u32::<LittleEndian>(VERSION)?;
+        w.write_u64::<LittleEndian>(qvm_checksum)?;
+        w.write_u64::<LittleEndian>(map_checksum)?;
+        w.write_u32::<LittleEndian>(usercmds.len() as u32)?;
+        write_usercmds(&mut w, usercmds)?;
+
+        w.write_u32::<LittleEndian>(checksums.len() as u32)?;
+        for &checksum in checksums {
+            w.write_u64::<LittleEndian>(checksum)?;
+        }
+
+        w.write_u32::<LittleEndian>(snapshots.len().saturating_sub(1) as u32)?;
+        for pair in snapshots.windows(2) {
+            pair[1].write(&pair[0], &mut w)?;
+        }
+        w.flush()
+    }
+
+    /// The rolling checksum after each frame when the run was saved, if it was simulated with the
+    /// same qvm and map.
+    pub fn checksums(&self, qvm_checksum: u64, map_checksum: u64) -> &[u64] {
+        if (qvm_checksum, map_checksum) != (self.qvm_checksum, self.map_checksum) {
+            return &[];
+        }
+        &self.checksums
+    }
+
+    /// Decodes the snapshots after `first`, the snapshot at the first checkpoint. There are none
+    /// unless they were made with the same qvm and map.
+    pub fn snapshots(
+        &self,
+        qvm_checksum: u64,
+        map_checksum: u64,
+        first: &Arc<Snapshot>,
+    ) -> io::Result<Vec<Arc<Snapshot>>> {
+        if (qvm_checksum, map_checksum) != (self.qvm_checksum, self.map_checksum) {
+            return Ok(vec![]);
+        }
+
+        let mut r = Cursor::new(&self.snapshots);
+        let mut snapshots: Vec<Arc<Snapshot>> = vec![];
+        for _ in 0..self.num_snapshots {
+            let previous = snapshots.last().unwrap_or(first);
+            snapshots.push(Arc::new(Snapshot::read(previous, &mut r)?));
+        }
+        Ok(snapshots)
+    }
+}
+
+fn write_usercmds(w: &mut impl Write, usercmds: &[usercmd_t]) -> io::Result<()> {
+    let mut previous = usercmd_t::zeroed();
+    let mut step = 0;
+    let mut repeats = 0;
+    for usercmd in usercmds {
+        let new_step = usercmd.serverTime.wrapping_sub(previous.serverTime);
+
+        let mut mask = 0;
+        if new_step != step {
+            mask |= SERVER_TIME;
+        }
+        for i in 0..3 {
+            if usercmd.angles[i] != previous.angles[i] {
+                mask |= ANGLES[i];
+            }
+        }
+        if usercmd.buttons != previous.buttons {
+            mask |= BUTTONS;
+        }
+        if usercmd.weapon != previous.weapon {
+            mask |= WEAPON;
+        }
+        let moves = |u: &usercmd_t| [u.forwardmove, u.rightmove, u.upmove];
+        if moves(usercmd) != moves(&previous) {
+            mask |= MOVES;
+        }
+
+        previous = *usercmd;
+        step = new_step;
+        if mask == 0 {
+            repeats += 1;
+            continue;
+        }
+
+        if repeats > 0 {
+            w.write_u8(REPEAT)?;
+            write_varint(w, repeats)?;
+            repeats = 0;
+        }
+        w.write_u8(mask)?;
+        if mask & SERVER_TIME != 0 {
+            w.write_i32::<LittleEndian>(step)?;
+        }
+        for i in 0..3 {
+            if mask & ANGLES[i] != 0 {
+                w.write_i32::<LittleEndian>(usercmd.angles[i])?;
+            }
+        }
+        if mask & BUTTONS != 0 {
+            w.write_i32::<LittleEndian>(usercmd.buttons)?;
+        }
+        if mask & WEAPON != 0 {
+            w.write_u8(usercmd.weapon)?;
+        }
+        if mask & MOVES != 0 {
+            for x in moves(usercmd) {
+                w.write_i8(x)?;
+            }
+        }
+    }
+
+    if repeats > 0 {
+        w.write_u8(REPEAT)?;
+        write_varint(w, repeats)?;
+    }
+    Ok(())
+}
+
+fn read_usercmds(r: &mut impl Read, num_frames: usize) -> io::Result<Vec<usercmd_t>> {
+    // Grown as they're read rather than trusting the count
+    let mut usercmds = vec![];
+    let mut usercmd = usercmd_t::zeroed();
+    let mut step = 0;
+    while usercmds.len() < num_frames {
+        let mask = r.read_u8()?;
+        if mask == REPEAT {
+            let repeats = read_varint(r)?;
+            if repeats > (num_frames - usercmds.len()) as u64 {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "too many usercmds",
+                ));
+            }
+            for _ in 0..repeats {
+                usercmd.serverTime = usercmd.serverTime.wrapping_add(step);
+                usercmds.push(usercmd);
+            }
+            continue;
+        }
+
+        if mask & SERVER_TIME != 0 {
+            step = r.read_i32::<LittleEndian>()?;
+        }
+        usercmd.serverTime = usercmd.serverTime.wrapping_add(step);
+        for i in 0..3 {
+            if mask & ANGLES[i] != 0 {
+                usercmd.angles[i] = r.read_i32::<LittleEndian>()?;
+            }
+        }
+        if mask & BUTTONS != 0 {
+            usercmd.buttons = r.read_i32::<LittleEndian>()?;
+        }
+        if mask & WEAPON != 0 {
+            usercmd.weapon = r.read_u8()?;
+        }
+        if mask & MOVES != 0 {
+            usercmd.forwardmove = r.read_i8()?;
+            usercmd.rightmove = r.read_i8()?;
+            usercmd.upmove = r.read_i8()?;
+        }
+        usercmds.push(usercmd);
+    }
+    Ok(usercmds)
+}
+
+/// LEB128, so short runs of repeats only take a byte.
+fn write_varint(w: &mut impl Write, mut x: u64) -> io::Result<()> {
+    while x >= 0x80 {
+        w.write_u8(x as u8 | 0x80)?;
+        x >>= 7;
+    }
+    w.write_u8(x as u8)
+}
+
+fn read_varint(r: &mut impl Read) -> io::Result<u64> {
+    let mut x = 0;
+    for shift in (0..64).step_by(7) {
+        let byte = r.read_u8()?;
+        x |= ((byte & 0x7f) as u64) << shift;
+        if byte & 0x80 == 0 {
+            return Ok(x);
+        }
+    }
+    Err(io::Error::new(
+        io::ErrorKind::InvalidData,
+        "varint too long",
+    ))
+}
+
+#[cfg(test)]
+mod tests {
+    use bytemuck::cast_slice;
+
+    use super::*;
+
+    /// Encodes and decodes `usercmds`, checking they come back the same and that nothing's left
+    /// over, and returns the size of the encoding.
+    fn round_trip(usercmds: &[usercmd_t]) -> usize {
+        let mut buf = vec![];
+        write_usercmds(&mut buf, usercmds).unwrap();
+        let mut r = Cursor::new(&buf[..]);
+        let read = read_usercmds(&mut r, usercmds.len()).unwrap();
+        assert_eq!(
+            cast_slice::<_, u8>(&read),
+            cast_slice::<_, u8>(usercmds),
+            "{usercmds:?}"
+        );
+        assert_eq!(r.position() as usize, buf.len());
+        buf.len()
+    }
+
+    fn at_times(times: &[i32]) -> Vec<usercmd_t> {
+        times
+            .iter()
+            .map(|&server_time| usercmd_t {
+                serverTime: server_time,
+                ..usercmd_t::zeroed()
+            })
+            .collect()
+    }
+
+    #[test]
+    fn usercmds_round_trip() {
+        assert_eq!(round_trip(&[]), 0);
+
+        // A zeroed usercmd is a repeat of the zeroed one before the first
+        assert_eq!(round_trip(&[usercmd_t::zeroed()]), 2);
+        let mut usercmds = vec![usercmd_t::zeroed(); 3];
+        usercmds[2].buttons = 1;
+        round_trip(&usercmds);
+
+        // Steps that change, go back to a step seen before, stall and go backwards
+        round_trip(&at_times(&[
+            8,
+            16,
+            24,
+            25,
+            33,
+            33,
+            33,
+            41,
+            49,
+            40,
+            0,
+            i32::MIN,
+        ]));
+
+        // Long enough runs of repeats take more than a byte to count, and the last one is written
+        // when the usercmds end on it
+        for len in [127, 128, 129, 300, 20000] {
+            let times: Vec<_> = (1..=len).map(|i| i * 8).collect();
+            assert!(round_trip(&at_times(&times)) <= 9);
+        }
+        let mut usercmds = at_times(&(1..=500).map(|i| i * 8).collect::<Vec<_>>());
+        usercmds[250].forwardmove = 127;
+        round_trip(&usercmds);
+
+        // Every field on its own, changed and then changed back
+        let fields: [fn(&mut usercmd_t); 9] = [
+            |u| u.serverTime = 8,
+            |u| u.angles[0] = -1,
+            |u| u.angles[1] = 0x7fff,
+            |u| u.angles[2] = i32::MIN,
+            |u| u.buttons = 0x800,
+            |u| u.weapon = 5,
+            |u| u.forwardmove = -127,
+            |u| u.rightmove = 127,
+            |u| u.upmove = -128,
+        ];
+        for change in fields {
+            let mut changed = usercmd_t::zeroed();
+            change(&mut changed);
+            round_trip(&[usercmd_t::zeroed(), changed, usercmd_t::zeroed()]);
+            round_trip(&[changed, changed, usercmd_t::zeroed(), changed]);
+        }
+
+        // And anything else, from few enough values that some of them repeat. xorshift, so
+        // failures can be reproduced
+        let mut state = 0x2545_f491_4f6c_dd1du64;
+        let mut random = move |n: u64| {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            (state % n) as i32
+        };
+        let mut usercmd = usercmd_t::zeroed();
+        let usercmds: Vec<_> = (0..5000)
+            .map(|_| {
+                let fields = random(1 << 9);
+                let field = |i: usize| fields & (1 << i) != 0;
+                usercmd.serverTime += if field(0) { random(3) * 8 } else { 8 };
+                for i in 0..3 {
+                    if field(1 + i) {
+                        usercmd.angles[i] = random(4) - 2;
+                    }
+                }
+                if field(4) {
+                    usercmd.buttons = random(3);
+                }
+                if field(5) {
+                    usercmd.weapon = random(3) as u8;
+                }
+                if field(6) {
+                    usercmd.forwardmove = (random(3) as i8 - 1) * 127;
+                }
+                if field(7) {
+                    usercmd.rightmove = (random(3) as i8 - 1) * 127;
+                }
+                if field(8) {
+                    usercmd.upmove = (random(3) as i8 - 1) * 127;
+                }
+                usercmd
+            })
+            .collect();
+        round_trip(&usercmds);
+    }
+
+    /// Counts in a file that claim far more than it holds are errors rather than huge allocations.
+    #[test]
+    fn huge_counts_fail() {
+        let mut r = Cursor::new(&[0u8][..]);
+        assert!(read_usercmds(&mut r, u32::MAX as usize).is_err());
+
+        // A header and then four billion frames
+        let mut buf = MAGIC.to_vec();
+        buf.extend(VERSION.to_le_bytes());
+        buf.extend([0; 16]);
+        buf.extend(u32::MAX.to_le_bytes());
+        let path = std::env::temp_dir().join(format!("tasjr-huge-{}.run", std::process::id()));
+        std::fs::write(&path, &buf).unwrap();
+        assert!(RunFile::read(&path).is_err());
+        std::fs::remove_file(&path).unwrap();
+    }
+}
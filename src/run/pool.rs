@@ -0,0 +1,257 @@
+//! Threads that regenerate snapshots in the background for every `Run`.
+//!
+//! Each segment between checkpoints is a job that can be picked up as soon as the snapshot it
+//! starts from exists, even if that snapshot is outdated. Such a job is speculative: if simulating
+//! the segment before it ends up in the same state as before then its result is good, otherwise
+//! it's thrown away. This lets separate edits in the same run, or in different runs, be worked on
+//! in parallel, while an edit whose effects die out only costs the segments until they do.
+//!
+//! When there's nothing to simulate, workers rebuild snapshots far from the playhead to save
+//! memory instead. See `repack`.
+
+use std::{
+    mem,
+    sync::{Arc, Condvar, LazyLock, Mutex, Weak, atomic::Ordering},
+    thread,
+};
+
+#[cfg(feature = "profile")]
+use std::time::Instant;
+
+use super::{SNAPSHOT_INTERVAL, Shared, SharedRun, Snapshot, Trajectory, Waiter, repack::Repack};
+#[cfg(feature = "profile")]
+use crate::profile;
+use crate::{Snapshot as _, game::Game, q3::usercmd_t};
+
+struct Pool {
+    registry: Mutex<Registry>,
+    wakeup: Condvar,
+}
+
+struct Registry {
+    runs: Vec<Weak<SharedRun>>,
+
+    /// Incremented whenever there might be new jobs, so workers know not to go to sleep.
+    generation: u64,
+}
+
+/// Simulating one segment to produce the snapshot at the next checkpoint.
+struct Job {
+    run: Arc<SharedRun>,
+    checkpoint_num: usize,
+    usercmds: Vec<usercmd_t>,
+
+    /// The snapshot to start from, which is the one at the previous checkpoint unless that was
+    /// dropped, in which case the segments in between are simulated too.
+    start_num: usize,
+    start: Arc<Snapshot>,
+
+    /// Of each checkpoint after `start_num` up to `checkpoint_num`.
+    versions: Vec<u64>,
+}
+
+enum Work {
+    Simulate(Job),
+    Repack(Repack),
+}
+
+static POOL: LazyLock<Pool> = LazyLock::new(|| {
+    // Leave a core for the UI
+    let num_workers = thread::available_parallelism()
+        .map_or(1, |n| n.get() - 1)
+        .max(1);
+    for _ in 0..num_workers {
+        thread::spawn(|| POOL.work());
+    }
+
+    Pool {
+        registry: Mutex::new(Registry {
+            runs: vec![],
+            generation: 0,
+        }),
+        wakeup: Condvar::new(),
+    }
+});
+
+/// Starts generating snapshots for a run. It's dropped from the pool once the run is.
+pub(super) fn register(run: &Arc<SharedRun>) {
+    POOL.registry.lock().unwrap().runs.push(Arc::downgrade(run));
+    notify();
+}
+
+/// Wakes up workers after something changed that might have created jobs.
+pub(super) fn notify() {
+    POOL.registry.lock().unwrap().generation += 1;
+    POOL.wakeup.notify_all();
+}
+
+impl Pool {
+    fn work(&self) {
+        // Each run needs its own copy of the game
+        let mut games: Vec<(Weak<SharedRun>, Game)> = vec![];
+
+        loop {
+            let job = match self.wait_for_job() {
+                Work::Simulate(job) => job,
+                Work::Repack(repack) => {
+                    let snapshots = repack.run();
+                    repack
+                        .run
+                        .lock(Waiter::Worker)
+                        .finish_repack(&repack, snapshots);
+                    notify();
+                    continue;
+                }
+            };
+
+            games.retain(|(run, _)| run.strong_count() > 0);
+            let game = match games
+                .iter()
+                .position(|(run, _)| run.as_ptr() == Arc::as_ptr(&job.run))
+            {
+                Some(i) => &mut games[i].1,
+                None => {
+                    let mut game = job.run.game.clone();
+                    game.trace_cache_stats = Default::default();
+                    games.push((Arc::downgrade(&job.run), game));
+                    &mut games.last_mut().unwrap().1
+                }
+            };
+
+            #[cfg(feature = "profile")]
+            let start = Instant::now();
+            game.restore_from_snapshot(&job.start);
+            // Only the last segment is the job's
+            let mut trajectory = Trajectory::with_capacity(SNAPSHOT_INTERVAL);
+            let segment_start = job.usercmds.len() - SNAPSHOT_INTERVAL;
+            for (i, &usercmd) in job.usercmds.iter().enumerate() {
+                game.run_frame(usercmd);
+                if i >= segment_start {
+                    trajectory.record(game);
+                }
+            }
+            #[cfg(feature = "profile")]
+            let snapshot_start = Instant::now();
+            let snapshot = Arc::new(game.take_snapshot(Some(&job.start)));
+            #[cfg(feature = "profile")]
+            if profile::enabled() {
+                let mut profile = profile::get();
+                profile.record_worker(job.usercmds.len(), snapshot_start - start);
+                profile.record_snapshot(snapshot_start.elapsed());
+            }
+
+            let stats = mem::take(&mut game.trace_cache_stats);
+            job.run
+                .worker_trace_cache_hits
+                .fetch_add(stats.hits, Ordering::Relaxed);
+            job.run
+                .worker_trace_cache_misses
+                .fetch_add(stats.misses, Ordering::Relaxed);
+
+            job.run
+                .lock(Waiter::Worker)
+                .finish(&job, snapshot, Arc::new(trajectory));
+            notify();
+        }
+    }
+
+    fn wait_for_job(&self) -> Work {
+        loop {
+            // Never hold the registry lock while locking a run, since runs notify while locked
+            let (runs, generation) = {
+                let mut registry = self.registry.lock().unwrap();
+                registry.runs.retain(|run| run.strong_count() > 0);
+                let runs: Vec<_> = registry.runs.iter().filter_map(Weak::upgrade).collect();
+                (runs, registry.generation)
+            };
+
+            for run in runs {
+                if let Some(job) = run.lock(Waiter::Worker).claim(&run) {
+                    return job;
+                }
+            }
+
+            let mut registry = self.registry.lock().unwrap();
+            while registry.generation == generation {
+                registry = self.wakeup.wait(registry).unwrap();
+            }
+        }
+    }
+}
+
+impl Shared {
+    /// Claims the earliest segment that needs simulating and has a snapshot to start from, since
+    /// every segment after it depends on it. If that's already being worked on, the segment under
+    /// the playhead comes next, and then the rest in order. Once there aren't any, valid segments
+    /// without a trajectory are simulated again just for that, and then there's repacking.
+    fn claim(&mut self, run: &Arc<SharedRun>) -> Option<Work> {
+        if !self.workers_enabled {
+            return None;
+        }
+
+        let claimable = |i: usize| {
+            let checkpoint = &self.checkpoints[i];
+            !checkpoint.up_to_date
+                && !checkpoint.in_progress
+                && self.snapshot_before(i - 1).is_some()
+        };
+        let first = self.num_valid_snapshots.max(1);
+        let playhead = self.playhead / SNAPSHOT_INTERVAL + 1;
+        let checkpoint_num = (first < self.checkpoints.len() && claimable(first))
+            .then_some(first)
+            .or_else(|| {
+                (first < playhead && playhead < self.checkpoints.len() && claimable(playhead))
+                    .then_some(playhead)
+            })
+            .or_else(|| (first..self.checkpoints.len()).find(|&i| claimable(i)))
+            .or_else(|| {
+                (1..self.num_valid_snapshots).find(|&i| {
+                    let checkpoint = &self.checkpoints[i];
+                    checkpoint.trajectory.is_none() && !checkpoint.in_progress
+                })
+            });
+        let Some(checkpoint_num) = checkpoint_num else {
+            return self.claim_repack(run).map(Work::Repack);
+        };
+
+        let (start_num, start) = self.snapshot_before(checkpoint_num - 1).unwrap();
+        let start = Arc::clone(start);
+        self.checkpoints[checkpoint_num].in_progress = true;
+
+        Some(Work::Simulate(Job {
+            run: Arc::clone(run),
+            checkpoint_num,
+            usercmds: self.usercmds
+                [start_num * SNAPSHOT_INTERVAL..checkpoint_num * SNAPSHOT_INTERVAL]
+                .to_owned(),
+            start_num,
+            start,
+            versions: self.checkpoints[start_num + 1..=checkpoint_num]
+                .iter()
+                .map(|checkpoint| checkpoint.version)
+                .collect(),
+        }))
+    }
+
+    /// Saves the result of a job unless the snapshot it started from or its usercmds have changed
+    /// since it was claimed.
+    fn finish(&mut self, job: &Job, snapshot: Arc<Snapshot>, trajectory: Arc<Trajectory>) {
+        // Opening a shorter run can take the checkpoint away
+        if job.checkpoint_num >= self.checkpoints.len() {
+            return;
+        }
+        let current_start = self.checkpoints[job.start_num].snapshot.as_ref();
+        let started_from_current = current_start.is_some_and(|s| Arc::ptr_eq(s, &job.start));
+        let same_usercmds = self.checkpoints[job.start_num + 1..=job.checkpoint_num]
+            .iter()
+            .map(|checkpoint| checkpoint.version)
+            .eq(job.versions.iter().copied());
+
+        self.checkpoints[job.checkpoint_num].in_progress = false;
+        if !same_usercmds || !started_from_current {
+            return;
+        }
+
+        self.store(job.checkpoint_num, snapshot, Some(trajectory));
+    }
+}
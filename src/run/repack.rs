@@ -0,0 +1,265 @@
+//! Keeping the memory taken by checkpoints in check on long runs. Workers with nothing to simulate
+//! rebuild the snapshots far from the playhead with their chunks packed, and while the snapshots
+//! take up more than the cap they drop every other one of them instead, which only means seeking
+//! there has to simulate more.
+//!
+//! Snapshots have to be rebuilt a group at a time. A group starts at a checkpoint whose snapshot
+//! is stored relative to the baseline and goes up to the next one, and every snapshot in between is
+//! stored relative to an earlier one in the group, so none of them can be freed until all of them
+//! are replaced. The first checkpoint is never rebuilt, so the first group starts at the one after
+//! it instead.
+
+use std::{ops::Range, sync::Arc};
+
+use super::{Checkpoint, SNAPSHOT_INTERVAL, Shared, SharedRun, Snapshot};
+
+/// Groups at least this many segments from the one under the playhead are cold enough to rebuild,
+/// which keeps it well clear of anywhere dense snapshots are being taken.
+const COLD_SEGMENTS: usize = 16;
+
+/// How much memory a run's snapshots take up, not counting what snapshots that have been replaced
+/// still hold until whatever's using them lets go.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct SnapshotMemoryStats {
+    /// Checkpoints with a snapshot.
+    pub checkpoints: usize,
+    /// How many of those are packed.
+    pub packed: usize,
+    /// Checkpoints that are up to date but whose snapshots were dropped to stay under the cap.
+    pub dropped: usize,
+    pub checkpoint_bytes: usize,
+
+    pub dense: usize,
+    pub dense_bytes: usize,
+}
+
+/// Rebuilding the snapshots of one group.
+pub(super) struct Repack {
+    pub run: Arc<SharedRun>,
+    group: Range<usize>,
+
+    /// The snapshots and versions of the checkpoints in `group` when it was claimed.
+    snapshots: Vec<Option<Arc<Snapshot>>>,
+    versions: Vec<u64>,
+
+    /// Drop every other snapshot, keeping the first so the group still starts in the same place.
+    thin: bool,
+    pack: bool,
+}
+
+impl Repack {
+    /// The new snapshot for each checkpoint in the group.
+    pub fn run(&self) -> Vec<Option<Arc<Snapshot>>> {
+        let mut previous: Option<Arc<Snapshot>> = None;
+        let mut num_seen = 0;
+        self.snapshots
+            .iter()
+            .map(|snapshot| {
+                let snapshot = snapshot.as_ref()?;
+                if snapshot.depth() == 0 {
+                    // There's nothing to rebase a baseline onto
+                    return Some(Arc::clone(snapshot));
+                }
+                num_seen += 1;
+                if self.thin && num_seen % 2 == 0 {
+                    return None;
+                }
+                let rebased = Arc::new(snapshot.rebased(previous.as_deref(), self.pack));
+                previous = Some(Arc::clone(&rebased));
+                Some(rebased)
+            })
+            .collect()
+    }
+}
+
+impl Shared {
+    pub(super) fn snapshot_memory_stats(&self) -> SnapshotMemoryStats {
+        let mut stats = SnapshotMemoryStats::default();
+        for checkpoint in &self.checkpoints {
+            match &checkpoint.snapshot {
+                Some(snapshot) => {
+                    stats.checkpoints += 1;
+                    stats.packed += snapshot.is_packed() as usize;
+                    stats.checkpoint_bytes += snapshot.size();
+                }
+                None => stats.dropped += checkpoint.up_to_date as usize,
+            }
+        }
+        stats
+    }
+
+    /// The groups of valid checkpoints that are followed by another valid group, so nothing more
+    /// can be stored relative to them. The first checkpoint is left out, since it's where the
+    /// run starts and stores nothing but the baseline, so the first group starts after it.
+    fn closed_groups(&self) -> Vec<Range<usize>> {
+        let mut groups = vec![];
+        let mut start = 1;
+        for i in 1..self.num_valid_snapshots {
+            if self.checkpoints[i]
+                .snapshot
+                .as_ref()
+                .is_some_and(|snapshot| snapshot.depth() == 1)
+            {
+                if start < i {
+                    groups.push(start..i);
+                }
+                start = i;
+            }
+        }
+        groups
+    }
+
+    /// Claims the cold group that most needs rebuilding, if there is one. Over the cap that's the
+    /// one with the most snapshots left, and otherwise the farthest one that isn't packed yet.
+    pub(super) fn claim_repack(&mut self, run: &Arc<SharedRun>) -> Option<Repack> {
+        if self.repacking {
+            return None;
+        }
+
+        let playhead = self.playhead / SNAPSHOT_INTERVAL;
+        let distance = |group: &Range<usize>| {
+            if playhead >= group.end {
+                playhead + 1 - group.end
+            } else {
+                group.start.saturating_sub(playhead)
+            }
+        };
+        let snapshots = |group: &Range<usize>| {
+            self.checkpoints[group.clone()]
+                .iter()
+                .filter_map(|checkpoint| checkpoint.snapshot.as_ref())
+        };
+        let cold: Vec<_> = self
+            .closed_groups()
+            .into_iter()
+            .filter(|group| distance(group) >= COLD_SEGMENTS)
+            .collect();
+
+        let over_cap = self.snapshot_memory_stats().checkpoint_bytes > self.checkpoint_memory_cap;
+        let thin = over_cap
+            .then(|| {
+                cold.iter()
+                    .filter(|group| snapshots(group).count() > 1)
+                    .max_by_key(|group| (snapshots(group).count(), distance(group)))
+            })
+            .flatten();
+        let pack = self
+            .pack_cold_snapshots
+            .then(|| {
+                cold.iter()
+                    .filter(|group| snapshots(group).any(|snapshot| !snapshot.is_packed()))
+                    .max_by_key(|group| distance(group))
+            })
+            .flatten();
+        let group = thin.or(pack)?.clone();
+
+        self.repacking = true;
+        let checkpoints = &self.checkpoints[group.clone()];
+        Some(Repack {
+            run: Arc::clone(run),
+            snapshots: checkpoints
+                .iter()
+                .map(|checkpoint| checkpoint.snapshot.clone())
+                .collect(),
+            versions: checkpoints
+                .iter()
+                .map(|checkpoint| checkpoint.version)
+                .collect(),
+            group,
+            thin: thin.is_some(),
+            pack: self.pack_cold_snapshots,
+        })
+    }
+
+    /// Replaces the group's snapshots with the rebuilt ones, unless any of them have changed since
+    /// it was claimed. They hash the same, so nothing else needs to know.
+    pub(super) fn finish_repack(&mut self, repack: &Repack, snapshots: Vec<Option<Arc<Snapshot>>>) {
+        self.repacking = false;
+
+        let same = |checkpoint: &Checkpoint, old: &Option<Arc<Snapshot>>| match (
+            &checkpoint.snapshot,
+            old,
+        ) {
+            (Some(current), Some(old)) => Arc::ptr_eq(current, old),
+            (None, None) => true,
+            _ => false,
+        };
+        let unchanged = repack.group.end < self.num_valid_snapshots
+            && self.checkpoints[repack.group.clone()]
+                .iter()
+                .zip(&repack.snapshots)
+                .zip(&repack.versions)
+                .all(|((checkpoint, old), &version)| {
+                    checkpoint.up_to_date && checkpoint.version == version && same(checkpoint, old)
+                });
+        if !unchanged {
+            return;
+        }
+
+        for (checkpoint, snapshot) in self.checkpoints[repack.group.clone()]
+            .iter_mut()
+            .zip(snapshots)
+        {
+            checkpoint.snapshot = snapshot;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use bytemuck::Zeroable;
+
+    use super::*;
+    use crate::{
+        game::test_game,
+        q3::usercmd_t,
+        run::{Run, Waiter},
+        vm::ExecMode,
+    };
+
+    /// Groups cover every checkpoint but the first up to the last closed one, each after the first
+    /// starting at a snapshot relative to the baseline, and rebuilding one keeps its contents.
+    #[test]
+    fn groups_leave_out_first_checkpoint() {
+        const NUM_SEGMENTS: usize = 40;
+
+        let mut run = Run::new(&test_game::fs(), ExecMode::Interpreted);
+        run.disable_snapshot_worker();
+        let usercmds: Vec<_> = (0..NUM_SEGMENTS * SNAPSHOT_INTERVAL)
+            .map(|i| usercmd_t {
+                serverTime: i as i32 * 8,
+                forwardmove: (i % 7) as i8,
+                ..usercmd_t::zeroed()
+            })
+            .collect();
+        run.set_usercmds(0, &usercmds);
+        // Without workers it can only go a segment at a time
+        for frame in (0..usercmds.len()).step_by(SNAPSHOT_INTERVAL).skip(1) {
+            run.seek(frame);
+        }
+        run.seek(usercmds.len() - 1);
+
+        let mut shared = run.shared.lock(Waiter::Run);
+        assert_eq!(shared.num_valid_snapshots, NUM_SEGMENTS + 1);
+        let groups = shared.closed_groups();
+        assert!(groups.len() > 1);
+        assert_eq!(groups[0].start, 1);
+        for pair in groups.windows(2) {
+            assert_eq!(pair[0].end, pair[1].start);
+            let first = shared.checkpoints[pair[1].start].snapshot.as_ref().unwrap();
+            assert_eq!(first.depth(), 1);
+        }
+
+        // The playhead's at the end, so the first group is the coldest
+        let repack = shared.claim_repack(&run.shared).unwrap();
+        assert_eq!(repack.group, groups[0]);
+        let snapshots = repack.run();
+        for (old, new) in repack.snapshots.iter().zip(&snapshots) {
+            let (old, new) = (old.as_ref().unwrap(), new.as_ref().unwrap());
+            assert_eq!(old.hash(), new.hash());
+            assert!(new.is_packed());
+        }
+        shared.finish_repack(&repack, snapshots);
+        assert!(!shared.checkpoints[0].snapshot.as_ref().unwrap().is_packed());
+    }
+}
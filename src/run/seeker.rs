@@ -0,0 +1,257 @@
+//! Seeking far from where the game is, on a thread of its own so that scrubbing never stalls the
+//! UI. Only the latest request matters: one that comes in while another is being simulated takes
+//! over, carrying on from where that got to if it's on the way. What comes back is a snapshot to
+//! restore from, which is quick compared to simulating.
+
+use std::{
+    mem,
+    sync::{
+        Arc, Condvar, Mutex, Weak,
+        atomic::{AtomicU64, Ordering},
+    },
+    thread::{self, JoinHandle},
+};
+
+use super::{DENSE_INTERVAL, SNAPSHOT_INTERVAL, SharedRun, Snapshot, Trajectory, Waiter};
+use crate::{Snapshot as _, game::Game, q3::usercmd_t};
+
+pub(super) struct Request {
+    pub frame: usize,
+    pub usercmds: Arc<Vec<usercmd_t>>,
+    pub usercmds_version: u64,
+
+    /// A valid snapshot at or before `frame`, and the frame the game is on when restored from it.
+    pub start: (usize, Arc<Snapshot>),
+}
+
+pub(super) struct Finished {
+    pub frame: usize,
+    pub usercmds_version: u64,
+    pub snapshot: Arc<Snapshot>,
+
+    /// Dense snapshots taken on the way, by frame.
+    pub dense: Vec<(usize, Arc<Snapshot>)>,
+}
+
+#[derive(Default)]
+struct State {
+    request: Option<Request>,
+    finished: Option<Finished>,
+    shutdown: bool,
+}
+
+#[derive(Default)]
+struct Shared {
+    state: Mutex<State>,
+    wakeup: Condvar,
+
+    /// Incremented whenever `State::request` changes, so the thread can check for a new one after
+    /// every frame without locking.
+    generation: AtomicU64,
+}
+
+pub(super) struct Seeker {
+    shared: Arc<Shared>,
+    thread: Option<JoinHandle<()>>,
+
+    /// The frame and usercmds version of the request that hasn't finished yet, if any, so the
+    /// same one isn't sent again every time the UI seeks to it.
+    pending: Option<(usize, u64)>,
+}
+
+impl Seeker {
+    pub fn new(run: &Arc<SharedRun>) -> Self {
+        let shared = Arc::new(Shared::default());
+        let mut worker = Worker {
+            shared: Arc::clone(&shared),
+            run: Arc::downgrade(run),
+            game: run.game.clone(),
+            dense: vec![],
+            trajectory: None,
+        };
+        Self {
+            shared,
+            thread: Some(thread::spawn(move || worker.work())),
+            pending: None,
+        }
+    }
+
+    pub fn request(&mut self, request: Request) {
+        let key = (request.frame, request.usercmds_version);
+        if self.pending == Some(key) {
+            return;
+        }
+        self.pending = Some(key);
+        self.replace_request(Some(request));
+    }
+
+    /// Stops working on the current request, if there is one.
+    pub fn cancel(&mut self) {
+        if self.pending.take().is_some() {
+            self.replace_request(None);
+        }
+    }
+
+    pub fn take_finished(&mut self) -> Option<Finished> {
+        let finished = self.shared.state.lock().unwrap().finished.take()?;
+        if self.pending == Some((finished.frame, finished.usercmds_version)) {
+            self.pending = None;
+        }
+        Some(finished)
+    }
+
+    pub fn is_busy(&self) -> bool {
+        self.pending.is_some()
+    }
+
+    fn replace_request(&self, request: Option<Request>) {
+        let mut state = self.shared.state.lock().unwrap();
+        state.request = request;
+        self.shared.generation.fetch_add(1, Ordering::Release);
+        self.shared.wakeup.notify_one();
+    }
+}
+
+impl Drop for Seeker {
+    fn drop(&mut self) {
+        self.shared.state.lock().unwrap().shutdown = true;
+        self.shared.generation.fetch_add(1, Ordering::Release);
+        self.shared.wakeup.notify_one();
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
+
+struct Worker {
+    shared: Arc<Shared>,
+    run: Weak<SharedRun>,
+
+    /// Kept between requests, so that restoring it only has to touch what changed.
+    game: Game,
+
+    /// Dense snapshots taken since the game was last restored.
+    dense: Vec<(usize, Arc<Snapshot>)>,
+
+    /// The segment being simulated, if it was simulated from its start.
+    trajectory: Option<Trajectory>,
+}
+
+impl Worker {
+    fn work(&mut self) {
+        while let Some((mut request, mut generation)) = self.wait_for_request() {
+            self.restore(&request.start.1);
+
+            loop {
+                if self.shared.generation.load(Ordering::Acquire) != generation {
+                    let Some((next, next_generation)) = self.take_request() else {
+                        break;
+                    };
+                    generation = next_generation;
+                    let Some(next) = next else {
+                        break;
+                    };
+
+                    // Carry on if the new target is still ahead and nothing closer to it is known
+                    let on_the_way = next.usercmds_version == request.usercmds_version
+                        && next.start.0 <= self.game.frame()
+                        && self.game.frame() <= next.frame + 1;
+                    if !on_the_way {
+                        self.restore(&next.start.1);
+                    }
+                    request = next;
+                }
+
+                if self.game.frame() > request.frame {
+                    let snapshot = Arc::new(self.game.take_snapshot(Some(&request.start.1)));
+                    let mut state = self.shared.state.lock().unwrap();
+                    // Otherwise there's a newer request to pick up
+                    if self.shared.generation.load(Ordering::Acquire) == generation {
+                        state.finished = Some(Finished {
+                            frame: request.frame,
+                            usercmds_version: request.usercmds_version,
+                            snapshot,
+                            dense: mem::take(&mut self.dense),
+                        });
+                        break;
+                    }
+                    continue;
+                }
+
+                let Some(run) = self.run.upgrade() else {
+                    return;
+                };
+                self.step(&run, &request);
+            }
+        }
+    }
+
+    fn restore(&mut self, snapshot: &Snapshot) {
+        self.game.restore_from_snapshot(snapshot);
+        self.dense.clear();
+        self.trajectory = (self.game.frame() % SNAPSHOT_INTERVAL == 0)
+            .then(|| Trajectory::with_capacity(SNAPSHOT_INTERVAL));
+    }
+
+    /// Simulates one frame towards the target, keeping what's worth keeping on the way.
+    fn step(&mut self, run: &SharedRun, request: &Request) {
+        self.game.run_frame(request.usercmds[self.game.frame()]);
+        if let Some(trajectory) = &mut self.trajectory {
+            trajectory.record(&self.game);
+        }
+
+        let current = self.game.frame();
+        if current % SNAPSHOT_INTERVAL == 0 {
+            let trajectory = self
+                .trajectory
+                .replace(Trajectory::with_capacity(SNAPSHOT_INTERVAL));
+            run.store_reached_checkpoint(
+                Waiter::Worker,
+                &mut self.game,
+                request.usercmds_version,
+                trajectory,
+            );
+        } else if current % DENSE_INTERVAL == 0 && request.frame + 1 - current < SNAPSHOT_INTERVAL {
+            // Only near the target, where the UI is likely to seek next
+            let segment = current / SNAPSHOT_INTERVAL;
+            let checkpoint = {
+                let shared = run.lock(Waiter::Worker);
+                (shared.usercmds_version == request.usercmds_version
+                    && shared.has_valid_snapshot(current))
+                .then(|| shared.checkpoints[segment].snapshot.clone())
+                .flatten()
+            };
+            if let Some(checkpoint) = checkpoint {
+                let snapshot = Arc::new(self.game.take_snapshot(Some(&checkpoint)));
+                self.dense.push((current, snapshot));
+            }
+        }
+    }
+
+    /// Waits for a request, or returns `None` once the seeker is dropped.
+    fn wait_for_request(&self) -> Option<(Request, u64)> {
+        let mut state = self.shared.state.lock().unwrap();
+        loop {
+            if state.shutdown {
+                return None;
+            }
+            if let Some(request) = state.request.take() {
+                return Some((request, self.shared.generation.load(Ordering::Acquire)));
+            }
+            state = self.shared.wakeup.wait(state).unwrap();
+        }
+    }
+
+    /// The latest request, which is `None` if it was cancelled, or `None` altogether if the
+    /// seeker was dropped.
+    fn take_request(&self) -> Option<(Option<Request>, u64)> {
+        let mut state = self.shared.state.lock().unwrap();
+        if state.shutdown {
+            return None;
+        }
+        Some((
+            state.request.take(),
+            self.shared.generation.load(Ordering::Acquire),
+        ))
+    }
+}
@@ -0,0 +1,52 @@
+//! The player's movement through a segment, recorded while it's simulated so the whole run can be
+//! graphed and drawn without simulating any of it again. Each field is its own array so that
+//! looking at one of them over thousands of frames only touches that one.
+
+use crate::game::Game;
+
+/// One entry per frame of a segment, for the state after running that frame's usercmd.
+#[derive(Default)]
+pub struct Trajectory {
+    pub origins: Vec<[f32; 3]>,
+    pub velocities: Vec<[f32; 3]>,
+    pub ground_entity_nums: Vec<i32>,
+    pub pm_flags: Vec<i32>,
+
+    /// See `Game::frame_hash`.
+    pub frame_hashes: Vec<u64>,
+}
+
+impl Trajectory {
+    pub(super) fn with_capacity(capacity: usize) -> Self {
+        Self {
+            origins: Vec::with_capacity(capacity),
+            velocities: Vec::with_capacity(capacity),
+            ground_entity_nums: Vec::with_capacity(capacity),
+            pm_flags: Vec::with_capacity(capacity),
+            frame_hashes: Vec::with_capacity(capacity),
+        }
+    }
+
+    pub(super) fn record(&mut self, game: &Game) {
+        let ps = game.ps();
+        self.origins.push(ps.origin);
+        self.velocities.push(ps.velocity);
+        self.ground_entity_nums.push(ps.groundEntityNum);
+        self.pm_flags.push(ps.pm_flags);
+        self.frame_hashes.push(game.frame_hash());
+    }
+
+    pub fn len(&self) -> usize {
+        self.origins.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.origins.is_empty()
+    }
+
+    /// Speed in the horizontal plane, which is what strafe jumping gains.
+    pub fn horizontal_speed(&self, i: usize) -> f32 {
+        let [x, y, _] = self.velocities[i];
+        x.hypot(y)
+    }
+}
@@ -0,0 +1,49 @@
+//! What there is to draw of the game, copied out after every seek so that drawing never has to
+//! look at the game itself.
+
+use std::sync::Arc;
+
+use super::Trajectory;
+use crate::game::Game;
+
+/// The bounds of an entity. Entities without any have both corners at their origin.
+#[derive(Clone, Copy, Default, PartialEq)]
+pub struct EntityBox {
+    pub mins: [f32; 3],
+    pub maxs: [f32; 3],
+}
+
+#[derive(Default)]
+pub struct View {
+    /// The frame the game is on.
+    pub frame: usize,
+
+    pub eye_origin: [f32; 3],
+    pub view_angles: [f32; 3],
+
+    /// Indexed by entity number.
+    pub boxes: Vec<EntityBox>,
+
+    /// From `Run::trajectories`.
+    pub trajectories: Vec<Arc<Trajectory>>,
+}
+
+impl View {
+    pub(super) fn capture(&mut self, game: &Game) {
+        let ps = game.ps();
+        self.frame = game.frame();
+        self.eye_origin = ps.origin;
+        self.eye_origin[2] += ps.viewheight as f32;
+        self.view_angles = ps.viewangles;
+
+        let g_entities = game.g_entities.unwrap();
+        self.boxes.clear();
+        self.boxes.extend((0..g_entities.count).map(|i| {
+            let r = &game.entity(i).r;
+            EntityBox {
+                mins: [0, 1, 2].map(|j| r.currentOrigin[j] + r.mins[j]),
+                maxs: [0, 1, 2].map(|j| r.currentOrigin[j] + r.maxs[j]),
+            }
+        }));
+    }
+}
@@ -0,0 +1,241 @@
+//! Brute-force search: simulating many variants of a few frames of input from the same state, in
+//! parallel, to find the ones that do best by some measure. A game with several clients simulates
+//! that many candidates at once, one per client, so they share each frame's `G_RUN_FRAME`.
+
+use std::{
+    sync::atomic::{AtomicUsize, Ordering},
+    thread,
+};
+
+use glam::Vec3;
+
+use bytemuck::Zeroable;
+
+use crate::{
+    Snapshot,
+    game::{Game, GameSnapshot},
+    q3::usercmd_t,
+};
+
+/// How well one of the candidates passed to `search` did.
+#[derive(Clone, Copy, Debug)]
+pub struct Scored {
+    /// Index into the candidates.
+    pub index: usize,
+    pub score: f32,
+}
+
+/// Simulates each candidate sequence of usercmds starting from `start`, scores the resulting state
+/// of the client that ran it with `objective`, and returns the `keep` best candidates, best first.
+///
+/// `game` is only used as a template for the clones that do the work, one per thread, and `start`
+/// has to be a snapshot of a game with as many clients. Candidates are handed out to its clients
+/// in turn, and each is scored after its last usercmd while the others go on.
+///
+/// Clients only keep out of each other's way, so with several of them a candidate's score is only
+/// what it'd get alone as long as nothing else is shared: the same item picked up, the random
+/// seed, or anything else the game keeps for everyone. Where that isn't certain, pass what's kept
+/// through `rescore` on a game with one client.
+pub fn search<F>(
+    game: &Game,
+    start: &GameSnapshot,
+    candidates: &[Vec<usercmd_t>],
+    objective: F,
+    keep: usize,
+) -> Vec<Scored>
+where
+    F: Fn(&Game, usize) -> f32 + Sync,
+{
+    let num_clients = game.num_clients();
+    let num_threads = thread::available_parallelism()
+        .map_or(1, |n| n.get())
+        .min(candidates.len().div_ceil(num_clients));
+    let next = AtomicUsize::new(0);
+
+    let mut scored: Vec<Scored> = thread::scope(|scope| {
+        let workers: Vec<_> = (0..num_threads)
+            .map(|_| {
+                scope.spawn(|| {
+                    let mut game = game.clone();
+                    let mut scored = vec![];
+                    let mut usercmds = vec![usercmd_t::zeroed(); num_clients];
+                    loop {
+                        let first = next.fetch_add(num_clients, Ordering::Relaxed);
+                        let batch = candidates.get(first..).unwrap_or_default();
+                        let batch = &batch[..batch.len().min(num_clients)];
+                        if batch.is_empty() {
+                            break scored;
+                        }
+
+                        game.restore_from_snapshot(start);
+                        let num_frames = batch.iter().map(Vec::len).max().unwrap();
+                        for frame in 0..=num_frames {
+                            for (client_num, candidate) in batch.iter().enumerate() {
+                                if candidate.len() == frame {
+                                    scored.push(Scored {
+                                        index: first + client_num,
+                                        score: objective(&game, client_num),
+                                    });
+                                }
+                            }
+                            if frame == num_frames {
+                                break;
+                            }
+
+                            // Clients without a candidate, or past the end of theirs, stand still
+                            for (client_num, usercmd) in usercmds.iter_mut().enumerate() {
+                                *usercmd = batch
+                                    .get(client_num)
+                                    .and_then(|candidate| candidate.get(frame))
+                                    .copied()
+                                    .unwrap_or_else(usercmd_t::zeroed);
+                            }
+                            game.run_frame_with_clients(&usercmds);
+                        }
+                    }
+                })
+            })
+            .collect();
+
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().unwrap())
+            .collect()
+    });
+
+    // Ties go to the earlier candidate so results don't depend on scheduling
+    scored.sort_by(|a, b| b.score.total_cmp(&a.score).then(a.index.cmp(&b.index)));
+    scored.truncate(keep);
+    scored
+}
+
+/// Scores the candidates in `scored` again one at a time on `game`, which has to have a single
+/// client, and sorts them by their new scores.
+pub fn rescore<F>(
+    game: &Game,
+    start: &GameSnapshot,
+    candidates: &[Vec<usercmd_t>],
+    scored: &[Scored],
+    objective: F,
+) -> Vec<Scored>
+where
+    F: Fn(&Game, usize) -> f32 + Sync,
+{
+    assert_eq!(game.num_clients(), 1);
+    let mut indices: Vec<_> = scored.iter().map(|scored| scored.index).collect();
+    indices.sort();
+    let kept: Vec<_> = indices
+        .iter()
+        .map(|&index| candidates[index].clone())
+        .collect();
+    search(game, start, &kept, objective, kept.len())
+        .into_iter()
+        .map(|scored| Scored {
+            index: indices[scored.index],
+            ..scored
+        })
+        .collect()
+}
+
+/// An objective that rewards horizontal speed.
+pub fn horizontal_speed(game: &Game, client_num: usize) -> f32 {
+    let [x, y, _] = game.client_ps(client_num).velocity;
+    x.hypot(y)
+}
+
+/// An objective that rewards having moved far along `direction`.
+pub fn distance_along(direction: Vec3) -> impl Fn(&Game, usize) -> f32 + Sync {
+    move |game, client_num| Vec3::from(game.client_ps(client_num).origin).dot(direction)
+}
+
+/// Copies of `base` with the usercmds in `frames` changed by `vary`, once for each value it's
+/// given, for trying out things like a range of yaws.
+pub fn variants<T>(
+    base: &[usercmd_t],
+    frames: std::ops::Range<usize>,
+    values: impl IntoIterator<Item = T>,
+    vary: impl Fn(&mut usercmd_t, &T),
+) -> Vec<Vec<usercmd_t>> {
+    values
+        .into_iter()
+        .map(|value| {
+            let mut usercmds = base.to_owned();
+            usercmds[frames.clone()]
+                .iter_mut()
+                .for_each(|usercmd| vary(usercmd, &value));
+            usercmds
+        })
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{game::test_game, vm::ExecMode};
+
+    /// Searching with several clients to a game finds the same scores as with one, including for
+    /// candidates shorter than the others in their batch and a batch that doesn't fill every
+    /// client.
+    #[test]
+    fn clients_search_like_one() {
+        let base = vec![
+            usercmd_t {
+                forwardmove: 127,
+                ..usercmd_t::zeroed()
+            };
+            30
+        ];
+        let mut candidates = variants(&base, 5..20, -6..=6, |usercmd, &rightmove| {
+            usercmd.rightmove = rightmove * 20;
+        });
+        candidates[3].truncate(12);
+        candidates[6].clear();
+
+        let objective = distance_along(Vec3::new(0.6, 0.8, 0.0));
+        let results: Vec<Vec<(usize, f32)>> = [1, 4]
+            .into_iter()
+            .map(|num_clients| {
+                let game = test_game::start(ExecMode::Interpreted, num_clients);
+                let start = game.take_snapshot(None);
+                search(&game, &start, &candidates, &objective, candidates.len())
+                    .into_iter()
+                    .map(|scored| (scored.index, scored.score))
+                    .collect()
+            })
+            .collect();
+        assert_eq!(results[0].len(), candidates.len());
+        assert_eq!(results[0], results[1]);
+    }
+
+    /// Rescoring what a search with several clients kept on a game with one gives what a search
+    /// with one would have kept.
+    #[test]
+    fn rescore_matches_single_client() {
+        let base = vec![
+            usercmd_t {
+                forwardmove: 127,
+                ..usercmd_t::zeroed()
+            };
+            20
+        ];
+        let candidates = variants(&base, 0..20, -6..=6, |usercmd, &rightmove| {
+            usercmd.rightmove = rightmove * 20;
+        });
+        let objective = distance_along(Vec3::new(0.0, 1.0, 0.0));
+
+        let game = test_game::start(ExecMode::Interpreted, 4);
+        let start = game.take_snapshot(None);
+        let kept = search(&game, &start, &candidates, &objective, 5);
+
+        let single = test_game::start(ExecMode::Interpreted, 1);
+        let single_start = single.take_snapshot(None);
+        let rescored = rescore(&single, &single_start, &candidates, &kept, &objective);
+        let expected = search(&single, &single_start, &candidates, &objective, 5);
+
+        let pairs = |scored: &[Scored]| -> Vec<(usize, f32)> {
+            scored.iter().map(|s| (s.index, s.score)).collect()
+        };
+        assert_eq!(pairs(&rescored), pairs(&expected));
+        assert_eq!(expected[0].index, 12);
+    }
+}
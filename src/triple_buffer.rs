@@ -0,0 +1,80 @@
+//! Hands the latest of something from one thread to another without either ever waiting on the
+//! other. There are three copies: one the writer fills in, one the reader looks at and one in
+//! between, which the writer swaps its copy into when it's done and the reader swaps its copy out
+//! for when there's anything new there. Copies are reused, so anything they allocate only has to be
+//! allocated once.
+
+use std::{
+    cell::UnsafeCell,
+    sync::{
+        Arc,
+        atomic::{AtomicU8, Ordering},
+    },
+};
+
+/// Set in `Shared::middle` when the copy there hasn't been read yet.
+const FRESH: u8 = 1 << 2;
+const INDEX: u8 = FRESH - 1;
+
+struct Shared<T> {
+    copies: [UnsafeCell<T>; 3],
+
+    /// The index of the copy in between, and `FRESH`.
+    middle: AtomicU8,
+}
+
+// Each copy only ever belongs to one side at a time
+unsafe impl<T: Send> Sync for Shared<T> {}
+
+pub fn triple_buffer<T: Default>() -> (Writer<T>, Reader<T>) {
+    let shared = Arc::new(Shared {
+        copies: Default::default(),
+        middle: AtomicU8::new(1),
+    });
+    (
+        Writer {
+            shared: Arc::clone(&shared),
+            back: 0,
+        },
+        Reader { shared, front: 2 },
+    )
+}
+
+pub struct Writer<T> {
+    shared: Arc<Shared<T>>,
+    back: u8,
+}
+
+impl<T> Writer<T> {
+    /// The copy to fill in, which still has whatever it had from two publishes ago.
+    pub fn get_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.shared.copies[self.back as usize].get() }
+    }
+
+    /// Makes the copy from `get_mut` the latest one, replacing anything the reader hasn't seen.
+    pub fn publish(&mut self) {
+        let previous = self.shared.middle.swap(self.back | FRESH, Ordering::AcqRel);
+        self.back = previous & INDEX;
+    }
+}
+
+pub struct Reader<T> {
+    shared: Arc<Shared<T>>,
+    front: u8,
+}
+
+impl<T> Reader<T> {
+    /// Switches to the latest published copy, if there's one that hasn't been seen yet.
+    pub fn update(&mut self) -> bool {
+        if self.shared.middle.load(Ordering::Relaxed) & FRESH == 0 {
+            return false;
+        }
+        let previous = self.shared.middle.swap(self.front, Ordering::AcqRel);
+        self.front = previous & INDEX;
+        true
+    }
+
+    pub fn get(&self) -> &T {
+        unsafe { &*self.shared.copies[self.front as usize].get() }
+    }
+}
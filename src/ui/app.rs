@@ -1,22 +1,24 @@
 use std::{
-    path::PathBuf,
+    path::{Path, PathBuf},
     sync::{Arc, Mutex},
+    thread,
 };
 
-use bytemuck::pod_collect_to_vec;
 use clap::Parser;
 use eframe::{egui, glow};
 
 use crate::{
     fs::Fs,
-    q3::{Map, usercmd_t},
-    renderer::Renderer,
-    run::Run,
+    q3::{self, Map},
+    renderer::{MapMesh, Renderer},
+    run::{Run, RunFile, SNAPSHOT_INTERVAL},
     ui::{
         Timeline,
         theme::set_theme,
+        timeline::format_time,
         viewport::{FlyCam, first_person_ui},
     },
+    vm::ExecMode,
 };
 
 #[derive(clap::Parser)]
@@ -29,9 +31,26 @@ struct Args {
     #[arg()]
     bsp: PathBuf,
 
-    /// User inputs to load
+    /// Run to load, either a saved run or raw usercmds
     #[arg()]
     usercmds: PathBuf,
+
+    /// How to execute the qvm
+    #[arg(long, value_enum, default_value_t = ExecMode::Interpreted)]
+    vm: ExecMode,
+
+    /// Megabytes of extra snapshots to keep around recently seeked frames
+    #[arg(long, default_value_t = 256)]
+    dense_snapshot_budget: usize,
+
+    /// Megabytes of snapshots at checkpoints to keep before ones far from the playhead are
+    /// dropped, which makes seeking there slower
+    #[arg(long, default_value_t = 4096)]
+    checkpoint_memory_cap: usize,
+
+    /// Don't pack the snapshots far from the playhead to save memory
+    #[arg(long)]
+    no_snapshot_packing: bool,
 }
 
 struct AppState {
@@ -39,6 +58,9 @@ struct AppState {
     renderer: Arc<Mutex<Renderer>>,
     timeline: Timeline,
     flycam: FlyCam,
+
+    /// Where to save the run. Raw usercmds are saved next to the original rather than over it.
+    save_path: PathBuf,
 }
 
 impl AppState {
@@ -46,33 +68,61 @@ impl AppState {
         let args = Args::parse();
         let fs = Fs::new(&args.roots).unwrap();
 
-        let mut buf = fs.read(&args.bsp).unwrap();
-        Map::instance().load(args.bsp.to_str().unwrap(), &mut buf);
+        let buf = fs.get(&args.bsp).unwrap();
 
-        let mut run = Run::new(&fs);
+        // The render mesh only needs the BSP, so it's built while the collision map loads and the
+        // run starts
+        let (mut run, duration, map_mesh) = thread::scope(|scope| {
+            let map_mesh = scope.spawn(|| MapMesh::new(&buf).unwrap());
 
-        let usercmds: Vec<usercmd_t> = pod_collect_to_vec(&std::fs::read(args.usercmds).unwrap());
-        let duration = (usercmds.len() - 1) as f32 * 0.008;
-        run.set_usercmds(0, &usercmds);
+            Map::load(
+                args.bsp.to_str().unwrap(),
+                &buf,
+                q3::patch_cache_dir().as_deref(),
+            );
 
-        let mut renderer = Renderer::new(gl);
-        renderer.load_bsp(&fs, &args.bsp);
+            let mut run = Run::new(&fs, args.vm);
+            run.set_dense_snapshot_budget(args.dense_snapshot_budget << 20);
+            run.set_checkpoint_memory_cap(args.checkpoint_memory_cap << 20);
+            run.set_pack_cold_snapshots(!args.no_snapshot_packing);
+
+            let file = RunFile::read(&args.usercmds).unwrap();
+            let duration = (file.usercmds.len() - 1) as f32 * 0.008;
+            run.open(&file).unwrap();
+
+            (run, duration, map_mesh.join().unwrap())
+        });
+
+        let mut renderer = Renderer::new(gl, run.publish_views());
+        renderer.load_map(map_mesh);
 
         Self {
             run,
             renderer: Arc::new(Mutex::new(renderer)),
             timeline: Timeline::new((0.0..=duration).into()),
             flycam: Default::default(),
+            save_path: save_path(&args.usercmds),
         }
     }
 }
 
+fn save_path(path: &Path) -> PathBuf {
+    if path.extension().is_some_and(|ext| ext == "tasjr") {
+        path.to_owned()
+    } else {
+        path.with_extension("tasjr")
+    }
+}
+
 #[derive(serde::Deserialize, serde::Serialize)]
 enum Tab {
     FirstPerson,
     FlyCam,
     PlayerState,
     Timeline,
+    Performance,
+    #[cfg(feature = "profile")]
+    Profiler,
 }
 
 impl egui_dock::TabViewer for AppState {
@@ -84,6 +134,9 @@ impl egui_dock::TabViewer for AppState {
             Tab::FlyCam => "Fly camera",
             Tab::PlayerState => "Player state inspector",
             Tab::Timeline => "Timeline",
+            Tab::Performance => "Performance",
+            #[cfg(feature = "profile")]
+            Tab::Profiler => "Profiler",
         }
         .into()
     }
@@ -110,6 +163,31 @@ impl egui_dock::TabViewer for AppState {
             Tab::Timeline => {
                 self.timeline.show(ui, &self.run);
             }
+            Tab::Performance => {
+                let (run_waits, worker_waits) = self.run.lock_wait_stats();
+                let trace_cache = self.run.trace_cache_stats();
+                let snapshot_memory = self.run.snapshot_memory_stats();
+                egui::ScrollArea::vertical().show(ui, |ui| {
+                    ui.take_available_space();
+                    ui.label(format!("UI waiting on workers: {run_waits:#?}"));
+                    ui.label(format!("Workers waiting on UI: {worker_waits:#?}"));
+                    ui.label(format!("Trace cache: {trace_cache:#?}"));
+                    ui.label(format!("Snapshot memory: {snapshot_memory:#?}"));
+                    egui::CollapsingHeader::new("Snapshot at each checkpoint").show(ui, |ui| {
+                        for (i, size) in self.run.checkpoint_snapshot_sizes().iter().enumerate() {
+                            let time = format_time((i * SNAPSHOT_INTERVAL) as f32 * 0.008);
+                            ui.label(match size {
+                                Some(size) => format!("{time}: {} KiB", size.div_ceil(1 << 10)),
+                                None => format!("{time}: none"),
+                            });
+                        }
+                    });
+                });
+            }
+            #[cfg(feature = "profile")]
+            Tab::Profiler => {
+                crate::ui::profiler::profiler_ui(ui);
+            }
         }
     }
 }
@@ -132,7 +210,12 @@ impl App {
                 let [_, ps] = dock_state.main_surface_mut().split_above(
                     egui_dock::NodeIndex::root(),
                     0.5,
-                    vec![Tab::PlayerState],
+                    vec![
+                        Tab::PlayerState,
+                        Tab::Performance,
+                        #[cfg(feature = "profile")]
+                        Tab::Profiler,
+                    ],
                 );
 
                 let [_, fly] =
@@ -159,12 +242,6 @@ impl eframe::App for App {
     fn update(&mut self, ctx: &eframe::egui::Context, _frame: &mut eframe::Frame) {
         ctx.request_repaint();
 
-        self.app_state
-            .renderer
-            .lock()
-            .unwrap()
-            .update(&self.app_state.run);
-
         // Space is the standard play/pause key, but it's also jump, so enter also works even
         // during recording.
         if ctx.input(|i| {
@@ -176,6 +253,16 @@ impl eframe::App for App {
 
         self.app_state.timeline.update(ctx.input(|i| i.unstable_dt));
 
+        if ctx.input(|i| i.modifiers.command && i.key_pressed(egui::Key::S)) {
+            match self.app_state.run.save(&self.app_state.save_path) {
+                Ok(()) => println!("Saved {}", self.app_state.save_path.display()),
+                Err(err) => eprintln!(
+                    "Couldn't save {}: {err}",
+                    self.app_state.save_path.display()
+                ),
+            }
+        }
+
         if self.app_state.timeline.recording {
             self.app_state.run.disable_snapshot_worker();
         } else {
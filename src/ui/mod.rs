@@ -2,6 +2,8 @@ pub use app::App;
 pub use timeline::Timeline;
 
 pub mod app;
+#[cfg(feature = "profile")]
+pub mod profiler;
 pub mod theme;
 pub mod timeline;
 pub mod viewport;
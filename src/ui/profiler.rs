@@ -0,0 +1,83 @@
+use std::path::Path;
+
+use eframe::egui;
+
+use crate::profile;
+
+/// How many of the busiest functions to list.
+const NUM_FUNCTIONS: usize = 40;
+
+pub fn profiler_ui(ui: &mut egui::Ui) {
+    ui.horizontal(|ui| {
+        let mut enabled = profile::enabled();
+        if ui.checkbox(&mut enabled, "Enabled").changed() {
+            profile::set_enabled(enabled);
+        }
+        if ui.button("Reset").clicked() {
+            profile::get().reset();
+        }
+        if ui
+            .button("Save folded stacks")
+            .on_hover_text(
+                "Writes instructions.folded and syscalls.folded to the current directory",
+            )
+            .clicked()
+        {
+            if let Err(err) = profile::save_folded(Path::new(".")) {
+                eprintln!("Couldn't save folded stacks: {err}");
+            }
+        }
+    });
+
+    let profile = profile::get();
+    egui::ScrollArea::vertical().show(ui, |ui| {
+        ui.take_available_space();
+
+        for (name, timing) in [("Seeking", &profile.seek), ("Workers", &profile.worker)] {
+            ui.label(format!(
+                "{name}: {} frames in {:.3}s, {:?} per frame",
+                timing.frames,
+                timing.time.as_secs_f64(),
+                timing.per_frame(),
+            ));
+        }
+        ui.label(format!(
+            "Snapshots: {} in {:.3}s",
+            profile.snapshots.count,
+            profile.snapshots.time.as_secs_f64(),
+        ));
+
+        ui.collapsing("Syscalls", |ui| {
+            egui::Grid::new("profiler_syscalls")
+                .striped(true)
+                .show(ui, |ui| {
+                    ui.strong("Syscall");
+                    ui.strong("Count");
+                    ui.strong("Time");
+                    ui.end_row();
+                    for (name, timing) in profile.syscalls() {
+                        ui.label(name);
+                        ui.label(timing.count.to_string());
+                        ui.label(format!("{:?}", timing.time));
+                        ui.end_row();
+                    }
+                });
+        });
+
+        ui.collapsing("Functions (interpreter only)", |ui| {
+            egui::Grid::new("profiler_functions")
+                .striped(true)
+                .show(ui, |ui| {
+                    ui.strong("Function");
+                    ui.strong("Instructions");
+                    ui.end_row();
+                    for (name, instructions) in profile.functions().into_iter().take(NUM_FUNCTIONS)
+                    {
+                        ui.label(name);
+                        ui.label(instructions.to_string());
+                        ui.end_row();
+                    }
+                });
+        });
+    });
+}
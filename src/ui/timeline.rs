@@ -1,9 +1,9 @@
 use eframe::egui::{
-    Align2, FontId, Mesh, NumExt, Rangef, Rect, Response, Sense, Shape, Ui, pos2, remap,
+    Align2, FontId, Mesh, NumExt, Rangef, Rect, Response, Sense, Shape, Stroke, Ui, pos2, remap,
     remap_clamp, vec2,
 };
 
-use crate::run::Run;
+use crate::run::{Run, SNAPSHOT_INTERVAL};
 
 pub struct Timeline {
     pub visible_range: Rangef,
@@ -47,6 +47,8 @@ impl Timeline {
 
         self.interact(ui, &response);
         self.paint_ticks(ui, rect, run);
+        self.paint_dense_snapshots(ui, rect, run);
+        self.paint_speed(ui, rect, run);
         self.paint_playhead(ui, rect, &response);
     }
 
@@ -136,6 +138,64 @@ impl Timeline {
         }
     }
 
+    fn paint_dense_snapshots(&self, ui: &mut Ui, rect: Rect, run: &Run) {
+        let stroke = ui.visuals().selection.stroke;
+        for frame in run.dense_snapshot_frames() {
+            let t = frame as f32 * 0.008;
+            if self.visible_range.contains(t) {
+                let x = remap(t, self.visible_range, rect.x_range());
+                ui.painter().vline(x, rect.top()..=rect.top() + 4.0, stroke);
+            }
+        }
+    }
+
+    /// Graphs horizontal speed below the ticks, as far as the run's trajectories go. Each column
+    /// of pixels shows the fastest frame in it, so short peaks don't disappear when zoomed out.
+    fn paint_speed(&self, ui: &mut Ui, rect: Rect, run: &Run) {
+        let graph = Rect::from_x_y_ranges(rect.x_range(), rect.top() + 28.0..=rect.bottom() - 4.0);
+        if graph.height() < 8.0 {
+            return;
+        }
+
+        let trajectories = run.trajectories();
+        let num_frames = trajectories.len() * SNAPSHOT_INTERVAL;
+        let first_frame =
+            ((self.visible_range.min / 0.008).floor().max(0.0) as usize).min(num_frames);
+        let last_frame =
+            ((self.visible_range.max / 0.008).ceil().max(0.0) as usize).min(num_frames);
+
+        let mut columns: Vec<(f32, f32)> = vec![];
+        for frame in first_frame..last_frame {
+            let trajectory = &trajectories[frame / SNAPSHOT_INTERVAL];
+            let speed = trajectory.horizontal_speed(frame % SNAPSHOT_INTERVAL);
+            let x = remap(frame as f32 * 0.008, self.visible_range, graph.x_range()).round();
+            match columns.last_mut() {
+                Some((last_x, last_speed)) if *last_x == x => *last_speed = last_speed.max(speed),
+                _ => columns.push((x, speed)),
+            }
+        }
+
+        let Some(max_speed) = columns.iter().map(|&(_, speed)| speed).reduce(f32::max) else {
+            return;
+        };
+        // Never scale up less than normal running speed, so standing still doesn't look like noise
+        let scale = graph.height() / max_speed.max(320.0);
+
+        let stroke = Stroke::new(1.0, ui.visuals().selection.bg_fill);
+        let points = columns
+            .into_iter()
+            .map(|(x, speed)| pos2(x, graph.bottom() - speed * scale))
+            .collect();
+        ui.painter().add(Shape::line(points, stroke));
+        ui.painter().text(
+            graph.left_top() + vec2(2.0, 0.0),
+            Align2::LEFT_TOP,
+            format!("{max_speed:.0} ups"),
+            FontId::proportional(12.0),
+            ui.visuals().widgets.noninteractive.fg_stroke.color,
+        );
+    }
+
     fn paint_playhead(&self, ui: &mut Ui, rect: Rect, response: &Response) {
         if let Some(pointer_pos) = response.hover_pos()
             && rect.contains(pointer_pos)
@@ -165,7 +225,7 @@ impl Timeline {
     }
 }
 
-fn format_time(time: f32) -> String {
+pub fn format_time(time: f32) -> String {
     let ms = (time * 1000.0).round() as u32;
     if ms < 60 * 1000 {
         format!("{}.{:03}", ms / 1000, ms % 1000)
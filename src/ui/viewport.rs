@@ -26,23 +26,26 @@ pub fn first_person_ui(
     timeline: &mut Timeline,
     run: &mut Run,
 ) {
-    let ps = run.game.ps();
-    let origin = Vec3::from(ps.origin) + vec3(0.0, 0.0, ps.viewheight as f32);
-    let viewangles = ps.viewangles;
     viewport(ui, move |info| {
-        renderer
-            .lock()
-            .unwrap()
-            .render(info, origin, viewangles.into());
+        renderer.lock().unwrap().render_first_person(info);
     });
+    let viewangles = run.game.ps().viewangles;
 
     let frame = timeline.frame();
 
-    if !run.can_seek_to(frame) {
+    // Showing an older frame while the seeker gets to this one
+    let icon = if run.is_seeking() {
+        Some("⏳")
+    } else if !run.can_seek_to(frame) {
+        Some("🚫")
+    } else {
+        None
+    };
+    if let Some(icon) = icon {
         ui.painter().text(
             ui.min_rect().center(),
             egui::Align2::CENTER_CENTER,
-            "🚫",
+            icon,
             egui::FontId::proportional(ui.min_size().min_elem()),
             egui::Color32::from_white_alpha(64),
         );
@@ -1,16 +1,24 @@
-use std::collections::HashMap;
+use std::borrow::Cow;
 use std::ffi::CStr;
-use std::io::{Read, Seek, SeekFrom};
+use std::io::{self, Read, Seek, SeekFrom, Write};
 use std::ops::{Add, BitAnd, BitOr, BitXor, Div, Mul, Neg, Not, Sub};
-use std::sync::Arc;
+use std::ptr;
+use std::sync::{Arc, Weak};
 
-use bit_set::BitSet;
-use bytemuck::{Pod, cast, from_bytes, from_bytes_mut, pod_read_unaligned};
-use byteorder::{LittleEndian, ReadBytesExt};
+use bytemuck::{Pod, bytes_of, cast, from_bytes, from_bytes_mut, pod_read_unaligned};
+use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
 
 use crate::Snapshot;
 use crate::q3::opcode_t::{Type as opcode_t, *};
 
+mod image;
+#[cfg(all(target_arch = "x86_64", unix))]
+mod jit;
+#[cfg(any(test, feature = "fixtures"))]
+pub mod test_qvm;
+
+use image::Image;
+
 const CHUNK_SIZE: usize = 64;
 
 #[derive(Clone, Debug)]
@@ -19,17 +27,83 @@ pub struct Instruction {
     pub arg: u32,
 }
 
-#[derive(Clone, Default)]
+/// Iterates over the indices of the set bits in a bitmap of chunks.
+fn iter_chunks(bitmap: &[u64]) -> impl Iterator<Item = usize> + '_ {
+    bitmap.iter().enumerate().flat_map(|(i, &word)| {
+        let mut word = word;
+        std::iter::from_fn(move || {
+            (word != 0).then(|| {
+                let bit = word.trailing_zeros() as usize;
+                word &= word - 1;
+                i * 64 + bit
+            })
+        })
+    })
+}
+
+/// Sets the bits for chunks `start..end`, a whole word at a time.
+fn set_chunks(bitmap: &mut [u64], start: usize, end: usize) {
+    if start >= end {
+        return;
+    }
+    let (first, last) = (start / 64, (end - 1) / 64);
+    let first_mask = !0 << (start % 64);
+    let last_mask = !0 >> (63 - (end - 1) % 64);
+    if first == last {
+        bitmap[first] |= first_mask & last_mask;
+    } else {
+        bitmap[first] |= first_mask;
+        bitmap[first + 1..last].fill(!0);
+        bitmap[last] |= last_mask;
+    }
+}
+
+#[derive(Default)]
 pub struct Memory {
-    data: Vec<u8>,
-    dirty: BitSet,
+    data: Image,
+
+    /// One bit per `CHUNK_SIZE` bytes of `data`, for the chunks written since memory was last
+    /// restored from a snapshot. This is a plain bitmap so that jitted code can update it directly.
+    dirty: Vec<u64>,
+
+    /// The snapshot memory was last restored from, which only the chunks in `dirty` can differ
+    /// from. Snapshots taken relative to it only have to look at those.
+    restored_from: Option<Weak<MemorySnapshot>>,
+
+    /// Chunks that were dirty before the last restore. Together with `dirty` and `restored` this
+    /// covers every chunk that may differ from the contents at the last `clear_dirty`.
+    changed: Vec<u64>,
+
+    /// Chunks recorded by the deltas of the snapshot last restored from, which memory can differ
+    /// from the baseline in without having written them. Replaced by every restore.
+    restored: Vec<u64>,
+
+    /// Chunks that were changed before the last `clear_dirty`. Together with the others this
+    /// covers every chunk that may differ from the contents `data` was created with.
+    modified: Vec<u64>,
+
+    /// Where `dirty` is set aside between `track_writes` and `hash_writes`, so that `dirty` only
+    /// has the chunks written in between.
+    dirty_before_writes: Vec<u64>,
+
+    /// The chunks a restore has yet to copy, kept between restores so they don't allocate.
+    pending: Vec<u64>,
 }
 
 impl Memory {
     pub fn new(mut data: Vec<u8>) -> Self {
         data.resize(data.len().next_multiple_of(CHUNK_SIZE), 0);
-        let dirty = BitSet::with_capacity(data.len() / CHUNK_SIZE);
-        Self { data, dirty }
+        let dirty = vec![0; (data.len() / CHUNK_SIZE).div_ceil(64)];
+        Self {
+            data: Image::new(data),
+            restored_from: None,
+            changed: dirty.clone(),
+            restored: dirty.clone(),
+            modified: dirty.clone(),
+            dirty_before_writes: dirty.clone(),
+            pending: dirty.clone(),
+            dirty,
+        }
     }
 
     pub fn size(&self) -> usize {
@@ -37,13 +111,62 @@ impl Memory {
     }
 
     pub fn clear_dirty(&mut self) {
-        self.dirty.clear();
+        for (((modified, changed), restored), dirty) in self
+            .modified
+            .iter_mut()
+            .zip(&mut self.changed)
+            .zip(&mut self.restored)
+            .zip(&mut self.dirty)
+        {
+            *modified |= std::mem::take(changed) | std::mem::take(restored) | std::mem::take(dirty);
+        }
+        self.restored_from = None;
+    }
+
+    /// Starts collecting the chunks written from now on by themselves, for `hash_writes`.
+    pub fn track_writes(&mut self) {
+        for (before, dirty) in self.dirty_before_writes.iter_mut().zip(&mut self.dirty) {
+            *before = std::mem::take(dirty);
+        }
+    }
+
+    /// A hash of every chunk written since `track_writes`, where they are and what's in them. They
+    /// go back to being tracked along with the rest afterwards.
+    pub fn hash_writes(&mut self) -> u64 {
+        let hash = iter_chunks(&self.dirty).fold(0u64, |hash, chunk| {
+            hash.wrapping_add(hash_chunk(
+                chunk,
+                &self.data[chunk * CHUNK_SIZE..][..CHUNK_SIZE],
+            ))
+        });
+        for (dirty, before) in self.dirty.iter_mut().zip(&self.dirty_before_writes) {
+            *dirty |= before;
+        }
+        hash
+    }
+
+    /// Every chunk that may differ from the contents at the last `clear_dirty`.
+    fn changed_since_clear(&self) -> Vec<u64> {
+        self.changed
+            .iter()
+            .zip(&self.restored)
+            .zip(&self.dirty)
+            .map(|((changed, restored), dirty)| changed | restored | dirty)
+            .collect()
     }
 
     pub fn set_dirty(&mut self, address: usize, size: usize) {
-        let (start, end) = (address / CHUNK_SIZE, (address + size).div_ceil(CHUNK_SIZE));
-        for chunk in start..end {
-            self.dirty.insert(chunk);
+        if size == 0 {
+            return;
+        }
+        let (first, last) = (address / CHUNK_SIZE, (address + size - 1) / CHUNK_SIZE);
+        if size <= CHUNK_SIZE {
+            // Every store is at most two chunks, and setting both bits is cheaper than checking
+            // whether they're the same one
+            self.dirty[first / 64] |= 1 << (first % 64);
+            self.dirty[last / 64] |= 1 << (last % 64);
+        } else {
+            set_chunks(&mut self.dirty, first, last + 1);
         }
     }
 
@@ -72,6 +195,15 @@ impl Memory {
         *self.cast_mut(address) = value;
     }
 
+    pub fn read_unaligned<T: Pod>(&self, address: u32) -> T {
+        pod_read_unaligned(self.slice(address as usize, size_of::<T>()))
+    }
+
+    pub fn write_unaligned<T: Pod>(&mut self, address: u32, value: T) {
+        self.slice_mut(address as usize, size_of::<T>())
+            .copy_from_slice(bytes_of(&value));
+    }
+
     pub fn cstr(&self, address: u32) -> &CStr {
         CStr::from_bytes_until_nul(&self.data[address as usize..]).unwrap()
     }
@@ -104,68 +236,811 @@ impl Memory {
     }
 }
 
+/// How many deltas can be chained before a snapshot is taken relative to the baseline again.
+/// Looking up a chunk or restoring a snapshot has to walk the whole chain.
+const MAX_DELTA_DEPTH: usize = 16;
+
+/// Hashes one chunk of memory so that the hash of all of memory is just the sum over its chunks,
+/// which lets a delta's hash be updated from its parent's by looking only at the chunks it changes.
+fn hash_chunk(chunk: usize, data: &[u8]) -> u64 {
+    const K: u64 = 0x9e3779b97f4a7c15;
+    let mut h = (chunk as u64 + 1).wrapping_mul(K);
+    for word in data.chunks_exact(8) {
+        h = (h.rotate_left(23) ^ u64::from_le_bytes(word.try_into().unwrap())).wrapping_mul(K);
+    }
+    // splitmix64 finalizer, so that sums of chunk hashes don't cancel out easily
+    h = (h ^ (h >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+    h = (h ^ (h >> 27)).wrapping_mul(0x94d049bb133111eb);
+    h ^ (h >> 31)
+}
+
+/// The contents of a delta's chunks, in the same order as its `chunks`.
+pub enum DeltaData {
+    /// Back to back.
+    Raw(Vec<u8>),
+
+    /// Each chunk packed by `pack_chunk`, with where each one starts in `data` and where the last
+    /// one ends.
+    Packed { data: Vec<u8>, offsets: Vec<u32> },
+}
+
+impl DeltaData {
+    fn pack(raw: &[u8]) -> Self {
+        let mut data = vec![];
+        let mut offsets = Vec::with_capacity(raw.len() / CHUNK_SIZE + 1);
+        offsets.push(0);
+        for chunk in raw.chunks_exact(CHUNK_SIZE) {
+            pack_chunk(chunk, &mut data);
+            offsets.push(data.len() as u32);
+        }
+        Self::Packed { data, offsets }
+    }
+
+    fn size(&self) -> usize {
+        match self {
+            Self::Raw(data) => data.len(),
+            Self::Packed { data, offsets } => data.len() + offsets.len() * size_of::<u32>(),
+        }
+    }
+
+    /// Copies the contents of the `i`th chunk into `dst`.
+    fn copy_to(&self, i: usize, dst: &mut [u8]) {
+        match self {
+            Self::Raw(data) => dst.copy_from_slice(&data[i * CHUNK_SIZE..][..CHUNK_SIZE]),
+            Self::Packed { data, offsets } => {
+                unpack_chunk(&data[offsets[i] as usize..offsets[i + 1] as usize], dst);
+            }
+        }
+    }
+
+    /// The contents of the `i`th chunk, unpacked into `buf` if they're packed.
+    fn get<'a>(&'a self, i: usize, buf: &'a mut [u8; CHUNK_SIZE]) -> &'a [u8] {
+        match self {
+            Self::Raw(data) => &data[i * CHUNK_SIZE..][..CHUNK_SIZE],
+            Self::Packed { .. } => {
+                self.copy_to(i, buf);
+                buf
+            }
+        }
+    }
+}
+
+// Packed chunks have one bit for each of their words
+const _: () = assert!(CHUNK_SIZE / 4 <= u16::BITS as usize);
+
+/// Packs a chunk as a mask of which of its 32-bit words aren't zero, followed by just those. Most
+/// of the game's memory is small numbers, flags and fields that are never used, so this is usually
+/// a lot smaller, and unpacking it is hardly slower than copying.
+fn pack_chunk(chunk: &[u8], out: &mut Vec<u8>) {
+    let is_set = |word: &&[u8]| word.iter().any(|&byte| byte != 0);
+    let words = chunk.chunks_exact(4);
+    let mask = words
+        .clone()
+        .enumerate()
+        .filter(|(_, word)| is_set(word))
+        .fold(0u16, |mask, (i, _)| mask | 1 << i);
+    out.extend_from_slice(&mask.to_le_bytes());
+    for word in words.filter(is_set) {
+        out.extend_from_slice(word);
+    }
+}
+
+fn unpack_chunk(packed: &[u8], dst: &mut [u8]) {
+    let mask = u16::from_le_bytes([packed[0], packed[1]]);
+    let mut words = packed[2..].chunks_exact(4);
+    for (i, dst) in dst.chunks_exact_mut(4).enumerate() {
+        if mask & 1 << i != 0 {
+            dst.copy_from_slice(words.next().unwrap());
+        } else {
+            dst.fill(0);
+        }
+    }
+}
+
+/// A copy of memory, either in full or as the chunks that differ from a parent snapshot.
 pub enum MemorySnapshot {
-    Baseline(Vec<u8>),
+    Baseline {
+        data: Vec<u8>,
+        /// See `MemorySnapshot::hash`.
+        hash: u64,
+    },
     Delta {
-        baseline: Arc<Self>,
-        chunks: HashMap<usize, Vec<u8>>,
+        parent: Arc<Self>,
+        /// See `MemorySnapshot::hash`.
+        hash: u64,
+        /// Number of deltas between this one and the baseline, including this one.
+        depth: usize,
+        /// Sorted indices of the chunks that differ from `parent`.
+        chunks: Vec<u32>,
+        data: DeltaData,
     },
 }
 
+impl MemorySnapshot {
+    /// Number of deltas between this snapshot and the baseline, including this one.
+    pub fn depth(&self) -> usize {
+        match self {
+            Self::Baseline { .. } => 0,
+            Self::Delta { depth, .. } => *depth,
+        }
+    }
+
+    /// A hash of the full contents of memory at the time the snapshot was taken, regardless of how
+    /// it's stored.
+    pub fn hash(&self) -> u64 {
+        match self {
+            Self::Baseline { hash, .. } | Self::Delta { hash, .. } => *hash,
+        }
+    }
+
+    /// Have this snapshot's chunks been packed by `rebased`?
+    pub fn is_packed(&self) -> bool {
+        matches!(
+            self,
+            Self::Delta {
+                data: DeltaData::Packed { .. },
+                ..
+            }
+        )
+    }
+
+    fn root(self: &Arc<Self>) -> &Arc<Self> {
+        let mut snapshot = self;
+        while let Self::Delta { parent, .. } = &**snapshot {
+            snapshot = parent;
+        }
+        snapshot
+    }
+
+    /// Bytes of chunk data held by this snapshot itself, not counting its parents.
+    pub fn size(&self) -> usize {
+        match self {
+            Self::Baseline { data, .. } => data.len(),
+            Self::Delta { chunks, data, .. } => data.size() + chunks.len() * size_of::<u32>(),
+        }
+    }
+
+    fn num_chunks(&self) -> usize {
+        let mut snapshot = self;
+        loop {
+            match snapshot {
+                Self::Baseline { data, .. } => return data.len() / CHUNK_SIZE,
+                Self::Delta { parent, .. } => snapshot = parent,
+            }
+        }
+    }
+
+    fn parent(&self) -> Option<&Self> {
+        match self {
+            Self::Baseline { .. } => None,
+            Self::Delta { parent, .. } => Some(parent),
+        }
+    }
+
+    /// The latest snapshot that both this one and `other` are deltas on top of, or either of them
+    /// if it's the other's ancestor. There's none if they don't share a baseline.
+    fn common_ancestor<'a>(&'a self, other: &'a Self) -> Option<&'a Self> {
+        let (mut a, mut b) = (self, other);
+        while a.depth() > b.depth() {
+            a = a.parent()?;
+        }
+        while b.depth() > a.depth() {
+            b = b.parent()?;
+        }
+        while !ptr::eq(a, b) {
+            a = a.parent()?;
+            b = b.parent()?;
+        }
+        Some(a)
+    }
+
+    /// Marks every chunk recorded by a delta between this snapshot and the baseline, which are the
+    /// only ones that can differ from it.
+    fn mark_changed(&self, bitmap: &mut [u64]) {
+        self.mark_changed_since(None, bitmap);
+    }
+
+    /// Like `mark_changed`, but only for the deltas after `ancestor`.
+    fn mark_changed_since(&self, ancestor: Option<&Self>, bitmap: &mut [u64]) {
+        let mut snapshot = self;
+        while let Self::Delta { parent, chunks, .. } = snapshot {
+            if ancestor.is_some_and(|ancestor| ptr::eq(snapshot, ancestor)) {
+                break;
+            }
+            for &chunk in chunks {
+                bitmap[chunk as usize / 64] |= 1 << (chunk % 64);
+            }
+            snapshot = parent;
+        }
+    }
+
+    /// The chunks whose contents differ from `other`'s, which must share the same baseline.
+    fn differing_chunks(&self, other: &Self) -> Vec<usize> {
+        let mut changed = vec![0u64; self.num_chunks().div_ceil(64)];
+        self.mark_changed(&mut changed);
+        other.mark_changed(&mut changed);
+
+        let (mut a, mut b) = ([0; CHUNK_SIZE], [0; CHUNK_SIZE]);
+        iter_chunks(&changed)
+            .filter(|&chunk| self.chunk(chunk, &mut a) != other.chunk(chunk, &mut b))
+            .collect()
+    }
+
+    /// Writes the chunks that differ from `previous`, which must share the same baseline, so that
+    /// `read` can rebuild this snapshot on top of it.
+    pub fn write(&self, previous: &Self, w: &mut impl Write) -> io::Result<()> {
+        let chunks = self.differing_chunks(previous);
+        w.write_u32::<LittleEndian>(chunks.len() as u32)?;
+        for &chunk in &chunks {
+            w.write_u32::<LittleEndian>(chunk as u32)?;
+        }
+        let mut buf = [0; CHUNK_SIZE];
+        for &chunk in &chunks {
+            w.write_all(self.chunk(chunk, &mut buf))?;
+        }
+        Ok(())
+    }
+
+    /// The same contents as this snapshot, stored as the chunks that differ from `parent` instead,
+    /// or from the baseline if there's no parent. `parent` must share the same baseline. Packing
+    /// the chunks makes the snapshot a lot smaller, but looking them up and restoring from it a
+    /// little slower.
+    pub fn rebased(self: &Arc<Self>, parent: Option<&Arc<Self>>, pack: bool) -> Arc<Self> {
+        let mut parent = parent.unwrap_or_else(|| self.root());
+        if parent.depth() >= MAX_DELTA_DEPTH {
+            parent = parent.root();
+        }
+
+        let chunks = self.differing_chunks(parent);
+        let mut data = Vec::with_capacity(chunks.len() * CHUNK_SIZE);
+        let mut buf = [0; CHUNK_SIZE];
+        for &chunk in &chunks {
+            data.extend_from_slice(self.chunk(chunk, &mut buf));
+        }
+        Arc::new(Self::Delta {
+            parent: Arc::clone(parent),
+            hash: self.hash(),
+            depth: parent.depth() + 1,
+            chunks: chunks.into_iter().map(|chunk| chunk as u32).collect(),
+            data: if pack {
+                DeltaData::pack(&data)
+            } else {
+                DeltaData::Raw(data)
+            },
+        })
+    }
+
+    /// Reads a snapshot written by `write` relative to `previous`.
+    pub fn read(previous: &Arc<Self>, r: &mut impl Read) -> io::Result<Arc<Self>> {
+        let num_chunks = r.read_u32::<LittleEndian>()? as usize;
+        // Checked before anything's allocated for them, since chunks can't repeat
+        if num_chunks > previous.num_chunks() {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "too many snapshot chunks",
+            ));
+        }
+        let mut chunks = vec![0u32; num_chunks];
+        r.read_u32_into::<LittleEndian>(&mut chunks)?;
+        let in_range = chunks
+            .last()
+            .is_none_or(|&c| (c as usize) < previous.num_chunks());
+        if !in_range || !chunks.is_sorted_by(|a, b| a < b) {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "bad snapshot chunks",
+            ));
+        }
+        let mut data = vec![0; num_chunks * CHUNK_SIZE];
+        r.read_exact(&mut data)?;
+
+        let mut buf = [0; CHUNK_SIZE];
+        let hash = chunks.iter().zip(data.chunks_exact(CHUNK_SIZE)).fold(
+            previous.hash(),
+            |hash, (&chunk, current)| {
+                let chunk = chunk as usize;
+                hash.wrapping_sub(hash_chunk(chunk, previous.chunk(chunk, &mut buf)))
+                    .wrapping_add(hash_chunk(chunk, current))
+            },
+        );
+        let snapshot = Arc::new(Self::Delta {
+            parent: Arc::clone(previous),
+            hash,
+            depth: previous.depth() + 1,
+            chunks,
+            data: DeltaData::Raw(data),
+        });
+        if snapshot.depth() <= MAX_DELTA_DEPTH {
+            return Ok(snapshot);
+        }
+
+        // Rebase it on the baseline so restoring stays cheap, like `take_snapshot` does
+        Ok(snapshot.rebased(None, false))
+    }
+
+    /// The contents of the given chunk at the time the snapshot was taken, unpacked into `buf` if
+    /// they're packed.
+    fn chunk<'a>(&'a self, chunk: usize, buf: &'a mut [u8; CHUNK_SIZE]) -> &'a [u8] {
+        let mut snapshot = self;
+        loop {
+            match snapshot {
+                Self::Baseline { data, .. } => return &data[chunk * CHUNK_SIZE..][..CHUNK_SIZE],
+                Self::Delta {
+                    parent,
+                    chunks,
+                    data,
+                    ..
+                } => {
+                    if let Ok(i) = chunks.binary_search(&(chunk as u32)) {
+                        return data.get(i, buf);
+                    }
+                    snapshot = parent;
+                }
+            }
+        }
+    }
+}
+
+/// Copies only the chunks that have changed since the memory was created, so it's cheap as long as
+/// most of it hasn't been touched.
+impl Clone for Memory {
+    fn clone(&self) -> Self {
+        let modified: Vec<u64> = self
+            .modified
+            .iter()
+            .zip(self.changed_since_clear())
+            .map(|(modified, changed)| modified | changed)
+            .collect();
+        Self {
+            data: self.data.copy(CHUNK_SIZE, iter_chunks(&modified)),
+            dirty: self.dirty.clone(),
+            restored_from: self.restored_from.clone(),
+            changed: self.changed.clone(),
+            restored: self.restored.clone(),
+            modified,
+            dirty_before_writes: vec![0; self.dirty.len()],
+            pending: vec![0; self.dirty.len()],
+        }
+    }
+}
+
 impl Snapshot for Memory {
     type Snapshot = Arc<MemorySnapshot>;
 
+    /// `baseline` must share a baseline with the snapshots memory was restored from, or capture the
+    /// contents memory had at the last `clear_dirty`.
+    ///
+    /// Only the dirty chunks are compared if `baseline` is the snapshot memory was last restored
+    /// from, which is the usual case of simulating forward from one snapshot to the next.
+    /// Otherwise it's every chunk that may differ from the baseline in either of them.
     fn take_snapshot(&self, baseline: Option<&Self::Snapshot>) -> Self::Snapshot {
-        if let Some(base_snap) = baseline
-            && let MemorySnapshot::Baseline(base_mem) = &**base_snap
-        {
-            Arc::new(MemorySnapshot::Delta {
-                baseline: Arc::clone(base_snap),
-                chunks: self
-                    .dirty
-                    .iter()
-                    .filter_map(|chunk| {
-                        let addr = chunk * CHUNK_SIZE;
-                        let data = &self.data[addr..][..CHUNK_SIZE];
-                        if data != &base_mem[addr..][..CHUNK_SIZE] {
-                            Some((addr, data.to_owned()))
-                        } else {
-                            None
-                        }
-                    })
-                    .collect(),
-            })
+        let Some(mut parent) = baseline else {
+            let hash = self
+                .data
+                .chunks_exact(CHUNK_SIZE)
+                .enumerate()
+                .fold(0u64, |hash, (chunk, data)| {
+                    hash.wrapping_add(hash_chunk(chunk, data))
+                });
+            return Arc::new(MemorySnapshot::Baseline {
+                data: self.data.to_vec(),
+                hash,
+            });
+        };
+
+        if parent.depth() >= MAX_DELTA_DEPTH {
+            parent = parent.root();
+        }
+
+        let restored_from_parent = self
+            .restored_from
+            .as_ref()
+            .is_some_and(|restored_from| Weak::as_ptr(restored_from) == Arc::as_ptr(parent));
+        let candidates = if restored_from_parent {
+            Cow::Borrowed(&self.dirty)
         } else {
-            Arc::new(MemorySnapshot::Baseline(self.data.clone()))
+            let mut candidates = self.changed_since_clear();
+            parent.mark_changed(&mut candidates);
+            Cow::Owned(candidates)
+        };
+
+        let mut chunks = vec![];
+        let mut data = vec![];
+        let mut hash = parent.hash();
+        let mut buf = [0; CHUNK_SIZE];
+        for chunk in iter_chunks(&candidates) {
+            let current = &self.data[chunk * CHUNK_SIZE..][..CHUNK_SIZE];
+            let previous = parent.chunk(chunk, &mut buf);
+            if current != previous {
+                chunks.push(chunk as u32);
+                data.extend_from_slice(current);
+                hash = hash
+                    .wrapping_sub(hash_chunk(chunk, previous))
+                    .wrapping_add(hash_chunk(chunk, current));
+            }
         }
+
+        Arc::new(MemorySnapshot::Delta {
+            parent: Arc::clone(parent),
+            hash,
+            depth: parent.depth() + 1,
+            chunks,
+            data: DeltaData::Raw(data),
+        })
     }
 
+    /// Only copies the chunks that may differ from `snapshot`. If memory was last restored from a
+    /// snapshot that's still around, those are the ones written since and the ones recorded by
+    /// either snapshot's deltas after the ones they share. Otherwise they're every chunk that may
+    /// differ from the baseline, and every one `snapshot` recorded.
     fn restore_from_snapshot(&mut self, snapshot: &Self::Snapshot) {
-        match &**snapshot {
-            MemorySnapshot::Baseline(baseline) => {
-                for chunk in &self.dirty {
-                    let addr = chunk * CHUNK_SIZE;
-                    self.data[addr..][..CHUNK_SIZE]
-                        .copy_from_slice(&baseline[addr..][..CHUNK_SIZE]);
-                }
+        let mut pending = std::mem::take(&mut self.pending);
+        pending.copy_from_slice(&self.dirty);
+        let restored_from = self.restored_from.as_ref().and_then(Weak::upgrade);
+        let common = restored_from.as_deref().and_then(|restored_from| {
+            Some((restored_from, restored_from.common_ancestor(snapshot)?))
+        });
+        if let Some((restored_from, common)) = common {
+            restored_from.mark_changed_since(Some(common), &mut pending);
+            snapshot.mark_changed_since(Some(common), &mut pending);
+        } else {
+            for ((pending, changed), restored) in
+                pending.iter_mut().zip(&self.changed).zip(&self.restored)
+            {
+                *pending |= changed | restored;
             }
-            MemorySnapshot::Delta { baseline, chunks } => {
-                self.restore_from_snapshot(baseline);
-                for (&addr, data) in chunks.iter() {
-                    self.data[addr..][..CHUNK_SIZE].copy_from_slice(data);
+            snapshot.mark_changed(&mut pending);
+        }
+
+        // Walk from the newest delta to the oldest so that each chunk is copied once, from its
+        // latest version, and stop as soon as there's nothing left
+        let mut remaining: usize = pending.iter().map(|word| word.count_ones() as usize).sum();
+        let mut level = &**snapshot;
+        while remaining != 0 {
+            match level {
+                MemorySnapshot::Baseline { data, .. } => {
+                    for chunk in iter_chunks(&pending) {
+                        let addr = chunk * CHUNK_SIZE;
+                        self.data[addr..][..CHUNK_SIZE]
+                            .copy_from_slice(&data[addr..][..CHUNK_SIZE]);
+                    }
+                    break;
+                }
+                MemorySnapshot::Delta {
+                    parent,
+                    chunks,
+                    data,
+                    ..
+                } => {
+                    for (i, &chunk) in chunks.iter().enumerate() {
+                        let (word, bit) = (chunk as usize / 64, 1 << (chunk % 64));
+                        if pending[word] & bit != 0 {
+                            pending[word] &= !bit;
+                            remaining -= 1;
+                            data.copy_to(
+                                i,
+                                &mut self.data[chunk as usize * CHUNK_SIZE..][..CHUNK_SIZE],
+                            );
+                        }
+                    }
+                    level = parent;
                 }
             }
         }
+
+        self.pending = pending;
+
+        // Nothing differs from the snapshot itself until it's written to again, and only the
+        // chunks it recorded can differ from the baseline. The dirty bitmap is cleared in place
+        // since jitted code may hold a pointer to it.
+        for (changed, dirty) in self.changed.iter_mut().zip(&mut self.dirty) {
+            *changed |= std::mem::take(dirty);
+        }
+        self.restored.fill(0);
+        snapshot.mark_changed(&mut self.restored);
+        self.restored_from = Some(Arc::downgrade(snapshot));
+    }
+}
+
+/// How `Vm::run` executes code. Every mode must produce bit-for-bit identical results, so they
+/// can be swapped freely to check each other.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, clap::ValueEnum)]
+pub enum ExecMode {
+    /// Dispatch on each `Instruction` exactly as it appears in the qvm.
+    #[default]
+    Interpreted,
+    /// Dispatch on the `Op`s built by `Vm::load`, which fuse common instruction sequences.
+    Predecoded,
+    /// Translate the code to native x86-64 the first time it is run.
+    #[cfg(all(target_arch = "x86_64", unix))]
+    Jit,
+}
+
+#[derive(Clone, Copy, Debug)]
+enum Cond {
+    Eq,
+    Ne,
+    LtI,
+    LeI,
+    GtI,
+    GeI,
+    LtU,
+    LeU,
+    GtU,
+    GeU,
+    EqF,
+    NeF,
+    LtF,
+    LeF,
+    GtF,
+    GeF,
+}
+
+impl Cond {
+    fn from_opcode(opcode: opcode_t) -> Option<Self> {
+        Some(match opcode {
+            OP_EQ => Self::Eq,
+            OP_NE => Self::Ne,
+            OP_LTI => Self::LtI,
+            OP_LEI => Self::LeI,
+            OP_GTI => Self::GtI,
+            OP_GEI => Self::GeI,
+            OP_LTU => Self::LtU,
+            OP_LEU => Self::LeU,
+            OP_GTU => Self::GtU,
+            OP_GEU => Self::GeU,
+            OP_EQF => Self::EqF,
+            OP_NEF => Self::NeF,
+            OP_LTF => Self::LtF,
+            OP_LEF => Self::LeF,
+            OP_GTF => Self::GtF,
+            OP_GEF => Self::GeF,
+            _ => return None,
+        })
+    }
+
+    #[inline(always)]
+    fn test(self, a: u32, b: u32) -> bool {
+        let (ai, bi) = (a as i32, b as i32);
+        let (af, bf) = (cast::<u32, f32>(a), cast::<u32, f32>(b));
+        match self {
+            Self::Eq => a == b,
+            Self::Ne => a != b,
+            Self::LtI => ai < bi,
+            Self::LeI => ai <= bi,
+            Self::GtI => ai > bi,
+            Self::GeI => ai >= bi,
+            Self::LtU => a < b,
+            Self::LeU => a <= b,
+            Self::GtU => a > b,
+            Self::GeU => a >= b,
+            Self::EqF => af == bf,
+            Self::NeF => af != bf,
+            Self::LtF => af < bf,
+            Self::LeF => af <= bf,
+            Self::GtF => af > bf,
+            Self::GeF => af >= bf,
+        }
+    }
+}
+
+/// An instruction decoded ahead of time for `ExecMode::Predecoded`.
+///
+/// There is exactly one `Op` per `Instruction` so that branch targets and return addresses mean
+/// the same thing in every mode. A fused op stands in for the sequence starting at its own index
+/// and skips over the rest, but the instructions it covers are still decoded individually in case
+/// something jumps into the middle of the sequence.
+#[derive(Clone, Copy, Debug)]
+enum Op {
+    Undefined,
+    Enter(u32),
+    Leave(u32),
+    Call,
+    Push,
+    Pop,
+    Const(u32),
+    Local(u32),
+    Jump,
+    Branch(Cond, u32),
+    Load1,
+    Load2,
+    Load4,
+    Store1,
+    Store2,
+    Store4,
+    Arg(u32),
+    BlockCopy(u32),
+    Sex8,
+    Sex16,
+    NegI,
+    Add,
+    Sub,
+    DivI,
+    DivU,
+    ModI,
+    ModU,
+    MulI,
+    MulU,
+    BAnd,
+    BOr,
+    BXor,
+    BCom,
+    Lsh,
+    RshI,
+    RshU,
+    NegF,
+    AddF,
+    SubF,
+    DivF,
+    MulF,
+    CvIF,
+    CvFI,
+
+    /// `OP_LOCAL`, `OP_LOAD4`
+    LocalLoad4(u32),
+    /// `OP_CONST`, `OP_LOAD4`
+    ConstLoad4(u32),
+    /// `OP_CONST`, `OP_ADD`
+    ConstAdd(u32),
+    /// `OP_CONST`, `OP_CALL`
+    ConstCall(u32),
+    /// `OP_CONST`, any conditional branch
+    ConstBranch(Cond, u32, u32),
+    /// `OP_LOCAL`, `OP_CONST`, `OP_STORE4`
+    LocalConstStore4(u32, u32),
+}
+
+impl Op {
+    fn decode(code: &[Instruction]) -> Vec<Self> {
+        let opcode_at = |i: usize| code.get(i).map_or(OP_UNDEF, |inst| inst.opcode);
+        let arg_at = |i: usize| code[i].arg;
+
+        (0..code.len())
+            .map(|i| {
+                let (first, second, third) = (opcode_at(i), opcode_at(i + 1), opcode_at(i + 2));
+                match (first, second, third) {
+                    (OP_LOCAL, OP_CONST, OP_STORE4) => {
+                        Self::LocalConstStore4(arg_at(i), arg_at(i + 1))
+                    }
+                    (OP_LOCAL, OP_LOAD4, _) => Self::LocalLoad4(arg_at(i)),
+                    (OP_CONST, OP_LOAD4, _) => Self::ConstLoad4(arg_at(i)),
+                    (OP_CONST, OP_ADD, _) => Self::ConstAdd(arg_at(i)),
+                    (OP_CONST, OP_CALL, _) => Self::ConstCall(arg_at(i)),
+                    _ => match (first, Cond::from_opcode(second)) {
+                        (OP_CONST, Some(cond)) => Self::ConstBranch(cond, arg_at(i), arg_at(i + 1)),
+                        _ => Self::decode_single(&code[i]),
+                    },
+                }
+            })
+            .collect()
+    }
+
+    fn decode_single(&Instruction { opcode, arg }: &Instruction) -> Self {
+        if let Some(cond) = Cond::from_opcode(opcode) {
+            return Self::Branch(cond, arg);
+        }
+
+        match opcode {
+            OP_ENTER => Self::Enter(arg),
+            OP_LEAVE => Self::Leave(arg),
+            OP_CALL => Self::Call,
+            OP_PUSH => Self::Push,
+            OP_POP => Self::Pop,
+            OP_CONST => Self::Const(arg),
+            OP_LOCAL => Self::Local(arg),
+            OP_JUMP => Self::Jump,
+            OP_LOAD1 => Self::Load1,
+            OP_LOAD2 => Self::Load2,
+            OP_LOAD4 => Self::Load4,
+            OP_STORE1 => Self::Store1,
+            OP_STORE2 => Self::Store2,
+            OP_STORE4 => Self::Store4,
+            OP_ARG => Self::Arg(arg),
+            OP_BLOCK_COPY => Self::BlockCopy(arg),
+            OP_SEX8 => Self::Sex8,
+            OP_SEX16 => Self::Sex16,
+            OP_NEGI => Self::NegI,
+            OP_ADD => Self::Add,
+            OP_SUB => Self::Sub,
+            OP_DIVI => Self::DivI,
+            OP_DIVU => Self::DivU,
+            OP_MODI => Self::ModI,
+            OP_MODU => Self::ModU,
+            OP_MULI => Self::MulI,
+            OP_MULU => Self::MulU,
+            OP_BAND => Self::BAnd,
+            OP_BOR => Self::BOr,
+            OP_BXOR => Self::BXor,
+            OP_BCOM => Self::BCom,
+            OP_LSH => Self::Lsh,
+            OP_RSHI => Self::RshI,
+            OP_RSHU => Self::RshU,
+            OP_NEGF => Self::NegF,
+            OP_ADDF => Self::AddF,
+            OP_SUBF => Self::SubF,
+            OP_DIVF => Self::DivF,
+            OP_MULF => Self::MulF,
+            OP_CVIF => Self::CvIF,
+            OP_CVFI => Self::CvFI,
+            _ => Self::Undefined,
+        }
+    }
+}
+
+const OP_STACK_SIZE: usize = 256;
+
+/// The operand stack used by `ExecMode::Predecoded`.
+///
+/// Like ioquake3's interpreter, the top index is a `u8` that wraps around instead of being
+/// checked, so no push or pop can go out of bounds.
+struct OpStack {
+    data: [u32; OP_STACK_SIZE],
+    top: u8,
+}
+
+impl OpStack {
+    fn new(values: &[u32]) -> Self {
+        assert!(values.len() < OP_STACK_SIZE);
+        let mut stack = Self {
+            data: [0; OP_STACK_SIZE],
+            top: 0,
+        };
+        values.iter().for_each(|&value| stack.push(value));
+        stack
+    }
+
+    fn as_slice(&self) -> &[u32] {
+        &self.data[..self.top as usize]
+    }
+
+    #[inline(always)]
+    fn push(&mut self, value: u32) {
+        self.data[self.top as usize] = value;
+        self.top = self.top.wrapping_add(1);
+    }
+
+    #[inline(always)]
+    fn pop(&mut self) -> u32 {
+        self.top = self.top.wrapping_sub(1);
+        self.data[self.top as usize]
+    }
+
+    #[inline(always)]
+    fn unary_op<F, T>(&mut self, f: F)
+    where
+        F: Fn(T) -> T,
+        T: Pod,
+    {
+        let x = cast(self.pop());
+        self.push(cast(f(x)));
+    }
+
+    #[inline(always)]
+    fn binary_op<F, T>(&mut self, f: F)
+    where
+        F: Fn(T, T) -> T,
+        T: Pod,
+    {
+        let b = cast(self.pop());
+        let a = cast(self.pop());
+        self.push(cast(f(a, b)));
     }
 }
 
 #[derive(Clone, Default)]
 pub struct Vm {
-    pub code: Vec<Instruction>,
+    /// Never changes after loading, so it's shared between clones.
+    pub code: Arc<[Instruction]>,
+    ops: Arc<[Op]>,
+    pub mode: ExecMode,
+    #[cfg(all(target_arch = "x86_64", unix))]
+    jit: Option<Arc<jit::Jit>>,
     pub memory: Memory,
     pub pc: u32,
     pub program_stack: u32,
     pub op_stack: Vec<u32>,
+    #[cfg(feature = "profile")]
+    pub recorder: Option<Box<crate::profile::Recorder>>,
 }
 
 #[derive(Clone, Copy, Debug)]
@@ -186,7 +1061,7 @@ impl Vm {
         let bss_length = reader.read_u32::<LittleEndian>()? as usize;
 
         reader.seek(SeekFrom::Start(code_offset.into()))?;
-        self.code.clear();
+        let mut code = Vec::with_capacity(instruction_count as usize);
         for _ in 0..instruction_count {
             let opcode = reader.read_u8()? as opcode_t;
             let arg = match opcode {
@@ -199,7 +1074,13 @@ impl Vm {
                 _ => 0,
             };
 
-            self.code.push(Instruction { opcode, arg });
+            code.push(Instruction { opcode, arg });
+        }
+        self.ops = Op::decode(&code).into();
+        self.code = code.into();
+        #[cfg(all(target_arch = "x86_64", unix))]
+        {
+            self.jit = None;
         }
 
         reader.seek(SeekFrom::Start(data_offset.into()))?;
@@ -270,16 +1151,196 @@ impl Vm {
     }
 
     pub fn run(&mut self) -> ExitReason {
-        loop {
-            if let Some(exit_reason) = self.step() {
-                return exit_reason;
+        match self.mode {
+            ExecMode::Interpreted => loop {
+                if let Some(exit_reason) = self.step() {
+                    return exit_reason;
+                }
+            },
+            ExecMode::Predecoded => self.run_predecoded(),
+            #[cfg(all(target_arch = "x86_64", unix))]
+            ExecMode::Jit => {
+                let jit = self.jit.get_or_insert_with(|| {
+                    Arc::new(jit::Jit::compile(&self.code, self.memory.size()))
+                });
+                Arc::clone(jit).run(self)
             }
         }
     }
 
+    fn run_predecoded(&mut self) -> ExitReason {
+        let mut stack = OpStack::new(&self.op_stack);
+        let mut pc = self.pc;
+
+        let exit_reason = loop {
+            let op = self.ops[pc as usize];
+            pc += 1;
+            match op {
+                Op::Enter(size) => {
+                    let old_stack = self.program_stack;
+                    self.program_stack -= size;
+                    self.memory
+                        .write_unaligned(self.program_stack + 4, old_stack);
+                }
+                Op::Leave(size) => {
+                    self.program_stack += size;
+                    pc = self.memory.read_unaligned(self.program_stack);
+                    if pc == 0xdeadbeef {
+                        self.program_stack = self.memory.read_unaligned(self.program_stack + 4);
+                        break ExitReason::Return;
+                    }
+                }
+                Op::Call => {
+                    let target = stack.pop();
+                    if (target as i32) < 0 {
+                        break ExitReason::Syscall((-(target as i32) - 1) as u32);
+                    }
+                    self.memory.write_unaligned(self.program_stack, pc);
+                    pc = target;
+                }
+                Op::Push => stack.push(0),
+                Op::Pop => {
+                    stack.pop();
+                }
+                Op::Const(value) => stack.push(value),
+                Op::Local(offset) => stack.push(self.program_stack + offset),
+                Op::Jump => pc = stack.pop(),
+                Op::Branch(cond, target) => {
+                    let b = stack.pop();
+                    let a = stack.pop();
+                    if cond.test(a, b) {
+                        pc = target;
+                    }
+                }
+                Op::Load1 => {
+                    let address = stack.pop();
+                    stack.push(self.memory.read_unaligned::<u8>(address) as u32);
+                }
+                Op::Load2 => {
+                    let address = stack.pop();
+                    stack.push(self.memory.read_unaligned::<u16>(address) as u32);
+                }
+                Op::Load4 => {
+                    let address = stack.pop();
+                    stack.push(self.memory.read_unaligned(address));
+                }
+                Op::Store1 => {
+                    let value = stack.pop() as u8;
+                    let address = stack.pop();
+                    self.memory.write_unaligned(address, value);
+                }
+                Op::Store2 => {
+                    let value = stack.pop() as u16;
+                    let address = stack.pop();
+                    self.memory.write_unaligned(address, value);
+                }
+                Op::Store4 => {
+                    let value = stack.pop();
+                    let address = stack.pop();
+                    self.memory.write_unaligned(address, value);
+                }
+                Op::Arg(offset) => {
+                    let value = stack.pop();
+                    self.memory
+                        .write_unaligned(self.program_stack + offset, value);
+                }
+                Op::BlockCopy(size) => {
+                    let src = stack.pop();
+                    let dst = stack.pop();
+                    self.memory.memcpy(dst, src, size);
+                }
+                Op::Sex8 => {
+                    let value = stack.pop();
+                    stack.push(value as i8 as i32 as u32);
+                }
+                Op::Sex16 => {
+                    let value = stack.pop();
+                    stack.push(value as i16 as i32 as u32);
+                }
+                Op::NegI => stack.unary_op(i32::wrapping_neg),
+                Op::Add => stack.binary_op(u32::wrapping_add),
+                Op::Sub => stack.binary_op(u32::wrapping_sub),
+                Op::DivI => stack.binary_op(i32::wrapping_div),
+                Op::DivU => stack.binary_op(u32::wrapping_div),
+                Op::ModI => stack.binary_op(i32::wrapping_rem),
+                Op::ModU => stack.binary_op(u32::wrapping_rem),
+                Op::MulI => stack.binary_op(i32::wrapping_mul),
+                Op::MulU => stack.binary_op(u32::wrapping_mul),
+                Op::BAnd => stack.binary_op(u32::bitand),
+                Op::BOr => stack.binary_op(u32::bitor),
+                Op::BXor => stack.binary_op(u32::bitxor),
+                Op::BCom => stack.unary_op(u32::not),
+                Op::Lsh => stack.binary_op(u32::wrapping_shl),
+                Op::RshI => stack.binary_op(|a: i32, b: i32| a.wrapping_shr(b as u32)),
+                Op::RshU => stack.binary_op(u32::wrapping_shr),
+                Op::NegF => stack.unary_op(<f32>::neg),
+                Op::AddF => stack.binary_op(<f32>::add),
+                Op::SubF => stack.binary_op(<f32>::sub),
+                Op::DivF => stack.binary_op(<f32>::div),
+                Op::MulF => stack.binary_op(<f32>::mul),
+                Op::CvIF => {
+                    let value = stack.pop();
+                    stack.push(cast(value as i32 as f32));
+                }
+                Op::CvFI => {
+                    let value: f32 = cast(stack.pop());
+                    stack.push(value as i32 as u32);
+                }
+                Op::LocalLoad4(offset) => {
+                    pc += 1;
+                    stack.push(self.memory.read_unaligned(self.program_stack + offset));
+                }
+                Op::ConstLoad4(address) => {
+                    pc += 1;
+                    stack.push(self.memory.read_unaligned(address));
+                }
+                Op::ConstAdd(value) => {
+                    pc += 1;
+                    let a = stack.pop();
+                    stack.push(a.wrapping_add(value));
+                }
+                Op::ConstCall(target) => {
+                    pc += 1;
+                    if (target as i32) < 0 {
+                        break ExitReason::Syscall((-(target as i32) - 1) as u32);
+                    }
+                    self.memory.write_unaligned(self.program_stack, pc);
+                    pc = target;
+                }
+                Op::ConstBranch(cond, b, target) => {
+                    pc += 1;
+                    let a = stack.pop();
+                    if cond.test(a, b) {
+                        pc = target;
+                    }
+                }
+                Op::LocalConstStore4(offset, value) => {
+                    pc += 2;
+                    self.memory
+                        .write_unaligned(self.program_stack + offset, value);
+                }
+                Op::Undefined => unimplemented!(),
+            }
+        };
+
+        self.pc = pc;
+        self.op_stack.clear();
+        self.op_stack.extend_from_slice(stack.as_slice());
+        exit_reason
+    }
+
     pub fn step(&mut self) -> Option<ExitReason> {
         let &Instruction { opcode, arg } = &self.code[self.pc as usize];
         // println!("{}: {opcode:?} {arg:#x}", self.pc);
+        #[cfg(feature = "profile")]
+        if let Some(recorder) = &mut self.recorder {
+            recorder.instruction();
+            match opcode {
+                OP_ENTER => recorder.enter(self.pc),
+                OP_LEAVE => recorder.leave(),
+                _ => {}
+            }
+        }
         self.pc += 1;
         match opcode {
             OP_ENTER => {
@@ -421,3 +1482,71 @@ impl Snapshot for Vm {
         self.memory.restore_from_snapshot(snapshot);
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Restoring a snapshot gives back exactly what it captured, wherever memory has got to since
+    /// and whether or not the snapshot it was last restored from is still around.
+    #[test]
+    fn restore_gives_back_snapshot() {
+        const SIZE: usize = 1024 * CHUNK_SIZE;
+
+        // xorshift, so failures can be reproduced
+        let mut state = 0x9e37_79b9_7f4a_7c15u64;
+        let mut random = move |n: usize| {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            (state % n as u64) as usize
+        };
+
+        let mut memory = Memory::new(vec![0; SIZE]);
+        let mut snapshots = vec![(memory.take_snapshot(None), vec![0; SIZE])];
+        for _ in 0..5000 {
+            match random(17) {
+                0..=8 => {
+                    for _ in 0..=random(8) {
+                        memory.write(random(SIZE) as u32, random(256) as u8);
+                    }
+                }
+                9..=11 => {
+                    let parent = &snapshots[random(snapshots.len())].0;
+                    let snapshot = memory.take_snapshot(Some(parent));
+                    snapshots.push((snapshot, memory.slice(0, SIZE).to_vec()));
+                }
+                12 | 13 => {
+                    let (snapshot, contents) = &snapshots[random(snapshots.len())];
+                    memory.restore_from_snapshot(snapshot);
+                    assert!(memory.slice(0, SIZE) == contents);
+                }
+                14 if snapshots.len() > 1 => {
+                    // Often the last one restored from, which is then only around while there are
+                    // snapshots on top of it
+                    let i = 1 + random(snapshots.len() - 1);
+                    let (snapshot, contents) = snapshots.swap_remove(i);
+                    if random(2) == 0 {
+                        memory.restore_from_snapshot(&snapshot);
+                        assert!(memory.slice(0, SIZE) == contents);
+                    }
+                }
+                15 => memory = memory.clone(),
+                _ => {
+                    // Back where it started, so everything else can be forgotten
+                    memory.restore_from_snapshot(&snapshots[0].0);
+                    memory.clear_dirty();
+                }
+            }
+        }
+    }
+
+    /// A snapshot claiming more chunks than memory has is an error rather than a huge allocation.
+    #[test]
+    fn read_rejects_huge_chunk_count() {
+        let memory = Memory::new(vec![0; 4 * CHUNK_SIZE]);
+        let baseline = memory.take_snapshot(None);
+        let mut r = io::Cursor::new(u32::MAX.to_le_bytes());
+        assert!(MemorySnapshot::read(&baseline, &mut r).is_err());
+    }
+}
@@ -0,0 +1,167 @@
+//! The bytes behind `Memory`, which can be copied in time proportional to how much of it has
+//! changed since it was created.
+//!
+//! On Linux the initial contents are written once to an anonymous file, and every copy is a private
+//! mapping of that file. The kernel shares pages between mappings until they're written to, so a
+//! copy only has to bring over the chunks that differ from the initial contents. Elsewhere it's
+//! just a `Vec`.
+
+use std::ops::{Deref, DerefMut};
+
+#[cfg(target_os = "linux")]
+pub use linux::Image;
+
+#[cfg(not(target_os = "linux"))]
+#[derive(Default)]
+pub struct Image(Vec<u8>);
+
+#[cfg(not(target_os = "linux"))]
+impl Image {
+    pub fn new(data: Vec<u8>) -> Self {
+        Self(data)
+    }
+
+    /// A copy of this image. Only `changed` chunks may differ from the initial contents.
+    pub fn copy(&self, _chunk_size: usize, _changed: impl Iterator<Item = usize>) -> Self {
+        Self(self.0.clone())
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+impl Deref for Image {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.0
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+impl DerefMut for Image {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        &mut self.0
+    }
+}
+
+#[cfg(target_os = "linux")]
+mod linux {
+    use std::{
+        os::fd::{AsRawFd, FromRawFd, OwnedFd},
+        ptr::{NonNull, null_mut},
+        sync::Arc,
+    };
+
+    use super::*;
+
+    pub struct Image {
+        /// Holds the initial contents, or `None` if there are none.
+        file: Option<Arc<OwnedFd>>,
+        ptr: NonNull<u8>,
+        len: usize,
+    }
+
+    // An image owns its mapping exclusively, like a `Vec` owns its allocation
+    unsafe impl Send for Image {}
+    unsafe impl Sync for Image {}
+
+    impl Default for Image {
+        fn default() -> Self {
+            Self {
+                file: None,
+                ptr: NonNull::dangling(),
+                len: 0,
+            }
+        }
+    }
+
+    impl Image {
+        pub fn new(data: Vec<u8>) -> Self {
+            if data.is_empty() {
+                return Self::default();
+            }
+
+            let file = unsafe {
+                let fd = libc::memfd_create(c"qvm".as_ptr(), libc::MFD_CLOEXEC);
+                assert!(fd >= 0, "memfd_create failed");
+                OwnedFd::from_raw_fd(fd)
+            };
+            assert_eq!(
+                unsafe { libc::ftruncate(file.as_raw_fd(), data.len() as libc::off_t) },
+                0,
+                "ftruncate failed"
+            );
+
+            let shared = map(&file, data.len(), libc::MAP_SHARED);
+            unsafe {
+                shared
+                    .as_ptr()
+                    .copy_from_nonoverlapping(data.as_ptr(), data.len());
+                libc::munmap(shared.as_ptr().cast(), data.len());
+            }
+
+            Self {
+                ptr: map(&file, data.len(), libc::MAP_PRIVATE),
+                file: Some(Arc::new(file)),
+                len: data.len(),
+            }
+        }
+
+        /// A copy of this image. Only `changed` chunks may differ from the initial contents.
+        pub fn copy(&self, chunk_size: usize, changed: impl Iterator<Item = usize>) -> Self {
+            let Some(file) = &self.file else {
+                return Self::default();
+            };
+
+            let mut copy = Self {
+                file: Some(Arc::clone(file)),
+                ptr: map(file, self.len, libc::MAP_PRIVATE),
+                len: self.len,
+            };
+            for chunk in changed {
+                let range = chunk * chunk_size..(chunk + 1) * chunk_size;
+                // Chunks that are back to their initial contents can keep sharing their pages
+                if copy[range.clone()] != self[range.clone()] {
+                    copy[range.clone()].copy_from_slice(&self[range]);
+                }
+            }
+            copy
+        }
+    }
+
+    fn map(file: &OwnedFd, len: usize, flags: i32) -> NonNull<u8> {
+        let ptr = unsafe {
+            libc::mmap(
+                null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                flags,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        assert!(ptr != libc::MAP_FAILED, "mmap failed");
+        NonNull::new(ptr.cast()).unwrap()
+    }
+
+    impl Drop for Image {
+        fn drop(&mut self) {
+            if self.file.is_some() {
+                unsafe { libc::munmap(self.ptr.as_ptr().cast(), self.len) };
+            }
+        }
+    }
+
+    impl Deref for Image {
+        type Target = [u8];
+
+        fn deref(&self) -> &[u8] {
+            unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+        }
+    }
+
+    impl DerefMut for Image {
+        fn deref_mut(&mut self) -> &mut [u8] {
+            unsafe { std::slice::from_raw_parts_mut(self.ptr.as_ptr(), self.len) }
+        }
+    }
+}
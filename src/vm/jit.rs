@@ -0,0 +1,1089 @@
+//! Translates qvm bytecode to x86-64 machine code, in the spirit of ioquake3's `vm_x86.c`.
+//!
+//! The generated code keeps no state in registers between instructions. The operand stack lives
+//! in memory and every instruction has its own entry point, so execution can stop at a syscall,
+//! return to Rust, and later pick up again at any instruction index exactly like the interpreter.
+//! qvm calls and returns are plain jumps through the table of entry points since the return
+//! addresses already live on the program stack in qvm memory.
+//!
+//! Register assignment while running jitted code:
+//!
+//! * `rbp`: the `Context` for this run
+//! * `rbx`: index of the top of the operand stack, only ever modified through `bl` so it wraps
+//!   around the same way as `OpStack`
+//! * `r12`: base of qvm memory
+//! * `r13`: base of the dirty chunk bitmap
+//! * `r14`: base of the operand stack
+//! * `r15d`: program stack
+
+use std::{mem::offset_of, ptr};
+
+use bytemuck::cast;
+
+use super::{CHUNK_SIZE, ExitReason, Instruction, Memory, OpStack, Vm};
+use crate::q3::opcode_t::*;
+
+const RAX: u8 = 0;
+const RCX: u8 = 1;
+const RDX: u8 = 2;
+const RBX: u8 = 3;
+const RSP: u8 = 4;
+const RBP: u8 = 5;
+const RSI: u8 = 6;
+const RDI: u8 = 7;
+const R8: u8 = 8;
+const R12: u8 = 12;
+const R13: u8 = 13;
+const R14: u8 = 14;
+const R15: u8 = 15;
+
+const XMM0: u8 = 0;
+const XMM1: u8 = 1;
+
+// Condition codes for `jcc`
+const CC_P: u8 = 0xa;
+const CC_B: u8 = 0x2;
+const CC_AE: u8 = 0x3;
+const CC_E: u8 = 0x4;
+const CC_NE: u8 = 0x5;
+const CC_BE: u8 = 0x6;
+const CC_A: u8 = 0x7;
+const CC_NS: u8 = 0x9;
+const CC_L: u8 = 0xc;
+const CC_GE: u8 = 0xd;
+const CC_LE: u8 = 0xe;
+const CC_G: u8 = 0xf;
+
+const EXIT_RETURN: u32 = 0;
+const EXIT_SYSCALL: u32 = 1;
+const EXIT_BAD_ADDRESS: u32 = 2;
+const EXIT_BAD_PC: u32 = 3;
+const EXIT_DIVIDE_BY_ZERO: u32 = 4;
+const EXIT_BAD_OPCODE: u32 = 5;
+
+/// Everything jitted code needs to know about the `Vm` it's running on, and everything it hands
+/// back when it exits.
+#[repr(C)]
+struct Context {
+    memory: *mut u8,
+    dirty: *mut u64,
+    op_stack: *mut u32,
+    targets: *const usize,
+    vm_memory: *mut Memory,
+    pc: u32,
+    program_stack: u32,
+    op_stack_top: u32,
+    syscall: u32,
+}
+
+/// A memory operand of the form `[base + index * (1 << scale) + disp]`.
+#[derive(Clone, Copy)]
+struct Mem {
+    base: u8,
+    index: Option<(u8, u8)>,
+    disp: i32,
+}
+
+impl Mem {
+    fn base(base: u8, disp: i32) -> Self {
+        Self {
+            base,
+            index: None,
+            disp,
+        }
+    }
+
+    fn indexed(base: u8, index: u8, scale: u8, disp: i32) -> Self {
+        Self {
+            base,
+            index: Some((index, scale)),
+            disp,
+        }
+    }
+
+    /// The top of the operand stack.
+    fn top() -> Self {
+        Self::indexed(R14, RBX, 2, 0)
+    }
+
+    fn context(offset: usize) -> Self {
+        Self::base(RBP, offset as i32)
+    }
+}
+
+type Label = usize;
+
+#[derive(Default)]
+struct Assembler {
+    code: Vec<u8>,
+    labels: Vec<Option<usize>>,
+    fixups: Vec<(usize, Label)>,
+}
+
+impl Assembler {
+    fn new_label(&mut self) -> Label {
+        self.labels.push(None);
+        self.labels.len() - 1
+    }
+
+    fn bind(&mut self, label: Label) {
+        assert!(self.labels[label].is_none());
+        self.labels[label] = Some(self.code.len());
+    }
+
+    fn emit(&mut self, bytes: &[u8]) {
+        self.code.extend_from_slice(bytes);
+    }
+
+    fn rel32(&mut self, label: Label) {
+        self.fixups.push((self.code.len(), label));
+        self.emit(&[0; 4]);
+    }
+
+    fn finish(mut self) -> (Vec<u8>, Vec<Option<usize>>) {
+        for &(position, label) in &self.fixups {
+            let target = self.labels[label].unwrap();
+            let rel = target as i32 - (position + 4) as i32;
+            self.code[position..][..4].copy_from_slice(&rel.to_le_bytes());
+        }
+        (self.code, self.labels)
+    }
+
+    fn rex(&mut self, w: bool, reg: u8, index: u8, base: u8) {
+        let rex = 0x40 | (w as u8) << 3 | (reg >> 3) << 2 | (index >> 3) << 1 | (base >> 3);
+        if rex != 0x40 {
+            self.emit(&[rex]);
+        }
+    }
+
+    /// An instruction with a register (or opcode extension) and a memory operand.
+    fn op_mem(&mut self, prefix: &[u8], w: bool, opcode: &[u8], reg: u8, mem: Mem) {
+        let (index, scale) = mem.index.unwrap_or((RSP, 0));
+        assert!(index != RSP || mem.index.is_none());
+
+        self.emit(prefix);
+        self.rex(w, reg, index, mem.base);
+        self.emit(opcode);
+
+        let needs_sib = mem.index.is_some() || mem.base & 7 == RSP;
+        let rm = if needs_sib { 4 } else { mem.base & 7 };
+        let mode = if mem.disp == 0 && mem.base & 7 != RBP {
+            0
+        } else if i8::try_from(mem.disp).is_ok() {
+            1
+        } else {
+            2
+        };
+
+        self.emit(&[mode << 6 | (reg & 7) << 3 | rm]);
+        if needs_sib {
+            self.emit(&[scale << 6 | (index & 7) << 3 | (mem.base & 7)]);
+        }
+        match mode {
+            1 => self.emit(&[mem.disp as i8 as u8]),
+            2 => self.emit(&mem.disp.to_le_bytes()),
+            _ => {}
+        }
+    }
+
+    /// An instruction with two register operands.
+    fn op_reg(&mut self, prefix: &[u8], w: bool, opcode: &[u8], reg: u8, rm: u8) {
+        self.emit(prefix);
+        self.rex(w, reg, 0, rm);
+        self.emit(opcode);
+        self.emit(&[0xc0 | (reg & 7) << 3 | (rm & 7)]);
+    }
+
+    fn load32(&mut self, reg: u8, mem: Mem) {
+        self.op_mem(&[], false, &[0x8b], reg, mem);
+    }
+
+    fn load64(&mut self, reg: u8, mem: Mem) {
+        self.op_mem(&[], true, &[0x8b], reg, mem);
+    }
+
+    fn store8(&mut self, mem: Mem, reg: u8) {
+        self.op_mem(&[], false, &[0x88], reg, mem);
+    }
+
+    fn store16(&mut self, mem: Mem, reg: u8) {
+        self.op_mem(&[0x66], false, &[0x89], reg, mem);
+    }
+
+    fn store32(&mut self, mem: Mem, reg: u8) {
+        self.op_mem(&[], false, &[0x89], reg, mem);
+    }
+
+    fn store64(&mut self, mem: Mem, reg: u8) {
+        self.op_mem(&[], true, &[0x89], reg, mem);
+    }
+
+    fn store32_imm(&mut self, mem: Mem, imm: u32) {
+        self.op_mem(&[], false, &[0xc7], 0, mem);
+        self.emit(&imm.to_le_bytes());
+    }
+
+    fn mov32(&mut self, dst: u8, src: u8) {
+        self.op_reg(&[], false, &[0x89], src, dst);
+    }
+
+    fn mov32_imm(&mut self, reg: u8, imm: u32) {
+        self.rex(false, 0, 0, reg);
+        self.emit(&[0xb8 + (reg & 7)]);
+        self.emit(&imm.to_le_bytes());
+    }
+
+    fn mov64_imm(&mut self, reg: u8, imm: u64) {
+        self.rex(true, 0, 0, reg);
+        self.emit(&[0xb8 + (reg & 7)]);
+        self.emit(&imm.to_le_bytes());
+    }
+
+    fn lea32(&mut self, reg: u8, mem: Mem) {
+        self.op_mem(&[], false, &[0x8d], reg, mem);
+    }
+
+    /// `opcode` is one of the `op r/m32, r32` forms, e.g. `0x01` for `add`.
+    fn alu_mem(&mut self, opcode: u8, mem: Mem, reg: u8) {
+        self.op_mem(&[], false, &[opcode], reg, mem);
+    }
+
+    fn alu_reg(&mut self, opcode: u8, dst: u8, src: u8) {
+        self.op_reg(&[], false, &[opcode], src, dst);
+    }
+
+    /// `ext` selects the operation of the `0x81` group, e.g. `7` for `cmp`.
+    fn alu_imm(&mut self, ext: u8, reg: u8, imm: u32) {
+        self.op_reg(&[], false, &[0x81], ext, reg);
+        self.emit(&imm.to_le_bytes());
+    }
+
+    fn alu_mem_imm(&mut self, ext: u8, mem: Mem, imm: u32) {
+        self.op_mem(&[], false, &[0x81], ext, mem);
+        self.emit(&imm.to_le_bytes());
+    }
+
+    fn cmp_imm(&mut self, reg: u8, imm: u32) {
+        self.alu_imm(7, reg, imm);
+    }
+
+    fn add_imm(&mut self, reg: u8, imm: u32) {
+        self.alu_imm(0, reg, imm);
+    }
+
+    fn sub_imm(&mut self, reg: u8, imm: u32) {
+        self.alu_imm(5, reg, imm);
+    }
+
+    fn shr_imm(&mut self, reg: u8, imm: u8) {
+        self.op_reg(&[], false, &[0xc1], 5, reg);
+        self.emit(&[imm]);
+    }
+
+    fn test32(&mut self, a: u8, b: u8) {
+        self.op_reg(&[], false, &[0x85], b, a);
+    }
+
+    fn push(&mut self, reg: u8) {
+        self.rex(false, 0, 0, reg);
+        self.emit(&[0x50 + (reg & 7)]);
+    }
+
+    fn pop(&mut self, reg: u8) {
+        self.rex(false, 0, 0, reg);
+        self.emit(&[0x58 + (reg & 7)]);
+    }
+
+    fn jmp(&mut self, label: Label) {
+        self.emit(&[0xe9]);
+        self.rel32(label);
+    }
+
+    fn jcc(&mut self, cc: u8, label: Label) {
+        self.emit(&[0x0f, 0x80 + cc]);
+        self.rel32(label);
+    }
+
+    fn call_reg(&mut self, reg: u8) {
+        self.op_reg(&[], false, &[0xff], 2, reg);
+    }
+
+    /// Pushes onto the operand stack.
+    fn inc_top(&mut self) {
+        self.emit(&[0xfe, 0xc3]);
+    }
+
+    /// Pops from the operand stack.
+    fn dec_top(&mut self) {
+        self.emit(&[0xfe, 0xcb]);
+    }
+
+    fn sse(&mut self, prefix: &[u8], opcode: u8, reg: u8, mem: Mem) {
+        self.op_mem(prefix, false, &[0x0f, opcode], reg, mem);
+    }
+
+    fn sse_reg(&mut self, prefix: &[u8], opcode: u8, reg: u8, rm: u8) {
+        self.op_reg(prefix, false, &[0x0f, opcode], reg, rm);
+    }
+}
+
+/// Native code for one loaded qvm. It only depends on the code and the size of memory, so it's
+/// shared between clones of a `Vm`.
+pub struct Jit {
+    code: *mut u8,
+    code_len: usize,
+    targets: Vec<usize>,
+    memory_size: usize,
+}
+
+// The mapping is never written to again after compilation.
+unsafe impl Send for Jit {}
+unsafe impl Sync for Jit {}
+
+impl Drop for Jit {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.code.cast(), self.code_len);
+        }
+    }
+}
+
+struct Compiler {
+    asm: Assembler,
+    instruction_labels: Vec<Label>,
+    exit: Label,
+    bad_address: Label,
+    bad_pc: Label,
+    divide_by_zero: Label,
+    bad_opcode: Label,
+    memory_size: u32,
+}
+
+impl Compiler {
+    fn target(&self, pc: u32) -> Label {
+        self.instruction_labels
+            .get(pc as usize)
+            .copied()
+            .unwrap_or(self.bad_pc)
+    }
+
+    /// Exits unless an access of `size` bytes at the address in `reg` is within qvm memory.
+    fn check_address(&mut self, reg: u8, size: u32) {
+        self.asm.cmp_imm(reg, self.memory_size - size);
+        self.asm.jcc(CC_A, self.bad_address);
+    }
+
+    /// Jumps to the instruction index in `eax`.
+    fn jump_to_eax(&mut self) {
+        self.asm.cmp_imm(RAX, self.instruction_labels.len() as u32);
+        self.asm.jcc(CC_AE, self.bad_pc);
+        self.asm
+            .load64(RCX, Mem::context(offset_of!(Context, targets)));
+        self.asm
+            .op_mem(&[], false, &[0xff], 4, Mem::indexed(RCX, RAX, 3, 0));
+    }
+
+    /// Marks the chunks covered by `size` bytes at the address in `reg` as dirty. Clobbers `esi`,
+    /// `edi` and `r8`.
+    fn mark_dirty(&mut self, reg: u8, size: u32) {
+        self.mark_chunk_dirty(reg, 0);
+        if size > 1 {
+            // Unaligned accesses can straddle two chunks
+            self.mark_chunk_dirty(reg, size - 1);
+        }
+    }
+
+    fn mark_chunk_dirty(&mut self, reg: u8, offset: u32) {
+        const _: () = assert!(CHUNK_SIZE == 64);
+
+        self.asm.lea32(RSI, Mem::base(reg, offset as i32));
+        self.asm.shr_imm(RSI, 6);
+        self.asm.mov32(RDI, RSI);
+        self.asm.shr_imm(RDI, 6);
+        self.asm.load64(R8, Mem::indexed(R13, RDI, 3, 0));
+        // bts r8, rsi
+        self.asm.op_reg(&[], true, &[0x0f, 0xab], RSI, R8);
+        self.asm.store64(Mem::indexed(R13, RDI, 3, 0), R8);
+    }
+
+    fn exit_with(&mut self, reason: u32) {
+        self.asm.mov32_imm(RAX, reason);
+        self.asm.jmp(self.exit);
+    }
+
+    fn prologue(&mut self) {
+        for reg in [RBX, RBP, R12, R13, R14, R15] {
+            self.asm.push(reg);
+        }
+        // Keep the stack 16-byte aligned for calls into Rust
+        self.asm.op_reg(&[], true, &[0x83], 5, RSP);
+        self.asm.emit(&[8]);
+
+        // mov rbp, rdi
+        self.asm.op_reg(&[], true, &[0x89], RDI, RBP);
+        self.asm
+            .load64(R12, Mem::context(offset_of!(Context, memory)));
+        self.asm
+            .load64(R13, Mem::context(offset_of!(Context, dirty)));
+        self.asm
+            .load64(R14, Mem::context(offset_of!(Context, op_stack)));
+        self.asm
+            .load32(R15, Mem::context(offset_of!(Context, program_stack)));
+        // movzx ebx, byte [rbp + op_stack_top]
+        self.asm.op_mem(
+            &[],
+            false,
+            &[0x0f, 0xb6],
+            RBX,
+            Mem::context(offset_of!(Context, op_stack_top)),
+        );
+        self.asm.load32(RAX, Mem::context(offset_of!(Context, pc)));
+        self.jump_to_eax();
+
+        self.asm.bind(self.exit);
+        self.asm
+            .store32(Mem::context(offset_of!(Context, program_stack)), R15);
+        self.asm
+            .store32(Mem::context(offset_of!(Context, op_stack_top)), RBX);
+        self.asm.op_reg(&[], true, &[0x83], 0, RSP);
+        self.asm.emit(&[8]);
+        for reg in [R15, R14, R13, R12, RBP, RBX] {
+            self.asm.pop(reg);
+        }
+        self.asm.emit(&[0xc3]);
+
+        for (label, reason) in [
+            (self.bad_address, EXIT_BAD_ADDRESS),
+            (self.bad_pc, EXIT_BAD_PC),
+            (self.divide_by_zero, EXIT_DIVIDE_BY_ZERO),
+            (self.bad_opcode, EXIT_BAD_OPCODE),
+        ] {
+            self.asm.bind(label);
+            self.exit_with(reason);
+        }
+    }
+
+    fn branch(&mut self, cc: u8, target: u32) {
+        self.asm.load32(RCX, Mem::top());
+        self.asm.dec_top();
+        self.asm.load32(RAX, Mem::top());
+        self.asm.dec_top();
+        self.asm.alu_reg(0x39, RAX, RCX);
+        self.asm.jcc(cc, self.target(target));
+    }
+
+    /// Pops `b` into `xmm1` and `a` into `xmm0` and compares them with `ucomiss`, swapped if
+    /// `swap` is set.
+    fn compare_floats(&mut self, swap: bool) {
+        self.asm.sse(&[0xf3], 0x10, XMM1, Mem::top());
+        self.asm.dec_top();
+        self.asm.sse(&[0xf3], 0x10, XMM0, Mem::top());
+        self.asm.dec_top();
+        let (a, b) = if swap { (XMM1, XMM0) } else { (XMM0, XMM1) };
+        self.asm.sse_reg(&[], 0x2e, a, b);
+    }
+
+    fn load(&mut self, opcode: &[u8], size: u32) {
+        self.asm.load32(RAX, Mem::top());
+        self.check_address(RAX, size);
+        self.asm
+            .op_mem(&[], false, opcode, RAX, Mem::indexed(R12, RAX, 0, 0));
+        self.asm.store32(Mem::top(), RAX);
+    }
+
+    fn store(&mut self, size: u32) {
+        self.asm.load32(RCX, Mem::top());
+        self.asm.dec_top();
+        self.asm.load32(RAX, Mem::top());
+        self.asm.dec_top();
+        self.check_address(RAX, size);
+        let mem = Mem::indexed(R12, RAX, 0, 0);
+        match size {
+            1 => self.asm.store8(mem, RCX),
+            2 => self.asm.store16(mem, RCX),
+            _ => self.asm.store32(mem, RCX),
+        }
+        self.mark_dirty(RAX, size);
+    }
+
+    /// `a op= b` on the top two stack entries, where `opcode` is an `op r/m32, r32` form.
+    fn binary_op(&mut self, opcode: u8) {
+        self.asm.load32(RCX, Mem::top());
+        self.asm.dec_top();
+        self.asm.alu_mem(opcode, Mem::top(), RCX);
+    }
+
+    fn shift_op(&mut self, ext: u8) {
+        self.asm.load32(RCX, Mem::top());
+        self.asm.dec_top();
+        self.asm.op_mem(&[], false, &[0xd3], ext, Mem::top());
+    }
+
+    fn float_op(&mut self, opcode: u8) {
+        self.asm.sse(&[0xf3], 0x10, XMM1, Mem::top());
+        self.asm.dec_top();
+        self.asm.sse(&[0xf3], 0x10, XMM0, Mem::top());
+        self.asm.sse_reg(&[0xf3], opcode, XMM0, XMM1);
+        self.asm.sse(&[0xf3], 0x11, XMM0, Mem::top());
+    }
+
+    fn divide(&mut self, signed: bool, remainder: bool) {
+        let (normal, done) = (self.asm.new_label(), self.asm.new_label());
+
+        self.asm.load32(RCX, Mem::top());
+        self.asm.dec_top();
+        self.asm.load32(RAX, Mem::top());
+        self.asm.test32(RCX, RCX);
+        self.asm.jcc(CC_E, self.divide_by_zero);
+
+        if signed {
+            // idiv faults on i32::MIN / -1, but wrapping_div and wrapping_rem don't
+            self.asm.cmp_imm(RCX, u32::MAX);
+            self.asm.jcc(CC_NE, normal);
+            if remainder {
+                self.asm.alu_reg(0x31, RAX, RAX);
+            } else {
+                self.asm.op_reg(&[], false, &[0xf7], 3, RAX);
+            }
+            self.asm.jmp(done);
+            self.asm.bind(normal);
+            self.asm.emit(&[0x99]);
+            self.asm.op_reg(&[], false, &[0xf7], 7, RCX);
+        } else {
+            self.asm.bind(normal);
+            self.asm.alu_reg(0x31, RDX, RDX);
+            self.asm.op_reg(&[], false, &[0xf7], 6, RCX);
+        }
+
+        if remainder {
+            self.asm.mov32(RAX, RDX);
+        }
+        self.asm.bind(done);
+        self.asm.store32(Mem::top(), RAX);
+    }
+
+    fn call_helper(&mut self, helper: usize) {
+        self.asm.mov64_imm(RAX, helper as u64);
+        self.asm.call_reg(RAX);
+    }
+
+    fn instruction(&mut self, pc: u32, &Instruction { opcode, arg }: &Instruction) {
+        match opcode {
+            OP_ENTER => {
+                self.asm.mov32(RAX, R15);
+                self.asm.sub_imm(R15, arg);
+                self.asm.lea32(RDX, Mem::base(R15, 4));
+                self.check_address(RDX, 4);
+                self.asm.store32(Mem::indexed(R12, RDX, 0, 0), RAX);
+                self.mark_dirty(RDX, 4);
+            }
+            OP_LEAVE => {
+                let ret = self.asm.new_label();
+                self.asm.add_imm(R15, arg);
+                self.check_address(R15, 8);
+                self.asm.load32(RAX, Mem::indexed(R12, R15, 0, 0));
+                self.asm.cmp_imm(RAX, 0xdeadbeef);
+                self.asm.jcc(CC_E, ret);
+                self.jump_to_eax();
+
+                self.asm.bind(ret);
+                self.asm.load32(R15, Mem::indexed(R12, R15, 0, 4));
+                self.asm
+                    .store32_imm(Mem::context(offset_of!(Context, pc)), 0xdeadbeef);
+                self.exit_with(EXIT_RETURN);
+            }
+            OP_CALL => {
+                let not_syscall = self.asm.new_label();
+                self.asm.load32(RAX, Mem::top());
+                self.asm.dec_top();
+                self.asm.test32(RAX, RAX);
+                self.asm.jcc(CC_NS, not_syscall);
+
+                // not eax
+                self.asm.op_reg(&[], false, &[0xf7], 2, RAX);
+                self.asm
+                    .store32(Mem::context(offset_of!(Context, syscall)), RAX);
+                self.asm
+                    .store32_imm(Mem::context(offset_of!(Context, pc)), pc + 1);
+                self.exit_with(EXIT_SYSCALL);
+
+                self.asm.bind(not_syscall);
+                self.check_address(R15, 4);
+                self.asm.mov32_imm(RCX, pc + 1);
+                self.asm.store32(Mem::indexed(R12, R15, 0, 0), RCX);
+                self.mark_dirty(R15, 4);
+                self.jump_to_eax();
+            }
+            OP_PUSH => {
+                self.asm.inc_top();
+                self.asm.store32_imm(Mem::top(), 0);
+            }
+            OP_POP => self.asm.dec_top(),
+            OP_CONST => {
+                self.asm.inc_top();
+                self.asm.store32_imm(Mem::top(), arg);
+            }
+            OP_LOCAL => {
+                self.asm.lea32(RAX, Mem::base(R15, arg as i32));
+                self.asm.inc_top();
+                self.asm.store32(Mem::top(), RAX);
+            }
+            OP_JUMP => {
+                self.asm.load32(RAX, Mem::top());
+                self.asm.dec_top();
+                self.jump_to_eax();
+            }
+            OP_EQ => self.branch(CC_E, arg),
+            OP_NE => self.branch(CC_NE, arg),
+            OP_LTI => self.branch(CC_L, arg),
+            OP_LEI => self.branch(CC_LE, arg),
+            OP_GTI => self.branch(CC_G, arg),
+            OP_GEI => self.branch(CC_GE, arg),
+            OP_LTU => self.branch(CC_B, arg),
+            OP_LEU => self.branch(CC_BE, arg),
+            OP_GTU => self.branch(CC_A, arg),
+            OP_GEU => self.branch(CC_AE, arg),
+            OP_EQF => {
+                let unordered = self.asm.new_label();
+                self.compare_floats(false);
+                self.asm.jcc(CC_P, unordered);
+                self.asm.jcc(CC_E, self.target(arg));
+                self.asm.bind(unordered);
+            }
+            OP_NEF => {
+                self.compare_floats(false);
+                self.asm.jcc(CC_P, self.target(arg));
+                self.asm.jcc(CC_NE, self.target(arg));
+            }
+            // ucomiss sets CF on unordered, so only "above" style conditions are false for NaN
+            OP_LTF => {
+                self.compare_floats(true);
+                self.asm.jcc(CC_A, self.target(arg));
+            }
+            OP_LEF => {
+                self.compare_floats(true);
+                self.asm.jcc(CC_AE, self.target(arg));
+            }
+            OP_GTF => {
+                self.compare_floats(false);
+                self.asm.jcc(CC_A, self.target(arg));
+            }
+            OP_GEF => {
+                self.compare_floats(false);
+                self.asm.jcc(CC_AE, self.target(arg));
+            }
+            OP_LOAD1 => self.load(&[0x0f, 0xb6], 1),
+            OP_LOAD2 => self.load(&[0x0f, 0xb7], 2),
+            OP_LOAD4 => self.load(&[0x8b], 4),
+            OP_STORE1 => self.store(1),
+            OP_STORE2 => self.store(2),
+            OP_STORE4 => self.store(4),
+            OP_ARG => {
+                self.asm.load32(RCX, Mem::top());
+                self.asm.dec_top();
+                self.asm.lea32(RAX, Mem::base(R15, arg as i32));
+                self.check_address(RAX, 4);
+                self.asm.store32(Mem::indexed(R12, RAX, 0, 0), RCX);
+                self.mark_dirty(RAX, 4);
+            }
+            OP_BLOCK_COPY => {
+                self.asm.load32(RDX, Mem::top());
+                self.asm.dec_top();
+                self.asm.load32(RSI, Mem::top());
+                self.asm.dec_top();
+                self.asm
+                    .load64(RDI, Mem::context(offset_of!(Context, vm_memory)));
+                self.asm.mov32_imm(RCX, arg);
+                self.call_helper(block_copy as usize);
+                self.asm.test32(RAX, RAX);
+                self.asm.jcc(CC_E, self.bad_address);
+            }
+            OP_SEX8 => {
+                self.asm.op_mem(&[], false, &[0x0f, 0xbe], RAX, Mem::top());
+                self.asm.store32(Mem::top(), RAX);
+            }
+            OP_SEX16 => {
+                self.asm.op_mem(&[], false, &[0x0f, 0xbf], RAX, Mem::top());
+                self.asm.store32(Mem::top(), RAX);
+            }
+            OP_NEGI => self.asm.op_mem(&[], false, &[0xf7], 3, Mem::top()),
+            OP_ADD => self.binary_op(0x01),
+            OP_SUB => self.binary_op(0x29),
+            OP_DIVI => self.divide(true, false),
+            OP_DIVU => self.divide(false, false),
+            OP_MODI => self.divide(true, true),
+            OP_MODU => self.divide(false, true),
+            OP_MULI | OP_MULU => {
+                self.asm.load32(RCX, Mem::top());
+                self.asm.dec_top();
+                self.asm.load32(RAX, Mem::top());
+                // imul eax, ecx
+                self.asm.op_reg(&[], false, &[0x0f, 0xaf], RAX, RCX);
+                self.asm.store32(Mem::top(), RAX);
+            }
+            OP_BAND => self.binary_op(0x21),
+            OP_BOR => self.binary_op(0x09),
+            OP_BXOR => self.binary_op(0x31),
+            OP_BCOM => self.asm.op_mem(&[], false, &[0xf7], 2, Mem::top()),
+            OP_LSH => self.shift_op(4),
+            OP_RSHI => self.shift_op(7),
+            OP_RSHU => self.shift_op(5),
+            OP_NEGF => self.asm.alu_mem_imm(6, Mem::top(), 0x80000000),
+            OP_ADDF => self.float_op(0x58),
+            OP_SUBF => self.float_op(0x5c),
+            OP_DIVF => self.float_op(0x5e),
+            OP_MULF => self.float_op(0x59),
+            OP_CVIF => {
+                self.asm.sse(&[0xf3], 0x2a, XMM0, Mem::top());
+                self.asm.sse(&[0xf3], 0x11, XMM0, Mem::top());
+            }
+            OP_CVFI => {
+                // cvttss2si returns i32::MIN for anything out of range, which `as` saturates
+                let done = self.asm.new_label();
+                self.asm.sse(&[0xf3], 0x2c, RAX, Mem::top());
+                self.asm.cmp_imm(RAX, 0x80000000);
+                self.asm.jcc(CC_NE, done);
+                self.asm.load32(RDI, Mem::top());
+                self.call_helper(float_to_int as usize);
+                self.asm.bind(done);
+                self.asm.store32(Mem::top(), RAX);
+            }
+            _ => self.asm.jmp(self.bad_opcode),
+        }
+    }
+}
+
+extern "sysv64" fn block_copy(memory: *mut Memory, dst: u32, src: u32, size: u32) -> u32 {
+    let memory = unsafe { &mut *memory };
+    let in_bounds = |address: u32| (address as usize + size as usize) <= memory.size();
+    if in_bounds(dst) && in_bounds(src) {
+        memory.memcpy(dst, src, size);
+        1
+    } else {
+        0
+    }
+}
+
+extern "sysv64" fn float_to_int(value: u32) -> u32 {
+    cast::<u32, f32>(value) as i32 as u32
+}
+
+impl Jit {
+    pub fn compile(code: &[Instruction], memory_size: usize) -> Self {
+        let mut asm = Assembler::default();
+        let instruction_labels = (0..code.len()).map(|_| asm.new_label()).collect();
+        let mut compiler = Compiler {
+            exit: asm.new_label(),
+            bad_address: asm.new_label(),
+            bad_pc: asm.new_label(),
+            divide_by_zero: asm.new_label(),
+            bad_opcode: asm.new_label(),
+            asm,
+            instruction_labels,
+            memory_size: memory_size.try_into().unwrap(),
+        };
+
+        compiler.prologue();
+        for (pc, instruction) in code.iter().enumerate() {
+            compiler.asm.bind(compiler.instruction_labels[pc]);
+            compiler.instruction(pc as u32, instruction);
+        }
+
+        let instruction_labels = compiler.instruction_labels;
+        let (bytes, labels) = compiler.asm.finish();
+
+        let code_len = bytes.len();
+        let mapping = unsafe {
+            let mapping = libc::mmap(
+                ptr::null_mut(),
+                code_len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            );
+            assert_ne!(mapping, libc::MAP_FAILED);
+            ptr::copy_nonoverlapping(bytes.as_ptr(), mapping.cast(), code_len);
+            assert_eq!(
+                libc::mprotect(mapping, code_len, libc::PROT_READ | libc::PROT_EXEC),
+                0
+            );
+            mapping.cast::<u8>()
+        };
+
+        let targets = instruction_labels
+            .iter()
+            .map(|&label| mapping as usize + labels[label].unwrap())
+            .collect();
+
+        Self {
+            code: mapping,
+            code_len,
+            targets,
+            memory_size,
+        }
+    }
+
+    pub fn run(&self, vm: &mut Vm) -> ExitReason {
+        assert_eq!(vm.memory.size(), self.memory_size);
+        assert!((vm.pc as usize) < self.targets.len());
+
+        let mut stack = OpStack::new(&vm.op_stack);
+        let mut context = Context {
+            memory: vm.memory.data.as_mut_ptr(),
+            dirty: vm.memory.dirty.as_mut_ptr(),
+            op_stack: stack.data.as_mut_ptr(),
+            targets: self.targets.as_ptr(),
+            vm_memory: &mut vm.memory,
+            pc: vm.pc,
+            program_stack: vm.program_stack,
+            op_stack_top: stack.top.wrapping_sub(1).into(),
+            syscall: 0,
+        };
+
+        let reason = unsafe {
+            let entry: extern "sysv64" fn(*mut Context) -> u32 = std::mem::transmute(self.code);
+            entry(&mut context)
+        };
+
+        vm.pc = context.pc;
+        vm.program_stack = context.program_stack;
+        stack.top = (context.op_stack_top as u8).wrapping_add(1);
+        vm.op_stack.clear();
+        vm.op_stack.extend_from_slice(stack.as_slice());
+
+        match reason {
+            EXIT_RETURN => ExitReason::Return,
+            EXIT_SYSCALL => ExitReason::Syscall(context.syscall),
+            EXIT_BAD_ADDRESS => panic!("qvm memory access out of bounds"),
+            EXIT_BAD_PC => panic!("qvm jumped out of bounds"),
+            EXIT_DIVIDE_BY_ZERO => panic!("qvm divided by zero"),
+            EXIT_BAD_OPCODE => panic!("qvm executed an unimplemented opcode"),
+            _ => unreachable!(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io::Cursor;
+
+    use bytemuck::cast;
+    use clap::ValueEnum;
+
+    use crate::{
+        q3::opcode_t::{Type as opcode_t, *},
+        vm::{ExecMode, ExitReason, Vm, test_qvm},
+    };
+
+    /// Where the results start in the test program's memory, after the bytes `LOAD`s read.
+    const RESULTS: u32 = 0x100;
+    const MEMORY_SIZE: u32 = 0x10000;
+
+    /// What syscalls return, so that their results show up in memory too.
+    fn syscall_result(syscall: u32) -> u32 {
+        0x1234_5678 ^ syscall
+    }
+
+    #[derive(Default)]
+    struct Program {
+        code: Vec<(opcode_t, u32)>,
+        next_result: u32,
+    }
+
+    impl Program {
+        fn op(&mut self, opcode: opcode_t, arg: u32) -> &mut Self {
+            self.code.push((opcode, arg));
+            self
+        }
+
+        fn next_index(&self) -> u32 {
+            self.code.len() as u32
+        }
+
+        /// Pushes the address of a new result.
+        fn result(&mut self) -> &mut Self {
+            let address = RESULTS + self.next_result * 4;
+            self.next_result += 1;
+            self.op(OP_CONST, address)
+        }
+
+        /// Stores `opcode` applied to `values` as a new result.
+        fn apply(&mut self, opcode: opcode_t, values: &[u32]) {
+            self.result();
+            values.iter().for_each(|&value| {
+                self.op(OP_CONST, value);
+            });
+            self.op(opcode, 0).op(OP_STORE4, 0);
+        }
+
+        /// Stores whether `opcode` branches for `a` and `b` as a new result.
+        fn branch(&mut self, opcode: opcode_t, a: u32, b: u32) {
+            let start = self.next_index();
+            let (taken, end) = (start + 8, start + 11);
+            self.result().op(OP_CONST, 0).op(OP_STORE4, 0);
+            self.op(OP_CONST, a).op(OP_CONST, b).op(opcode, taken);
+            self.op(OP_CONST, end).op(OP_JUMP, 0);
+            assert_eq!(self.next_index(), taken);
+            self.next_result -= 1;
+            self.result().op(OP_CONST, 1).op(OP_STORE4, 0);
+            assert_eq!(self.next_index(), end);
+        }
+
+        fn qvm(&self, data: &[u8]) -> Vec<u8> {
+            test_qvm::qvm(&self.code, data, MEMORY_SIZE)
+        }
+    }
+
+    /// Runs the program's first function to the end in `mode`, returning the results.
+    fn run(qvm: &[u8], mode: ExecMode, num_results: u32) -> Vec<u32> {
+        let mut vm = Vm::default();
+        vm.load(Cursor::new(qvm)).unwrap();
+        vm.mode = mode;
+        vm.prepare_call(&[0; 10]);
+        while let ExitReason::Syscall(syscall) = vm.run() {
+            vm.set_result(syscall_result(syscall));
+        }
+        let results = (0..num_results).map(|i| vm.memory.read(RESULTS + i * 4));
+        results
+            .chain([vm.program_stack, vm.op_stack.len() as u32])
+            .collect()
+    }
+
+    /// Every opcode on awkward operands, in every mode, which all have to agree with the
+    /// interpreter bit for bit.
+    #[test]
+    fn modes_match_interpreter() {
+        let ints: Vec<u32> = [
+            0, 1, -1, 2, -2, 7, -7, 31, 32, 33, 0x7f, 0x80, 0xffff, 0x8000,
+        ]
+        .into_iter()
+        .chain([i32::MIN, i32::MAX, i32::MIN + 1, 0x1234_5678])
+        .map(|x: i32| x as u32)
+        .collect();
+        let floats: Vec<u32> = [
+            0.0,
+            -0.0,
+            1.0,
+            -1.5,
+            0.1,
+            3.0e9,
+            -3.0e9,
+            1.0e-40,
+            f32::MAX,
+            f32::MIN_POSITIVE,
+            f32::INFINITY,
+            f32::NEG_INFINITY,
+            f32::NAN,
+        ]
+        .into_iter()
+        .map(cast::<f32, u32>)
+        .collect();
+
+        let mut program = Program::default();
+        program.op(OP_ENTER, 16);
+
+        for opcode in [
+            OP_ADD, OP_SUB, OP_MULI, OP_MULU, OP_BAND, OP_BOR, OP_BXOR, OP_LSH, OP_RSHI, OP_RSHU,
+            OP_DIVI, OP_DIVU, OP_MODI, OP_MODU,
+        ] {
+            for &a in &ints {
+                for &b in &ints {
+                    // Dividing by zero stops the qvm in every mode
+                    if b != 0 || !matches!(opcode, OP_DIVI | OP_DIVU | OP_MODI | OP_MODU) {
+                        program.apply(opcode, &[a, b]);
+                    }
+                }
+            }
+        }
+        for opcode in [OP_ADDF, OP_SUBF, OP_MULF, OP_DIVF] {
+            for &a in &floats {
+                for &b in &floats {
+                    program.apply(opcode, &[a, b]);
+                }
+            }
+        }
+        for &a in &ints {
+            for opcode in [OP_NEGI, OP_BCOM, OP_SEX8, OP_SEX16, OP_CVIF] {
+                program.apply(opcode, &[a]);
+            }
+        }
+        for &a in &floats {
+            for opcode in [OP_NEGF, OP_CVFI] {
+                program.apply(opcode, &[a]);
+            }
+        }
+
+        for opcode in [
+            OP_EQ, OP_NE, OP_LTI, OP_LEI, OP_GTI, OP_GEI, OP_LTU, OP_LEU, OP_GTU, OP_GEU,
+        ] {
+            for &a in &ints {
+                for &b in &ints {
+                    program.branch(opcode, a, b);
+                }
+            }
+        }
+        for opcode in [OP_EQF, OP_NEF, OP_LTF, OP_LEF, OP_GTF, OP_GEF] {
+            for &a in &floats {
+                for &b in &floats {
+                    program.branch(opcode, a, b);
+                }
+            }
+        }
+
+        // Loads at every offset they allow, since some qvms do unaligned 4-byte loads, and stores
+        // of the smaller sizes over a result
+        for offset in 0..8 {
+            program.apply(OP_LOAD1, &[offset]);
+            program.apply(OP_LOAD4, &[offset]);
+            if offset % 2 == 0 {
+                program.apply(OP_LOAD2, &[offset]);
+            }
+        }
+        for opcode in [OP_STORE1, OP_STORE2] {
+            program.result().op(OP_CONST, 0xdead_beef).op(OP_STORE4, 0);
+            program.next_result -= 1;
+            program.result().op(OP_CONST, 0x1234_5678).op(opcode, 0);
+        }
+        program.result().op(OP_CONST, 3).op(OP_BLOCK_COPY, 12);
+        program.next_result += 2;
+
+        // A call into the qvm with arguments, whose result is kept, and a syscall
+        let function = program.next_index() + 10;
+        program.result();
+        program.op(OP_CONST, 100).op(OP_ARG, 8);
+        program.op(OP_CONST, 58).op(OP_ARG, 12);
+        program
+            .op(OP_CONST, function)
+            .op(OP_CALL, 0)
+            .op(OP_STORE4, 0);
+        program.op(OP_CONST, function + 7).op(OP_JUMP, 0);
+        assert_eq!(program.next_index(), function);
+        program.op(OP_ENTER, 8);
+        program.op(OP_LOCAL, 16).op(OP_LOAD4, 0);
+        program.op(OP_LOCAL, 20).op(OP_LOAD4, 0);
+        program.op(OP_SUB, 0).op(OP_LEAVE, 8);
+        program
+            .result()
+            .op(OP_CONST, -5i32 as u32)
+            .op(OP_CALL, 0)
+            .op(OP_STORE4, 0);
+
+        program.op(OP_PUSH, 0).op(OP_LEAVE, 16);
+
+        let data: Vec<u8> = (0..RESULTS).map(|i| (i * 37 + 0x85) as u8).collect();
+        let qvm = program.qvm(&data);
+        let expected = run(&qvm, ExecMode::Interpreted, program.next_result);
+        assert_eq!(
+            expected[expected.len() - 3],
+            syscall_result(4),
+            "syscall result"
+        );
+        for &mode in ExecMode::value_variants() {
+            let results = run(&qvm, mode, program.next_result);
+            for (i, (a, b)) in expected.iter().zip(&results).enumerate() {
+                assert_eq!(a, b, "{mode:?} differs on result {i}");
+            }
+        }
+    }
+}
@@ -0,0 +1,36 @@
+//! Assembling qvms for tests, since real ones aren't ours to check in.
+
+use crate::q3::opcode_t::{Type as opcode_t, *};
+
+/// Encodes `code` and `data` as a qvm whose memory is `memory_size` bytes, with the stack at the
+/// top of it.
+pub fn qvm(code: &[(opcode_t, u32)], data: &[u8], memory_size: u32) -> Vec<u8> {
+    let mut bytes = vec![];
+    for &(opcode, arg) in code {
+        bytes.push(opcode as u8);
+        match opcode {
+            OP_ENTER | OP_LEAVE | OP_CONST | OP_LOCAL | OP_EQ | OP_NE | OP_LTI | OP_LEI
+            | OP_GTI | OP_GEI | OP_LTU | OP_LEU | OP_GTU | OP_GEU | OP_EQF | OP_NEF | OP_LTF
+            | OP_LEF | OP_GTF | OP_GEF | OP_BLOCK_COPY => bytes.extend(arg.to_le_bytes()),
+            OP_ARG => bytes.push(arg as u8),
+            _ => {}
+        }
+    }
+    bytes.resize(bytes.len().next_multiple_of(4), 0);
+
+    let data_offset = 32 + bytes.len() as u32;
+    let header = [
+        0x12721444,
+        code.len() as u32,
+        32,
+        bytes.len() as u32,
+        data_offset,
+        data.len() as u32,
+        0,
+        memory_size - data.len() as u32,
+    ];
+    let mut qvm: Vec<u8> = header.iter().flat_map(|x| x.to_le_bytes()).collect();
+    qvm.extend(bytes);
+    qvm.extend(data);
+    qvm
+}